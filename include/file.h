@@ -21,6 +21,9 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+
+struct timespec;
 
 struct fd {
     int fd;
@@ -31,10 +34,30 @@ struct fd {
     int (*read)(int, char*, int);
     int (*close)(int);
     short (*poll)(int);
+    ssize_t (*readv)(int, const struct iovec *, int);
+    ssize_t (*writev)(int, const struct iovec *, int);
+    /* Hand up to count bytes, from the current position, to a sink
+     * straight from the driver buffers, without reading them first.
+     * The sink returns how many bytes it took.
+     * Used by sendfile, that goes through read without it.
+     */
+    ssize_t (*forward)(int, size_t (*)(const void *, size_t, void *), void *, size_t);
+    /* Write count bytes of another file, from its position:
+     * files that can take data straight from the source provide it.
+     */
+    ssize_t (*sendfile)(int, int, size_t);
     int isallocated;
     int descriptor_flags;
     int status_flags;
     void *opaque;
+    /* The driver calls file_notify whenever poll might give another
+     * result: until then, poll and select take the last one, revents,
+     * without asking the driver.
+     */
+    int notify;
+    short revents;
+    /* file_generation at the last file_notify of the file */
+    unsigned long notified;
 };
 
 extern
@@ -46,5 +69,50 @@ int file_alloc(void);
 extern
 void file_free(int fd);
 
+/* Called by poll and select when no file is ready, before trying again,
+ * if all of their files notify (see file_notifies).
+ * The default does nothing, drivers that know when their files can
+ * become ready override it to sleep until then, or until deadline
+ * on CLOCK_MONOTONIC, the end of the timeout.
+ */
+extern
+void poll_idle(const struct timespec *deadline);
+
+/* Called by poll and select before they look at the files.
+ * The default does nothing, drivers that set notify override it
+ * to take the events that came meanwhile and call file_notify.
+ */
+extern
+void poll_update(void);
+
+/* The state of fd might have changed: the next file_poll asks its driver. */
+extern
+void file_notify(int fd);
+
+/* Counts the calls to file_notify: poll and select do not sleep
+ * if it changed while they were looking at the files.
+ */
+extern
+unsigned long file_generation;
+
+/* Nonzero if the driver of fd calls file_notify: poll and select
+ * sleep in poll_idle only when all their files notify, the others
+ * can become ready without waking anything up, and are polled in a loop.
+ */
+extern
+int file_notifies(int fd);
+
+/* Poll events of fd, as returned by its poll callback;
+ * POLLNVAL if there is no such file or it can not be polled.
+ */
+extern
+short file_poll(int fd);
+
+/* Called by open for paths under /dev/.
+ * The default fails with ENOENT, drivers with device files override it.
+ */
+extern
+int dev_open(const char *pathname, int flags);
+
 #endif
 
@@ -62,6 +62,9 @@ struct sockaddr_in6 {
 #define INADDR_ANY ((in_addr_t) 0x00000000) /* IPv4 local host address. */
 #define INADDR_BROADCAST ((in_addr_t) 0xffffffff) /* IPv4 broadcast address */
 
+/* Group addresses 224.0.0.0/4, a in host order. */
+#define IN_MULTICAST(a) ((((in_addr_t)(a)) & 0xf0000000) == 0xe0000000)
+
 #define INET_ADDRSTRLEN 16 /* Length of the string form for IP. */
 #define INET6_ADDRSTRLEN 46 /* Length of the string form for IPv6. */
 
@@ -73,6 +76,15 @@ struct sockaddr_in6 {
 #define IPV6_UNICAST_HOPS   6 /* Unicast hop limit. */
 #define IPV6_V6ONLY         7 /* Restrict AF_INET6 socket to IPv6 communications only. */
 
+#define IP_MULTICAST_TTL    1 /* Time to live of outgoing multicast datagrams. */
+#define IP_ADD_MEMBERSHIP   2 /* Join a multicast group. */
+#define IP_DROP_MEMBERSHIP  3 /* Leave a multicast group. */
+
+struct ip_mreq {
+    struct in_addr imr_multiaddr; /* Group address. */
+    struct in_addr imr_interface; /* Local address, ignored: there is only one. */
+};
+
 /* Missing IPv6 stuff */
 
 #endif /* NETINET_IN_H */
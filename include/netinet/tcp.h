@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NETINET_TCP_H
+#define NETINET_TCP_H
+
+/* http://pubs.opengroup.org/onlinepubs/9699919799/basedefs/netinet_tcp.h.html */
+
+#define TCP_NODELAY   0x01 /* Avoid coalescing of small segments. */
+#define TCP_CORK      0x02 /* Hold partial segments until uncorked (not POSIX). */
+#define TCP_KEEPIDLE  0x03 /* Idle seconds before keepalive probes (not POSIX). */
+#define TCP_KEEPINTVL 0x04 /* Seconds between keepalive probes (not POSIX). */
+#define TCP_MAXSEG    0x05 /* Maximum segment size (not POSIX). */
+
+#endif /* NETINET_TCP_H */
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SYS_EPOLL_H
+#define SYS_EPOLL_H
+
+/* As in Linux, not POSIX. */
+
+#include <stdint.h>
+#include <poll.h>
+
+/* Events are the poll ones, plus the flags. */
+#define EPOLLIN POLLIN
+#define EPOLLRDNORM POLLRDNORM
+#define EPOLLRDBAND POLLRDBAND
+#define EPOLLPRI POLLPRI
+#define EPOLLOUT POLLOUT
+#define EPOLLWRNORM POLLWRNORM
+#define EPOLLWRBAND POLLWRBAND
+#define EPOLLERR POLLERR
+#define EPOLLHUP POLLHUP
+/* Report the file once, then not until EPOLL_CTL_MOD. */
+#define EPOLLONESHOT (1U << 30)
+/* Report the file again only when its driver notified a change since
+ * the last look, as new data, or for files that do not notify, when
+ * events that were not there at the last look come.
+ */
+#define EPOLLET (1U << 31)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+    uint32_t events;
+    epoll_data_t data;
+};
+
+/**
+ * Open an interest list, that is kept across epoll_wait calls.
+ *
+ * It takes a file descriptor, and one of the EPOLL_MAX_INSTANCES lists;
+ * it holds up to EPOLL_MAX_FDS files. Both are 2 and 16
+ * unless defined at build time.
+ * size is not used, but must be positive.
+ * \retval the file descriptor, to be closed with close().
+ * \retval -1 on error, errno is EINVAL for a bad size,
+ *         ENFILE if no file descriptor or list is free.
+ */
+extern
+int epoll_create(int size);
+
+/* As epoll_create; flags must be 0. */
+extern
+int epoll_create1(int flags);
+
+/**
+ * Add (EPOLL_CTL_ADD), change (EPOLL_CTL_MOD) or remove (EPOLL_CTL_DEL)
+ * fd in the interest list of epfd. event is not used for EPOLL_CTL_DEL.
+ *
+ * Any file with a poll callback can be added: sockets, serial
+ * and FatFs files, that are always ready.
+ * Closed files are dropped from the list by epoll_wait; remove them
+ * before closing if their file descriptor might be taken again.
+ * \retval 0 on success.
+ * \retval -1 on error, errno is EBADF for a bad epfd or fd,
+ *         EINVAL if epfd is not an interest list or is fd,
+ *         EEXIST or ENOENT if fd is already or not in the list,
+ *         ENOSPC if the list is full.
+ */
+extern
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+/**
+ * Wait for the files in the interest list of epfd to be ready,
+ * for up to timeout ms, forever if -1.
+ *
+ * Files whose driver notifies changes (W5100 sockets, see file_notify)
+ * are not asked again until they change, so a wait on a list
+ * where nothing happened costs a bit test per file.
+ * \retval the number of entries filled in events, up to maxevents:
+ *         0 on timeout.
+ * \retval -1 on error, errno is EBADF or EINVAL for a bad epfd,
+ *         EINVAL for a maxevents not positive.
+ */
+extern
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+#endif /* SYS_EPOLL_H */
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SYS_SENDFILE_H
+#define SYS_SENDFILE_H
+
+/* As in Linux, not POSIX. */
+
+#include <sys/types.h>
+
+/**
+ * Write count bytes of in_fd to out_fd.
+ *
+ * A TCP socket takes the data straight from the file into the chip,
+ * without a copy in a user buffer.
+ *
+ * Data is read from offset, if not NULL, and offset is updated
+ * while the file position is left as it was.
+ * Otherwise it is read from the file position, that is advanced.
+ * \retval bytes sent, less than count at end of file or on timeout.
+ * \retval -1 on error.
+ */
+extern
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+#endif /* SYS_SENDFILE_H */
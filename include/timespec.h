@@ -49,5 +49,19 @@ const struct timespec TIMESPEC_ZERO;
 extern
 const struct timespec TIMESPEC_INFINITY;
 
+/**
+ * Sleep with the core in WFI until an interrupt is taken,
+ * or at the latest until deadline on CLOCK_MONOTONIC (NULL: none).
+ *
+ * It may return early, callers look at their conditions and call it
+ * again. Interrupts are masked inside, so that one coming after
+ * the caller masked them and looked at its conditions still wakes it up.
+ * The tick wakes it up every millisecond, unless the clock is built
+ * with CLOCK_GETTIME_TICKLESS: then the tick is stretched up to the deadline.
+ * Provided by the clock_gettime implementation.
+ */
+extern
+void clock_idle(const struct timespec *deadline);
+
 #endif /* TIMESPEC_H */
 
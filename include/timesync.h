@@ -38,6 +38,14 @@
  * All functions return 1 when synchronization has been successful,
  * and -1 when an error occurred during synchronization. timesync and
  * timesync_timespec return 0 when it is not time to synchronize yet.
+ *
+ * These block for the whole exchange with the server, and clock_gettime
+ * never calls them: timesync_poll does the same in the background,
+ * a step at each call from the main loop, without blocking.
+ * When it is time to synchronize it sends the request, then takes the
+ * reply at a later call, when timesync_fd is readable. It returns 0 while
+ * the exchange is in progress or it is not time yet.
+ * A failed or unanswered request is retried after TIMESYNC_RETRY_INTERVAL.
  */ 
 
 extern
@@ -52,6 +60,15 @@ int timesync_now(void);
 extern
 int timesync_now_timespec(struct timespec *out);
 
+extern
+int timesync_poll(void);
+
+/* The socket of the exchange in progress in timesync_poll, -1 if none:
+ * a main loop that sleeps in poll or select can wait for it.
+ */
+extern
+int timesync_fd(void);
+
 /* Get time from a RFC868 server.
  * The time is written in the timespec structure pointed by ts parameter.
  * Returns 0 if successful, -1 if some error happened. 
@@ -59,6 +76,17 @@ int timesync_now_timespec(struct timespec *out);
 extern
 int rfc868_gettime(struct timespec *ts);
 
+/* rfc868_gettime in two steps, that do not block: rfc868_gettime_start
+ * sends the request, and returns the socket or -1.
+ * rfc868_gettime_finish takes the reply once the socket is readable,
+ * it returns as rfc868_gettime. The caller closes the socket.
+ */
+extern
+int rfc868_gettime_start(void);
+
+extern
+int rfc868_gettime_finish(int sock, struct timespec *ts);
+
 /* Set the time server to retrieve time with RFC868 */
 extern
 void rfc868_timeserver_set(in_addr_t server);
@@ -74,6 +102,15 @@ in_addr_t rfc868_timeserver_get(void);
 extern
 int sntp_gettime(struct timespec *ts);
 
+/* sntp_gettime in two steps, as rfc868_gettime_start and
+ * rfc868_gettime_finish.
+ */
+extern
+int sntp_gettime_start(void);
+
+extern
+int sntp_gettime_finish(int sock, struct timespec *ts);
+
 /* Set the time server to retrieve time with RFC4330 */
 extern
 void sntp_timeserver_set(in_addr_t server);
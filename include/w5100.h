@@ -21,6 +21,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <time.h>
 
 #define W5100_S0 0
 #define W5100_S1 1
@@ -415,5 +416,19 @@ uint16_t w5100_sock_reg_get(uint16_t sn_reg, int socket)
 extern
 void w5100_init(void);
 
+/**
+ * State of the INT line, active low.
+ * \retval nonzero if the line is asserted, or it is not connected.
+ */
+extern
+int w5100_int_asserted(void);
+
+/**
+ * Sleep until an interrupt is taken, if INT is not asserted.
+ * \param deadline on CLOCK_MONOTONIC to wake up at the latest, or NULL.
+ */
+extern
+void w5100_int_wait(const struct timespec *deadline);
+
 #endif /* W5100_H */
 
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef W5100_SOCKET_H
+#define W5100_SOCKET_H
+
+#include <stdint.h>
+
+/* Level of the socket options specific to this library. */
+#define SOL_W5100 0xFE
+
+/**
+ * Read-ahead buffer in MCU RAM of a TCP socket, as int in bytes.
+ *
+ * A recv() smaller than the buffer takes up to that much data
+ * from the chip in one burst, and the following ones are served from RAM.
+ * Buffered data is readable for poll() and select().
+ * 0, the default, disables it.
+ * The maximum is W5100_RX_STAGE_MAX, 128 unless defined at build time.
+ * Setting it fails with EBUSY while the buffer holds data.
+ */
+#define W5100_SO_RXSTAGE 0x01
+
+/**
+ * TCP retransmission timeout, as int in units of 100us (RTR register):
+ * the first retry comes after it, and each next one after twice
+ * the previous wait.
+ * The chip has one setting for all the sockets: setting it on a
+ * socket changes it for all of them.
+ * The default is W5100_RETRY_TIME, 2000 (200ms) unless defined at build
+ * time; 1 to 65535 are accepted.
+ */
+#define W5100_SO_RETRY_TIME 0x02
+
+/**
+ * TCP retries before the connection times out, as int (RCR register).
+ * Common to all the sockets, as W5100_SO_RETRY_TIME.
+ * The default is W5100_RETRY_COUNT, 8 unless defined at build time;
+ * 0 to 255 are accepted.
+ */
+#define W5100_SO_RETRY_COUNT 0x03
+
+/**
+ * Counters of a socket, as struct w5100_sock_stats; only for getsockopt.
+ *
+ * They start from 0 when the socket is created or accepted.
+ * Frames are the SPI frames spent on the hardware socket, see
+ * struct w5x00_frames in w5x00.h; software sockets have none.
+ * option_len must be at least the size of the structure.
+ */
+#define W5100_SO_STATS 0x04
+
+struct w5100_sock_stats {
+    unsigned long bytes_in; /* received, not counting MSG_PEEK */
+    unsigned long bytes_out; /* sent */
+    unsigned long send_cmds; /* SEND commands */
+    unsigned long recv_cmds; /* RECV commands */
+    unsigned long data_frames; /* frames moving payload */
+    unsigned long reg_frames; /* frames on registers */
+    unsigned long polls; /* poll() and select() checks */
+    unsigned long eagain; /* EAGAIN returns, nonblocking calls */
+    unsigned long timeouts; /* EAGAIN returns, expired SO_RCVTIMEO or SO_SNDTIMEO */
+};
+
+/**
+ * Partition the chip buffer memory among the hardware sockets.
+ *
+ * tx_sizes and rx_sizes have one entry per hardware socket, in bytes.
+ * Sizes must be supported by the chip: powers of two from 1KiB,
+ * with a total not exceeding the chip memory.
+ * A socket with no memory can not be allocated by socket().
+ *
+ * Sockets in use must keep the same buffers, in size and position.
+ *
+ * \retval 0 on success.
+ * \retval -1 on error, errno is EINVAL for unsupported sizes,
+ *         EBUSY if the buffers of a socket in use would change.
+ */
+extern
+int w5100_socket_set_buf_sizes(const uint16_t *tx_sizes, const uint16_t *rx_sizes);
+
+/* Path of the stats file, for open() on the board. */
+#define W5100_STATS_PATH "/dev/w5100stats"
+
+/**
+ * Open the stats file, a read-only text file with the frames
+ * of the chip and a line with the counters of each socket in use.
+ * The text is made while it is read: open it again for fresh counters.
+ *
+ * \retval the file descriptor on success.
+ * \retval -1 on error, errno is ENFILE if all the descriptors,
+ *         or all the stats files, are in use.
+ */
+extern
+int w5100_stats_open(void);
+
+#endif /* W5100_SOCKET_H */
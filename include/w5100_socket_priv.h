@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef W5100_SOCKET_PRIV_H
+#define W5100_SOCKET_PRIV_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <time.h>
+#include "w5x00.h"
+#include "w5100_socket.h"
+
+/*
+ * Internals of the socket layer, shared by w5100_socket.c and
+ * w5100_macraw.c: not for applications.
+ */
+
+#define W5100_SOCKET_FREE (-1)
+
+#define W5100_BUF_SIZE_MIN 0x400 /* smallest buffer supported by all chips */
+
+#define W5100_UDP_HEADER_SIZE 8 /* before each datagram in the RX buffer */
+
+/* Sn_TTL at reset, kept for everything but multicast datagrams. */
+#define W5100_IP_TTL 128
+
+/* With W5100_MACRAW, socket 0 runs in MACRAW mode and SOCK_DGRAM
+ * sockets are made in software on top of it by w5100_macraw.c,
+ * with ARP, IPv4 and UDP: they take no hardware socket, that are
+ * left to TCP.
+ */
+#ifdef W5100_MACRAW
+#  ifndef W5100_MACRAW_SOCKETS
+#    define W5100_MACRAW_SOCKETS 8
+#  endif
+/* Received datagrams waiting in RAM, per software socket. */
+#  ifndef W5100_MACRAW_RX_BUF
+#    define W5100_MACRAW_RX_BUF 1024
+#  endif
+#else
+#  define W5100_MACRAW_SOCKETS 0
+#endif
+
+#define W5100_MACRAW_ISOCKET 0
+#define W5100_IP_HEADER_SIZE 20 /* no options */
+#define W5100_UDP_HDR_SIZE 8 /* on the wire, not W5100_UDP_HEADER_SIZE */
+#define W5100_MTU 1500
+
+/* Largest read-ahead buffer that W5100_SO_RXSTAGE can ask for,
+ * reserved in RAM for every hardware socket.
+ */
+#ifndef W5100_RX_STAGE_MAX
+#  define W5100_RX_STAGE_MAX 128
+#endif
+
+enum w5100_socket_state {
+    W5100_SOCK_STATE_NONE = 0,
+    W5100_SOCK_STATE_CREATED,
+    W5100_SOCK_STATE_CONNECTED,
+    W5100_SOCK_STATE_BOUND,
+    W5100_SOCK_STATE_LISTENING,
+    W5100_SOCK_STATE_ACCEPTED,
+    W5100_SOCK_STATE_SPARE, /* listening on behalf of another socket */
+    W5100_SOCK_STATE_CONNECTING, /* non-blocking connect in progress */
+    W5100_SOCK_STATE_CLOSING, /* closed, the chip still finishing the FIN handshake */
+};
+
+struct timeout_manager {
+    int has_timeout;
+    struct timespec end;
+};
+
+struct w5100_socket {
+    int fd;
+    int isocket;
+    int domain;
+    int type;
+    int protocol;
+    enum w5100_socket_state state;
+    struct sockaddr_in sockname;
+    struct sockaddr_in dest_address;
+    int can_broadcast;
+    struct timespec recv_timeout;
+    struct timespec send_timeout;
+    struct fd *fd_data;
+    struct fd *connection_data;
+    /* The MCU is the only writer of Sn_TX_WR and Sn_RX_RD:
+     * keep a copy to save SPI frames at every send and recv.
+     */
+    int shadow_valid;
+    uint16_t tx_wr;
+    uint16_t rx_rd;
+    /* TCP send coalescing: tx_pending bytes are in the TX buffer,
+     * before tx_wr, but Sn_TX_WR has not been updated yet.
+     */
+    int tcp_nodelay;
+    int tcp_cork;
+    uint16_t tx_pending;
+    struct timeout_manager tx_pending_tom;
+    /* Listen backlog: spare hardware sockets listen on the same port
+     * and point to the listening socket, that has listening set.
+     */
+    int listening;
+    int backlog;
+    struct w5100_socket *listener;
+    /* Sn_IR bits taken from the chip and not looked at yet. */
+    uint8_t events;
+    /* Last poll result for fd_data (0) and connection_data (1),
+     * valid until an event or a command on the socket.
+     */
+    int poll_valid[2];
+    short poll_revents[2];
+    /* TCP read-ahead: rx_stage_len bytes taken from the chip
+     * wait at rx_stage_start to be received.
+     */
+    uint16_t rx_stage_size;
+    uint16_t rx_stage_start;
+    uint16_t rx_stage_len;
+    uint8_t rx_stage[W5100_RX_STAGE_MAX];
+    /* UDP: a datagram has been sent and its SEND_OK not seen yet;
+     * Sn_DIPR and Sn_DPORT hold dgram_dest if dgram_dest_valid.
+     */
+    int dgram_in_flight;
+    int dgram_dest_valid;
+    struct sockaddr_in dgram_dest;
+    /* Pending error, as reported by SO_ERROR. */
+    int so_error;
+    /* shutdown() done for receptions and for sends. */
+    int shut_rd;
+    int shut_wr;
+    /* TCP keepalive: SEND_KEEP when keep_tom ends, keep_idle seconds
+     * after the last data received, then every keep_intvl seconds.
+     */
+    int keepalive;
+    int keep_idle;
+    int keep_intvl;
+    int keep_armed;
+    struct timeout_manager keep_tom;
+    /* MSS offered at connection, in Sn_MSSR. */
+    uint16_t tcp_maxseg;
+    /* UDP multicast: the socket is open in multicast mode on mc_group
+     * if mc_joined, and datagrams to any group go with mc_ttl.
+     * Sn_TTL holds ttl; Sn_DHAR holds the MAC address of dgram_dest
+     * if dgram_send_mac, and SEND_MAC skips ARP.
+     */
+    int mc_joined;
+    struct in_addr mc_group;
+    uint8_t mc_ttl;
+    uint8_t ttl;
+    int dgram_send_mac;
+    /* W5100_SO_STATS, but the frames: they are in w5x00_sock_frames. */
+    struct w5100_sock_stats stats;
+};
+
+extern
+struct w5100_socket w5100_sockets[W5X00_MAX_SOCKETS + W5100_MACRAW_SOCKETS];
+
+extern
+uint8_t w5100_mac_addr[6];
+
+/* RTR and RCR, written by w5100_socket_init and setsockopt. */
+extern
+uint16_t w5100_retry_time;
+
+extern
+uint8_t w5100_retry_count;
+
+/* Socket layer, in w5100_socket.c. */
+
+extern
+void w5100_command(int isocket, uint8_t cmd);
+
+extern
+void w5100_socket_free(int isocket);
+
+extern
+void w5100_timeout_init(const struct timespec *timeout, struct timeout_manager *tom);
+
+extern
+int w5100_timeout_ended(const struct timeout_manager *tom);
+
+extern
+void w5100_events_update(void);
+
+extern
+uint8_t w5100_events_wait(unsigned int set, uint8_t mask, const struct timeout_manager *tom);
+
+extern
+uint16_t w5100_read_buf_len(int isocket);
+
+extern
+uint16_t w5100_read_buf_pstart(int isocket);
+
+extern
+void w5100_read_buf_sure(int isocket, void *buf, size_t len, uint16_t *pread);
+
+extern
+void w5100_read_buf_recv(int isocket, uint16_t pstop);
+
+extern
+uint16_t w5100_write_buf_len(int isocket);
+
+extern
+uint16_t w5100_write_buf_pstart(int isocket);
+
+extern
+void w5100_write_buf_sure(int isocket, const void *buf, size_t len, uint16_t *pwrite);
+
+extern
+void w5100_write_buf_sure_iov(int isocket, const struct iovec *iov, int iovcnt, size_t skip, size_t len, uint16_t *pwrite);
+
+extern
+void w5100_write_buf_send(int isocket, uint16_t pstop);
+
+extern
+size_t w5100_iov_len_get(const struct iovec *iov, int iovcnt);
+
+extern
+void w5100_iov_fill(const struct iovec *iov, int iovcnt, size_t skip, const uint8_t *src, size_t n);
+
+extern
+uint16_t w5100_dgram_header_get(const uint8_t *header, struct msghdr *msg);
+
+extern
+int w5100_dgram_wait(struct w5100_socket *s, size_t len, int sent, int nonblock, const struct timeout_manager *tom);
+
+extern
+void w5100_mc_mac_get(in_addr_t group, uint8_t *mac);
+
+#ifdef W5100_MACRAW
+
+/* Software SOCK_DGRAM sockets, in w5100_macraw.c. */
+
+extern
+void w5100_macraw_open(void);
+
+extern
+int w5100_macraw_alloc(void);
+
+extern
+ssize_t w5100_macraw_send_dgram(struct w5100_socket *s, const struct iovec *iov, int iovcnt, size_t len,
+        const struct sockaddr_in *peer, int flags);
+
+extern
+int w5100_macraw_recvmmsg(struct w5100_socket *s, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+        const struct timespec *timeout);
+
+extern
+short w5100_macraw_poll(struct w5100_socket *s);
+
+#endif /* W5100_MACRAW */
+
+#endif /* W5100_SOCKET_PRIV_H */
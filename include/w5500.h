@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef W5500_H
+#define W5500_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Only what differs from W5100 is defined here,
+ * common registers up to SIPR and socket registers
+ * have the same offsets as in w5100.h
+ */
+
+#define W5500_N_SOCKETS 8
+
+#define W5500_TX_MEM_SIZE 0x4000
+#define W5500_RX_MEM_SIZE 0x4000
+
+/* Block select bits of the control phase */
+#define W5500_BSB_COMMON  0x00
+#define W5500_BSB_SOCK(n) ((uint8_t)(((n) << 2) + 1))
+#define W5500_BSB_TX(n)   ((uint8_t)(((n) << 2) + 2))
+#define W5500_BSB_RX(n)   ((uint8_t)(((n) << 2) + 3))
+
+/* Control phase */
+#define W5500_CTRL_BSB_SHIFT 3
+#define W5500_CTRL_READ      0x00
+#define W5500_CTRL_WRITE     0x04
+#define W5500_CTRL_VDM       0x00 /* variable length data mode */
+
+/* Common registers */
+#define W5500_INTLEVEL0 0x0013
+#define W5500_INTLEVEL1 0x0014
+#define W5500_IR        0x0015
+#define W5500_IMR       0x0016
+#define W5500_SIR       0x0017
+#define W5500_SIMR      0x0018
+#define W5500_RTR0      0x0019
+#define W5500_RTR1      0x001A
+#define W5500_RCR       0x001B
+#define W5500_PTIMER    0x001C
+#define W5500_PMAGIC    0x001D
+#define W5500_PHAR0     0x001E
+#define W5500_PSID0     0x0024
+#define W5500_PMRU0     0x0026
+#define W5500_UIPR0     0x0028
+#define W5500_UPORTR0   0x002C
+#define W5500_PHYCFGR   0x002E
+#define W5500_VERSIONR  0x0039
+
+#define W5500_RTR      W5500_RTR0
+#define W5500_RTR_SIZE 2
+
+#define W5500_VERSION 0x04
+
+/* Socket registers */
+#define W5500_Sn_RXBUF_SIZE 0x001E
+#define W5500_Sn_TXBUF_SIZE 0x001F
+#define W5500_Sn_RX_WR0     0x002A
+#define W5500_Sn_RX_WR1     0x002B
+#define W5500_Sn_IMR        0x002C
+#define W5500_Sn_FRAG0      0x002D
+#define W5500_Sn_FRAG1      0x002E
+#define W5500_Sn_KPALVTR    0x002F
+
+/* Sn_MR: MAC filter in MACRAW mode, MULTI in UDP mode */
+#define W5500_Sn_MR_MFEN 0x80
+
+/**
+ * Read n bytes from the block selected by bsb, starting from addr,
+ * with a single variable length data frame.
+ */
+extern
+void w5500_read_block(uint8_t bsb, uint16_t addr, void *buf, size_t n);
+
+/**
+ * Write n bytes to the block selected by bsb, starting from addr,
+ * with a single variable length data frame.
+ */
+extern
+void w5500_write_block(uint8_t bsb, uint16_t addr, const void *buf, size_t n);
+
+extern
+void w5500_init(void);
+
+/**
+ * State of the INT line, active low.
+ * \retval nonzero if the line is asserted, or it is not connected.
+ */
+extern
+int w5500_int_asserted(void);
+
+/**
+ * Sleep until an interrupt is taken, if INT is not asserted.
+ * \param deadline on CLOCK_MONOTONIC to wake up at the latest, or NULL.
+ */
+extern
+void w5500_int_wait(const struct timespec *deadline);
+
+#endif /* W5500_H */
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef W5X00_H
+#define W5X00_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "w5100.h"
+
+/*
+ * Chip driver used by the socket layer in w5100_socket.c.
+ *
+ * The socket register offsets (W5100_Sn_*), the socket modes, the
+ * commands and the socket states are the same for W5100 and W5500,
+ * so the socket layer uses the W5100 names and the chip driver only
+ * maps them to the right place in the chip.
+ *
+ * The driver is selected at build time by linking one of:
+ *  - w5100_chip.o (with w5100_spi.o and w5x00_int.o, or w5100_emu.o)
+ *  - w5500_chip.o (with w5500_spi.o and w5x00_int.o, or w5500_emu.o)
+ * Each of them defines the w5x00_chip instance.
+ */
+
+/* Maximum number of hardware sockets among supported chips. */
+#define W5X00_MAX_SOCKETS 8
+
+struct w5x00_chip {
+    const char *name;
+    /* Number of hardware sockets. */
+    int n_sockets;
+    /* Total TX and RX buffer memory, shared among sockets. */
+    uint16_t tx_mem_size;
+    uint16_t rx_mem_size;
+    /* Sn_MR bit that, in MACRAW mode, keeps only the frames for the
+     * chip MAC address and the broadcast ones; 0 if there is none.
+     */
+    uint8_t macraw_filter;
+    /* Initialize the bus towards the chip. */
+    void (*init)(void);
+    /* Access to common registers. */
+    void (*read_mem)(uint16_t reg, void *buf, size_t n);
+    void (*write_mem)(uint16_t reg, const void *buf, size_t n);
+    /* Access to socket registers, sn_reg is one of W5100_Sn_*. */
+    void (*read_sock_mem)(int isocket, uint16_t sn_reg, void *buf, size_t n);
+    void (*write_sock_mem)(int isocket, uint16_t sn_reg, const void *buf, size_t n);
+    /* Access to socket buffers. ptr is the value of Sn_RX_RD or Sn_TX_WR,
+     * wrap around the end of the socket buffer is managed by the driver.
+     */
+    void (*read_rx)(int isocket, uint16_t ptr, void *buf, size_t n);
+    void (*write_tx)(int isocket, uint16_t ptr, const void *buf, size_t n);
+    /* Buffer geometry: sizes in bytes of the socket buffers. */
+    uint16_t (*get_tx_size)(int isocket);
+    uint16_t (*get_rx_size)(int isocket);
+    /* Set the sizes in bytes of the buffers of all sockets.
+     * Returns 0 on success, -1 if the sizes are not supported by the chip.
+     */
+    int (*set_buf_sizes)(const uint16_t *tx_sizes, const uint16_t *rx_sizes);
+    /* Socket interrupts: mask has bit n set for socket n.
+     * sock_int_enable routes the Sn_IR of the sockets to the INT line,
+     * sock_int_get tells which sockets have some bit set in Sn_IR.
+     */
+    void (*sock_int_enable)(uint8_t mask);
+    uint8_t (*sock_int_get)(void);
+    /* TCP retransmission, common to all the sockets: rtr is the first
+     * timeout in units of 100us, doubled at each of the rcr retries.
+     */
+    void (*set_retry)(uint16_t rtr, uint8_t rcr);
+    /* INT line: int_asserted returns nonzero while it is asserted,
+     * or always when the line is not connected.
+     * int_wait sleeps until an interrupt is taken, unless the line is
+     * asserted already. It wakes up at the latest at deadline on
+     * CLOCK_MONOTONIC (NULL: none), so timeouts keep working;
+     * see clock_idle.
+     */
+    int (*int_asserted)(void);
+    void (*int_wait)(const struct timespec *deadline);
+};
+
+extern
+const struct w5x00_chip w5x00_chip;
+
+/* SPI frames spent by the chip driver: data frames move the contents
+ * of the socket buffers, reg frames access the registers.
+ * The W5100 takes a frame for each byte, the W5500 one for each access.
+ */
+struct w5x00_frames {
+    unsigned long data;
+    unsigned long reg;
+};
+
+/* Frames of the whole chip, and of each socket.
+ * The frames of a socket are counted in the chip ones too.
+ * Both are defined by the chip driver, next to w5x00_chip.
+ */
+extern
+struct w5x00_frames w5x00_frames;
+
+extern
+struct w5x00_frames w5x00_sock_frames[W5X00_MAX_SOCKETS];
+
+#define w5x00_read_regx(reg, buf) \
+    w5x00_chip.read_mem((reg), (buf), reg ## _SIZE)
+
+#define w5x00_write_regx(reg, buf) \
+    w5x00_chip.write_mem((reg), (buf), reg ## _SIZE)
+
+static inline
+uint8_t w5x00_read_reg(uint16_t reg)
+{
+    uint8_t val;
+
+    w5x00_chip.read_mem(reg, &val, 1);
+
+    return val;
+}
+
+static inline
+void w5x00_write_reg(uint16_t reg, uint8_t val)
+{
+    w5x00_chip.write_mem(reg, &val, 1);
+}
+
+static inline
+uint8_t w5x00_read_sock_reg(uint16_t sn_reg, int isocket)
+{
+    uint8_t val;
+
+    w5x00_chip.read_sock_mem(isocket, sn_reg, &val, 1);
+
+    return val;
+}
+
+static inline
+void w5x00_write_sock_reg(uint16_t sn_reg, int isocket, uint8_t val)
+{
+    w5x00_chip.write_sock_mem(isocket, sn_reg, &val, 1);
+}
+
+#define w5x00_read_sock_regx(sn_reg, socket, buf) \
+    w5x00_chip.read_sock_mem((socket), (sn_reg), (buf), sn_reg ## _SIZE)
+
+#define w5x00_write_sock_regx(sn_reg, socket, buf) \
+    w5x00_chip.write_sock_mem((socket), (sn_reg), (buf), sn_reg ## _SIZE)
+
+#endif /* W5X00_H */
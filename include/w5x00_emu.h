@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef W5X00_EMU_H
+#define W5X00_EMU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Register level model of the W5100/W5500 socket engine, to run
+ * the socket layer on a host.
+ *
+ * w5100_emu.c and w5500_emu.c decode the addresses of the
+ * respective chip and call this core, that keeps the registers,
+ * the buffer memories and the socket state machines.
+ *
+ * Packets sent to the IP address of the chip (SIPR) are delivered
+ * to the sockets of the chip itself, so that TCP connections and UDP
+ * datagrams can be exchanged between sockets of the same program.
+ *
+ * The rest of the traffic is tunneled through host sockets
+ * (w5x00_emu_host.c): TCP connections and UDP datagrams to other
+ * addresses, and TCP connections from host programs to the ports
+ * where the chip is listening, on the loopback interface.
+ *
+ * A socket in MACRAW mode sees a network where every address answers
+ * ARP requests; its UDP frames go to the sockets of the chip or,
+ * for other addresses, through host UDP sockets bound to their
+ * source ports on the loopback interface, that bring the answers back
+ * as frames.
+ */
+
+#define W5X00_EMU_MAX_SOCKETS    8
+#define W5X00_EMU_COMMON_SIZE    0x0040
+#define W5X00_EMU_SOCK_REGS_SIZE 0x0030
+#define W5X00_EMU_MEM_SIZE       0x4000
+
+struct w5x00_emu_stats {
+    unsigned long frames; /* SPI frames */
+    unsigned long bytes;  /* bytes transferred in data phases */
+    unsigned long commands; /* Sn_CR commands */
+};
+
+extern
+struct w5x00_emu_stats w5x00_emu_stats;
+
+extern
+uint8_t w5x00_emu_tx_mem[W5X00_EMU_MEM_SIZE];
+
+extern
+uint8_t w5x00_emu_rx_mem[W5X00_EMU_MEM_SIZE];
+
+/* Reset all registers and sockets, as after MR RST. */
+extern
+void w5x00_emu_reset(int n_sockets);
+
+extern
+uint8_t w5x00_emu_common_read(uint16_t reg);
+
+extern
+void w5x00_emu_common_write(uint16_t reg, uint8_t val);
+
+extern
+uint8_t w5x00_emu_sock_read(int isocket, uint16_t sn_reg);
+
+extern
+void w5x00_emu_sock_write(int isocket, uint16_t sn_reg, uint8_t val);
+
+/* Place the buffers of a socket in w5x00_emu_tx_mem and w5x00_emu_rx_mem. */
+extern
+void w5x00_emu_set_tx_buf(int isocket, uint16_t base, uint16_t size);
+
+extern
+void w5x00_emu_set_rx_buf(int isocket, uint16_t base, uint16_t size);
+
+/* Bit n set if socket n has some bit set in Sn_IR. */
+extern
+uint8_t w5x00_emu_sock_ir(void);
+
+/* Forget the local TCP connections without telling the sockets,
+ * as a NAT box or a peer that loses power would:
+ * only a timeout can reveal it.
+ */
+extern
+void w5x00_emu_drop_peers(void);
+
+/* Sleep until some tunneled socket has something to do,
+ * or for timeout_ms milliseconds, then move the tunneled data.
+ */
+extern
+void w5x00_emu_wait(int timeout_ms);
+
+#endif /* W5X00_EMU_H */
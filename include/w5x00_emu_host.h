@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef W5X00_EMU_HOST_H
+#define W5X00_EMU_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Host sockets, used by the emulator to tunnel the traffic that is
+ * not for the chip itself through the host kernel.
+ *
+ * The program linking the emulator gets socket(), connect(), poll()...
+ * from this library, so these functions go straight to the kernel.
+ * Addresses are 4 bytes in network order, as in the chip registers,
+ * ports are in host order.
+ * All descriptors are non-blocking.
+ */
+
+/* Return values of send and recv functions, besides byte counts. */
+#define W5X00_EMU_HOST_AGAIN (-1) /* would block */
+#define W5X00_EMU_HOST_ERROR (-2) /* connection is gone */
+
+/**
+ * Start a TCP connection.
+ * \retval descriptor, or -1 on error.
+ */
+extern
+int w5x00_emu_host_tcp_connect(const uint8_t *ip, uint16_t port);
+
+/**
+ * Outcome of w5x00_emu_host_tcp_connect.
+ * \retval 0 connected.
+ * \retval 1 still in progress.
+ * \retval -1 refused.
+ * \retval -2 other errors, like unreachable host or timeout.
+ */
+extern
+int w5x00_emu_host_tcp_connected(int fd);
+
+/**
+ * Listen for TCP connections on the loopback interface.
+ * \retval descriptor, or -1 on error.
+ */
+extern
+int w5x00_emu_host_tcp_listen(uint16_t port);
+
+/**
+ * Take a pending connection of a listening descriptor.
+ * \retval descriptor of the connection, or -1 if there is none.
+ */
+extern
+int w5x00_emu_host_tcp_accept(int fd, uint8_t *ip, uint16_t *port);
+
+/**
+ * UDP socket bound to port on the loopback interface.
+ * \retval descriptor, or -1 on error.
+ */
+extern
+int w5x00_emu_host_udp_open(uint16_t port);
+
+/**
+ * \retval bytes sent, W5X00_EMU_HOST_AGAIN or W5X00_EMU_HOST_ERROR.
+ */
+extern
+long w5x00_emu_host_send(int fd, const void *buf, size_t n);
+
+/**
+ * \retval bytes received, 0 at end of stream,
+ *         W5X00_EMU_HOST_AGAIN or W5X00_EMU_HOST_ERROR.
+ */
+extern
+long w5x00_emu_host_recv(int fd, void *buf, size_t n);
+
+extern
+long w5x00_emu_host_sendto(int fd, const void *buf, size_t n, const uint8_t *ip, uint16_t port);
+
+/**
+ * Receive a datagram, only if it fits in n bytes:
+ * bigger ones are left in the socket.
+ * \retval datagram length, or W5X00_EMU_HOST_AGAIN.
+ */
+extern
+long w5x00_emu_host_recvfrom(int fd, void *buf, size_t n, uint8_t *ip, uint16_t *port);
+
+extern
+void w5x00_emu_host_close(int fd);
+
+/**
+ * Sleep until one of rfds is readable, one of wfds is writable,
+ * or timeout_ms milliseconds have passed.
+ */
+extern
+void w5x00_emu_host_wait(const int *rfds, int nr, const int *wfds, int nw, int timeout_ms);
+
+#endif /* W5X00_EMU_HOST_H */
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef W5X00_INT_H
+#define W5X00_INT_H
+
+#include <time.h>
+
+/*
+ * INT line of the W5100 and W5500 shields, on CN5_9 D2 PA10, shared
+ * by w5100_spi.c and w5500_spi.c. Shields that do not have it
+ * connected must be built with W5X00_SPI_NO_INT.
+ */
+
+/**
+ * Configure PA10 and its external interrupt.
+ */
+extern
+void w5x00_int_init(void);
+
+/**
+ * State of the INT line, active low.
+ * \retval nonzero if the line is asserted, or it is not connected.
+ */
+extern
+int w5x00_int_asserted(void);
+
+/**
+ * Sleep until an interrupt is taken, if INT is not asserted.
+ * \param deadline on CLOCK_MONOTONIC to wake up at the latest, or NULL.
+ */
+extern
+void w5x00_int_wait(const struct timespec *deadline);
+
+#endif /* W5X00_INT_H */
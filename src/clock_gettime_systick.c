@@ -20,15 +20,35 @@
 #include <errno.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/cortex.h>
 #include "timespec.h"
 
-#ifndef CLOCK_GETTIME_SYNC_DISABLED
-#  include "timesync.h"
-#endif
-
 #define SYSTICK_NSEC 1000000
 #define SYSTICK_FREQ_HZ (NSECS_IN_SEC/SYSTICK_NSEC)
 
+/* With CLOCK_GETTIME_TICKLESS, clock_idle does not wake up at every
+ * tick: SysTick is reloaded once to count all the ticks up to the
+ * deadline, then it is put back in phase with the ticks and the
+ * ticks that went by are added to the clocks.
+ */
+#define SYSTICK_RELOAD_MAX 0xFFFFFF /* 24 bit counter */
+
+/* Cycles SysTick misses when it is stopped to be reloaded, from
+ * systick_counter_disable() to its first count after
+ * systick_counter_enable(): they are taken off the reload, for the
+ * clocks not to drift. The code in between is straight, its length
+ * depends on the compiler and on the flash wait states.
+ */
+#ifndef SYSTICK_STOP_CYCLES
+#  define SYSTICK_STOP_CYCLES 16
+#endif
+
+/* It is not stopped closer than this to a tick, so that the reload
+ * is not shorter than the cycles it misses.
+ */
+#define SYSTICK_STOP_MARGIN ((2 * SYSTICK_STOP_CYCLES) + 16)
+
 void sys_tick_handler(void);
 void clock_gettime_systick_init(void);
 
@@ -43,8 +63,6 @@ static const struct timespec systick_step = {
     .tv_nsec = SYSTICK_NSEC
 };
 
-static int clock_gettime_mutex;
-
 static
 volatile struct timespec *clock_get(clockid_t clock_id)
 {
@@ -72,24 +90,10 @@ void systick_fraction_to_timespec(uint32_t fraction, struct timespec *tp)
     
     ticks = (rcc_ahb_frequency/SYSTICK_FREQ_HZ) - fraction;
     tp->tv_sec = 0; /* assuming  SYSTICK_NSEC < NSECS_IN_SEC */
-    tp->tv_nsec = ticks * (NSECS_IN_SEC / rcc_ahb_frequency);
-}
-
-#ifndef CLOCK_GETTIME_SYNC_DISABLED
-
-/* Empty default that does nothing, in case
- * there is no implementation of timesync
- * linked in the program.
- */
-__attribute__((__weak__))
-int timesync_timespec(struct timespec *t)
-{
-    (void)t;
-    return 0;
+    /* NSECS_IN_SEC / rcc_ahb_frequency would truncate the cycle time */
+    tp->tv_nsec = ((uint64_t)ticks * NSECS_IN_SEC) / rcc_ahb_frequency;
 }
 
-#endif
-
 int clock_gettime(clockid_t clock_id, struct timespec *tp)
 {
     int ret;
@@ -120,27 +124,7 @@ int clock_gettime(clockid_t clock_id, struct timespec *tp)
         } while (flag_before != flag_after);
         systick_fraction_to_timespec(fraction_ticks, &fraction_ts);
         timespec_incr(tp, &fraction_ts);
-#ifndef CLOCK_GETTIME_SYNC_DISABLED
-        if (clock_id == CLOCK_REALTIME)
-        {
-            /* We use clock_gettime_mutex
-             * so that we do not get stuck in a recursion.
-             * Note that this Implementation is not completely thread-safe.
-             */
-            if (!clock_gettime_mutex)
-            {
-                int sync_ret;
-
-                clock_gettime_mutex = 1;
-
-                sync_ret = timesync_timespec(tp);
-
-                (void)sync_ret; /* ignore */
-
-                clock_gettime_mutex = 0;
-            }
-        }
-#endif
+        /* no synchronization here: see timesync_poll */
         ret = 0;
     }
     return ret;
@@ -227,6 +211,175 @@ void sys_tick_incr(clockid_t clock_id)
     timespec_incr(clk, &systick_step);
 }
 
+#ifdef CLOCK_GETTIME_TICKLESS
+
+/* Add n ticks at once: called with interrupts masked. */
+static
+void sys_tick_add(uint32_t n)
+{
+    struct timespec step;
+
+    step.tv_sec = n / SYSTICK_FREQ_HZ;
+    step.tv_nsec = (n % SYSTICK_FREQ_HZ) * SYSTICK_NSEC;
+    timespec_incr((struct timespec *)&monotonic, &step);
+    timespec_incr((struct timespec *)&realtime, &step);
+    timer_update_flag++;
+}
+
+/* Ticks to wait, the next one being the first, so that the last one
+ * comes at deadline or less than a tick after it; 0 if it is past.
+ */
+static
+uint32_t ticks_until(const struct timespec *deadline)
+{
+    uint32_t ret;
+    struct timespec now;
+    struct timespec left;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (deadline == NULL)
+    {
+        ret = UINT32_MAX;
+    }
+    else if (timespec_diff(deadline, &now, &left) <= 0)
+    {
+        ret = 0;
+    }
+    else if (left.tv_sec >= (time_t)(UINT32_MAX / SYSTICK_FREQ_HZ - 1))
+    {
+        ret = UINT32_MAX;
+    }
+    else
+    {
+        ret = left.tv_sec * SYSTICK_FREQ_HZ + left.tv_nsec / SYSTICK_NSEC + 1;
+    }
+    return ret;
+}
+
+/* Called with SysTick stopped: it counts reload + 1 cycles from its
+ * stop, then ticks again.
+ */
+static
+void systick_restart(uint32_t reload, uint32_t tick)
+{
+    systick_set_reload(reload - SYSTICK_STOP_CYCLES);
+    systick_clear();
+    systick_counter_enable();
+    /* the reload is taken at the first count after the clear:
+     * the one of the next periods is written after it.
+     */
+    while (systick_get_value() == 0)
+    {
+    }
+    systick_set_reload(tick - 1);
+}
+
+/* Waits until SysTick is far enough from a tick for the time it is
+ * stopped, and returns its value then.
+ */
+static
+uint32_t systick_value_away(uint32_t tick)
+{
+    uint32_t ret;
+
+    do
+    {
+        ret = systick_get_value();
+    } while ((ret % tick) < SYSTICK_STOP_MARGIN);
+    return ret;
+}
+
+/* Called when WFI returns, during a stretch of n ticks: the ticks that
+ * went by are counted and, if it was not the end, SysTick is put back
+ * to the next tick.
+ */
+static
+void systick_woken(uint32_t n, uint32_t tick)
+{
+    uint32_t ahead;
+    uint32_t left;
+
+    if (systick_get_countflag())
+    {
+        /* all of it: the pending tick interrupt counts the last one */
+        sys_tick_add(n - 1);
+    }
+    else
+    {
+        /* the ticks after the next one; if the end came in between,
+         * none: the pending tick interrupt counts it.
+         */
+        ahead = systick_value_away(tick) / tick;
+        systick_counter_disable();
+        left = systick_get_value() + 1 - (ahead * tick);
+        systick_restart(left - 1, tick);
+        /* the next tick interrupt counts the last one */
+        sys_tick_add(n - 1 - ahead);
+    }
+}
+
+/* Sleep for up to n ticks; interrupts are masked.
+ * The end of the stretch is in phase with the ticks, with nothing to
+ * do when it is reached: the counter is stopped only to start it, and
+ * to end it early.
+ */
+static
+void systick_sleep(uint32_t n)
+{
+    uint32_t tick;
+
+    tick = rcc_ahb_frequency / SYSTICK_FREQ_HZ;
+    if (n > (SYSTICK_RELOAD_MAX + 1) / tick)
+    {
+        /* up to a whole tick is left before the stretch */
+        n = (SYSTICK_RELOAD_MAX + 1) / tick;
+    }
+    if (n > 1)
+    {
+        (void)systick_value_away(tick);
+    }
+    if (SCB_ICSR & SCB_ICSR_PENDSTSET)
+    {
+        /* a tick is being taken: it wakes up WFI anyway */
+        n = 1;
+    }
+    if (n > 1)
+    {
+        systick_counter_disable();
+        /* the current tick stretched by the n - 1 after it */
+        systick_restart(systick_get_value() + (n - 1) * tick, tick);
+    }
+    __asm__ volatile ("wfi");
+    if (n > 1)
+    {
+        systick_woken(n, tick);
+    }
+}
+
+#endif /* CLOCK_GETTIME_TICKLESS */
+
+void clock_idle(const struct timespec *deadline)
+{
+    uint32_t masked;
+#ifdef CLOCK_GETTIME_TICKLESS
+    uint32_t n;
+#endif
+
+    masked = cm_mask_interrupts(1);
+#ifdef CLOCK_GETTIME_TICKLESS
+    n = ticks_until(deadline);
+    if (n > 0)
+    {
+        systick_sleep(n);
+    }
+#else
+    /* the next tick wakes it up */
+    (void)deadline;
+    __asm__ volatile ("wfi");
+#endif
+    cm_mask_interrupts(masked);
+}
+
 void sys_tick_handler(void)
 {
     sys_tick_incr(CLOCK_MONOTONIC);
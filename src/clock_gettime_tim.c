@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Clocks on a free-running hardware timer, counting at the timer clock:
+ * a resolution of 14 ns at 72 MHz, 10 ns at 100 MHz.
+ * The overflows of the 32 bit count are counted in the timer interrupt,
+ * making a 64 bit count that does not wrap. Reading it is a handful of
+ * register accesses with interrupts masked, there is no retry.
+ * On STM32F4 the 32 bit TIM5 overflows every 43 s at 100 MHz.
+ * STM32F1 has no 32 bit timer: TIM2 counts the low 16 bits and clocks
+ * TIM3, its slave, with the high 16 bits; they overflow every 60 s
+ * at 72 MHz.
+ * It replaces clock_gettime_systick.c, that must not be linked with it.
+ *
+ * The DWT cycle counter is not used: it stops while the core sleeps
+ * in WFI, as it does in clock_idle.
+ */
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
+#include "timespec.h"
+
+/* The timer counts at the timer clock divided by this. */
+#ifndef CLOCK_GETTIME_TIM_PRESCALER
+#  define CLOCK_GETTIME_TIM_PRESCALER 1
+#endif
+
+#ifdef STM32F4
+#  define CLOCK_TIM TIM5
+#  define CLOCK_TIM_RCC RCC_TIM5
+#  define CLOCK_TIM_IRQ NVIC_TIM5_IRQ
+#  define clock_tim_isr tim5_isr
+#else
+/* CLOCK_TIM is the high half, CLOCK_TIM_LO the low half */
+#  define CLOCK_TIM_CHAINED
+#  define CLOCK_TIM TIM3
+#  define CLOCK_TIM_RCC RCC_TIM3
+#  define CLOCK_TIM_IRQ NVIC_TIM3_IRQ
+#  define clock_tim_isr tim3_isr
+#  define CLOCK_TIM_LO TIM2
+#  define CLOCK_TIM_LO_RCC RCC_TIM2
+#  define CLOCK_TIM_LO_IRQ NVIC_TIM2_IRQ
+#  define CLOCK_TIM_LO_TRIGGER TIM_SMCR_TS_ITR1
+#  define clock_tim_lo_isr tim2_isr
+#endif
+
+#define CLOCK_TIM_MAX UINT32_MAX
+
+void clock_tim_isr(void);
+#ifdef CLOCK_TIM_CHAINED
+void clock_tim_lo_isr(void);
+#endif
+void clock_gettime_tim_init(void);
+
+/* counts of the timer before its current period */
+static volatile uint64_t overflows_counts;
+
+static uint32_t counts_freq;
+
+/* nanoseconds per count, 32.32 fixed point */
+static uint64_t nsec_scale;
+
+/* CLOCK_REALTIME is CLOCK_MONOTONIC plus this */
+static struct timespec realtime_offset;
+
+#ifdef CLOCK_TIM_CHAINED
+/* The high half counts a few cycles after the low half wrapped,
+ * less than it takes to read it again: when the two reads of the
+ * high half differ, the low half tells which one goes with it.
+ */
+static
+uint32_t counter_get(void)
+{
+    uint32_t hi;
+    uint32_t lo;
+    uint32_t hi_after;
+
+    hi = timer_get_counter(CLOCK_TIM);
+    lo = timer_get_counter(CLOCK_TIM_LO);
+    hi_after = timer_get_counter(CLOCK_TIM);
+    if ((hi_after != hi) && (lo < 0x8000))
+    {
+        hi = hi_after;
+    }
+    return (hi << 16) | lo;
+}
+#else
+static
+uint32_t counter_get(void)
+{
+    return timer_get_counter(CLOCK_TIM);
+}
+#endif
+
+/* Called with interrupts masked. An overflow that came after the
+ * interrupt was masked is still pending: the counter is then low,
+ * for as long as interrupts can stay masked.
+ */
+static
+uint64_t counts_get(void)
+{
+    uint64_t ret;
+    uint32_t cnt;
+
+    ret = overflows_counts;
+    cnt = counter_get();
+    if (timer_get_flag(CLOCK_TIM, TIM_SR_UIF) && (cnt < (CLOCK_TIM_MAX / 2)))
+    {
+        ret += (uint64_t)CLOCK_TIM_MAX + 1;
+    }
+    ret += cnt;
+
+    return ret;
+}
+
+static
+void counts_to_timespec(uint64_t counts, struct timespec *tp)
+{
+    uint64_t sec;
+    uint32_t rem;
+
+    sec = counts / counts_freq;
+    rem = counts - (sec * counts_freq);
+    tp->tv_sec = sec;
+    /* rem < counts_freq, so the product fits */
+    tp->tv_nsec = ((uint64_t)rem * nsec_scale) >> 32;
+}
+
+/* Count at deadline, rounded up. */
+static
+uint64_t timespec_to_counts(const struct timespec *tp)
+{
+    uint64_t ret;
+
+    if (tp->tv_sec < 0)
+    {
+        ret = 0;
+    }
+    else if ((tp->tv_nsec < 0) || (tp->tv_nsec >= NSECS_IN_SEC))
+    {
+        /* as TIMESPEC_INFINITY: the end of the second */
+        ret = ((uint64_t)tp->tv_sec + 1) * counts_freq;
+    }
+    else
+    {
+        ret = (uint64_t)tp->tv_sec * counts_freq;
+        ret += ((uint64_t)tp->tv_nsec * counts_freq + NSECS_IN_SEC - 1) / NSECS_IN_SEC;
+    }
+    return ret;
+}
+
+static
+void monotonic_get(struct timespec *tp)
+{
+    uint32_t masked;
+    uint64_t counts;
+
+    masked = cm_mask_interrupts(1);
+    counts = counts_get();
+    cm_mask_interrupts(masked);
+    counts_to_timespec(counts, tp);
+}
+
+int clock_gettime(clockid_t clock_id, struct timespec *tp)
+{
+    int ret;
+
+    if (clock_id == CLOCK_MONOTONIC)
+    {
+        monotonic_get(tp);
+        ret = 0;
+    }
+    else if (clock_id == CLOCK_REALTIME)
+    {
+        monotonic_get(tp);
+        timespec_incr(tp, &realtime_offset);
+        ret = 0;
+    }
+    else
+    {
+        ret = -1;
+        errno = EINVAL;
+    }
+    return ret;
+}
+
+int clock_settime(clockid_t clock_id, const struct timespec *tp)
+{
+    int ret;
+
+    if (clock_id != CLOCK_REALTIME)
+    {
+        ret = -1;
+        errno = EINVAL;
+    }
+    else if (tp == NULL)
+    {
+        ret = -1;
+        errno = EINVAL;
+    }
+    else if (tp->tv_nsec < 0)
+    {
+        ret = -1;
+        errno = EINVAL;
+    }
+    else if (tp->tv_nsec >= NSECS_IN_SEC)
+    {
+        ret = -1;
+        errno = EINVAL;
+    }
+    else
+    {
+        struct timespec now;
+
+        monotonic_get(&now);
+        (void)timespec_diff(tp, &now, &realtime_offset);
+        ret = 0;
+    }
+
+    return ret;
+}
+
+int clock_getres(clockid_t clock_id, struct timespec *res)
+{
+    int ret;
+
+    if ((clock_id != CLOCK_MONOTONIC) && (clock_id != CLOCK_REALTIME))
+    {
+        ret = -1;
+        errno = EINVAL;
+    }
+    else
+    {
+        ret = 0;
+        if (res != NULL)
+        {
+            res->tv_sec = 0;
+            res->tv_nsec = (NSECS_IN_SEC + counts_freq - 1) / counts_freq;
+        }
+    }
+    return ret;
+}
+
+/* Sleeps until compare channel 1 of timer matches value, that is
+ * when the count reaches match.
+ */
+static
+void compare_wait(uint32_t timer, uint32_t value, uint64_t match)
+{
+    timer_set_oc_value(timer, TIM_OC1, value);
+    timer_clear_flag(timer, TIM_SR_CC1IF);
+    timer_enable_irq(timer, TIM_DIER_CC1IE);
+    /* if the counter went past it already, there is no match */
+    if (counts_get() < match)
+    {
+        __asm__ volatile ("wfi");
+    }
+    timer_disable_irq(timer, TIM_DIER_CC1IE);
+}
+
+/* The overflow interrupt wakes it up at least once per period of
+ * the count, compare channel 1 at deadline when it comes before.
+ * With the chained timers the high half matches first, up to one
+ * period of the low half before the deadline: it returns early and
+ * the next call matches the low half.
+ */
+void clock_idle(const struct timespec *deadline)
+{
+    uint32_t masked;
+    uint64_t now;
+    uint64_t end;
+
+    masked = cm_mask_interrupts(1);
+    now = counts_get();
+    end = (deadline != NULL) ? timespec_to_counts(deadline) : UINT64_MAX;
+#ifdef CLOCK_TIM_CHAINED
+    if ((end - now) <= 0xFFFF)
+    {
+        compare_wait(CLOCK_TIM_LO, (uint32_t)end & 0xFFFF, end);
+    }
+    else if ((end - now) <= CLOCK_TIM_MAX)
+    {
+        compare_wait(CLOCK_TIM, ((uint32_t)end >> 16) & 0xFFFF,
+                end & ~(uint64_t)0xFFFF);
+    }
+#else
+    if ((end - now) <= CLOCK_TIM_MAX)
+    {
+        compare_wait(CLOCK_TIM, (uint32_t)end, end);
+    }
+#endif
+    else if (end > now)
+    {
+        __asm__ volatile ("wfi");
+    }
+    cm_mask_interrupts(masked);
+}
+
+void clock_tim_isr(void)
+{
+    if (timer_get_flag(CLOCK_TIM, TIM_SR_UIF))
+    {
+        timer_clear_flag(CLOCK_TIM, TIM_SR_UIF);
+        overflows_counts += (uint64_t)CLOCK_TIM_MAX + 1;
+    }
+    if (timer_get_flag(CLOCK_TIM, TIM_SR_CC1IF))
+    {
+        /* deadline of clock_idle: waking up is all it takes */
+        timer_clear_flag(CLOCK_TIM, TIM_SR_CC1IF);
+    }
+}
+
+#ifdef CLOCK_TIM_CHAINED
+void clock_tim_lo_isr(void)
+{
+    /* deadline of clock_idle: its overflows only clock CLOCK_TIM */
+    timer_clear_flag(CLOCK_TIM_LO, TIM_SR_CC1IF);
+}
+#endif
+
+__attribute__((__constructor__))
+void clock_gettime_tim_init(void)
+{
+    uint32_t tim_freq;
+
+    /* timers run at twice the APB1 clock when it is divided */
+    tim_freq = rcc_apb1_frequency;
+    if (rcc_apb1_frequency != rcc_ahb_frequency)
+    {
+        tim_freq *= 2;
+    }
+    counts_freq = tim_freq / CLOCK_GETTIME_TIM_PRESCALER;
+    nsec_scale = ((uint64_t)NSECS_IN_SEC << 32) / counts_freq;
+
+#ifdef CLOCK_TIM_CHAINED
+    rcc_periph_clock_enable(CLOCK_TIM_LO_RCC);
+    timer_set_prescaler(CLOCK_TIM_LO, CLOCK_GETTIME_TIM_PRESCALER - 1);
+    timer_set_period(CLOCK_TIM_LO, 0xFFFF);
+    /* before CLOCK_TIM is its slave, it would count it */
+    timer_generate_event(CLOCK_TIM_LO, TIM_EGR_UG);
+    timer_clear_flag(CLOCK_TIM_LO, TIM_SR_UIF);
+    timer_set_counter(CLOCK_TIM_LO, 0);
+    timer_set_master_mode(CLOCK_TIM_LO, TIM_CR2_MMS_UPDATE);
+    nvic_enable_irq(CLOCK_TIM_LO_IRQ);
+
+    rcc_periph_clock_enable(CLOCK_TIM_RCC);
+    timer_set_prescaler(CLOCK_TIM, 0);
+    timer_set_period(CLOCK_TIM, 0xFFFF);
+    timer_slave_set_trigger(CLOCK_TIM, CLOCK_TIM_LO_TRIGGER);
+    timer_slave_set_mode(CLOCK_TIM, TIM_SMCR_SMS_ECM1);
+#else
+    rcc_periph_clock_enable(CLOCK_TIM_RCC);
+    timer_set_prescaler(CLOCK_TIM, CLOCK_GETTIME_TIM_PRESCALER - 1);
+    timer_set_period(CLOCK_TIM, CLOCK_TIM_MAX);
+#endif
+    /* load the prescaler, the update flag it sets is not an overflow */
+    timer_generate_event(CLOCK_TIM, TIM_EGR_UG);
+    timer_clear_flag(CLOCK_TIM, TIM_SR_UIF);
+    timer_set_counter(CLOCK_TIM, 0);
+    timer_enable_irq(CLOCK_TIM, TIM_DIER_UIE);
+    nvic_enable_irq(CLOCK_TIM_IRQ);
+    timer_enable_counter(CLOCK_TIM);
+#ifdef CLOCK_TIM_CHAINED
+    timer_enable_counter(CLOCK_TIM_LO);
+#endif
+}
@@ -19,7 +19,34 @@
 #include <time.h>
 #include "timespec.h"
 
-/* polling implementation */
+/* Sleep until rqtp on clock_id, tcurrent being the time on clock_id.
+ * clock_idle wants a deadline on CLOCK_MONOTONIC,
+ * what is left to wait is the same on any clock.
+ */
+static
+void idle_until(clockid_t clock_id, const struct timespec *rqtp, const struct timespec *tcurrent)
+{
+    struct timespec left;
+    struct timespec now;
+    struct timespec deadline;
+
+    if (clock_id == CLOCK_MONOTONIC)
+    {
+        clock_idle(rqtp);
+    }
+    else if (clock_gettime(CLOCK_MONOTONIC, &now) == 0)
+    {
+        (void)timespec_diff(rqtp, tcurrent, &left);
+        timespec_add(&now, &left, &deadline);
+        clock_idle(&deadline);
+    }
+    else
+    {
+        clock_idle(NULL);
+    }
+}
+
+/* polling implementation, sleeping in clock_idle between the polls */
 int clock_nanosleep(
         clockid_t clock_id,
         int flags,
@@ -50,6 +77,7 @@ int clock_nanosleep(
             }
             break;
         }
+        idle_until(clock_id, rqtp, &tcurrent);
         ret = clock_gettime(clock_id, &tcurrent);
     }
 
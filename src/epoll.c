@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/epoll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include "file.h"
+#include "timespec.h"
+
+#ifndef EPOLL_MAX_INSTANCES
+#  define EPOLL_MAX_INSTANCES 2
+#endif
+
+#ifndef EPOLL_MAX_FDS
+#  define EPOLL_MAX_FDS 16
+#endif
+
+#define EPOLL_FLAGS (EPOLLONESHOT|EPOLLET)
+
+struct epoll_item {
+    int fd;
+    struct epoll_event event;
+    /* ready events and notification of the file at the last look,
+     * for EPOLLET
+     */
+    short last;
+    unsigned long notified;
+};
+
+static struct epoll_instance {
+    int isopen;
+    int nitems;
+    struct epoll_item items[EPOLL_MAX_FDS];
+} epoll_instances[EPOLL_MAX_INSTANCES];
+
+static
+int epoll_close(int fd);
+
+static
+short epoll_poll(int fd);
+
+static
+struct epoll_instance *get_instance(int epfd)
+{
+    struct epoll_instance *ep;
+    struct fd *f;
+
+    f = (epfd >= 0) ? file_struct_get(epfd) : NULL;
+    if ((f == NULL) || !f->isopen)
+    {
+        errno = EBADF;
+        ep = NULL;
+    }
+    else if (f->close != epoll_close)
+    {
+        errno = EINVAL;
+        ep = NULL;
+    }
+    else
+    {
+        ep = f->opaque;
+    }
+    return ep;
+}
+
+static
+struct epoll_item *find_item(struct epoll_instance *ep, int fd)
+{
+    struct epoll_item *item;
+    int i;
+
+    item = NULL;
+    for (i = 0; i < ep->nitems; i++)
+    {
+        if (ep->items[i].fd == fd)
+        {
+            item = &ep->items[i];
+            break;
+        }
+    }
+    return item;
+}
+
+static
+void remove_item(struct epoll_instance *ep, struct epoll_item *item)
+{
+    ep->nitems--;
+    *item = ep->items[ep->nitems];
+}
+
+/* Events of item to report now, 0 if none; with update the
+ * EPOLLET and EPOLLONESHOT state is updated as they are reported.
+ */
+static
+uint32_t item_events(struct epoll_instance *ep, struct epoll_item *item, int update, int *removed)
+{
+    uint32_t ret;
+    short revents;
+    struct fd *f;
+
+    *removed = 0;
+    f = file_struct_get(item->fd);
+    /* a closed file is dropped, whatever it was ready for */
+    revents = f->isopen ? file_poll(item->fd) : POLLNVAL;
+    if (revents & POLLNVAL)
+    {
+        /* closed */
+        if (update)
+        {
+            remove_item(ep, item);
+            *removed = 1;
+        }
+        ret = 0;
+    }
+    else
+    {
+        short ready;
+
+        ready = revents & (item->event.events | EPOLLERR | EPOLLHUP);
+        if (item->event.events & EPOLLET)
+        {
+            unsigned long notified;
+
+            /* a notification is an edge, even if the level did not
+             * change, as new data coming after a partial read;
+             * files without notify only have the level to go by
+             */
+            notified = f->notified;
+            ret = (notified != item->notified) ? ready : (ready & ~item->last);
+            if (update)
+            {
+                item->last = ready;
+                item->notified = notified;
+            }
+        }
+        else
+        {
+            ret = ready;
+        }
+        if ((item->event.events & EPOLLONESHOT) && ((item->event.events & ~EPOLL_FLAGS) == 0))
+        {
+            /* disabled until EPOLL_CTL_MOD */
+            ret = 0;
+        }
+        if ((ret != 0) && update && (item->event.events & EPOLLONESHOT))
+        {
+            item->event.events &= EPOLL_FLAGS;
+        }
+    }
+    return ret;
+}
+
+static
+int epoll_tentative(struct epoll_instance *ep, struct epoll_event *events, int maxevents)
+{
+    int ret;
+    int i;
+
+    ret = 0;
+    i = 0;
+    while ((i < ep->nitems) && (ret < maxevents))
+    {
+        uint32_t ev;
+        int removed;
+
+        ev = item_events(ep, &ep->items[i], 1, &removed);
+        if (ev != 0)
+        {
+            events[ret].events = ev;
+            events[ret].data = ep->items[i].event.data;
+            ret++;
+        }
+        if (!removed)
+        {
+            i++;
+        }
+    }
+    return ret;
+}
+
+/* poll_idle is only for files that wake it up. */
+static
+int items_notify(const struct epoll_instance *ep)
+{
+    int ret;
+    int i;
+
+    ret = 1;
+    for (i = 0; i < ep->nitems; i++)
+    {
+        if (!file_notifies(ep->items[i].fd))
+        {
+            ret = 0;
+        }
+    }
+    return ret;
+}
+
+static
+int epoll_close(int fd)
+{
+    struct fd *f;
+
+    f = file_struct_get(fd);
+    ((struct epoll_instance *)f->opaque)->isopen = 0;
+    f->isopen = 0;
+    file_free(fd);
+
+    return 0;
+}
+
+/* Readable when some file of the list is ready;
+ * nothing is reported or dropped here.
+ */
+static
+short epoll_poll(int fd)
+{
+    short ret;
+    struct epoll_instance *ep;
+    int i;
+
+    ep = file_struct_get(fd)->opaque;
+    ret = 0;
+    for (i = 0; i < ep->nitems; i++)
+    {
+        int removed;
+
+        if (item_events(ep, &ep->items[i], 0, &removed) != 0)
+        {
+            ret = POLLIN|POLLRDNORM;
+            break;
+        }
+    }
+    return ret;
+}
+
+int epoll_create1(int flags)
+{
+    int ret;
+    int i;
+
+    for (i = 0; i < EPOLL_MAX_INSTANCES; i++)
+    {
+        if (!epoll_instances[i].isopen)
+        {
+            break;
+        }
+    }
+    if (flags != 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (i == EPOLL_MAX_INSTANCES)
+    {
+        errno = ENFILE;
+        ret = -1;
+    }
+    else
+    {
+        ret = file_alloc();
+        if (ret == -1)
+        {
+            errno = ENFILE;
+        }
+        else
+        {
+            struct fd *f;
+
+            epoll_instances[i].isopen = 1;
+            epoll_instances[i].nitems = 0;
+            f = file_struct_get(ret);
+            f->isatty = 0;
+            f->isopen = 1;
+            f->close = epoll_close;
+            f->poll = epoll_poll;
+            f->status_flags = O_RDONLY;
+            f->opaque = &epoll_instances[i];
+        }
+    }
+    return ret;
+}
+
+int epoll_create(int size)
+{
+    int ret;
+
+    if (size <= 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        ret = epoll_create1(0);
+    }
+    return ret;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    int ret;
+    struct epoll_instance *ep;
+    struct fd *f;
+    struct epoll_item *item;
+
+    ep = get_instance(epfd);
+    f = (fd >= 0) ? file_struct_get(fd) : NULL;
+    if (ep == NULL)
+    {
+        ret = -1;
+    }
+    else if ((f == NULL) || !f->isopen || (f->poll == NULL))
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else if (fd == epfd)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if ((op != EPOLL_CTL_DEL) && (event == NULL))
+    {
+        errno = EFAULT;
+        ret = -1;
+    }
+    else
+    {
+        item = find_item(ep, fd);
+        switch (op)
+        {
+            case EPOLL_CTL_ADD:
+                if (item != NULL)
+                {
+                    errno = EEXIST;
+                    ret = -1;
+                }
+                else if (ep->nitems == EPOLL_MAX_FDS)
+                {
+                    errno = ENOSPC;
+                    ret = -1;
+                }
+                else
+                {
+                    item = &ep->items[ep->nitems];
+                    ep->nitems++;
+                    item->fd = fd;
+                    item->event = *event;
+                    item->last = 0;
+                    item->notified = file_struct_get(fd)->notified;
+                    ret = 0;
+                }
+                break;
+            case EPOLL_CTL_MOD:
+                if (item == NULL)
+                {
+                    errno = ENOENT;
+                    ret = -1;
+                }
+                else
+                {
+                    item->event = *event;
+                    item->last = 0;
+                    item->notified = file_struct_get(fd)->notified;
+                    ret = 0;
+                }
+                break;
+            case EPOLL_CTL_DEL:
+                if (item == NULL)
+                {
+                    errno = ENOENT;
+                    ret = -1;
+                }
+                else
+                {
+                    remove_item(ep, item);
+                    ret = 0;
+                }
+                break;
+            default:
+                errno = EINVAL;
+                ret = -1;
+                break;
+        }
+    }
+    return ret;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    int ret;
+    struct epoll_instance *ep;
+
+    ep = get_instance(epfd);
+    if (ep == NULL)
+    {
+        ret = -1;
+    }
+    else if (maxevents <= 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        struct timespec tend;
+        int timeout_expired;
+
+        if (timeout < 0)
+        {
+            tend = TIMESPEC_INFINITY;
+        }
+        else
+        {
+            struct timespec timeout_ts;
+
+            timeout_ts.tv_sec = timeout / MSECS_IN_SEC;
+            timeout_ts.tv_nsec = (timeout % MSECS_IN_SEC) * (NSECS_IN_SEC / MSECS_IN_SEC);
+            (void)clock_gettime(CLOCK_MONOTONIC, &tend);
+            timespec_add(&tend, &timeout_ts, &tend);
+        }
+        do
+        {
+            struct timespec tcurrent;
+            unsigned long generation;
+
+            ret = clock_gettime(CLOCK_MONOTONIC, &tcurrent);
+            if (ret != 0)
+            {
+                break;
+            }
+
+            poll_update();
+            generation = file_generation;
+            ret = epoll_tentative(ep, events, maxevents);
+            if (ret != 0)
+            {
+                break;
+            }
+
+            timeout_expired = (timespec_diff(&tcurrent, &tend, NULL) >= 0);
+            if (!timeout_expired && items_notify(ep) && (generation == file_generation))
+            {
+                /* nothing happened while looking */
+                poll_idle(&tend);
+            }
+        } while(!timeout_expired);
+    }
+    return ret;
+}
@@ -22,6 +22,7 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <poll.h>
 #include "fatfs.h"
 #include "file.h"
 
@@ -45,6 +46,14 @@ int fatfs_read (int fd, char *ptr, int len);
 static
 int fatfs_close (int fd);
 
+static
+short fatfs_poll(int fd);
+
+#if _USE_FORWARD && _FS_TINY
+static
+ssize_t fatfs_forward(int fd, size_t (*sink)(const void *, size_t, void *), void *arg, size_t count);
+#endif
+
 static
 BYTE flags2mode(int flags);
 
@@ -96,6 +105,12 @@ struct dirstream {
 
 /* typedef struct dirstream DIR in dirent.h */
 
+#if _USE_FORWARD && _FS_TINY
+/* f_forward gives no context to its callback. */
+static size_t (*forward_sink)(const void *, size_t, void *);
+static void *forward_arg;
+#endif
+
 static struct {
     int allocated;
     union
@@ -375,6 +390,25 @@ int fatfs_write (int fd, char *ptr, int len)
     return ret;
 }
 
+/* Regular files are always ready. */
+static
+short fatfs_poll(int fd)
+{
+    short ret;
+    struct fd *pfd;
+
+    pfd = file_struct_get(fd);
+    if ((pfd == NULL) || !pfd->isopen)
+    {
+        ret = -1;
+    }
+    else
+    {
+        ret = POLLIN|POLLRDNORM|POLLOUT|POLLWRNORM;
+    }
+    return ret;
+}
+
 static
 int fatfs_read (int fd, char *ptr, int len)
 {
@@ -426,6 +460,66 @@ int fatfs_read (int fd, char *ptr, int len)
     return ret;
 }
 
+#if _USE_FORWARD && _FS_TINY
+static
+UINT forward_func(const BYTE *buf, UINT btf)
+{
+    UINT ret;
+
+    if (btf == 0)
+    {
+        /* asking if the sink is ready */
+        ret = 1;
+    }
+    else
+    {
+        ret = forward_sink(buf, btf, forward_arg);
+    }
+    return ret;
+}
+
+/* Sectors go from disk_read to the sink through the file system window,
+ * with no other copy.
+ */
+static
+ssize_t fatfs_forward(int fd, size_t (*sink)(const void *, size_t, void *), void *arg, size_t count)
+{
+    ssize_t ret;
+    struct fd *pfd;
+
+    pfd = file_struct_get(fd);
+
+    if ((pfd == NULL) || (pfd->opaque == NULL) || !S_ISREG(pfd->stat.st_mode))
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else
+    {
+        FIL *filp;
+        FRESULT result;
+        UINT nbytes_forwarded;
+
+        filp = pfd->opaque;
+        forward_sink = sink;
+        forward_arg = arg;
+
+        result = f_forward(filp, forward_func, count, &nbytes_forwarded);
+        if ((result == FR_OK) || (nbytes_forwarded > 0))
+        {
+            ret = nbytes_forwarded;
+        }
+        else
+        {
+            errno = fresult2errno(result);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+#endif
+
 static
 int fatfs_close (int fd)
 {
@@ -455,6 +549,7 @@ int fatfs_close (int fd)
         if (result == FR_OK)
         {
             fatfs_fil_free(filp);
+            pfd->isopen = 0;
             file_free(fd);
             ret = 0;
         }
@@ -475,6 +570,7 @@ int fatfs_close (int fd)
         if (result == FR_OK)
         {
             fatfs_dir_free(dp);
+            pfd->isopen = 0;
             file_free(fd);
             ret = 0;
         }
@@ -543,6 +639,11 @@ void fill_fd(struct fd *pfd, int flags, const FILINFO *fno)
     {
         pfd->write = fatfs_write;
         pfd->read = fatfs_read;
+        pfd->poll = fatfs_poll;
+        pfd->notify = 1; /* never changes until closed */
+#if _USE_FORWARD && _FS_TINY
+        pfd->forward = fatfs_forward;
+#endif
     }
 
     fill_stat(fno, &pfd->stat);
@@ -24,10 +24,19 @@
 #include <string.h>
 #include <file.h>
 #include <limits.h>
+#include <poll.h>
+
+#define FILE_BITS (8 * sizeof(unsigned long))
 
 static
 struct fd files[OPEN_MAX];
 
+/* Files with notify whose revents is stale, bit n for fd n. */
+static
+unsigned long files_changed[(OPEN_MAX + FILE_BITS - 1) / FILE_BITS];
+
+unsigned long file_generation;
+
 struct fd *file_struct_get(int fd)
 {
     struct fd *f;
@@ -57,6 +66,7 @@ int file_alloc(void)
             
             files[fd].isallocated = 1;
             files[fd].fd = fd;
+            file_notify(fd);
             ret = fd;
             break;
         }
@@ -69,6 +79,56 @@ void file_free(int fd)
     if ((fd < OPEN_MAX) && (fd >= 0) && (files[fd].isallocated))
     {
         files[fd].isallocated = 0;
+        files[fd].notify = 0;
+        files[fd].revents = 0;
+        /* pollers of a notifying fd see it closed */
+        file_notify(fd);
+    }
+}
+
+void file_notify(int fd)
+{
+    if ((fd >= 0) && (fd < OPEN_MAX))
+    {
+        files_changed[fd / FILE_BITS] |= 1UL << (fd % FILE_BITS);
+        file_generation++;
+        files[fd].notified = file_generation;
     }
 }
 
+int file_notifies(int fd)
+{
+    struct fd *f;
+
+    f = (fd >= 0) ? file_struct_get(fd) : NULL;
+
+    return (f != NULL) && f->isallocated && f->notify;
+}
+
+short file_poll(int fd)
+{
+    short revents;
+    struct fd *f;
+
+    f = (fd >= 0) ? file_struct_get(fd) : NULL;
+    if ((f == NULL) || !f->isallocated || !f->isopen || (f->poll == NULL))
+    {
+        revents = POLLNVAL;
+    }
+    else if (f->notify && !(files_changed[fd / FILE_BITS] & (1UL << (fd % FILE_BITS))))
+    {
+        revents = f->revents;
+    }
+    else
+    {
+        /* cleared first: a notification while polling is not lost */
+        files_changed[fd / FILE_BITS] &= ~(1UL << (fd % FILE_BITS));
+        revents = f->poll(fd);
+        if (revents == -1)
+        {
+            revents = POLLNVAL;
+        }
+        f->revents = revents;
+    }
+    return revents;
+}
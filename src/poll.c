@@ -22,6 +22,17 @@
 #include "time.h"
 #include "timespec.h"
 
+__attribute__((__weak__))
+void poll_idle(const struct timespec *deadline)
+{
+    (void)deadline;
+}
+
+__attribute__((__weak__))
+void poll_update(void)
+{
+}
+
 static
 short poll_one(struct pollfd *p)
 {
@@ -33,25 +44,7 @@ short poll_one(struct pollfd *p)
     }
     else
     {
-        struct fd *f;
-
-        f = file_struct_get(p->fd);
-        if (f == NULL)
-        {
-            revents = POLLNVAL;
-        }
-        else if (f->poll == NULL)
-        {
-            revents = POLLNVAL;
-        }
-        else
-        {
-            revents = f->poll(p->fd);
-            if (revents == -1)
-            {
-                revents = POLLNVAL;
-            }
-        }
+        revents = file_poll(p->fd);
     }
     if (revents >= 0)
     {
@@ -107,13 +100,24 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout)
 
     if (timeout == 0)
     {
+        poll_update();
         ret = poll_tentative(fds, nfds);
     }
     else
     {
         struct timespec tend;
         int timeout_expired;
+        int idle;
+        nfds_t i;
 
+        idle = 1;
+        for (i = 0; i < nfds; i++)
+        {
+            if ((fds[i].fd >= 0) && !file_notifies(fds[i].fd))
+            {
+                idle = 0;
+            }
+        }
         if (timeout == -1)
         {
             tend = TIMESPEC_INFINITY;
@@ -134,6 +138,7 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout)
         do
         {
             struct timespec tcurrent;
+            unsigned long generation;
 
             ret = clock_gettime(CLOCK_MONOTONIC, &tcurrent);
             if (ret != 0)
@@ -141,6 +146,8 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout)
                 break;
             }
 
+            poll_update();
+            generation = file_generation;
             ret = poll_tentative(fds, nfds);
             if (ret != 0)
             {
@@ -148,6 +155,11 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout)
             }
 
             timeout_expired = (timespec_diff(&tcurrent, &tend, NULL) >= 0);
+            if (!timeout_expired && idle && (generation == file_generation))
+            {
+                /* nothing happened while looking */
+                poll_idle(&tend);
+            }
         } while(!timeout_expired);
 
     }
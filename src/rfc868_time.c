@@ -18,6 +18,8 @@
 #include "timesync.h"
 #include <sys/socket.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "timespec.h"
 
 #define RFC868_TYPE_TCP 1
@@ -157,10 +159,10 @@ void timespec_correct(struct timespec *ts)
     ts->tv_nsec = NSECS_IN_SEC/2;
 }
 
-int rfc868_gettime(struct timespec *ts)
+static
+int rfc868_to_timespec(int32_t tp_secs, struct timespec *ts)
 {
     int res;
-    int32_t tp_secs;
     time_t secs_to_epoch;
 
     /* RFC 868 time starts at 1900/1/1
@@ -169,7 +171,6 @@ int rfc868_gettime(struct timespec *ts)
      */
     secs_to_epoch = 2208988800U; /* (70*365 + 17)*86400 http://stackoverflow.com/a/29138806/1415942 */
 
-    tp_secs = rfc868_gettime32(rfc868_server);
     if (tp_secs == 0)
     {
         res = -1;
@@ -196,6 +197,44 @@ int rfc868_gettime(struct timespec *ts)
     return res;
 }
 
+int rfc868_gettime(struct timespec *ts)
+{
+    return rfc868_to_timespec(rfc868_gettime32(rfc868_server), ts);
+}
+
+int rfc868_gettime_start(void)
+{
+    int sock;
+    int sock_type;
+
+#if (RFC868_TYPE == RFC868_TYPE_TCP)
+    sock_type = SOCK_STREAM;
+#elif (RFC868_TYPE == RFC868_TYPE_UDP)
+    sock_type = SOCK_DGRAM;
+#endif
+
+    sock = socket(AF_INET, sock_type, 0);
+    if (sock >= 0)
+    {
+        if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+        {
+            close(sock);
+            sock = -1;
+        }
+        else if ((rfc868_connect(sock, rfc868_server) != 0) && (errno != EINPROGRESS))
+        {
+            close(sock);
+            sock = -1;
+        }
+    }
+    return sock;
+}
+
+int rfc868_gettime_finish(int sock, struct timespec *ts)
+{
+    return rfc868_to_timespec(recv_time32(sock), ts);
+}
+
 void rfc868_timeserver_set(in_addr_t server)
 {
     rfc868_server = server;
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <string.h>
 #include <poll.h>
+#include "file.h"
 #include "timespec.h"
 
 static
@@ -96,87 +97,129 @@ void FD_ZERO(fd_set *fdset)
     }
 }
 
+/* Bits of word i of a fd_set that are for fds below nfds. */
+static
+unsigned long fd_set_word_mask(int nfds, int i)
+{
+    unsigned long mask;
+    int nbits;
+
+    nbits = nfds - i * (int)(8*sizeof(unsigned long));
+    if (nbits >= (int)(8*sizeof(unsigned long)))
+    {
+        mask = ~0UL;
+    }
+    else
+    {
+        mask = (1UL << nbits) - 1;
+    }
+    return mask;
+}
+
+/* Move the fds below nfds from set to in:
+ * set then only gets the ready ones, as they are found.
+ */
+static
+void fd_set_take(fd_set *set, fd_set *in, int nfds)
+{
+    int i;
+
+    FD_ZERO(in);
+    if (set != NULL)
+    {
+        for (i = 0; i * (int)(8*sizeof(unsigned long)) < nfds; i++)
+        {
+            unsigned long mask;
+
+            mask = fd_set_word_mask(nfds, i);
+            in->mask[i] = set->mask[i] & mask;
+            set->mask[i] &= ~mask;
+        }
+    }
+}
+
 static
 int pselect_one(
         int fd,
+        fd_set *readfds_in,
+        fd_set *writefds_in,
+        fd_set *errorfds_in,
         fd_set *readfds,
         fd_set *writefds,
         fd_set *errorfds)
 {
     int ret;
+    short revents;
 
-    if (FD_ISSET(fd, readfds) || FD_ISSET(fd, writefds) || FD_ISSET(fd, errorfds))
+    revents = file_poll(fd);
+    if (revents & POLLNVAL)
     {
-        struct pollfd p;
-        int pollret;
-
-        p.fd = fd;
-        p.events =
-            POLLIN|POLLRDNORM|POLLRDBAND|POLLPRI|
-            POLLOUT|POLLWRNORM|POLLWRBAND|
-            POLLERR|POLLHUP|POLLNVAL;
-        pollret = poll(&p, 1, 0);
-        if ((pollret == -1) || (p.revents & POLLNVAL))
-        {
-            errno = EBADF;
-            ret = -1;
-        }
-        else
-        {
-            if (!(p.revents & (POLLIN|POLLRDNORM|POLLERR|POLLHUP)))
-            {
-                FD_CLR(fd, readfds);
-            }
-            if (!(p.revents & (POLLOUT|POLLWRNORM|POLLERR|POLLHUP)))
-            {
-                FD_CLR(fd, writefds);
-            }
-            if (!(p.revents & (POLLRDBAND|POLLWRBAND|POLLPRI)))
-            {
-                FD_CLR(fd, errorfds);
-            }
-            if (FD_ISSET(fd, readfds) || FD_ISSET(fd, writefds) || FD_ISSET(fd, errorfds))
-            {
-                ret = 1;
-            }
-            else
-            {
-                ret = 0;
-            }
-        }
+        errno = EBADF;
+        ret = -1;
     }
     else
     {
         ret = 0;
+        if (FD_ISSET(fd, readfds_in) && (revents & (POLLIN|POLLRDNORM|POLLERR|POLLHUP)))
+        {
+            FD_SET(fd, readfds);
+            ret = 1;
+        }
+        if (FD_ISSET(fd, writefds_in) && (revents & (POLLOUT|POLLWRNORM|POLLERR|POLLHUP)))
+        {
+            FD_SET(fd, writefds);
+            ret = 1;
+        }
+        if (FD_ISSET(fd, errorfds_in) && (revents & (POLLRDBAND|POLLWRBAND|POLLPRI)))
+        {
+            FD_SET(fd, errorfds);
+            ret = 1;
+        }
     }
 
     return ret;
 }
 
+/* Only the fds in the sets are looked at, a word of fds at a time;
+ * those of drivers with notify cost nothing until they change.
+ */
 static
 int pselect_tentative(
         int nfds,
+        fd_set *readfds_in,
+        fd_set *writefds_in,
+        fd_set *errorfds_in,
         fd_set *readfds,
         fd_set *writefds,
         fd_set *errorfds)
 {
     int ret;
-    int fd;
+    int i;
 
     ret = 0;
-    for (fd = 0; fd < nfds; fd++)
+    for (i = 0; (ret != -1) && (i * (int)(8*sizeof(unsigned long)) < nfds); i++)
     {
-        int ret_one;
+        unsigned long todo;
+        int fd;
 
-        ret_one = pselect_one(fd, readfds, writefds, errorfds);
-        if (ret_one == -1)
-        {
-            ret = -1;
-            break;
-        }
-        else
+        todo = readfds_in->mask[i] | writefds_in->mask[i] | errorfds_in->mask[i];
+        for (fd = i * (8*sizeof(unsigned long)); todo != 0; fd++, todo >>= 1)
         {
-            ret += ret_one;
+            if (todo & 1)
+            {
+                int ret_one;
+
+                ret_one = pselect_one(fd, readfds_in, writefds_in, errorfds_in, readfds, writefds, errorfds);
+                if (ret_one == -1)
+                {
+                    ret = -1;
+                    break;
+                }
+                else
+                {
+                    ret += ret_one;
+                }
+            }
         }
     }
 
@@ -194,49 +237,73 @@ int pselect(int nfds, fd_set *readfds,
     fd_set readfds_in;
     fd_set writefds_in;
     fd_set errorfds_in;
+    int idle;
+    int fd;
 
     (void)sigmask; /* TODO when we have signals */
 
-    if (timeout == NULL)
+    if ((nfds < 0) || (nfds > FD_SETSIZE))
     {
-        tend = TIMESPEC_INFINITY;
+        errno = EINVAL;
+        ret = -1;
     }
     else
     {
-        ret = clock_gettime(CLOCK_MONOTONIC, &tend);
-
-        timespec_add(&tend, timeout, &tend);
-    }
-
-    /* save fd sets to reinit them after each tentative */
-    readfds_in = *readfds;
-    writefds_in = *writefds;
-    errorfds_in = *errorfds;
-    do
-    {
-        struct timespec tcurrent;
-
-        ret = clock_gettime(CLOCK_MONOTONIC, &tcurrent);
-        if (ret != 0)
+        if (timeout == NULL)
         {
-            break;
+            tend = TIMESPEC_INFINITY;
         }
-
-        ret = pselect_tentative(nfds, readfds, writefds, errorfds);
-        if (ret != 0)
+        else
         {
-            break;
+            ret = clock_gettime(CLOCK_MONOTONIC, &tend);
+
+            timespec_add(&tend, timeout, &tend);
         }
 
-        timeout_expired = (timespec_diff(&tcurrent, &tend, NULL) >= 0);
-        if (!timeout_expired)
+        /* the sets only get the ready fds, nothing to restore on retries */
+        fd_set_take(readfds, &readfds_in, nfds);
+        fd_set_take(writefds, &writefds_in, nfds);
+        fd_set_take(errorfds, &errorfds_in, nfds);
+        idle = 1;
+        for (fd = 0; fd < nfds; fd++)
         {
-            /* reinit fd sets */
-            *readfds = readfds_in;
-            *writefds = writefds_in;
-            *errorfds = errorfds_in;
+            if (
+                    (FD_ISSET(fd, &readfds_in) || FD_ISSET(fd, &writefds_in) || FD_ISSET(fd, &errorfds_in))
+                    &&
+                    !file_notifies(fd)
+               )
+            {
+                idle = 0;
+            }
         }
-    } while(!timeout_expired);
+        do
+        {
+            struct timespec tcurrent;
+            unsigned long generation;
+
+            ret = clock_gettime(CLOCK_MONOTONIC, &tcurrent);
+            if (ret != 0)
+            {
+                break;
+            }
+
+            poll_update();
+            generation = file_generation;
+            ret = pselect_tentative(nfds, &readfds_in, &writefds_in, &errorfds_in,
+                    readfds, writefds, errorfds);
+            if (ret != 0)
+            {
+                break;
+            }
+
+            timeout_expired = (timespec_diff(&tcurrent, &tend, NULL) >= 0);
+            if (!timeout_expired && idle && (generation == file_generation))
+            {
+                /* nothing happened while looking */
+                poll_idle(&tend);
+            }
+        } while(!timeout_expired);
+    }
 
     return ret;
 }
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include <errno.h>
+#include "file.h"
+
+/* Files that can take the data straight from the source
+ * provide the sendfile callback, like sockets do.
+ * For the other ones the data goes through read and write.
+ */
+
+#ifndef SENDFILE_BUF
+#  define SENDFILE_BUF 512
+#endif
+
+static
+ssize_t copy_file(int out_fd, int in_fd, size_t count)
+{
+    ssize_t ret;
+    char buf[SENDFILE_BUF];
+
+    ret = 0;
+    while ((size_t)ret < count)
+    {
+        ssize_t nread;
+        ssize_t nwritten;
+        size_t n;
+
+        n = count - ret;
+        if (n > sizeof(buf))
+        {
+            n = sizeof(buf);
+        }
+        nread = read(in_fd, buf, n);
+        if (nread <= 0)
+        {
+            if ((nread == -1) && (ret == 0))
+            {
+                ret = -1;
+            }
+            break;
+        }
+        nwritten = write(out_fd, buf, nread);
+        if (nwritten == -1)
+        {
+            if (ret == 0)
+            {
+                ret = -1;
+            }
+            break;
+        }
+        ret += nwritten;
+        if (nwritten < nread)
+        {
+            break;
+        }
+    }
+    return ret;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    ssize_t ret;
+    off_t pos;
+    struct fd *f;
+
+    pos = 0;
+    if (offset != NULL)
+    {
+        /* the file position is put back at the end */
+        pos = lseek(in_fd, 0, SEEK_CUR);
+        if ((pos != -1) && (lseek(in_fd, *offset, SEEK_SET) == -1))
+        {
+            pos = -1;
+        }
+    }
+
+    if (pos == -1)
+    {
+        ret = -1;
+    }
+    else
+    {
+        f = file_struct_get(out_fd);
+        if ((f != NULL) && (f->isopen) && (f->sendfile != NULL))
+        {
+            ret = f->sendfile(out_fd, in_fd, count);
+        }
+        else
+        {
+            ret = copy_file(out_fd, in_fd, count);
+        }
+        if (offset != NULL)
+        {
+            if (ret > 0)
+            {
+                *offset += ret;
+            }
+            (void)lseek(in_fd, pos, SEEK_SET);
+        }
+    }
+    return ret;
+}
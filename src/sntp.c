@@ -19,6 +19,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include "timespec.h"
@@ -303,6 +304,32 @@ int sntp_gettime(struct timespec *ts)
     return res;
 }
 
+int sntp_gettime_start(void)
+{
+    int sock;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock >= 0)
+    {
+        if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+        {
+            close(sock);
+            sock = -1;
+        }
+        else if (sntp_request(sock, sntp_server) != 0)
+        {
+            close(sock);
+            sock = -1;
+        }
+    }
+    return sock;
+}
+
+int sntp_gettime_finish(int sock, struct timespec *ts)
+{
+    return sntp_reply(sock, ts);
+}
+
 void sntp_timeserver_set(in_addr_t server)
 {
     sntp_server = server;
@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/spi.h>
 #include <libopencm3/stm32/usart.h>
@@ -74,6 +75,26 @@ int stdio_usart_read(int fd, char *ptr, int len)
     return nread;
 }
 
+/* Writes wait for the USART, so they never block for long. */
+static
+short stdio_usart_poll(int fd)
+{
+    short ret;
+    struct fd *f;
+
+    f = file_struct_get(fd);
+    ret = 0;
+    if ((f->read != NULL) && (USART_SR(USART2) & USART_SR_RXNE))
+    {
+        ret |= POLLIN|POLLRDNORM;
+    }
+    if (f->write != NULL)
+    {
+        ret |= POLLOUT|POLLWRNORM;
+    }
+    return ret;
+}
+
 static
 void stdio_usart_init(void)
 {
@@ -109,7 +130,9 @@ void fileno_out_init(int fd)
     f->stat.st_mode = S_IFCHR|S_IWUSR|S_IWGRP|S_IWOTH;
     f->status_flags = O_WRONLY;
     f->write = stdio_usart_write;
+    f->poll = stdio_usart_poll;
     f->isatty = 1;
+    f->isallocated = 1;
     f->isopen = 1;
 }
 
@@ -123,7 +146,9 @@ void fileno_in_init(int fd)
     f->stat.st_mode = S_IFCHR|S_IRUSR|S_IRGRP|S_IROTH;
     f->status_flags = O_RDONLY;
     f->read = stdio_usart_read;
+    f->poll = stdio_usart_poll;
     f->isatty = 1;
+    f->isallocated = 1;
     f->isopen = 1;
 }
 
@@ -39,14 +39,32 @@ int _link(const char *path1, const char *path2);
 pid_t _getpid(void);
 int _kill(pid_t pid, int sig);
 int _stat(const char *path, struct stat *buf);
+int dev_open(const char *pathname, int flags);
+
+/* No device files unless a driver provides dev_open. */
+__attribute__((__weak__))
+int dev_open(const char *pathname, int flags)
+{
+    (void)pathname;
+    (void)flags;
+    errno = ENOENT;
+    return -1;
+}
+
 int _open(const char *pathname, int flags)
 {
     int ret;
 
-    /* TODO: choose driver */
     /* TODO: stdin, stdout, stderr */
 
-    ret = fatfs_open(pathname, flags);
+    if (strncmp(pathname, "/dev/", 5) == 0)
+    {
+        ret = dev_open(pathname, flags);
+    }
+    else
+    {
+        ret = fatfs_open(pathname, flags);
+    }
 
     return ret;
 }
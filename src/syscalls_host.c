@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <unistd.h>
+#include <errno.h>
+#include <file.h>
+#include <sys/syscall.h>
+
+/* Host counterpart of syscalls.c, used with the chip emulators.
+ * Descriptors allocated by file_alloc() are served by their
+ * callbacks, the other ones go to the host kernel.
+ */
+
+static
+struct fd *host_file_get(int fd)
+{
+    struct fd *f;
+
+    f = (fd >= 0) ? file_struct_get(fd) : NULL;
+    if ((f != NULL) && !(f->isallocated))
+    {
+        f = NULL;
+    }
+    return f;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    ssize_t ret;
+    struct fd *f;
+
+    f = host_file_get(fd);
+    if (f == NULL)
+    {
+        ret = syscall(SYS_write, fd, buf, count);
+    }
+    else if (!f->isopen || (f->write == NULL))
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else
+    {
+        ret = f->write(fd, (char *)buf, count);
+    }
+    return ret;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    ssize_t ret;
+    struct fd *f;
+
+    f = host_file_get(fd);
+    if (f == NULL)
+    {
+        ret = syscall(SYS_read, fd, buf, count);
+    }
+    else if (!f->isopen || (f->read == NULL))
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else
+    {
+        ret = f->read(fd, buf, count);
+    }
+    return ret;
+}
+
+int close(int fd)
+{
+    int ret;
+    struct fd *f;
+
+    f = host_file_get(fd);
+    if (f == NULL)
+    {
+        ret = syscall(SYS_close, fd);
+    }
+    else if (!f->isopen)
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else if (f->close != NULL)
+    {
+        ret = f->close(fd);
+    }
+    else
+    {
+        f->isopen = 0;
+        ret = 0;
+    }
+    return ret;
+}
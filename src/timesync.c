@@ -18,6 +18,8 @@
  */
 #include "timesync.h"
 #include <time.h>
+#include <poll.h>
+#include <unistd.h>
 #include "timespec.h"
 
 #define TIMESYNC_METHOD_RFC868 1
@@ -36,6 +38,16 @@
 #  define TIMESYNC_INTERVAL (60*60*24) /* 1 day */
 #endif
 
+/* timesync_poll gives up on a reply after this */
+#ifndef TIMESYNC_REPLY_TIMEOUT_MS
+#  define TIMESYNC_REPLY_TIMEOUT_MS 1000
+#endif
+
+/* and tries again after this, in seconds */
+#ifndef TIMESYNC_RETRY_INTERVAL
+#  define TIMESYNC_RETRY_INTERVAL 60
+#endif
+
 static
 struct timespec next_sync = {0, 0};
 
@@ -44,6 +56,24 @@ struct timespec sync_interval = {
     .tv_sec = TIMESYNC_INTERVAL,
     .tv_nsec = 0};
 
+static
+struct timespec retry_interval = {
+    .tv_sec = TIMESYNC_RETRY_INTERVAL,
+    .tv_nsec = 0};
+
+static
+struct timespec reply_timeout = {
+    .tv_sec = TIMESYNC_REPLY_TIMEOUT_MS / MSECS_IN_SEC,
+    .tv_nsec = (TIMESYNC_REPLY_TIMEOUT_MS % MSECS_IN_SEC) * (NSECS_IN_SEC / MSECS_IN_SEC)};
+
+/* exchange in progress in timesync_poll */
+static
+int poll_sock = -1;
+
+/* on CLOCK_MONOTONIC */
+static
+struct timespec poll_reply_end;
+
 static
 int time_to_sync(const struct timespec *now)
 {
@@ -61,6 +91,28 @@ int time_to_sync(const struct timespec *now)
     return res;
 }
 
+/* Apply the time from the server, now. */
+static
+int sync_set(const struct timespec *now, struct timespec *out)
+{
+    int res;
+
+    if (clock_settime(CLOCK_REALTIME, now) == 0)
+    {
+        if (out != NULL)
+        {
+            *out = *now;
+        }
+        timespec_add(now, &sync_interval, &next_sync);
+        res = 1;
+    }
+    else
+    {
+        res = -1;
+    }
+    return res;
+}
+
 int timesync_now_timespec(struct timespec *out)
 {
     int res;
@@ -75,22 +127,7 @@ int timesync_now_timespec(struct timespec *out)
 
     if (gettime_ret == 0)
     {
-        int clk_ret;
-
-        clk_ret = clock_settime(CLOCK_REALTIME, &now);
-        if (clk_ret == 0)
-        {
-            if (out != NULL)
-            {
-                *out = now;
-            }
-            timespec_add(&now, &sync_interval, &next_sync);
-            res = 1;
-        }
-        else
-        {
-            res = -1;
-        }
+        res = sync_set(&now, out);
     }
     else
     {
@@ -128,3 +165,109 @@ int timesync_now(void)
     return timesync_now_timespec(NULL);
 }
 
+static
+int poll_start(void)
+{
+    int res;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (!time_to_sync(&now))
+    {
+        res = 0;
+    }
+    else
+    {
+#if (TIMESYNC_METHOD == TIMESYNC_METHOD_RFC868)
+        poll_sock = rfc868_gettime_start();
+#elif (TIMESYNC_METHOD == TIMESYNC_METHOD_SNTP)
+        poll_sock = sntp_gettime_start();
+#endif
+        if (poll_sock >= 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &poll_reply_end);
+            timespec_incr(&poll_reply_end, &reply_timeout);
+            res = 0;
+        }
+        else
+        {
+            timespec_add(&now, &retry_interval, &next_sync);
+            res = -1;
+        }
+    }
+    return res;
+}
+
+static
+int poll_finish(void)
+{
+    int res;
+    struct pollfd p;
+    struct timespec now;
+
+    p.fd = poll_sock;
+    p.events = POLLIN;
+    p.revents = 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (poll(&p, 1, 0) < 0)
+    {
+        res = -1;
+    }
+    else if (p.revents & POLLIN)
+    {
+        int gettime_ret;
+        struct timespec t;
+
+#if (TIMESYNC_METHOD == TIMESYNC_METHOD_RFC868)
+        gettime_ret = rfc868_gettime_finish(poll_sock, &t);
+#elif (TIMESYNC_METHOD == TIMESYNC_METHOD_SNTP)
+        gettime_ret = sntp_gettime_finish(poll_sock, &t);
+#endif
+        res = (gettime_ret == 0) ? sync_set(&t, NULL) : -1;
+    }
+    else if (p.revents & (POLLERR | POLLHUP | POLLNVAL))
+    {
+        res = -1;
+    }
+    else if (timespec_diff(&now, &poll_reply_end, NULL) >= 0)
+    {
+        res = -1;
+    }
+    else
+    {
+        res = 0; /* no reply yet */
+    }
+
+    if (res != 0)
+    {
+        close(poll_sock);
+        poll_sock = -1;
+        if (res == -1)
+        {
+            clock_gettime(CLOCK_REALTIME, &now);
+            timespec_add(&now, &retry_interval, &next_sync);
+        }
+    }
+    return res;
+}
+
+int timesync_poll(void)
+{
+    int res;
+
+    if (poll_sock < 0)
+    {
+        res = poll_start();
+    }
+    else
+    {
+        res = poll_finish();
+    }
+    return res;
+}
+
+int timesync_fd(void)
+{
+    return poll_sock;
+}
+
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include "file.h"
+
+/* Files that can move the whole vector in one go provide
+ * the readv and writev callbacks, like sockets do.
+ * For the other ones each buffer is transferred in turn.
+ */
+
+ssize_t readv(int fildes, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+    struct fd *f;
+
+    f = file_struct_get(fildes);
+    if ((f != NULL) && (f->isopen) && (f->readv != NULL))
+    {
+        ret = f->readv(fildes, iov, iovcnt);
+    }
+    else
+    {
+        int i;
+
+        ret = 0;
+        for (i = 0; i < iovcnt; i++)
+        {
+            ssize_t nread;
+
+            nread = read(fildes, iov[i].iov_base, iov[i].iov_len);
+            if (nread == -1)
+            {
+                if (ret == 0)
+                {
+                    ret = -1;
+                }
+                break;
+            }
+            ret += nread;
+            if ((size_t)nread < iov[i].iov_len)
+            {
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+ssize_t writev(int fildes, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+    struct fd *f;
+
+    f = file_struct_get(fildes);
+    if ((f != NULL) && (f->isopen) && (f->writev != NULL))
+    {
+        ret = f->writev(fildes, iov, iovcnt);
+    }
+    else
+    {
+        int i;
+
+        ret = 0;
+        for (i = 0; i < iovcnt; i++)
+        {
+            ssize_t nwritten;
+
+            nwritten = write(fildes, iov[i].iov_base, iov[i].iov_len);
+            if (nwritten == -1)
+            {
+                if (ret == 0)
+                {
+                    ret = -1;
+                }
+                break;
+            }
+            ret += nwritten;
+            if ((size_t)nwritten < iov[i].iov_len)
+            {
+                break;
+            }
+        }
+    }
+    return ret;
+}
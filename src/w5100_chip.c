@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "w5100.h"
+#include "w5x00.h"
+
+/* W5100 backend of the chip driver.
+ * Registers and buffers are accessed through w5100_read_mem and
+ * w5100_write_mem, that are provided by w5100_spi.c on the board
+ * and by w5100_emu.c on the host.
+ */
+
+#define W5100_BUF_SIZE_MIN 0x400 /* 1KiB */
+#define W5100_BUF_SIZE_MAX 0x2000 /* 8KiB */
+
+static uint16_t tx_sizes[W5100_N_SOCKETS];
+static uint16_t rx_sizes[W5100_N_SOCKETS];
+
+struct w5x00_frames w5x00_frames;
+struct w5x00_frames w5x00_sock_frames[W5X00_MAX_SOCKETS];
+
+/* A frame for each byte; isocket is -1 for common registers. */
+static
+void reg_frames_add(int isocket, size_t n)
+{
+    w5x00_frames.reg += n;
+    if (isocket >= 0)
+    {
+        w5x00_sock_frames[isocket].reg += n;
+    }
+}
+
+static
+void data_frames_add(int isocket, size_t n)
+{
+    w5x00_frames.data += n;
+    w5x00_sock_frames[isocket].data += n;
+}
+
+static
+uint16_t w5100_chip_get_tx_size(int isocket)
+{
+    return tx_sizes[isocket];
+}
+
+static
+uint16_t w5100_chip_get_rx_size(int isocket)
+{
+    return rx_sizes[isocket];
+}
+
+/* Socket buffers are allocated one after the other,
+ * starting from socket 0.
+ */
+static
+uint16_t get_base(const uint16_t *sizes, uint16_t mem_base, int isocket)
+{
+    uint16_t base;
+    int i;
+
+    base = mem_base;
+    for (i = 0; i < isocket; i++)
+    {
+        base += sizes[i];
+    }
+    return base;
+}
+
+static
+void w5100_chip_read_mem(uint16_t reg, void *buf, size_t n)
+{
+    reg_frames_add(-1, n);
+    w5100_read_mem(reg, buf, n);
+}
+
+static
+void w5100_chip_write_mem(uint16_t reg, const void *buf, size_t n)
+{
+    reg_frames_add(-1, n);
+    w5100_write_mem(reg, buf, n);
+}
+
+static
+void w5100_chip_read_sock_mem(int isocket, uint16_t sn_reg, void *buf, size_t n)
+{
+    reg_frames_add(isocket, n);
+    w5100_read_mem(w5100_sock_reg_get(sn_reg, isocket), buf, n);
+}
+
+static
+void w5100_chip_write_sock_mem(int isocket, uint16_t sn_reg, const void *buf, size_t n)
+{
+    reg_frames_add(isocket, n);
+    w5100_write_mem(w5100_sock_reg_get(sn_reg, isocket), buf, n);
+}
+
+static
+void w5100_chip_read_rx(int isocket, uint16_t ptr, void *buf, size_t n)
+{
+    uint16_t size;
+    uint16_t base;
+    uint16_t offset;
+    uint16_t toread1;
+    uint8_t *bytes = buf;
+
+    data_frames_add(isocket, n);
+    size = rx_sizes[isocket];
+    base = get_base(rx_sizes, W5100_RX_MEM_BASE, isocket);
+    offset = ptr & (size - 1); /* size is always power of 2 */
+    if (offset + n > size)
+    {
+        toread1 = size - offset;
+    }
+    else
+    {
+        toread1 = n;
+    }
+    if (toread1 > 0)
+    {
+        w5100_read_mem(base + offset, &bytes[0], toread1);
+    }
+    if (n > toread1)
+    {
+        w5100_read_mem(base, &bytes[toread1], n - toread1);
+    }
+}
+
+static
+void w5100_chip_write_tx(int isocket, uint16_t ptr, const void *buf, size_t n)
+{
+    uint16_t size;
+    uint16_t base;
+    uint16_t offset;
+    uint16_t towrite1;
+    const uint8_t *bytes = buf;
+
+    data_frames_add(isocket, n);
+    size = tx_sizes[isocket];
+    base = get_base(tx_sizes, W5100_TX_MEM_BASE, isocket);
+    offset = ptr & (size - 1); /* size is always power of 2 */
+    if (offset + n > size)
+    {
+        towrite1 = size - offset;
+    }
+    else
+    {
+        towrite1 = n;
+    }
+    if (towrite1 > 0)
+    {
+        w5100_write_mem(base + offset, &bytes[0], towrite1);
+    }
+    if (n > towrite1)
+    {
+        w5100_write_mem(base, &bytes[towrite1], n - towrite1);
+    }
+}
+
+/* Get the RMSR/TMSR value for the sizes,
+ * 2 bits per socket: 00 -> 1KiB, 01 -> 2KiB, 10 -> 4KiB, 11 -> 8KiB
+ * A socket can have no memory (size 0) only when the previous ones
+ * take it all, because the chip allocates it in socket order.
+ */
+static
+int sizes_to_msr(const uint16_t *sizes, uint8_t *msr)
+{
+    int ret;
+    int isocket;
+    uint32_t total;
+
+    ret = 0;
+    total = 0;
+    *msr = 0;
+    for (isocket = 0; isocket < W5100_N_SOCKETS; isocket++)
+    {
+        uint16_t size;
+        uint8_t code;
+
+        code = 0;
+        size = W5100_BUF_SIZE_MIN;
+        while ((size < sizes[isocket]) && (size < W5100_BUF_SIZE_MAX))
+        {
+            size <<= 1;
+            code++;
+        }
+        if ((sizes[isocket] == 0) && (total == W5100_TX_MEM_SIZE))
+        {
+            size = 0;
+        }
+        if (size != sizes[isocket])
+        {
+            ret = -1;
+            break;
+        }
+        total += size;
+        *msr |= code << (2 * isocket);
+    }
+    if (total > W5100_TX_MEM_SIZE)
+    {
+        ret = -1;
+    }
+    return ret;
+}
+
+static
+int w5100_chip_set_buf_sizes(const uint16_t *tx, const uint16_t *rx)
+{
+    int ret;
+    uint8_t tmsr;
+    uint8_t rmsr;
+
+    if (sizes_to_msr(tx, &tmsr) != 0)
+    {
+        ret = -1;
+    }
+    else if (sizes_to_msr(rx, &rmsr) != 0)
+    {
+        ret = -1;
+    }
+    else
+    {
+        int isocket;
+
+        reg_frames_add(-1, 2);
+        w5100_write_reg(W5100_TMSR, tmsr);
+        w5100_write_reg(W5100_RMSR, rmsr);
+        for (isocket = 0; isocket < W5100_N_SOCKETS; isocket++)
+        {
+            tx_sizes[isocket] = tx[isocket];
+            rx_sizes[isocket] = rx[isocket];
+        }
+        ret = 0;
+    }
+    return ret;
+}
+
+static
+void w5100_chip_sock_int_enable(uint8_t mask)
+{
+    reg_frames_add(-1, 1);
+    w5100_write_reg(W5100_IMR, mask);
+}
+
+static
+uint8_t w5100_chip_sock_int_get(void)
+{
+    reg_frames_add(-1, 1);
+    return w5100_read_reg(W5100_IR) & (W5100_S0_INT|W5100_S1_INT|W5100_S2_INT|W5100_S3_INT);
+}
+
+static
+void w5100_chip_set_retry(uint16_t rtr, uint8_t rcr)
+{
+    uint8_t buf[2];
+
+    buf[0] = rtr >> 8;
+    buf[1] = rtr & 0xFF;
+    reg_frames_add(-1, sizeof(buf) + 1);
+    w5100_write_mem(W5100_RTR, buf, sizeof(buf));
+    w5100_write_reg(W5100_RCR, rcr);
+}
+
+const struct w5x00_chip w5x00_chip = {
+    .name = "W5100",
+    .n_sockets = W5100_N_SOCKETS,
+    .tx_mem_size = W5100_TX_MEM_SIZE,
+    .rx_mem_size = W5100_RX_MEM_SIZE,
+    .macraw_filter = 0, /* every frame on the wire is received */
+    .init = w5100_init,
+    .read_mem = w5100_chip_read_mem,
+    .write_mem = w5100_chip_write_mem,
+    .read_sock_mem = w5100_chip_read_sock_mem,
+    .write_sock_mem = w5100_chip_write_sock_mem,
+    .read_rx = w5100_chip_read_rx,
+    .write_tx = w5100_chip_write_tx,
+    .get_tx_size = w5100_chip_get_tx_size,
+    .get_rx_size = w5100_chip_get_rx_size,
+    .set_buf_sizes = w5100_chip_set_buf_sizes,
+    .sock_int_enable = w5100_chip_sock_int_enable,
+    .sock_int_get = w5100_chip_sock_int_get,
+    .set_retry = w5100_chip_set_retry,
+    .int_asserted = w5100_int_asserted,
+    .int_wait = w5100_int_wait,
+};
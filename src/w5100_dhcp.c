@@ -19,6 +19,7 @@
 #include "w5100_dhcp.h"
 #include "dhcp_client.h"
 #include "w5100.h"
+#include "w5x00.h"
 #include "timespec.h"
 
 static
@@ -38,17 +39,17 @@ void configure(void)
 {
     if (binding.client != config.client)
     {
-        w5100_write_regx(W5100_SIPR, &binding.client);
+        w5x00_write_regx(W5100_SIPR, &binding.client);
         config.client = binding.client;
     }
     if (binding.gateway != config.gateway)
     {
-        w5100_write_regx(W5100_GAR, &binding.gateway);
+        w5x00_write_regx(W5100_GAR, &binding.gateway);
         config.gateway = binding.gateway;
     }
     if (binding.subnet != config.subnet)
     {
-        w5100_write_regx(W5100_SUBR, &binding.subnet);
+        w5x00_write_regx(W5100_SUBR, &binding.subnet);
         config.subnet = binding.subnet;
     }
 }
@@ -71,7 +72,7 @@ time_t w5100_dhcp(void)
     {
         uint8_t mac_addr[6];
 
-        w5100_read_regx(W5100_SHAR, mac_addr);
+        w5x00_read_regx(W5100_SHAR, mac_addr);
 
         /* TODO: check if we already have a preferred IP address */
         dhcp_init(mac_addr, &binding);
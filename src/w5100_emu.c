@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include "w5100.h"
+#include "w5x00_emu.h"
+
+/* Host replacement of w5100_spi.c: the W5100 address space
+ * is decoded and forwarded to the emulator core.
+ * Every byte costs a 4-byte SPI frame, as on the real bus.
+ */
+
+#define W5100_COMMON_REGS_END  0x0030
+#define W5100_SOCK_REGS_END    (W5100_S0_REGS_OFFSET + W5100_N_SOCKETS * W5100_SOCKET_REGS_SIZE)
+
+static
+void layout_set(uint8_t msr, uint16_t mem_size, void (*set_buf)(int, uint16_t, uint16_t))
+{
+    int isocket;
+    uint16_t base;
+
+    base = 0;
+    for (isocket = 0; isocket < W5100_N_SOCKETS; isocket++)
+    {
+        uint16_t size;
+
+        size = 0x400 << ((msr >> (2 * isocket)) & 0x3);
+        if (base + size > mem_size)
+        {
+            size = 0; /* socket can not be used */
+        }
+        set_buf(isocket, base, size);
+        base += size;
+    }
+}
+
+static
+void reset(void)
+{
+    w5x00_emu_reset(W5100_N_SOCKETS);
+    w5x00_emu_common_write(W5100_RMSR, 0x55);
+    w5x00_emu_common_write(W5100_TMSR, 0x55);
+    w5x00_emu_common_write(W5100_RTR0, 0x07);
+    w5x00_emu_common_write(W5100_RTR1, 0xD0);
+    w5x00_emu_common_write(W5100_RCR, 0x08);
+    layout_set(0x55, W5100_TX_MEM_SIZE, w5x00_emu_set_tx_buf);
+    layout_set(0x55, W5100_RX_MEM_SIZE, w5x00_emu_set_rx_buf);
+}
+
+static
+uint8_t emu_read(uint16_t addr)
+{
+    uint8_t val;
+
+    if (addr == W5100_IR)
+    {
+        val = w5x00_emu_common_read(W5100_IR) | w5x00_emu_sock_ir();
+    }
+    else if (addr < W5100_COMMON_REGS_END)
+    {
+        val = w5x00_emu_common_read(addr);
+    }
+    else if ((addr >= W5100_S0_REGS_OFFSET) && (addr < W5100_SOCK_REGS_END))
+    {
+        uint16_t offset;
+
+        offset = addr - W5100_S0_REGS_OFFSET;
+        val = w5x00_emu_sock_read(
+                offset / W5100_SOCKET_REGS_SIZE,
+                offset % W5100_SOCKET_REGS_SIZE);
+    }
+    else if ((addr >= W5100_TX_MEM_BASE) && (addr < W5100_TX_MEM_BASE + W5100_TX_MEM_SIZE))
+    {
+        val = w5x00_emu_tx_mem[addr - W5100_TX_MEM_BASE];
+    }
+    else if ((addr >= W5100_RX_MEM_BASE) && (addr < W5100_RX_MEM_BASE + W5100_RX_MEM_SIZE))
+    {
+        val = w5x00_emu_rx_mem[addr - W5100_RX_MEM_BASE];
+    }
+    else
+    {
+        val = 0;
+    }
+    return val;
+}
+
+static
+void emu_write(uint16_t addr, uint8_t val)
+{
+    if (addr == W5100_MR)
+    {
+        if (val & W5100_MODE_RST)
+        {
+            reset(); /* RST bit clears by itself */
+        }
+        else
+        {
+            w5x00_emu_common_write(W5100_MR, val);
+        }
+    }
+    else if (addr == W5100_RMSR)
+    {
+        w5x00_emu_common_write(addr, val);
+        layout_set(val, W5100_RX_MEM_SIZE, w5x00_emu_set_rx_buf);
+    }
+    else if (addr == W5100_TMSR)
+    {
+        w5x00_emu_common_write(addr, val);
+        layout_set(val, W5100_TX_MEM_SIZE, w5x00_emu_set_tx_buf);
+    }
+    else if (addr < W5100_COMMON_REGS_END)
+    {
+        w5x00_emu_common_write(addr, val);
+    }
+    else if ((addr >= W5100_S0_REGS_OFFSET) && (addr < W5100_SOCK_REGS_END))
+    {
+        uint16_t offset;
+
+        offset = addr - W5100_S0_REGS_OFFSET;
+        w5x00_emu_sock_write(
+                offset / W5100_SOCKET_REGS_SIZE,
+                offset % W5100_SOCKET_REGS_SIZE,
+                val);
+    }
+    else if ((addr >= W5100_TX_MEM_BASE) && (addr < W5100_TX_MEM_BASE + W5100_TX_MEM_SIZE))
+    {
+        w5x00_emu_tx_mem[addr - W5100_TX_MEM_BASE] = val;
+    }
+    else if ((addr >= W5100_RX_MEM_BASE) && (addr < W5100_RX_MEM_BASE + W5100_RX_MEM_SIZE))
+    {
+        w5x00_emu_rx_mem[addr - W5100_RX_MEM_BASE] = val;
+    }
+}
+
+uint8_t w5100_read_reg(uint16_t reg)
+{
+    w5x00_emu_stats.frames++;
+    w5x00_emu_stats.bytes++;
+
+    return emu_read(reg);
+}
+
+uint16_t w5100_read_reg2(uint16_t reg)
+{
+    uint16_t rx;
+
+    /* MSB first. */
+    rx = w5100_read_reg(reg) << 8;
+    rx |= w5100_read_reg(reg + 1);
+
+    return rx;
+}
+
+void w5100_write_reg(uint16_t reg, uint8_t val)
+{
+    w5x00_emu_stats.frames++;
+    w5x00_emu_stats.bytes++;
+
+    emu_write(reg, val);
+}
+
+void w5100_write_reg2(uint16_t reg, uint16_t val)
+{
+    /* MSB first. */
+    w5100_write_reg(reg, val >> 8);
+    w5100_write_reg(reg + 1, val & 0xFF);
+}
+
+void w5100_read_mem(uint16_t addr, void *buf, size_t n)
+{
+    uint8_t *pbytes = buf;
+    size_t i_byte;
+
+    for (i_byte = 0; i_byte < n; i_byte++)
+    {
+        pbytes[i_byte] = w5100_read_reg(addr + i_byte);
+    }
+}
+
+void w5100_write_mem(uint16_t addr, const void *buf, size_t n)
+{
+    const uint8_t *pbytes = buf;
+    size_t i_byte;
+
+    for (i_byte = 0; i_byte < n; i_byte++)
+    {
+        w5100_write_reg(addr + i_byte, pbytes[i_byte]);
+    }
+}
+
+void w5100_init(void)
+{
+    reset(); /* power on */
+}
+
+/* The INT line follows the socket interrupts enabled in IMR.
+ * Waiting lasts at most a tick of 1 ms, as on the board.
+ */
+int w5100_int_asserted(void)
+{
+    return (w5x00_emu_sock_ir() & w5x00_emu_common_read(W5100_IMR)) != 0;
+}
+
+void w5100_int_wait(const struct timespec *deadline)
+{
+    (void)deadline;
+    w5x00_emu_wait(1);
+}
@@ -0,0 +1,849 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Software SOCK_DGRAM sockets of the socket layer, built with
+ * W5100_MACRAW: socket 0 runs in MACRAW mode and this file makes
+ * ARP, IPv4 and UDP on top of it, see w5100_socket_priv.h.
+ */
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include "w5100.h"
+#include "w5x00.h"
+#include "w5100_socket_priv.h"
+#include "timespec.h"
+
+#ifndef W5100_MACRAW
+#  error "w5100_macraw.c is for the socket layer built with W5100_MACRAW."
+#endif
+
+/******* defines and macros ********/
+
+#ifndef W5100_ARP_ENTRIES
+#  define W5100_ARP_ENTRIES 4
+#endif
+
+/* Seconds an ARP entry is trusted without hearing from the host. */
+#ifndef W5100_ARP_TTL
+#  define W5100_ARP_TTL 300
+#endif
+
+#define W5100_MACRAW_INFO_SIZE 2 /* frame length, before each frame in the RX buffer */
+#define W5100_ETH_HEADER_SIZE 14
+#define W5100_ETH_TYPE_IP 0x0800
+#define W5100_ETH_TYPE_ARP 0x0806
+#define W5100_ARP_SIZE 28
+#define W5100_IP_PROTO_UDP 17
+#define W5100_ETH_MIN_FRAME 60 /* without CRC, shorter ones are padded */
+
+/******* global variables ********/
+
+/* Datagrams received by a software socket, one after the other,
+ * each one after a W5100_UDP_HEADER_SIZE header as in the chip buffer.
+ */
+static struct soft_rx {
+    uint16_t len;
+    uint8_t buf[W5100_MACRAW_RX_BUF];
+} soft_rx[W5100_MACRAW_SOCKETS];
+
+/* Ethernet addresses of the destinations: the gateway one for those
+ * outside the local network.
+ */
+static struct arp_entry {
+    in_addr_t ip; /* INADDR_ANY if unused */
+    uint8_t mac[6];
+    struct timeout_manager tom;
+} arp_cache[W5100_ARP_ENTRIES];
+
+static int arp_next; /* entry taken by the next new address */
+static uint16_t ip_id;
+
+/******* function definitions ********/
+
+static const struct timespec arp_timeout = {
+    .tv_sec = W5100_ARP_TTL,
+    .tv_nsec = 0
+};
+
+static
+uint16_t be16_get(const uint8_t *p)
+{
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static
+void be16_set(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+/* Add n bytes to the one's complement sum of 16 bit words;
+ * *pos counts the bytes added so far, for the odd ones.
+ */
+static
+uint32_t cksum_add(uint32_t sum, const uint8_t *buf, size_t n, size_t *pos)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        sum += (*pos & 1) ? buf[i] : ((uint32_t)buf[i] << 8);
+        (*pos)++;
+    }
+    return sum;
+}
+
+static
+uint16_t cksum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return ~sum & 0xFFFF;
+}
+
+/* UDP checksum, from the IP addresses and the UDP header
+ * at the end of the IP header, and the payload.
+ */
+static
+uint16_t udp_cksum(const uint8_t *ip, const struct iovec *iov, int iovcnt)
+{
+    uint32_t sum;
+    size_t pos;
+    uint8_t pseudo[4];
+    int i;
+
+    pseudo[0] = 0;
+    pseudo[1] = W5100_IP_PROTO_UDP;
+    memcpy(&pseudo[2], &ip[W5100_IP_HEADER_SIZE + 4], 2); /* UDP length */
+    pos = 0;
+    sum = cksum_add(0, &ip[12], 8, &pos);
+    sum = cksum_add(sum, pseudo, sizeof(pseudo), &pos);
+    sum = cksum_add(sum, &ip[W5100_IP_HEADER_SIZE], W5100_UDP_HDR_SIZE, &pos);
+    for (i = 0; i < iovcnt; i++)
+    {
+        sum = cksum_add(sum, iov[i].iov_base, iov[i].iov_len, &pos);
+    }
+    return cksum_fold(sum);
+}
+
+/* The entry of ip, if it has not expired. */
+static
+struct arp_entry *arp_find(in_addr_t ip)
+{
+    struct arp_entry *ret;
+    int saved_errno;
+    int i;
+
+    saved_errno = errno; /* w5100_timeout_ended sets it */
+    ret = NULL;
+    for (i = 0; (i < W5100_ARP_ENTRIES) && (ret == NULL); i++)
+    {
+        if ((ip != INADDR_ANY) && (arp_cache[i].ip == ip))
+        {
+            if (w5100_timeout_ended(&arp_cache[i].tom))
+            {
+                arp_cache[i].ip = INADDR_ANY;
+            }
+            else
+            {
+                ret = &arp_cache[i];
+            }
+        }
+    }
+    errno = saved_errno;
+
+    return ret;
+}
+
+static
+void arp_learn(in_addr_t ip, const uint8_t *mac)
+{
+    struct arp_entry *e;
+
+    e = arp_find(ip);
+    if (e == NULL)
+    {
+        /* the oldest one goes */
+        e = &arp_cache[arp_next];
+        arp_next = (arp_next + 1) % W5100_ARP_ENTRIES;
+    }
+    e->ip = ip;
+    memcpy(e->mac, mac, sizeof(e->mac));
+    w5100_timeout_init(&arp_timeout, &e->tom);
+}
+
+/* Queue of the software socket bound to port, if it has room
+ * for a datagram of len bytes; soft_rx_commit adds it after
+ * its payload is written past the end of the queue.
+ */
+static
+struct soft_rx *soft_rx_find(in_port_t port, size_t len)
+{
+    struct soft_rx *ret;
+    int k;
+
+    ret = NULL;
+    for (k = 0; k < W5100_MACRAW_SOCKETS; k++)
+    {
+        const struct w5100_socket *s;
+
+        s = &w5100_sockets[W5X00_MAX_SOCKETS + k];
+        if ((s->state == W5100_SOCK_STATE_BOUND) && (s->sockname.sin_port == port))
+        {
+            if (soft_rx[k].len + W5100_UDP_HEADER_SIZE + len <= W5100_MACRAW_RX_BUF)
+            {
+                ret = &soft_rx[k];
+            }
+            break;
+        }
+    }
+    return ret;
+}
+
+static
+void soft_rx_commit(struct soft_rx *q, in_addr_t src, in_port_t sport, uint16_t len)
+{
+    uint8_t *header;
+
+    header = &q->buf[q->len];
+    memcpy(&header[0], &src, 4);
+    memcpy(&header[4], &sport, 2);
+    be16_set(&header[6], len);
+    q->len += W5100_UDP_HEADER_SIZE + len;
+}
+
+/* Take a frame from the RX buffer of the MACRAW socket,
+ * hdr holding its first bytes.
+ */
+static
+void macraw_frame(const uint8_t *hdr, uint16_t frame_len, uint16_t pdata, in_addr_t local, in_addr_t mask)
+{
+    const uint8_t *eth;
+    const uint8_t *ip;
+
+    eth = &hdr[W5100_MACRAW_INFO_SIZE];
+    ip = &eth[W5100_ETH_HEADER_SIZE];
+    frame_len -= W5100_MACRAW_INFO_SIZE + W5100_ETH_HEADER_SIZE;
+    if ((be16_get(&eth[12]) == W5100_ETH_TYPE_ARP) && (frame_len >= W5100_ARP_SIZE))
+    {
+        in_addr_t spa;
+        in_addr_t tpa;
+
+        /* the chip itself answers the requests for its address */
+        memcpy(&spa, &ip[14], 4);
+        memcpy(&tpa, &ip[24], 4);
+        if ((be16_get(&ip[2]) == W5100_ETH_TYPE_IP) && (tpa == local) && (local != INADDR_ANY))
+        {
+            arp_learn(spa, &ip[8]);
+        }
+    }
+    else if (
+            (be16_get(&eth[12]) == W5100_ETH_TYPE_IP)
+            &&
+            (frame_len >= W5100_IP_HEADER_SIZE + W5100_UDP_HDR_SIZE)
+            &&
+            (ip[0] == 0x45) /* IPv4 without options */
+            &&
+            ((be16_get(&ip[6]) & 0x3FFF) == 0) /* not a fragment */
+            &&
+            (ip[9] == W5100_IP_PROTO_UDP)
+           )
+    {
+        const uint8_t *udp;
+        size_t pos;
+        uint16_t ulen;
+        in_addr_t dst;
+        in_addr_t src;
+
+        udp = &ip[W5100_IP_HEADER_SIZE];
+        ulen = be16_get(&udp[4]);
+        memcpy(&src, &ip[12], 4);
+        memcpy(&dst, &ip[16], 4);
+        pos = 0;
+        if (
+                (cksum_fold(cksum_add(0, ip, W5100_IP_HEADER_SIZE, &pos)) == 0)
+                &&
+                (ulen >= W5100_UDP_HDR_SIZE)
+                &&
+                (ulen <= be16_get(&ip[2]) - W5100_IP_HEADER_SIZE)
+                &&
+                (ulen <= frame_len - W5100_IP_HEADER_SIZE)
+                &&
+                (
+                    (dst == local)
+                    ||
+                    (dst == INADDR_BROADCAST)
+                    ||
+                    (dst == (local | ~mask))
+                    ||
+                    (local == INADDR_ANY)
+                )
+           )
+        {
+            struct soft_rx *q;
+            uint16_t len;
+            in_port_t dport;
+
+            len = ulen - W5100_UDP_HDR_SIZE;
+            memcpy(&dport, &udp[2], 2);
+            q = soft_rx_find(dport, len);
+            if (q != NULL)
+            {
+                struct iovec iov;
+                in_port_t sport;
+
+                iov.iov_base = &q->buf[q->len + W5100_UDP_HEADER_SIZE];
+                iov.iov_len = len;
+                w5100_read_buf_sure(W5100_MACRAW_ISOCKET, iov.iov_base, len, &pdata);
+                memcpy(&sport, &udp[0], 2);
+                if ((be16_get(&udp[6]) == 0) || (udp_cksum(ip, &iov, 1) == 0))
+                {
+                    soft_rx_commit(q, src, sport, len);
+                }
+            }
+        }
+    }
+}
+
+/* Take the frames received by the MACRAW socket, if it has had
+ * a RECV event, with a single update of Sn_RX_RD at the end.
+ * Datagrams go to the queues of the software sockets,
+ * or are dropped if there is no room.
+ */
+static
+void macraw_input(void)
+{
+    struct w5100_socket *m;
+
+    m = &w5100_sockets[W5100_MACRAW_ISOCKET];
+    w5100_events_update();
+    if (m->events & W5100_INT_RECV)
+    {
+        uint8_t hdr[W5100_MACRAW_INFO_SIZE + W5100_ETH_HEADER_SIZE + W5100_IP_HEADER_SIZE + W5100_UDP_HDR_SIZE];
+        in_addr_t local;
+        in_addr_t mask;
+        uint16_t toread;
+        uint16_t pstart;
+        uint16_t pread;
+
+        m->events &= ~W5100_INT_RECV;
+        w5x00_read_regx(W5100_SIPR, &local);
+        w5x00_read_regx(W5100_SUBR, &mask);
+        toread = w5100_read_buf_len(W5100_MACRAW_ISOCKET);
+        pstart = w5100_read_buf_pstart(W5100_MACRAW_ISOCKET);
+        pread = pstart;
+        while ((uint16_t)(pread - pstart) + W5100_MACRAW_INFO_SIZE <= toread)
+        {
+            uint16_t avail;
+            uint16_t frame_len;
+            uint16_t n;
+            uint16_t p;
+
+            avail = toread - (uint16_t)(pread - pstart);
+            n = (avail < sizeof(hdr)) ? avail : sizeof(hdr);
+            p = pread;
+            w5100_read_buf_sure(W5100_MACRAW_ISOCKET, hdr, n, &p);
+            frame_len = be16_get(hdr); /* info included */
+            if ((frame_len > avail) || (frame_len < W5100_MACRAW_INFO_SIZE + W5100_ETH_HEADER_SIZE))
+            {
+                /* out of sync: drop everything */
+                pread = pstart + toread;
+                break;
+            }
+            if (frame_len >= sizeof(hdr))
+            {
+                /* shorter ones are neither ARP nor UDP */
+                macraw_frame(hdr, frame_len, p, local, mask);
+            }
+            pread += frame_len;
+        }
+        if (pread != pstart)
+        {
+            w5100_read_buf_recv(W5100_MACRAW_ISOCKET, pread);
+        }
+    }
+}
+
+/* Sleep until the MACRAW socket receives something, or tom expires.
+ * The event is left for macraw_input.
+ */
+static
+void macraw_wait(const struct timeout_manager *tom)
+{
+    w5100_sockets[W5100_MACRAW_ISOCKET].events |=
+        w5100_events_wait(1U << W5100_MACRAW_ISOCKET, W5100_INT_RECV, tom);
+}
+
+/* Send a frame made of header, hlen bytes, and len bytes of the
+ * io vector, pipelined as in send_dgram.
+ */
+static
+int macraw_send(const uint8_t *header, size_t hlen, const struct iovec *iov, int iovcnt, size_t len,
+        int nonblock, const struct timeout_manager *tom)
+{
+    static const uint8_t pad[W5100_ETH_MIN_FRAME - W5100_ETH_HEADER_SIZE - W5100_ARP_SIZE];
+    struct w5100_socket *m;
+    size_t npad;
+    int ret;
+
+    m = &w5100_sockets[W5100_MACRAW_ISOCKET];
+    npad = (hlen + len < W5100_ETH_MIN_FRAME) ? (W5100_ETH_MIN_FRAME - hlen - len) : 0;
+    ret = w5100_dgram_wait(m, hlen + len + npad, 0, nonblock, tom);
+    if (ret == 0)
+    {
+        uint16_t pwrite;
+
+        pwrite = w5100_write_buf_pstart(W5100_MACRAW_ISOCKET);
+        w5100_write_buf_sure(W5100_MACRAW_ISOCKET, header, hlen, &pwrite);
+        w5100_write_buf_sure_iov(W5100_MACRAW_ISOCKET, iov, iovcnt, 0, len, &pwrite);
+        w5100_write_buf_sure(W5100_MACRAW_ISOCKET, pad, npad, &pwrite);
+        ret = w5100_dgram_wait(m, hlen + len + npad, 1, nonblock, tom);
+        if (ret == 0)
+        {
+            w5100_write_buf_send(W5100_MACRAW_ISOCKET, pwrite);
+            m->dgram_in_flight = 1;
+        }
+    }
+    return ret;
+}
+
+/* \retval 0 when it went, -1 when there was no room for it:
+ * EAGAIN if nonblock, else tom ended.
+ */
+static
+int arp_request(in_addr_t ip, in_addr_t local, int nonblock, const struct timeout_manager *tom)
+{
+    uint8_t frame[W5100_ETH_HEADER_SIZE + W5100_ARP_SIZE];
+    uint8_t *arp;
+
+    arp = &frame[W5100_ETH_HEADER_SIZE];
+    memset(frame, 0xFF, 6);
+    memcpy(&frame[6], w5100_mac_addr, 6);
+    be16_set(&frame[12], W5100_ETH_TYPE_ARP);
+    be16_set(&arp[0], 1); /* Ethernet */
+    be16_set(&arp[2], W5100_ETH_TYPE_IP);
+    arp[4] = 6;
+    arp[5] = 4;
+    be16_set(&arp[6], 1); /* request */
+    memcpy(&arp[8], w5100_mac_addr, 6);
+    memcpy(&arp[14], &local, 4);
+    memset(&arp[18], 0, 6);
+    memcpy(&arp[24], &ip, 4);
+
+    return macraw_send(frame, sizeof(frame), NULL, 0, 0, nonblock, tom);
+}
+
+/* Ethernet address of dest, asking the network for it with the
+ * retry time and count of the hardware sockets.
+ * Without blocking, a request goes and EAGAIN is returned:
+ * a later send finds the answer.
+ * \retval 0 on success, -1 with errno set.
+ */
+static
+int arp_resolve(in_addr_t dest, uint8_t *mac, int nonblock, const struct timeout_manager *tom)
+{
+    static struct timeout_manager request_tom;
+    static in_addr_t request_ip;
+    int ret;
+    in_addr_t local;
+    in_addr_t mask;
+    in_addr_t hop;
+    struct arp_entry *e;
+    struct timespec retry;
+
+    w5x00_read_regx(W5100_SIPR, &local);
+    w5x00_read_regx(W5100_SUBR, &mask);
+    hop = dest;
+    if (((dest ^ local) & mask) != 0)
+    {
+        w5x00_read_regx(W5100_GAR, &hop);
+    }
+    retry.tv_sec = w5100_retry_time / 10000; /* 100us units */
+    retry.tv_nsec = (w5100_retry_time % 10000) * 100000L;
+
+    macraw_input();
+    e = arp_find(hop);
+    if ((dest == INADDR_BROADCAST) || (dest == (local | ~mask)))
+    {
+        memset(mac, 0xFF, 6);
+        ret = 0;
+    }
+    else if (IN_MULTICAST(ntohl(dest)))
+    {
+        w5100_mc_mac_get(dest, mac);
+        ret = 0;
+    }
+    else if (e != NULL)
+    {
+        memcpy(mac, e->mac, 6);
+        ret = 0;
+    }
+    else if (nonblock)
+    {
+        if ((request_ip != hop) || w5100_timeout_ended(&request_tom))
+        {
+            /* one request per retry time */
+            if (arp_request(hop, local, 1, NULL) == 0)
+            {
+                request_ip = hop;
+                w5100_timeout_init(&retry, &request_tom);
+            }
+        }
+        errno = EAGAIN;
+        ret = -1;
+    }
+    else
+    {
+        int tries;
+
+        ret = -1;
+        for (tries = 0; (tries <= w5100_retry_count) && (ret == -1); tries++)
+        {
+            struct timeout_manager try_tom;
+
+            /* the retry time starts when the request went */
+            if (arp_request(hop, local, 0, tom) == -1)
+            {
+                break;
+            }
+            w5100_timeout_init(&retry, &try_tom);
+            while ((e == NULL) && !w5100_timeout_ended(&try_tom) && !w5100_timeout_ended(tom))
+            {
+                macraw_wait(&try_tom);
+                macraw_input();
+                e = arp_find(hop);
+            }
+            if (e != NULL)
+            {
+                memcpy(mac, e->mac, 6);
+                ret = 0;
+            }
+            else if (w5100_timeout_ended(tom))
+            {
+                break;
+            }
+        }
+        if (ret == -1)
+        {
+            errno = EHOSTUNREACH;
+        }
+    }
+    return ret;
+}
+
+/* Datagram from s to a software socket of this host. */
+static
+ssize_t soft_loopback(struct w5100_socket *s, const struct iovec *iov, int iovcnt, size_t len,
+        const struct sockaddr_in *peer, in_addr_t local)
+{
+    struct soft_rx *q;
+
+    q = soft_rx_find(peer->sin_port, len);
+    if (q != NULL)
+    {
+        uint8_t *p;
+        int i;
+
+        p = &q->buf[q->len + W5100_UDP_HEADER_SIZE];
+        for (i = 0; i < iovcnt; i++)
+        {
+            memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+        soft_rx_commit(q, local, s->sockname.sin_port, len);
+    }
+    /* else lost, as on the wire */
+    return len;
+}
+
+/* Build the Ethernet, IPv4 and UDP headers of the datagram
+ * and send it through the MACRAW socket.
+ */
+ssize_t w5100_macraw_send_dgram(struct w5100_socket *s, const struct iovec *iov, int iovcnt, size_t len,
+        const struct sockaddr_in *peer, int flags)
+{
+    ssize_t ret;
+    in_addr_t local;
+    in_addr_t dest;
+
+    w5x00_read_regx(W5100_SIPR, &local);
+    dest = peer->sin_addr.s_addr;
+    if (dest == local)
+    {
+        ret = soft_loopback(s, iov, iovcnt, len, peer, local);
+    }
+    else
+    {
+        uint8_t frame[W5100_ETH_HEADER_SIZE + W5100_IP_HEADER_SIZE + W5100_UDP_HDR_SIZE];
+        struct timeout_manager tom;
+        int nonblock;
+
+        nonblock = flags & MSG_DONTWAIT;
+        if (!nonblock)
+        {
+            w5100_timeout_init(&s->send_timeout, &tom);
+        }
+        ret = arp_resolve(dest, &frame[0], nonblock, &tom);
+        if (ret == 0)
+        {
+            uint8_t *ip;
+            uint8_t *udp;
+            size_t pos;
+            uint16_t cksum;
+
+            memcpy(&frame[6], w5100_mac_addr, 6);
+            be16_set(&frame[12], W5100_ETH_TYPE_IP);
+            ip = &frame[W5100_ETH_HEADER_SIZE];
+            ip[0] = 0x45;
+            ip[1] = 0;
+            be16_set(&ip[2], W5100_IP_HEADER_SIZE + W5100_UDP_HDR_SIZE + len);
+            be16_set(&ip[4], ip_id++);
+            be16_set(&ip[6], 0);
+            ip[8] = IN_MULTICAST(ntohl(dest)) ? s->mc_ttl : W5100_IP_TTL;
+            ip[9] = W5100_IP_PROTO_UDP;
+            be16_set(&ip[10], 0);
+            memcpy(&ip[12], &local, 4);
+            memcpy(&ip[16], &dest, 4);
+            pos = 0;
+            be16_set(&ip[10], cksum_fold(cksum_add(0, ip, W5100_IP_HEADER_SIZE, &pos)));
+            udp = &ip[W5100_IP_HEADER_SIZE];
+            memcpy(&udp[0], &s->sockname.sin_port, 2);
+            memcpy(&udp[2], &peer->sin_port, 2);
+            be16_set(&udp[4], W5100_UDP_HDR_SIZE + len);
+            be16_set(&udp[6], 0);
+            cksum = udp_cksum(ip, iov, iovcnt);
+            be16_set(&udp[6], (cksum != 0) ? cksum : 0xFFFF); /* 0 is for no checksum */
+            ret = macraw_send(frame, sizeof(frame), iov, iovcnt, len, nonblock, &tom);
+            if (ret == 0)
+            {
+                ret = len;
+            }
+        }
+    }
+    return ret;
+}
+
+/* Copy the datagram at *pread of q in msg, moving *pread past it.
+ * \retval bytes copied in msg, up to len.
+ */
+static
+uint16_t soft_read_dgram(const struct soft_rx *q, struct msghdr *msg, size_t len, uint16_t *pread)
+{
+    uint16_t msg_len;
+    uint16_t tocopy;
+
+    msg_len = w5100_dgram_header_get(&q->buf[*pread], msg);
+    *pread += W5100_UDP_HEADER_SIZE;
+    if (msg_len > len)
+    {
+        tocopy = len;
+        msg->msg_flags |= MSG_TRUNC;
+    }
+    else
+    {
+        tocopy = msg_len;
+    }
+    w5100_iov_fill(msg->msg_iov, msg->msg_iovlen, 0, &q->buf[*pread], tocopy);
+    *pread += msg_len;
+
+    return tocopy;
+}
+
+/* As read_dgrams, from the queue of a software socket. */
+static
+int soft_read_dgrams(struct soft_rx *q, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    int ret;
+    uint16_t pread;
+
+    pread = 0;
+    ret = 0;
+    while (((unsigned int)ret < vlen) && (pread < q->len))
+    {
+        struct msghdr *msg;
+
+        msg = &msgvec[ret].msg_hdr;
+        msg->msg_flags = 0;
+        msgvec[ret].msg_len = soft_read_dgram(q, msg, w5100_iov_len_get(msg->msg_iov, msg->msg_iovlen), &pread);
+        ret++;
+        if (flags & MSG_PEEK)
+        {
+            break;
+        }
+    }
+    if ((ret > 0) && !(flags & MSG_PEEK))
+    {
+        q->len -= pread;
+        memmove(q->buf, &q->buf[pread], q->len);
+    }
+    return ret;
+}
+
+int w5100_macraw_recvmmsg(struct w5100_socket *s, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+        const struct timespec *timeout)
+{
+    int ret;
+    struct timeout_manager tom;
+    int nonblock;
+
+    nonblock = flags & MSG_DONTWAIT;
+    if (!nonblock)
+    {
+        w5100_timeout_init(timeout, &tom);
+    }
+    do
+    {
+        macraw_input();
+        ret = soft_read_dgrams(&soft_rx[s->isocket - W5X00_MAX_SOCKETS], msgvec, vlen, flags);
+        if (ret > 0)
+        {
+            break;
+        }
+        else if (nonblock)
+        {
+            errno = EAGAIN;
+            ret = -1;
+            break;
+        }
+        else if (w5100_timeout_ended(&tom))
+        {
+            ret = -1;
+            break;
+        }
+        else
+        {
+            macraw_wait(&tom);
+        }
+    } while(1);
+    return ret;
+}
+
+/* No cache: the queue is in RAM, and the MACRAW socket is shared. */
+short w5100_macraw_poll(struct w5100_socket *s)
+{
+    short ret;
+
+    if (s->state != W5100_SOCK_STATE_BOUND)
+    {
+        ret = POLLNVAL;
+    }
+    else
+    {
+        macraw_input();
+        ret = 0;
+        if (soft_rx[s->isocket - W5X00_MAX_SOCKETS].len > 0)
+        {
+            ret |= POLLRDNORM|POLLIN;
+        }
+        if (w5100_write_buf_len(W5100_MACRAW_ISOCKET) > 0)
+        {
+            ret |= POLLWRNORM|POLLOUT;
+        }
+    }
+    return ret;
+}
+
+int w5100_macraw_alloc(void)
+{
+    int ret;
+    int i;
+
+    ret = -1;
+    for (i = W5X00_MAX_SOCKETS; i < W5X00_MAX_SOCKETS + W5100_MACRAW_SOCKETS; i++)
+    {
+        if (w5100_sockets[i].fd == W5100_SOCKET_FREE)
+        {
+            w5100_sockets[i].fd = i;
+            soft_rx[i - W5X00_MAX_SOCKETS].len = 0;
+            ret = i;
+            break;
+        }
+    }
+    if (ret == -1)
+    {
+        errno = ENFILE;
+    }
+    return ret;
+}
+
+/* Biggest buffer, of at least W5100_BUF_SIZE_MIN,
+ * that n sockets can have in mem_size bytes.
+ */
+static
+uint16_t buf_size_share(uint32_t mem_size, int n)
+{
+    uint16_t size;
+
+    size = W5100_BUF_SIZE_MIN;
+    while ((uint32_t)size * 2 * n <= mem_size)
+    {
+        size <<= 1;
+    }
+    return size;
+}
+
+/* Socket 0 in MACRAW mode, for the software sockets,
+ * with half of the buffer memory: the hardware sockets share the rest.
+ */
+void w5100_macraw_open(void)
+{
+    struct w5100_socket *m;
+    uint16_t tx_sizes[W5X00_MAX_SOCKETS];
+    uint16_t rx_sizes[W5X00_MAX_SOCKETS];
+    uint8_t sr;
+    int i;
+
+    for (i = 0; i < w5x00_chip.n_sockets; i++)
+    {
+        if (i == W5100_MACRAW_ISOCKET)
+        {
+            tx_sizes[i] = w5x00_chip.tx_mem_size / 2;
+            rx_sizes[i] = w5x00_chip.rx_mem_size / 2;
+        }
+        else
+        {
+            tx_sizes[i] = buf_size_share(w5x00_chip.tx_mem_size / 2, w5x00_chip.n_sockets - 1);
+            rx_sizes[i] = buf_size_share(w5x00_chip.rx_mem_size / 2, w5x00_chip.n_sockets - 1);
+        }
+    }
+    (void)w5x00_chip.set_buf_sizes(tx_sizes, rx_sizes);
+    for (i = W5X00_MAX_SOCKETS; i < W5X00_MAX_SOCKETS + W5100_MACRAW_SOCKETS; i++)
+    {
+        w5100_sockets[i].isocket = i;
+        w5100_sockets[i].ttl = W5100_IP_TTL;
+        w5100_socket_free(i);
+    }
+
+    m = &w5100_sockets[W5100_MACRAW_ISOCKET];
+    m->fd = W5100_MACRAW_ISOCKET; /* taken, without a descriptor */
+    m->isocket = W5100_MACRAW_ISOCKET;
+    m->type = SOCK_RAW;
+    m->state = W5100_SOCK_STATE_BOUND;
+    w5x00_write_sock_reg(W5100_Sn_MR, W5100_MACRAW_ISOCKET,
+            W5100_SOCK_MODE_MACRAW | w5x00_chip.macraw_filter);
+    w5100_command(W5100_MACRAW_ISOCKET, W5100_CMD_OPEN);
+    do {
+        sr = w5x00_read_sock_reg(W5100_Sn_SR, W5100_MACRAW_ISOCKET);
+    } while (sr != W5100_SOCK_MACRAW);
+}
@@ -17,20 +17,85 @@
  *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <file.h>
+#include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <poll.h>
 #include "w5100.h"
+#include "w5x00.h"
+#include "w5100_socket.h"
+#include "w5100_socket_priv.h"
 #include "timespec.h"
 
 /******* defines and macros ********/
 
-#define W5100_SOCKET_FREE (-1)
+/* Coalesced TCP data is sent when it reaches the threshold,
+ * or when it has been waiting for the timeout.
+ */
+#ifndef W5100_TCP_COALESCE_THRESHOLD
+#  define W5100_TCP_COALESCE_THRESHOLD 1460 /* default MSS */
+#endif
+
+#ifndef W5100_TCP_COALESCE_TIMEOUT_MS
+#  define W5100_TCP_COALESCE_TIMEOUT_MS 200
+#endif
+
+/* Waiting for socket events, the registers are looked at again
+ * after this time anyway, in case a state change came without interrupt.
+ */
+#ifndef W5100_EVENT_RECHECK_MS
+#  define W5100_EVENT_RECHECK_MS 100
+#endif
+
+/* TCP keepalive defaults, in seconds, as in Linux. */
+#ifndef W5100_TCP_KEEPIDLE
+#  define W5100_TCP_KEEPIDLE 7200
+#endif
+
+#ifndef W5100_TCP_KEEPINTVL
+#  define W5100_TCP_KEEPINTVL 75
+#endif
+
+/* TCP retransmission, for all the sockets, see W5100_SO_RETRY_TIME. */
+#ifndef W5100_RETRY_TIME
+#  define W5100_RETRY_TIME 2000 /* 200ms */
+#endif
+
+#ifndef W5100_RETRY_COUNT
+#  define W5100_RETRY_COUNT 8
+#endif
+
+/* MSS of new TCP sockets, the largest supported by the chips. */
+#define W5100_TCP_MAXSEG_MAX 1460
+
+#ifndef W5100_TCP_MAXSEG
+#  define W5100_TCP_MAXSEG W5100_TCP_MAXSEG_MAX
+#endif
+
+/* TTL of multicast datagrams of new sockets: the local network only. */
+#ifndef W5100_IP_MULTICAST_TTL
+#  define W5100_IP_MULTICAST_TTL 1
+#endif
+
+/* sendfile reads files that can not forward their data
+ * through a buffer of this size on the stack.
+ */
+#ifndef W5100_SENDFILE_BUF
+#  define W5100_SENDFILE_BUF 512 /* a sector */
+#endif
+
+/* Stats files that can be open at the same time. */
+#ifndef W5100_STATS_FILES
+#  define W5100_STATS_FILES 2
+#endif
+
+#define W5100_STATS_LINE 192 /* longest line of the stats file */
 
 #if !defined(W5100_NO_STATIC_IP) && !defined(W5100_STATIC_IP)
 #  define W5100_STATIC_IP
@@ -50,29 +115,11 @@
 #  endif
 #endif
 
-enum w5100_socket_state {
-    W5100_SOCK_STATE_NONE = 0,
-    W5100_SOCK_STATE_CREATED,
-    W5100_SOCK_STATE_CONNECTED,
-    W5100_SOCK_STATE_BOUND,
-    W5100_SOCK_STATE_LISTENING,
-    W5100_SOCK_STATE_ACCEPTED,
-    W5100_SOCK_STATE_DISCONNECTED,
-};
-
-struct timeout_manager {
-    int has_timeout;
-    struct timespec end;
-};
-
 /******* function prototypes ********/
 
 extern
 void w5100_socket_init(void);
 
-static
-void w5100_command(int isocket, uint8_t cmd);
-
 static
 int w5100_sock_write(int fd, char *buf, int len);
 
@@ -83,33 +130,57 @@ static
 int w5100_sock_close(int fd);
 
 static
-short w5100_sock_poll(int fd);
+ssize_t w5100_sock_readv(int fd, const struct iovec *iov, int iovcnt);
+
+static
+ssize_t w5100_sock_writev(int fd, const struct iovec *iov, int iovcnt);
 
 static
-void timeout_init(const struct timespec *timeout, struct timeout_manager *tom);
+short w5100_sock_poll(int fd);
 
 static
-int timeout_ended(const struct timeout_manager *tom);
+ssize_t w5100_sock_sendfile(int out_fd, int in_fd, size_t count);
 
 /******* global variables ********/
 
-static struct w5100_socket {
-    int fd;
-    int isocket;
-    int domain;
-    int type;
-    int protocol;
-    enum w5100_socket_state state;
-    struct sockaddr_in sockname;
-    struct sockaddr_in dest_address;
-    int can_broadcast;
-    struct timespec recv_timeout;
-    struct timespec send_timeout;
-    struct fd *fd_data;
-    struct fd *connection_data;
-} w5100_sockets[W5100_N_SOCKETS];
-
-static uint8_t w5100_mac_addr[6] = {0x80, 0x81, 0x82, 0x83, 0x84, 0x85};
+struct w5100_socket w5100_sockets[W5X00_MAX_SOCKETS + W5100_MACRAW_SOCKETS];
+
+static const struct timespec tx_coalesce_timeout = {
+    .tv_sec = 0,
+    .tv_nsec = W5100_TCP_COALESCE_TIMEOUT_MS * (NSECS_IN_SEC / MSECS_IN_SEC)
+};
+
+static const struct timespec event_recheck_timeout = {
+    .tv_sec = 0,
+    .tv_nsec = W5100_EVENT_RECHECK_MS * (NSECS_IN_SEC / MSECS_IN_SEC)
+};
+
+static
+void tx_flush(struct w5100_socket *s);
+
+static
+void tx_flush_check(struct w5100_socket *s);
+
+static
+void listen_rearm(struct w5100_socket *s);
+
+static
+void listen_close(struct w5100_socket *s);
+
+static
+void poll_invalidate(struct w5100_socket *s);
+
+static
+void poll_notify(const struct w5100_socket *s);
+
+static
+void linger_reap(void);
+
+/* RTR and RCR, written by w5100_socket_init and setsockopt. */
+uint16_t w5100_retry_time;
+uint8_t w5100_retry_count;
+
+uint8_t w5100_mac_addr[6] = {0x80, 0x81, 0x82, 0x83, 0x84, 0x85};
 
 /******* function definitions ********/
 
@@ -118,17 +189,77 @@ struct w5100_socket *get_socket_from_isocket(int isocket)
 {
     struct w5100_socket *s;
     
-    if (isocket < 0 || isocket >= W5100_N_SOCKETS)
+    if ((isocket >= 0) && (isocket < w5x00_chip.n_sockets))
     {
-        s = NULL;
+        s = &w5100_sockets[isocket];
     }
-    else
+    else if ((isocket >= W5X00_MAX_SOCKETS) && (isocket < W5X00_MAX_SOCKETS + W5100_MACRAW_SOCKETS))
     {
         s = &w5100_sockets[isocket];
     }
+    else
+    {
+        s = NULL;
+    }
     return s;
 }
 
+/* Software socket, on top of the MACRAW one: its isocket is past
+ * the hardware sockets, and it has no chip registers.
+ */
+static
+int is_soft(const struct w5100_socket *s)
+{
+    return (s->isocket >= W5X00_MAX_SOCKETS);
+}
+
+static
+void stats_reset(struct w5100_socket *s)
+{
+    memset(&s->stats, 0, sizeof(s->stats));
+    if (!is_soft(s))
+    {
+        memset(&w5x00_sock_frames[s->isocket], 0, sizeof(w5x00_sock_frames[s->isocket]));
+    }
+}
+
+static
+void stats_get(const struct w5100_socket *s, struct w5100_sock_stats *stats)
+{
+    *stats = s->stats;
+    if (!is_soft(s))
+    {
+        stats->data_frames = w5x00_sock_frames[s->isocket].data;
+        stats->reg_frames = w5x00_sock_frames[s->isocket].reg;
+    }
+}
+
+/* Outcome of a call that can wait: bytes moved, if bytes is not NULL,
+ * or EAGAIN, right away or at the end of the timeout.
+ */
+static
+void stats_result(struct w5100_socket *s, ssize_t ret, int flags, unsigned long *bytes)
+{
+    if (ret > 0)
+    {
+        if (bytes != NULL)
+        {
+            *bytes += ret;
+        }
+    }
+    else if ((ret == -1) && (errno == EAGAIN))
+    {
+        if (flags & MSG_DONTWAIT)
+        {
+            s->stats.eagain++;
+        }
+        else
+        {
+            s->stats.timeouts++;
+        }
+    }
+}
+
 static
 struct w5100_socket *get_socket_from_fd(int fd)
 {
@@ -144,7 +275,7 @@ struct w5100_socket *get_socket_from_fd(int fd)
     {
         errno = ENOTSOCK;
     }
-    else if (fds->opaque == NULL)
+    else if ((fds->opaque == NULL) || !(fds->isopen))
     {
         errno = EBADF;
     }
@@ -168,10 +299,15 @@ struct fd *fill_fd_struct(int sockfd, int isocket)
     fds->read = w5100_sock_read;
     fds->close = w5100_sock_close;
     fds->poll = w5100_sock_poll;
+    fds->readv = w5100_sock_readv;
+    fds->sendfile = w5100_sock_sendfile;
+    fds->writev = w5100_sock_writev;
     fds->stat.st_mode = S_IFSOCK|S_IRWXU|S_IRWXG|S_IRWXO;
     fds->status_flags = O_RDWR;
     fds->stat.st_blksize = 1024;
     fds->opaque = &w5100_sockets[isocket];
+    /* software sockets change on frames of the MACRAW socket */
+    fds->notify = (isocket < W5X00_MAX_SOCKETS);
 
     return fds;
 }
@@ -189,13 +325,13 @@ uint16_t get_avail_port(void)
 
         port_used = 0;
 
-        for (isocket = 0; isocket < W5100_N_SOCKETS; isocket++)
+        for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
         {
             if (get_socket_from_isocket(isocket)->state != W5100_SOCK_STATE_NONE)
             {
                 uint16_t port;
 
-                w5100_read_sock_regx(W5100_Sn_PORT, isocket, &port);
+                w5x00_read_sock_regx(W5100_Sn_PORT, isocket, &port);
                 if (port == avail_port)
                 {
                     port_used = 1;
@@ -204,6 +340,25 @@ uint16_t get_avail_port(void)
                 }
             }
         }
+        for (isocket = W5X00_MAX_SOCKETS;
+                !port_used && (isocket < W5X00_MAX_SOCKETS + W5100_MACRAW_SOCKETS);
+                isocket++)
+        {
+            const struct w5100_socket *s;
+
+            s = &w5100_sockets[isocket];
+            if (
+                    (s->state != W5100_SOCK_STATE_NONE)
+                    &&
+                    (s->sockname.sin_family == AF_INET)
+                    &&
+                    (s->sockname.sin_port == avail_port)
+               )
+            {
+                port_used = 1;
+                avail_port--;
+            }
+        }
     } while(port_used);
     
     return avail_port;
@@ -215,15 +370,44 @@ int socket_alloc(void)
     int i;
     int ret;
 
-    for (i = 0; i < W5100_N_SOCKETS; i++)
+    linger_reap();
+    for (i = 0; i < w5x00_chip.n_sockets; i++)
     {
-        if (w5100_sockets[i].fd == W5100_SOCKET_FREE)
+        if (
+                (w5100_sockets[i].fd == W5100_SOCKET_FREE)
+                &&
+                (w5x00_chip.get_tx_size(i) > 0)
+                &&
+                (w5x00_chip.get_rx_size(i) > 0)
+           )
         {
             w5100_sockets[i].fd = i;
             break;
         }
     }
-    if (i < W5100_N_SOCKETS)
+    if (i == w5x00_chip.n_sockets)
+    {
+        /* rather than failing, abort a connection still closing */
+        for (i = 0; i < w5x00_chip.n_sockets; i++)
+        {
+            if (
+                    (w5100_sockets[i].state == W5100_SOCK_STATE_CLOSING)
+                    &&
+                    !w5100_sockets[i].listening
+                    &&
+                    (w5x00_chip.get_tx_size(i) > 0)
+                    &&
+                    (w5x00_chip.get_rx_size(i) > 0)
+               )
+            {
+                w5100_command(i, W5100_CMD_CLOSE);
+                w5100_socket_free(i);
+                w5100_sockets[i].fd = i;
+                break;
+            }
+        }
+    }
+    if (i < w5x00_chip.n_sockets)
     {
         ret = i;
     }
@@ -235,13 +419,42 @@ int socket_alloc(void)
     return ret;
 }
 
-static
-void socket_free(int isocket)
+void w5100_socket_free(int isocket)
 {
     w5100_sockets[isocket].fd = W5100_SOCKET_FREE;
     w5100_sockets[isocket].fd_data = NULL;
     w5100_sockets[isocket].connection_data = NULL;
     w5100_sockets[isocket].state = W5100_SOCK_STATE_NONE;
+    w5100_sockets[isocket].shadow_valid = 0;
+    w5100_sockets[isocket].tx_pending = 0;
+    w5100_sockets[isocket].listening = 0;
+    w5100_sockets[isocket].listener = NULL;
+    w5100_sockets[isocket].events = 0;
+    w5100_sockets[isocket].shut_rd = 0;
+    w5100_sockets[isocket].shut_wr = 0;
+    w5100_sockets[isocket].so_error = 0; /* even if nobody read it */
+    if (w5100_sockets[isocket].ttl != W5100_IP_TTL)
+    {
+        /* the next user of the socket may be a TCP one */
+        w5100_sockets[isocket].ttl = W5100_IP_TTL;
+        w5x00_write_sock_reg(W5100_Sn_TTL, isocket, W5100_IP_TTL);
+    }
+    poll_invalidate(&w5100_sockets[isocket]);
+}
+
+/* Close the connection of s in the background: the FIN goes after
+ * the data in the TX buffer, and linger_reap takes the socket back
+ * when the chip is done with it.
+ */
+static
+void socket_linger(struct w5100_socket *s)
+{
+    tx_flush(s);
+    if (!s->shut_wr)
+    {
+        w5100_command(s->isocket, W5100_CMD_DISCON);
+    }
+    s->state = W5100_SOCK_STATE_CLOSING;
 }
 
 static
@@ -256,6 +469,30 @@ int w5100_sock_read(int fd, char *buf, int len)
     return recv(fd, buf, len, 0);
 }
 
+static
+ssize_t w5100_sock_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return recvmsg(fd, &msg, 0);
+}
+
+static
+ssize_t w5100_sock_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return sendmsg(fd, &msg, 0);
+}
+
 static
 int w5100_sock_close(int fd)
 {
@@ -279,20 +516,29 @@ int w5100_sock_close(int fd)
             s->fd_data->isopen = 0;
             file_free(s->fd_data->fd);
             s->fd_data = NULL;
-            if (s->state != W5100_SOCK_STATE_ACCEPTED)
+            if (s->listening)
             {
-                if (s->state == W5100_SOCK_STATE_CONNECTED)
-                {
-                    w5100_command(isocket, W5100_CMD_DISCON);
-                }
-                else
-                {
-                    w5100_command(isocket, W5100_CMD_CLOSE);
-                }
+                listen_close(s);
+            }
+            if (s->state == W5100_SOCK_STATE_CONNECTED)
+            {
+                socket_linger(s);
+            }
+            else if (is_soft(s))
+            {
+                w5100_socket_free(isocket);
+            }
+            else if (
+                    (s->state != W5100_SOCK_STATE_ACCEPTED)
+                    &&
+                    (s->state != W5100_SOCK_STATE_CLOSING)
+                    )
+            {
+                w5100_command(isocket, W5100_CMD_CLOSE);
                 do {
-                    sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
+                    sr = w5x00_read_sock_reg(W5100_Sn_SR, isocket);
                 } while (sr != W5100_SOCK_CLOSED);
-                socket_free(isocket);
+                w5100_socket_free(isocket);
             }
             ret = 0;
         }
@@ -306,24 +552,11 @@ int w5100_sock_close(int fd)
             s->connection_data->isopen = 0;
             file_free(s->connection_data->fd);
             s->connection_data = NULL;
-            w5100_command(isocket, W5100_CMD_DISCON);
-            do {
-                sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
-            } while (sr != W5100_SOCK_CLOSED);
-            if (s->fd_data == NULL)
-            {
-                /* underlying listening socket has been already closed. */
-                socket_free(isocket);
-            }
-            else
+            socket_linger(s);
+            if (s->listener != NULL)
             {
-                /* re-enter listening state */
-                w5100_command(isocket, W5100_CMD_OPEN);
-                w5100_command(isocket, W5100_CMD_LISTEN);
-                do {
-                    sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-                } while ((sr != W5100_SOCK_LISTEN) && (sr != W5100_SOCK_ESTABLISHED));
-                s->state = W5100_SOCK_STATE_LISTENING;
+                /* spare socket of a backlog: replaced now */
+                listen_rearm(s->listener);
             }
             ret = 0;
         }
@@ -336,19 +569,32 @@ int w5100_sock_close(int fd)
     return ret;
 }
 
+static
+void tcp_maxseg_set(struct w5100_socket *s)
+{
+    uint16_t mss;
+
+    mss = htons(s->tcp_maxseg);
+    w5x00_write_sock_regx(W5100_Sn_MSSR, s->isocket, &mss);
+}
+
 static
 int socket_create(int type)
 {
     int isocket;
     int fd = -1;
 
+#ifdef W5100_MACRAW
+    isocket = (type == SOCK_DGRAM) ? w5100_macraw_alloc() : socket_alloc();
+#else
     isocket = socket_alloc();
+#endif
     if (isocket != -1)
     {
         fd = file_alloc();
         if (fd == -1)
         {
-            socket_free(isocket);
+            w5100_socket_free(isocket);
             isocket = -1;
             errno = ENFILE;
         }
@@ -374,6 +620,21 @@ int socket_create(int type)
             s->recv_timeout = TIMESPEC_ZERO;
             s->send_timeout = TIMESPEC_ZERO;
             s->can_broadcast = 0;
+            s->tcp_nodelay = 1;
+            s->tcp_cork = 0;
+            s->listening = 0;
+            s->backlog = 0;
+            s->listener = NULL;
+            s->rx_stage_size = 0;
+            s->so_error = 0;
+            s->keepalive = 0;
+            s->keep_idle = W5100_TCP_KEEPIDLE;
+            s->keep_intvl = W5100_TCP_KEEPINTVL;
+            s->tcp_maxseg = W5100_TCP_MAXSEG;
+            s->mc_joined = 0;
+            s->mc_ttl = W5100_IP_MULTICAST_TTL;
+            s->dgram_send_mac = 0;
+            stats_reset(s);
             
             switch(type)
             {
@@ -391,7 +652,14 @@ int socket_create(int type)
                     sock_mode = W5100_SOCK_MODE_TCP;
                     break;
             }
-            w5100_write_sock_reg(W5100_Sn_MR, isocket, sock_mode);
+            if (!is_soft(s))
+            {
+                w5x00_write_sock_reg(W5100_Sn_MR, isocket, sock_mode);
+            }
+            if (type == SOCK_STREAM)
+            {
+                tcp_maxseg_set(s);
+            }
         }
     }
     else
@@ -430,26 +698,99 @@ int socket(int domain, int type, int protocol)
     return ret;
 }
 
-static
 void w5100_command(int isocket, uint8_t cmd)
 {
-    w5100_write_sock_reg(W5100_Sn_CR, isocket, cmd);
-    while (w5100_read_sock_reg(W5100_Sn_CR, isocket))
+    struct w5100_socket *s;
+
+    s = get_socket_from_isocket(isocket);
+    if ((cmd == W5100_CMD_OPEN) || (cmd == W5100_CMD_CLOSE))
+    {
+        /* the chip resets the buffer pointers */
+        s->shadow_valid = 0;
+        s->tx_pending = 0;
+        /* events and data of the previous use */
+        s->events = 0;
+        s->rx_stage_len = 0;
+        s->dgram_in_flight = 0;
+        s->dgram_dest_valid = 0;
+        s->shut_rd = 0;
+        s->shut_wr = 0;
+        s->keep_armed = 0;
+    }
+    if ((cmd == W5100_CMD_SEND) || (cmd == W5100_CMD_SEND_MAC))
+    {
+        s->stats.send_cmds++;
+    }
+    else if (cmd == W5100_CMD_RECV)
+    {
+        s->stats.recv_cmds++;
+    }
+    poll_invalidate(s);
+    w5x00_write_sock_reg(W5100_Sn_CR, isocket, cmd);
+    while (w5x00_read_sock_reg(W5100_Sn_CR, isocket))
     {
         continue;
     }
 }
 
+static
+struct w5100_socket *shadow_get(int isocket)
+{
+    struct w5100_socket *s;
+
+    s = get_socket_from_isocket(isocket);
+    if (!s->shadow_valid)
+    {
+        w5x00_read_sock_regx(W5100_Sn_TX_WR, isocket, &s->tx_wr);
+        s->tx_wr = ntohs(s->tx_wr);
+        w5x00_read_sock_regx(W5100_Sn_RX_RD, isocket, &s->rx_rd);
+        s->rx_rd = ntohs(s->rx_rd);
+        s->shadow_valid = 1;
+    }
+    return s;
+}
+
+/* Ethernet address of an IPv4 group: 01:00:5e and the low 23 bits. */
+void w5100_mc_mac_get(in_addr_t group, uint8_t *mac)
+{
+    const uint8_t *ip;
+
+    ip = (const uint8_t *)&group;
+    mac[0] = 0x01;
+    mac[1] = 0x00;
+    mac[2] = 0x5E;
+    mac[3] = ip[1] & 0x7F;
+    mac[4] = ip[2];
+    mac[5] = ip[3];
+}
+
 static
 void bind_udp(struct w5100_socket *s, uint16_t port)
 {
-    uint8_t sr;
+    if (!is_soft(s))
+    {
+        uint8_t sr;
+        uint8_t mode;
 
-    w5100_write_sock_regx(W5100_Sn_PORT, s->isocket, &port);
-    w5100_command(s->isocket, W5100_CMD_OPEN);
-    do {
-        sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-    } while (sr != W5100_SOCK_UDP);
+        mode = W5100_SOCK_MODE_UDP;
+        if (s->mc_joined)
+        {
+            uint8_t mac[W5100_Sn_DHAR_SIZE];
+
+            /* the chip sends the IGMP report at OPEN */
+            w5100_mc_mac_get(s->mc_group.s_addr, mac);
+            w5x00_write_sock_regx(W5100_Sn_DIPR, s->isocket, &s->mc_group.s_addr);
+            w5x00_write_sock_regx(W5100_Sn_DPORT, s->isocket, &port);
+            w5x00_write_sock_regx(W5100_Sn_DHAR, s->isocket, mac);
+            mode |= W5100_SOCK_MODE_MULTI;
+        }
+        w5x00_write_sock_reg(W5100_Sn_MR, s->isocket, mode);
+        w5x00_write_sock_regx(W5100_Sn_PORT, s->isocket, &port);
+        w5100_command(s->isocket, W5100_CMD_OPEN);
+        do {
+            sr = w5x00_read_sock_reg(W5100_Sn_SR, s->isocket);
+        } while (sr != W5100_SOCK_UDP);
+    }
     s->sockname.sin_family = AF_INET;
     s->sockname.sin_addr.s_addr = INADDR_ANY; /* TODO: local IP */
     s->sockname.sin_port = port;
@@ -468,8 +809,34 @@ void check_bind_udp(struct w5100_socket *s)
     }
 }
 
+/* Outcome of the connection attempt of s, if any.
+ * ev are the events of s taken since the last call.
+ */
+static
+void connect_update(struct w5100_socket *s, uint8_t ev)
+{
+    if (s->state == W5100_SOCK_STATE_CONNECTING)
+    {
+        uint8_t sr;
+
+        sr = w5x00_read_sock_reg(W5100_Sn_SR, s->isocket);
+        if (sr == W5100_SOCK_ESTABLISHED)
+        {
+            s->state = W5100_SOCK_STATE_CONNECTED;
+            poll_invalidate(s);
+        }
+        else if (sr == W5100_SOCK_CLOSED)
+        {
+            /* a RST gives DISCON */
+            s->so_error = (ev & W5100_INT_TIMEOUT) ? ETIMEDOUT : ECONNREFUSED;
+            s->state = W5100_SOCK_STATE_CREATED;
+            poll_invalidate(s);
+        }
+    }
+}
+
 static
-int connect_tcp(struct w5100_socket *s, const struct sockaddr *addr, socklen_t addrlen)
+int connect_tcp(struct w5100_socket *s, const struct sockaddr *addr, socklen_t addrlen, int nonblock)
 {
     int ret;
     
@@ -478,6 +845,11 @@ int connect_tcp(struct w5100_socket *s, const struct sockaddr *addr, socklen_t a
         errno = EAFNOSUPPORT;
         ret = -1;
     }
+    else if (s->state == W5100_SOCK_STATE_CONNECTING)
+    {
+        errno = EALREADY;
+        ret = -1;
+    }
     else if (
             (s->state == W5100_SOCK_STATE_CONNECTED)
             ||
@@ -508,33 +880,41 @@ int connect_tcp(struct w5100_socket *s, const struct sockaddr *addr, socklen_t a
         isocket = s->isocket;
         server = (struct sockaddr_in *)addr;
         /* TODO: check if already in use EADDRINUSE */
-        w5100_write_sock_regx(W5100_Sn_PORT, isocket, &server->sin_port);
+        w5x00_write_sock_regx(W5100_Sn_PORT, isocket, &server->sin_port);
         w5100_command(isocket, W5100_CMD_OPEN);
         do {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
+            sr = w5x00_read_sock_reg(W5100_Sn_SR, isocket);
         } while (sr != W5100_SOCK_INIT);
 
-        w5100_write_sock_regx(W5100_Sn_DIPR, isocket, &server->sin_addr.s_addr);
-        w5100_write_sock_regx(W5100_Sn_DPORT, isocket, &server->sin_port);
+        w5x00_write_sock_regx(W5100_Sn_DIPR, isocket, &server->sin_addr.s_addr);
+        w5x00_write_sock_regx(W5100_Sn_DPORT, isocket, &server->sin_port);
         w5100_command(isocket, W5100_CMD_CONNECT);
-        do {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
-        } while ((sr != W5100_SOCK_CLOSED) && (sr != W5100_SOCK_ESTABLISHED));
-        if (sr == W5100_SOCK_ESTABLISHED)
-        {
-            s->state = W5100_SOCK_STATE_CONNECTED;
-            s->dest_address = *server;
-            ret = 0;
-        }
-        else if (sr == W5100_SOCK_CLOSED)
+        s->dest_address = *server;
+        s->so_error = 0;
+        s->state = W5100_SOCK_STATE_CONNECTING;
+        if (nonblock)
         {
-            errno = ECONNREFUSED;
+            /* completion is seen by poll, the result by SO_ERROR */
+            errno = EINPROGRESS;
             ret = -1;
         }
         else
         {
-            errno = ECONNREFUSED; /* TODO: better error? */
-            ret = -1;
+            connect_update(s, 0);
+            while (s->state == W5100_SOCK_STATE_CONNECTING)
+            {
+                connect_update(s, w5100_events_wait(1U << isocket, W5100_INT_CON|W5100_INT_DISCON|W5100_INT_TIMEOUT, NULL));
+            }
+            if (s->state == W5100_SOCK_STATE_CONNECTED)
+            {
+                ret = 0;
+            }
+            else
+            {
+                errno = s->so_error;
+                s->so_error = 0;
+                ret = -1;
+            }
         }
     }
     return ret;
@@ -583,7 +963,7 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
     }
     else if (s->type == SOCK_STREAM)
     {
-        ret = connect_tcp(s, addr, addrlen);
+        ret = connect_tcp(s, addr, addrlen, file_struct_get(sockfd)->status_flags & O_NONBLOCK);
     }
     else if (s->type == SOCK_DGRAM)
     {
@@ -627,11 +1007,11 @@ int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
         
         server = (struct sockaddr_in *)addr;
         /* TODO: check if already in use EADDRINUSE */
-        w5100_write_sock_regx(W5100_Sn_PORT, s->isocket, &server->sin_port);
+        w5x00_write_sock_regx(W5100_Sn_PORT, s->isocket, &server->sin_port);
         w5100_command(s->isocket, W5100_CMD_OPEN);
         sr_end = W5100_SOCK_INIT;
         do {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+            sr = w5x00_read_sock_reg(W5100_Sn_SR, s->isocket);
         } while (sr != sr_end);
         s->sockname = *server;
         s->state = W5100_SOCK_STATE_BOUND;
@@ -655,17 +1035,269 @@ int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
     return ret;
 }
 
-int listen(int sockfd, int backlog)
+static
+void listen_arm(int isocket)
 {
-    int ret;
-    struct w5100_socket *s;
+    uint8_t sr;
 
-    s = get_socket_from_fd(sockfd);
-    if (s == NULL)
+    w5100_command(isocket, W5100_CMD_LISTEN);
+    do {
+        sr = w5x00_read_sock_reg(W5100_Sn_SR, isocket);
+    } while ((sr != W5100_SOCK_LISTEN) && (sr != W5100_SOCK_ESTABLISHED));
+}
+
+/* Is m listening for s, directly or as a spare? */
+static
+int listen_member(const struct w5100_socket *s, const struct w5100_socket *m)
+{
+    return (
+            ((m == s) && (m->state == W5100_SOCK_STATE_LISTENING))
+            ||
+            ((m->listener == s) && (m->state == W5100_SOCK_STATE_SPARE))
+           );
+}
+
+/* How many sockets are listening for s. */
+static
+int listen_count(const struct w5100_socket *s)
+{
+    int n_listening;
+    int isocket;
+
+    n_listening = 0;
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
     {
-        ret = -1;
+        if (listen_member(s, &w5100_sockets[isocket]))
+        {
+            n_listening++;
+        }
     }
-    else if (s->state != W5100_SOCK_STATE_BOUND)
+    return n_listening;
+}
+
+/* Arm spare sockets until backlog sockets are listening. */
+static
+void listen_rearm(struct w5100_socket *s)
+{
+    int n_listening;
+    int isocket;
+    int saved_errno;
+
+    n_listening = listen_count(s);
+    saved_errno = errno;
+    while (s->listening && (n_listening < s->backlog))
+    {
+        struct w5100_socket *m;
+
+        isocket = socket_alloc();
+        if (isocket == -1)
+        {
+            break;
+        }
+        m = get_socket_from_isocket(isocket);
+        m->isocket = isocket;
+        m->domain = s->domain;
+        m->type = s->type;
+        m->protocol = s->protocol;
+        m->state = W5100_SOCK_STATE_SPARE;
+        m->sockname = s->sockname;
+        m->dest_address.sin_family = AF_UNSPEC;
+        m->can_broadcast = 0;
+        m->recv_timeout = s->recv_timeout;
+        m->send_timeout = s->send_timeout;
+        m->fd_data = NULL;
+        m->connection_data = NULL;
+        m->tcp_nodelay = s->tcp_nodelay;
+        m->tcp_cork = s->tcp_cork;
+        m->rx_stage_size = s->rx_stage_size;
+        m->keepalive = s->keepalive;
+        m->keep_idle = s->keep_idle;
+        m->keep_intvl = s->keep_intvl;
+        m->tcp_maxseg = s->tcp_maxseg;
+        m->listening = 0;
+        m->backlog = 0;
+        m->listener = s;
+        /* nothing left from the last user of the socket */
+        m->so_error = 0;
+        m->shut_rd = 0;
+        m->shut_wr = 0;
+        m->keep_armed = 0;
+        m->dgram_in_flight = 0;
+        m->dgram_dest_valid = 0;
+        m->mc_joined = 0;
+        m->mc_ttl = W5100_IP_MULTICAST_TTL;
+        m->dgram_send_mac = 0;
+
+        w5x00_write_sock_reg(W5100_Sn_MR, isocket, W5100_SOCK_MODE_TCP);
+        tcp_maxseg_set(m);
+        w5x00_write_sock_regx(W5100_Sn_PORT, isocket, &s->sockname.sin_port);
+        w5100_command(isocket, W5100_CMD_OPEN);
+        listen_arm(isocket);
+        n_listening++;
+    }
+    errno = saved_errno;
+    /* a connection might have been taken */
+    poll_invalidate(s);
+}
+
+/* The listening socket is going away: spares are released,
+ * connections accepted on them stay until closed.
+ */
+static
+void listen_close(struct w5100_socket *s)
+{
+    int isocket;
+
+    s->listening = 0;
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        struct w5100_socket *m;
+
+        m = &w5100_sockets[isocket];
+        if (m->listener == s)
+        {
+            if (m->state == W5100_SOCK_STATE_SPARE)
+            {
+                w5100_command(isocket, W5100_CMD_CLOSE);
+                w5100_socket_free(isocket);
+            }
+            else
+            {
+                m->listener = NULL;
+            }
+        }
+    }
+}
+
+/* Release a spare of s that has no connection yet. */
+static
+void listen_drop_spare(struct w5100_socket *s)
+{
+    int isocket;
+
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        struct w5100_socket *m;
+
+        m = &w5100_sockets[isocket];
+        if (
+                (m->listener == s)
+                &&
+                (m->state == W5100_SOCK_STATE_SPARE)
+                &&
+                (w5x00_read_sock_reg(W5100_Sn_SR, isocket) == W5100_SOCK_LISTEN)
+           )
+        {
+            w5100_command(isocket, W5100_CMD_CLOSE);
+            w5100_socket_free(isocket);
+            break;
+        }
+    }
+}
+
+/* The sockets listening for s, bit n for socket n. */
+static
+unsigned int listen_set(const struct w5100_socket *s)
+{
+    unsigned int set;
+    int isocket;
+
+    set = 0;
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        if (listen_member(s, &w5100_sockets[isocket]))
+        {
+            set |= 1U << isocket;
+        }
+    }
+    return set;
+}
+
+/* A socket listening for s with an established connection. */
+static
+struct w5100_socket *listen_ready(struct w5100_socket *s)
+{
+    struct w5100_socket *ready;
+    int isocket;
+
+    ready = NULL;
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        struct w5100_socket *m;
+
+        m = &w5100_sockets[isocket];
+        if (
+                listen_member(s, m)
+                &&
+                (w5x00_read_sock_reg(W5100_Sn_SR, isocket) == W5100_SOCK_ESTABLISHED)
+           )
+        {
+            ready = m;
+            break;
+        }
+    }
+    return ready;
+}
+
+/* Sockets closed in the background are taken back once CLOSED;
+ * the listening socket itself listens again if its fd is still open.
+ */
+static
+void linger_reap(void)
+{
+    int isocket;
+
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        struct w5100_socket *m;
+
+        m = &w5100_sockets[isocket];
+        if (
+                (m->state == W5100_SOCK_STATE_CLOSING)
+                &&
+                (w5x00_read_sock_reg(W5100_Sn_SR, isocket) == W5100_SOCK_CLOSED)
+           )
+        {
+            if (m->listening)
+            {
+                /* spares armed meanwhile may fill the backlog */
+                if (listen_count(m) >= m->backlog)
+                {
+                    listen_drop_spare(m);
+                }
+                if (listen_count(m) < m->backlog)
+                {
+                    w5100_command(isocket, W5100_CMD_OPEN);
+                    listen_arm(isocket);
+                    m->state = W5100_SOCK_STATE_LISTENING;
+                }
+            }
+            else
+            {
+                struct w5100_socket *listener;
+
+                listener = m->listener;
+                w5100_socket_free(isocket);
+                if (listener != NULL)
+                {
+                    listen_rearm(listener);
+                }
+            }
+        }
+    }
+}
+
+int listen(int sockfd, int backlog)
+{
+    int ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if (s->state != W5100_SOCK_STATE_BOUND)
     {
         errno = EDESTADDRREQ;
         ret = 1;
@@ -677,14 +1309,13 @@ int listen(int sockfd, int backlog)
     }
     else /* TCP */
     {
-        uint8_t sr;
         /* TODO: check if already in use EADDRINUSE */
-        (void)backlog; /* ignoring the hint because we can't do anything about it. */
-        w5100_command(s->isocket, W5100_CMD_LISTEN);
-        do {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-        } while ((sr != W5100_SOCK_LISTEN) && (sr != W5100_SOCK_ESTABLISHED));
+        listen_arm(s->isocket);
         s->state = W5100_SOCK_STATE_LISTENING;
+        s->listening = 1;
+        /* spare sockets as long as they are available */
+        s->backlog = (backlog < 1) ? 1 : backlog;
+        listen_rearm(s);
         ret = 0;
     }
     return ret;
@@ -700,7 +1331,7 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     {
         ret = -1;
     }
-    else if (s->state != W5100_SOCK_STATE_LISTENING)
+    else if (!s->listening)
     {
         errno = EINVAL;
         ret = 1;
@@ -712,7 +1343,7 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     }
     else /* TCP */
     {
-        uint8_t sr;
+        struct w5100_socket *m;
         int newsockfd;
         int nonblock;
 
@@ -720,24 +1351,25 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 
         do
         {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-            if (sr == W5100_SOCK_ESTABLISHED)
+            m = listen_ready(s);
+            if (m != NULL)
             {
                 newsockfd = file_alloc();
                 if (newsockfd == -1)
                 {
                     errno = ENFILE;
                     /* go again into listen state */
-                    w5100_command(s->isocket, W5100_CMD_CLOSE);
-                    w5100_command(s->isocket, W5100_CMD_OPEN);
-                    w5100_command(s->isocket, W5100_CMD_LISTEN);
+                    w5100_command(m->isocket, W5100_CMD_CLOSE);
+                    w5100_command(m->isocket, W5100_CMD_OPEN);
+                    w5100_command(m->isocket, W5100_CMD_LISTEN);
                 }
                 else
                 {
                     struct sockaddr_in *client;
 
-                    s->state = W5100_SOCK_STATE_ACCEPTED;
-                    s->connection_data = fill_fd_struct(newsockfd, s->isocket);
+                    m->state = W5100_SOCK_STATE_ACCEPTED;
+                    m->connection_data = fill_fd_struct(newsockfd, m->isocket);
+                    stats_reset(m);
                     
                     if (addr != NULL)
                     {
@@ -748,9 +1380,11 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
                         client = (struct sockaddr_in *)addr;
                         addr->sa_family = AF_INET;
                         
-                        w5100_read_sock_regx(W5100_Sn_DIPR, s->isocket, &client->sin_addr.s_addr);
-                        w5100_read_sock_regx(W5100_Sn_DPORT, s->isocket, &client->sin_port);
+                        w5x00_read_sock_regx(W5100_Sn_DIPR, m->isocket, &client->sin_addr.s_addr);
+                        w5x00_read_sock_regx(W5100_Sn_DPORT, m->isocket, &client->sin_port);
                     }
+                    /* replace the socket that has been taken */
+                    listen_rearm(s);
                 }
                 ret = newsockfd;
                 break;
@@ -758,16 +1392,79 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
             else if (nonblock)
             {
                 errno = EAGAIN;
+                s->stats.eagain++;
                 ret = -1;
                 break;
             }
+            else
+            {
+                unsigned int set;
+
+                set = listen_set(s);
+                if (s->state == W5100_SOCK_STATE_CLOSING)
+                {
+                    /* listens again when its last connection is closed */
+                    set |= 1U << s->isocket;
+                }
+                w5100_events_wait(set, W5100_INT_CON|W5100_INT_DISCON, NULL);
+                linger_reap();
+            }
         } while(1);
     }
     return ret;
 }
 
-static
-void timeout_init(const struct timespec *timeout, struct timeout_manager *tom)
+/* SHUT_WR sends the FIN once the data in the TX buffer is gone;
+ * what the peer sends until its own FIN can still be received.
+ */
+int shutdown(int sockfd, int how)
+{
+    int ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if ((how != SHUT_RD) && (how != SHUT_WR) && (how != SHUT_RDWR))
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (s->type != SOCK_STREAM) /* UDP or RAW */
+    {
+        errno = EOPNOTSUPP;
+        ret = -1;
+    }
+    else if (
+            (s->state != W5100_SOCK_STATE_ACCEPTED)
+            &&
+            (s->state != W5100_SOCK_STATE_CONNECTED)
+            )
+    {
+        errno = ENOTCONN;
+        ret = -1;
+    }
+    else
+    {
+        if (how & SHUT_RD)
+        {
+            s->shut_rd = 1;
+        }
+        if ((how & SHUT_WR) && !s->shut_wr)
+        {
+            tx_flush(s);
+            w5100_command(s->isocket, W5100_CMD_DISCON);
+            s->shut_wr = 1;
+        }
+        poll_invalidate(s);
+        ret = 0;
+    }
+    return ret;
+}
+
+void w5100_timeout_init(const struct timespec *timeout, struct timeout_manager *tom)
 {
     tom->has_timeout = (timespec_diff(&TIMESPEC_ZERO, timeout, NULL) != 0);
 
@@ -778,8 +1475,7 @@ void timeout_init(const struct timespec *timeout, struct timeout_manager *tom)
     }
 }
 
-static
-int timeout_ended(const struct timeout_manager *tom)
+int w5100_timeout_ended(const struct timeout_manager *tom)
 {
     int ret;
     struct timespec cur;
@@ -802,88 +1498,240 @@ int timeout_ended(const struct timeout_manager *tom)
 }
 
 static
-uint16_t get_tx_size(int isocket)
+void keepalive_arm(struct w5100_socket *s, int seconds)
 {
-    (void)isocket;
-    return 0x800; /* 2KiB */
-}
+    struct timespec t;
 
-static
-uint16_t get_tx_mask(int isocket)
-{
-    return get_tx_size(isocket) - 1; /* size is always power of 2 */
+    t.tv_sec = seconds;
+    t.tv_nsec = 0;
+    w5100_timeout_init(&t, &s->keep_tom);
+    s->keep_armed = 1;
 }
 
+/* Probe the peer of s if the connection has been idle long enough.
+ * A peer that does not answer makes the chip time out: the socket
+ * gets CLOSED, seen as POLLHUP and ECONNRESET.
+ */
 static
-uint16_t get_tx_base(int isocket)
+void keepalive_check(struct w5100_socket *s)
 {
-    return W5100_TX_MEM_BASE + get_tx_size(isocket) * isocket;
+    if (
+            s->keepalive
+            &&
+            !s->shut_wr
+            &&
+            (
+                (s->state == W5100_SOCK_STATE_CONNECTED)
+                ||
+                (s->state == W5100_SOCK_STATE_ACCEPTED)
+            )
+       )
+    {
+        int saved_errno;
+
+        saved_errno = errno; /* w5100_timeout_ended sets it */
+        if (!s->keep_armed)
+        {
+            keepalive_arm(s, s->keep_idle);
+        }
+        else if (w5100_timeout_ended(&s->keep_tom))
+        {
+            if (w5x00_read_sock_reg(W5100_Sn_SR, s->isocket) == W5100_SOCK_ESTABLISHED)
+            {
+                w5100_command(s->isocket, W5100_CMD_SEND_KEEP);
+            }
+            keepalive_arm(s, s->keep_intvl);
+        }
+        errno = saved_errno;
+    }
 }
 
+/* Sockets are probed while the program waits for any of them:
+ * there is no timer of its own.
+ */
 static
-uint16_t get_rx_size(int isocket)
+void keepalive_tick(void)
 {
-    (void)isocket;
-    return 0x800; /* 2KiB */
+    int isocket;
+
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        keepalive_check(&w5100_sockets[isocket]);
+    }
 }
 
-static
-uint16_t get_rx_mask(int isocket)
+/* Move the socket interrupts from Sn_IR to the events of the sockets.
+ * Clearing Sn_IR releases the INT line.
+ */
+void w5100_events_update(void)
 {
-    return get_rx_size(isocket) - 1; /* size is always power of 2 */
+    while (w5x00_chip.int_asserted())
+    {
+        uint8_t pending;
+        int isocket;
+
+        pending = w5x00_chip.sock_int_get();
+        if (pending == 0)
+        {
+            break;
+        }
+        for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+        {
+            if (pending & (1U << isocket))
+            {
+                uint8_t ir;
+
+                ir = w5x00_read_sock_reg(W5100_Sn_IR, isocket);
+                w5x00_write_sock_reg(W5100_Sn_IR, isocket, ir); /* write 1 to clear */
+                w5100_sockets[isocket].events |= ir;
+                poll_notify(&w5100_sockets[isocket]);
+                if ((ir & W5100_INT_RECV) && w5100_sockets[isocket].keep_armed)
+                {
+                    /* the peer is alive */
+                    keepalive_arm(&w5100_sockets[isocket], w5100_sockets[isocket].keep_idle);
+                }
+            }
+        }
+    }
 }
 
+/* Earliest of deadline and the end of tom. */
 static
-uint16_t get_rx_base(int isocket)
+void deadline_min(struct timespec *deadline, const struct timeout_manager *tom)
 {
-    return W5100_RX_MEM_BASE + get_rx_size(isocket) * isocket;
+    if (tom->has_timeout && (timespec_diff(&tom->end, deadline, NULL) < 0))
+    {
+        *deadline = tom->end;
+    }
 }
 
+/* Sleep until the chip interrupts, or deadline, or the first timer of
+ * the sockets is due: coalesced data to send, keepalive probes.
+ */
 static
-int manage_disconnect(struct w5100_socket *s)
+void idle_until(struct timespec *deadline)
 {
-    int ret;
-    uint8_t sr;
-    
-    sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-    if (sr != W5100_SOCK_ESTABLISHED)
+    int isocket;
+
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
     {
-        if (sr == W5100_SOCK_CLOSE_WAIT)
+        struct w5100_socket *s;
+
+        s = &w5100_sockets[isocket];
+        if (s->tx_pending > 0)
         {
-            errno = ECONNRESET;
+            deadline_min(deadline, &s->tx_pending_tom);
         }
-        else
+        if (s->keepalive && s->keep_armed)
         {
-            errno = ETIMEDOUT;
+            deadline_min(deadline, &s->keep_tom);
         }
-        w5100_command(s->isocket, W5100_CMD_DISCON);
-        do
+    }
+    w5x00_chip.int_wait(deadline);
+}
+
+/* Sleep until one of the sockets in set (bit n for socket n)
+ * has one of the events in mask, or tom expires, or coalesced data
+ * is due. The events in mask are taken and returned, for all the set:
+ * the caller must look at the registers to know what happened.
+ */
+uint8_t w5100_events_wait(unsigned int set, uint8_t mask, const struct timeout_manager *tom)
+{
+    struct timeout_manager recheck;
+    int saved_errno;
+    int wake;
+    int isocket;
+    uint8_t taken;
+
+    saved_errno = errno; /* w5100_timeout_ended sets it */
+    w5100_timeout_init(&event_recheck_timeout, &recheck);
+    w5100_events_update();
+    do
+    {
+        wake = w5100_timeout_ended(&recheck) || ((tom != NULL) && w5100_timeout_ended(tom));
+        for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
         {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-        } while(sr != W5100_SOCK_CLOSED);
-        if (
-                (s->state == W5100_SOCK_STATE_ACCEPTED)
-                &&
-                (s->fd_data != NULL)
-           )
+            struct w5100_socket *s;
+
+            s = &w5100_sockets[isocket];
+            if (
+                    (set & (1U << isocket))
+                    &&
+                    (
+                        (s->events & mask)
+                        ||
+                        ((s->tx_pending > 0) && w5100_timeout_ended(&s->tx_pending_tom))
+                    )
+               )
+            {
+                wake = 1;
+            }
+        }
+        if (!wake)
         {
-            /* re-enter listening state */
-            w5100_command(s->isocket, W5100_CMD_OPEN);
-            w5100_command(s->isocket, W5100_CMD_LISTEN);
-            do {
-                sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-            } while ((sr != W5100_SOCK_LISTEN) && (sr != W5100_SOCK_ESTABLISHED));
-            s->state = W5100_SOCK_STATE_LISTENING;
+            struct timespec deadline;
+
+            keepalive_tick();
+            deadline = recheck.end;
+            if (tom != NULL)
+            {
+                deadline_min(&deadline, tom);
+            }
+            idle_until(&deadline);
+            w5100_events_update();
         }
-        else
+    } while (!wake);
+    taken = 0;
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        if (set & (1U << isocket))
         {
-            s->state = W5100_SOCK_STATE_DISCONNECTED;
+            taken |= w5100_sockets[isocket].events & mask;
+            w5100_sockets[isocket].events &= ~mask;
         }
-        ret = -1;
     }
-    else
+    errno = saved_errno;
+
+    return taken;
+}
+
+static
+uint16_t get_tx_size(int isocket)
+{
+    return w5x00_chip.get_tx_size(isocket);
+}
+
+/* Where the connection of s stands, from Sn_SR.
+ * \retval 0 open for receptions.
+ * \retval 1 the peer has sent its FIN: end of stream.
+ * \retval -1 lost without an orderly close, reset or timeout.
+ */
+static
+int stream_status(struct w5100_socket *s)
+{
+    int ret;
+    uint8_t sr;
+
+    sr = w5x00_read_sock_reg(W5100_Sn_SR, s->isocket);
+    switch (sr)
     {
-        ret = 0;
+        case W5100_SOCK_ESTABLISHED:
+        case W5100_SOCK_FIN_WAIT:
+            ret = 0;
+            break;
+        case W5100_SOCK_CLOSE_WAIT:
+        case W5100_SOCK_CLOSING:
+        case W5100_SOCK_TIME_WAIT:
+        case W5100_SOCK_LAST_ACK:
+            ret = 1;
+            break;
+        case W5100_SOCK_CLOSED:
+            /* after our FIN, the end of the handshake */
+            ret = s->shut_wr ? 1 : -1;
+            break;
+        default:
+            ret = -1;
+            break;
     }
     return ret;
 }
@@ -893,75 +1741,92 @@ ssize_t recv(int sockfd, void *buf, size_t len, int flags)
     return recvfrom(sockfd, buf, len, flags, NULL, NULL);
 }
 
-static
-uint16_t read_buf_len(int isocket)
+uint16_t w5100_read_buf_len(int isocket)
 {
     uint16_t toread;
 
-    w5100_read_sock_regx(W5100_Sn_RX_RSR, isocket, &toread);
+    w5x00_read_sock_regx(W5100_Sn_RX_RSR, isocket, &toread);
     toread = ntohs(toread);
 
     return toread;
 }
 
-static
-void read_buf_sure(int isocket, void *buf, size_t len, uint16_t *pread)
+void w5100_read_buf_sure(int isocket, void *buf, size_t len, uint16_t *pread)
 {
-    uint16_t offset;
-    uint16_t phys;
-    uint16_t toread1;
-    uint16_t toread2;
-    uint8_t *bytes = buf;
-
-    offset = *pread & get_rx_mask(isocket);
-    phys = get_rx_base(isocket) + offset;
-    if (offset + len > get_rx_size(isocket))
+    if (len > 0)
     {
-        toread1 = get_rx_size(isocket) - offset;
-        toread2 = len - toread1;
-    }
-    else
-    {
-        toread1 = len;
-        toread2 = 0;
-    }
-    if (toread1 > 0)
-    {
-        w5100_read_mem(phys, &bytes[0], toread1);
-    }
-    if (toread2 > 0)
-    {
-        w5100_read_mem(get_rx_base(isocket), &bytes[toread1], toread2);
+        w5x00_chip.read_rx(isocket, *pread, buf, len);
     }
     *pread = *pread + len;
 }
 
-static
-uint16_t read_buf_pstart(int isocket)
+uint16_t w5100_read_buf_pstart(int isocket)
 {
-    uint16_t pread;
+    return shadow_get(isocket)->rx_rd;
+}
 
-    w5100_read_sock_regx(W5100_Sn_RX_RD, isocket, &pread);
-    pread = ntohs(pread);
+void w5100_read_buf_recv(int isocket, uint16_t pstop)
+{
+    uint16_t rx_rd;
 
-    return pread;
+    shadow_get(isocket)->rx_rd = pstop;
+    rx_rd = htons(pstop);
+    w5x00_write_sock_regx(W5100_Sn_RX_RD, isocket, &rx_rd);
+    w5100_command(isocket, W5100_CMD_RECV);
 }
 
+/* Scatter len bytes of the RX buffer into the io vector,
+ * starting after the first skip bytes.
+ */
 static
-void read_buf_recv(int isocket, uint16_t pstop)
+void read_buf_sure_iov(int isocket, const struct iovec *iov, int iovcnt, size_t skip, size_t len, uint16_t *pread)
 {
-    pstop = htons(pstop);
-    w5100_write_sock_regx(W5100_Sn_RX_RD, isocket, &pstop);
-    w5100_command(isocket, W5100_CMD_RECV);
+    int i;
+
+    for (i = 0; (i < iovcnt) && (len > 0); i++)
+    {
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+        }
+        else
+        {
+            size_t n;
+
+            n = iov[i].iov_len - skip;
+            if (n > len)
+            {
+                n = len;
+            }
+            w5100_read_buf_sure(isocket, (uint8_t *)iov[i].iov_base + skip, n, pread);
+            skip = 0;
+            len -= n;
+        }
+    }
 }
 
+/* With MSG_WAITALL nothing is read until len bytes,
+ * or a full chip buffer, are available.
+ * With MSG_PEEK data is left in the chip buffer.
+ */
 static
-uint16_t read_buf(int isocket, void *buf, size_t len)
+uint16_t read_buf(int isocket, const struct iovec *iov, int iovcnt, size_t skip, size_t len, int flags)
 {
     uint16_t toread;
+    size_t needed;
+
+    needed = 1;
+    if (flags & MSG_WAITALL)
+    {
+        needed = w5x00_chip.get_rx_size(isocket);
+        if (needed > len)
+        {
+            needed = len;
+        }
+    }
 
-    toread = read_buf_len(isocket);
-    if (toread != 0)
+    toread = w5100_read_buf_len(isocket);
+    if ((toread != 0) && (toread >= needed))
     {
         uint16_t pread;
         
@@ -969,9 +1834,12 @@ uint16_t read_buf(int isocket, void *buf, size_t len)
         {
             len = toread;
         }
-        pread = read_buf_pstart(isocket);
-        read_buf_sure(isocket, buf, len, &pread);
-        read_buf_recv(isocket, pread);
+        pread = w5100_read_buf_pstart(isocket);
+        read_buf_sure_iov(isocket, iov, iovcnt, skip, len, &pread);
+        if (!(flags & MSG_PEEK))
+        {
+            w5100_read_buf_recv(isocket, pread);
+        }
     }
     else
     {
@@ -980,74 +1848,219 @@ uint16_t read_buf(int isocket, void *buf, size_t len)
     return len;
 }
 
+/* Copy n bytes from RAM into the io vector,
+ * starting after the first skip bytes.
+ */
+void w5100_iov_fill(const struct iovec *iov, int iovcnt, size_t skip, const uint8_t *src, size_t n)
+{
+    int i;
+
+    for (i = 0; (i < iovcnt) && (n > 0); i++)
+    {
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+        }
+        else
+        {
+            size_t ncopy;
+
+            ncopy = iov[i].iov_len - skip;
+            if (ncopy > n)
+            {
+                ncopy = n;
+            }
+            memcpy((uint8_t *)iov[i].iov_base + skip, src, ncopy);
+            src += ncopy;
+            skip = 0;
+            n -= ncopy;
+        }
+    }
+}
+
+/* Take up to rx_stage_size bytes from the chip in one burst. */
+static
+uint16_t rx_stage_fill(struct w5100_socket *s)
+{
+    struct iovec iov;
+
+    iov.iov_base = s->rx_stage;
+    iov.iov_len = s->rx_stage_size;
+    s->rx_stage_start = 0;
+    s->rx_stage_len = read_buf(s->isocket, &iov, 1, 0, s->rx_stage_size, 0);
+
+    return s->rx_stage_len;
+}
+
+/* Like read_buf, through the read-ahead buffer of s.
+ * Small reads are served from RAM, refilled when empty;
+ * reads as big as the buffer go straight to the chip.
+ * With MSG_PEEK data is only looked at, in RAM if there is some.
+ */
 static
-uint16_t write_buf_len(int isocket)
+uint16_t rx_stage_read(struct w5100_socket *s, const struct iovec *iov, int iovcnt, size_t skip, size_t len, int flags)
+{
+    uint16_t ret;
+
+    ret = 0;
+    while (len > 0)
+    {
+        uint16_t n;
+
+        if (s->rx_stage_len == 0)
+        {
+            if (len >= s->rx_stage_size)
+            {
+                ret += read_buf(s->isocket, iov, iovcnt, skip + ret, len, flags);
+                break;
+            }
+            else if (rx_stage_fill(s) == 0)
+            {
+                break;
+            }
+        }
+        n = (len > s->rx_stage_len) ? s->rx_stage_len : (uint16_t)len;
+        w5100_iov_fill(iov, iovcnt, skip + ret, &s->rx_stage[s->rx_stage_start], n);
+        ret += n;
+        len -= n;
+        if (flags & MSG_PEEK)
+        {
+            break;
+        }
+        s->rx_stage_start += n;
+        s->rx_stage_len -= n;
+        if (s->rx_stage_len == 0)
+        {
+            /* no more POLLIN from RAM */
+            poll_invalidate(s);
+        }
+    }
+    return ret;
+}
+
+uint16_t w5100_write_buf_len(int isocket)
 {
     uint16_t nfree;
 
-    w5100_read_sock_regx(W5100_Sn_TX_FSR, isocket, &nfree);
+    w5x00_read_sock_regx(W5100_Sn_TX_FSR, isocket, &nfree);
     nfree = ntohs(nfree);
+    /* the chip does not know about data not sent yet */
+    nfree -= get_socket_from_isocket(isocket)->tx_pending;
 
     return nfree;
 }
 
-static
-uint16_t write_buf_pstart(int isocket)
+uint16_t w5100_write_buf_pstart(int isocket)
 {
-    uint16_t pwrite;
+    return shadow_get(isocket)->tx_wr;
+}
 
-    w5100_read_sock_regx(W5100_Sn_TX_WR, isocket, &pwrite);
-    pwrite = ntohs(pwrite);
+static
+void tx_flush(struct w5100_socket *s)
+{
+    if (s->tx_pending > 0)
+    {
+        uint16_t tx_wr;
 
-    return pwrite;
+        tx_wr = htons(s->tx_wr);
+        w5x00_write_sock_regx(W5100_Sn_TX_WR, s->isocket, &tx_wr);
+        w5100_command(s->isocket,
+                s->dgram_send_mac ? W5100_CMD_SEND_MAC : W5100_CMD_SEND);
+        s->tx_pending = 0;
+    }
 }
 
+/* Send coalesced data that has been waiting too long. */
 static
-void write_buf_send(int isocket, uint16_t pstop)
+void tx_flush_check(struct w5100_socket *s)
 {
-    pstop = htons(pstop);
-    w5100_write_sock_regx(W5100_Sn_TX_WR, isocket, &pstop);
-    w5100_command(isocket, W5100_CMD_SEND);
+    if ((s->tx_pending > 0) && w5100_timeout_ended(&s->tx_pending_tom))
+    {
+        tx_flush(s);
+    }
 }
 
 static
-void write_buf_sure(int isocket, const void *buf, size_t len, uint16_t *pwrite)
+int tx_coalescing(const struct w5100_socket *s)
 {
-    uint16_t offset;
-    uint16_t phys;
-    uint16_t towrite1;
-    uint16_t towrite2;
-    const uint8_t *bytes = buf;
-    
-    offset = *pwrite & get_tx_mask(isocket);
-    phys = offset + get_tx_base(isocket);
-    if (len + offset > get_tx_size(isocket))
+    return (s->type == SOCK_STREAM) && (s->tcp_cork || !s->tcp_nodelay);
+}
+
+void w5100_write_buf_send(int isocket, uint16_t pstop)
+{
+    struct w5100_socket *s;
+    uint16_t threshold;
+
+    s = shadow_get(isocket);
+    poll_invalidate(s);
+    if (s->tx_pending == 0)
     {
-        towrite1 = get_tx_size(isocket) - offset;
-        towrite2 = len - towrite1;
+        w5100_timeout_init(&tx_coalesce_timeout, &s->tx_pending_tom);
     }
-    else
+    s->tx_pending += (uint16_t)(pstop - s->tx_wr);
+    s->tx_wr = pstop;
+
+    threshold = w5x00_chip.get_tx_size(isocket) / 2;
+    if (threshold > W5100_TCP_COALESCE_THRESHOLD)
     {
-        towrite1 = len;
-        towrite2 = 0;
+        threshold = W5100_TCP_COALESCE_THRESHOLD;
     }
-    if (towrite1 > 0)
+    if (
+            !tx_coalescing(s)
+            ||
+            (s->tx_pending >= threshold)
+            ||
+            w5100_timeout_ended(&s->tx_pending_tom)
+       )
     {
-        w5100_write_mem(phys, &bytes[0], towrite1);
+        tx_flush(s);
     }
-    if (towrite2 > 0)
+}
+
+void w5100_write_buf_sure(int isocket, const void *buf, size_t len, uint16_t *pwrite)
+{
+    if (len > 0)
     {
-        w5100_write_mem(get_tx_base(isocket), &bytes[towrite1], towrite2);
+        w5x00_chip.write_tx(isocket, *pwrite, buf, len);
     }
     *pwrite += len;
 }
 
+/* Gather len bytes of the io vector into the TX buffer,
+ * starting after the first skip bytes.
+ */
+void w5100_write_buf_sure_iov(int isocket, const struct iovec *iov, int iovcnt, size_t skip, size_t len, uint16_t *pwrite)
+{
+    int i;
+
+    for (i = 0; (i < iovcnt) && (len > 0); i++)
+    {
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+        }
+        else
+        {
+            size_t n;
+
+            n = iov[i].iov_len - skip;
+            if (n > len)
+            {
+                n = len;
+            }
+            w5100_write_buf_sure(isocket, (const uint8_t *)iov[i].iov_base + skip, n, pwrite);
+            skip = 0;
+            len -= n;
+        }
+    }
+}
+
 static
-uint16_t write_buf(int isocket, const void *buf, size_t len)
+uint16_t write_buf(int isocket, const struct iovec *iov, int iovcnt, size_t skip, size_t len)
 {
     uint16_t nfree;
 
-    nfree = write_buf_len(isocket);
+    nfree = w5100_write_buf_len(isocket);
     if (nfree > 0)
     {
         uint16_t pwrite;
@@ -1056,25 +2069,98 @@ uint16_t write_buf(int isocket, const void *buf, size_t len)
         {
             len = nfree;
         }
-        pwrite = write_buf_pstart(isocket);
-        write_buf_sure(isocket, buf, len, &pwrite);
-        write_buf_send(isocket, pwrite);
+        pwrite = w5100_write_buf_pstart(isocket);
+        w5100_write_buf_sure_iov(isocket, iov, iovcnt, skip, len, &pwrite);
+        w5100_write_buf_send(isocket, pwrite);
     }
     else
     {
+        /* make room sending what is held */
+        tx_flush(get_socket_from_isocket(isocket));
         len = 0;
     }
     return len;
 }
 
-ssize_t recvfrom(int sockfd, void *__restrict buf, size_t len, int flags,
-        struct sockaddr *__restrict address, socklen_t *__restrict address_len)
+/* Fill the source of msg from the header of a datagram.
+ * \retval length of the datagram.
+ */
+uint16_t w5100_dgram_header_get(const uint8_t *header, struct msghdr *msg)
+{
+    uint16_t msg_len;
+
+    if (msg->msg_name != NULL)
+    {
+        struct sockaddr_in *peer;
+        /* TODO: check msg_namelen in input and truncate in case */
+
+        peer = (struct sockaddr_in *)msg->msg_name;
+        peer->sin_family = AF_INET;
+        memcpy(&peer->sin_addr.s_addr, &header[0], 4);
+        memcpy(&peer->sin_port, &header[4], 2);
+        msg->msg_namelen = sizeof(struct sockaddr_in);
+    }
+    memcpy(&msg_len, &header[6], 2);
+
+    return ntohs(msg_len);
+}
+
+/* Read the datagram at *pread, that is moved past it.
+ * \retval bytes copied in msg, up to len.
+ */
+static
+uint16_t read_dgram(int isocket, struct msghdr *msg, size_t len, uint16_t *pread)
+{
+    uint8_t header[W5100_UDP_HEADER_SIZE];
+    uint16_t msg_len;
+    uint16_t tocopy;
+
+    w5100_read_buf_sure(isocket, header, sizeof(header), pread);
+    msg_len = w5100_dgram_header_get(header, msg);
+    if (msg_len > len)
+    {
+        /* discard the rest of the datagram */
+        tocopy = len;
+        msg->msg_flags |= MSG_TRUNC;
+    }
+    else
+    {
+        tocopy = msg_len;
+    }
+    read_buf_sure_iov(isocket, msg->msg_iov, msg->msg_iovlen, 0, tocopy, pread);
+    *pread += msg_len - tocopy;
+
+    return tocopy;
+}
+
+size_t w5100_iov_len_get(const struct iovec *iov, int iovcnt)
+{
+    size_t len;
+    int i;
+
+    len = 0;
+    for (i = 0; i < iovcnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
     ssize_t ret;
     struct w5100_socket *s;
+    size_t len;
 
-    (void)flags; /* TODO */
+    len = w5100_iov_len_get(msg->msg_iov, msg->msg_iovlen);
+    msg->msg_flags = 0;
 
+    if ((file_struct_get(sockfd) != NULL)
+            && (file_struct_get(sockfd)->status_flags & O_NONBLOCK))
+    {
+        /* The accepted fd decides, not the socket it was accepted on. */
+        flags |= MSG_DONTWAIT;
+    }
     s = get_socket_from_fd(sockfd);
     if (s == NULL)
     {
@@ -1089,7 +2175,7 @@ ssize_t recvfrom(int sockfd, void *__restrict buf, size_t len, int flags,
             )
     {
         errno = ENOTCONN;
-        ret = 1;
+        ret = -1;
     }
     else if (
             (s->type == SOCK_DGRAM)
@@ -1100,22 +2186,51 @@ ssize_t recvfrom(int sockfd, void *__restrict buf, size_t len, int flags,
             )
     {
         errno = ENOTCONN;
-        ret = 1;
+        ret = -1;
     }
     else if (len == 0)
     {
         ret = 0;
     }
+    else if ((s->type == SOCK_STREAM) && s->shut_rd)
+    {
+        ret = 0;
+    }
+#ifdef W5100_MACRAW
+    else if (is_soft(s))
+    {
+        struct mmsghdr mmsg;
+
+        mmsg.msg_hdr = *msg;
+        ret = w5100_macraw_recvmmsg(s, &mmsg, 1, flags, &s->recv_timeout);
+        if (ret == 1)
+        {
+            *msg = mmsg.msg_hdr;
+            ret = mmsg.msg_len;
+        }
+    }
+#endif
     else
     {
         struct timeout_manager tom;
         int nonblock;
+        size_t ntotal;
 
-        nonblock = s->fd_data->status_flags & O_NONBLOCK;
-
-        if (!nonblock)
+        nonblock = flags & MSG_DONTWAIT;
+        if (nonblock)
+        {
+            /* return what is there */
+            flags &= ~MSG_WAITALL;
+        }
+        else
         {
-            timeout_init(&s->recv_timeout, &tom);
+            w5100_timeout_init(&s->recv_timeout, &tom);
+        }
+        ntotal = 0;
+        if (!s->tcp_cork)
+        {
+            /* the peer might be waiting for it to answer */
+            tx_flush(s);
         }
         do
         {
@@ -1123,321 +2238,1471 @@ ssize_t recvfrom(int sockfd, void *__restrict buf, size_t len, int flags,
             {
                 uint16_t nread;
 
-                nread = read_buf(s->isocket, buf, len);
-                if (nread != 0)
+                tx_flush_check(s);
+
+                nread = rx_stage_read(s, msg->msg_iov, msg->msg_iovlen, ntotal, len - ntotal, flags);
+                ntotal += nread;
+                if (
+                        (nread != 0)
+                        &&
+                        (
+                            (ntotal == len)
+                            ||
+                            !(flags & MSG_WAITALL)
+                            ||
+                            (flags & MSG_PEEK)
+                        )
+                   )
                 {
-                    (void)address; /* TODO: fill */
-                    (void)address_len; /* TODO: fill */
-                    ret = nread;
+                    /* TODO: fill msg_name */
+                    ret = ntotal;
                     break;
                 }
-                else if (manage_disconnect(s) == -1)
+                else if (nread == 0)
                 {
-                    /* TODO: return 0 on orderly shutdown */
-                    ret = -1;
-                    break;
+                    int status;
+
+                    status = stream_status(s);
+                    if ((status != 0) && (w5100_read_buf_len(s->isocket) > 0))
+                    {
+                        /* arrived before the FIN, all there will be */
+                        flags &= ~MSG_WAITALL;
+                        continue;
+                    }
+                    else if (status == 1)
+                    {
+                        /* 0 at end of stream */
+                        ret = ntotal;
+                        break;
+                    }
+                    else if (status == -1)
+                    {
+                        if (ntotal > 0)
+                        {
+                            ret = ntotal;
+                        }
+                        else
+                        {
+                            errno = ECONNRESET;
+                            ret = -1;
+                        }
+                        break;
+                    }
                 }
             }
             else if (s->type == SOCK_DGRAM)
             {
                 uint16_t toread;
-                uint8_t header[8];
 
-                toread = read_buf_len(s->isocket);
+                toread = w5100_read_buf_len(s->isocket);
 
-                if (toread >= sizeof(header))
+                if (toread >= W5100_UDP_HEADER_SIZE)
                 {
                     uint16_t pread;
-                    uint16_t msg_len;
 
-                    pread = read_buf_pstart(s->isocket);
-                    read_buf_sure(s->isocket, header, sizeof(header), &pread);
-                    if ((address != NULL) && (address_len != NULL))
+                    pread = w5100_read_buf_pstart(s->isocket);
+                    ret = read_dgram(s->isocket, msg, len, &pread);
+                    if (!(flags & MSG_PEEK))
                     {
-                        struct sockaddr_in *peer;
-                        /* TODO: check address_len in input and truncate in case */
-                        
-                        peer = (struct sockaddr_in *)address;
-                        memcpy(&peer->sin_addr.s_addr, &header[0], 4);
-                        memcpy(&peer->sin_port, &header[4], 2);
-                        *address_len = sizeof(struct sockaddr_in);
+                        w5100_read_buf_recv(s->isocket, pread);
                     }
-                    memcpy(&msg_len, &header[6], 2);
-                    msg_len = ntohs(msg_len);
-                    read_buf_sure(s->isocket, buf, msg_len, &pread);
-                    read_buf_recv(s->isocket, pread);
-                    ret = msg_len;
                     break;
                 }
             }
             if (nonblock)
             {
-                ret = -1;
-                errno = EAGAIN;
+                if (ntotal > 0)
+                {
+                    ret = ntotal;
+                }
+                else
+                {
+                    ret = -1;
+                    errno = EAGAIN;
+                }
                 break;
             }
-            else if (timeout_ended(&tom))
+            else if (w5100_timeout_ended(&tom))
             {
-                ret = -1;
-                break;
+                if (flags & MSG_WAITALL)
+                {
+                    /* last round with what is there */
+                    flags &= ~MSG_WAITALL;
+                    nonblock = 1;
+                }
+                else
+                {
+                    ret = (ntotal > 0) ? (ssize_t)ntotal : -1;
+                    break;
+                }
+            }
+            else
+            {
+                w5100_events_wait(1U << s->isocket, W5100_INT_RECV|W5100_INT_DISCON|W5100_INT_TIMEOUT, &tom);
             }
         } while(1);
     }
+    if (s != NULL)
+    {
+        stats_result(s, ret, flags, (flags & MSG_PEEK) ? NULL : &s->stats.bytes_in);
+    }
     return ret;
 }
 
-ssize_t send(int sockfd, const void *buf, size_t len, int flags)
+ssize_t recvfrom(int sockfd, void *__restrict buf, size_t len, int flags,
+        struct sockaddr *__restrict address, socklen_t *__restrict address_len)
 {
     ssize_t ret;
-    struct w5100_socket *s;
+    struct iovec iov;
+    struct msghdr msg;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_name = ((address != NULL) && (address_len != NULL)) ? address : NULL;
+    msg.msg_namelen = (address_len != NULL) ? *address_len : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    msg.msg_flags = 0;
+
+    ret = recvmsg(sockfd, &msg, flags);
+    if ((ret != -1) && (msg.msg_name != NULL))
+    {
+        *address_len = msg.msg_namelen;
+    }
+    return ret;
+}
+
+/* Take the datagrams in the RX buffer, up to vlen,
+ * with a single update of Sn_RX_RD at the end.
+ * With MSG_PEEK only the first one is looked at.
+ * \retval number of datagrams taken.
+ */
+static
+int read_dgrams(int isocket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    int ret;
+    uint16_t toread;
+    uint16_t pstart;
+    uint16_t pread;
+
+    toread = w5100_read_buf_len(isocket);
+    pstart = w5100_read_buf_pstart(isocket);
+    pread = pstart;
+    ret = 0;
+    while (
+            ((unsigned int)ret < vlen)
+            &&
+            ((uint16_t)(pread - pstart) + W5100_UDP_HEADER_SIZE <= toread)
+          )
+    {
+        struct msghdr *msg;
+
+        msg = &msgvec[ret].msg_hdr;
+        msg->msg_flags = 0;
+        msgvec[ret].msg_len = read_dgram(isocket, msg, w5100_iov_len_get(msg->msg_iov, msg->msg_iovlen), &pread);
+        ret++;
+        if (flags & MSG_PEEK)
+        {
+            break;
+        }
+    }
+    if ((ret > 0) && !(flags & MSG_PEEK))
+    {
+        w5100_read_buf_recv(isocket, pread);
+    }
+    return ret;
+}
 
-    (void)flags; /* TODO */
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+        struct timespec *timeout)
+{
+    int ret;
+    struct w5100_socket *s;
 
+    if ((file_struct_get(sockfd) != NULL)
+            && (file_struct_get(sockfd)->status_flags & O_NONBLOCK))
+    {
+        flags |= MSG_DONTWAIT;
+    }
     s = get_socket_from_fd(sockfd);
     if (s == NULL)
     {
         ret = -1;
     }
-    else if (s->type == SOCK_DGRAM)
-    {
-        if (s->dest_address.sin_family == AF_UNSPEC)
-        {
-            errno = EDESTADDRREQ;
-            ret = -1;
-        }
-        else
-        {
-            ret = sendto(sockfd, buf, len, flags, (const struct sockaddr *)&s->dest_address, sizeof(s->dest_address));
-        }
-    }
-    else if (s->type != SOCK_STREAM) /* RAW */
+    else if (s->type != SOCK_DGRAM)
     {
-        errno = EDESTADDRREQ;
+        /* TODO: streams */
+        errno = EOPNOTSUPP;
         ret = -1;
     }
     else if (
-            (s->state != W5100_SOCK_STATE_ACCEPTED)
+            (s->state != W5100_SOCK_STATE_BOUND)
             &&
-            (s->state != W5100_SOCK_STATE_CONNECTED)
+            (s->state != W5100_SOCK_STATE_CREATED)
             )
     {
         errno = ENOTCONN;
-        ret = 1;
+        ret = -1;
+    }
+    else if (vlen == 0)
+    {
+        ret = 0;
+    }
+#ifdef W5100_MACRAW
+    else if (is_soft(s))
+    {
+        ret = w5100_macraw_recvmmsg(s, msgvec, vlen, flags, (timeout != NULL) ? timeout : &s->recv_timeout);
     }
+#endif
     else
     {
-        size_t towrite;
         struct timeout_manager tom;
-        const uint8_t *bytes;
         int nonblock;
 
-        nonblock = s->fd_data->status_flags & O_NONBLOCK;
-        towrite = len;
-        bytes = buf;
+        nonblock = flags & MSG_DONTWAIT;
         if (!nonblock)
         {
-            timeout_init(&s->send_timeout, &tom);
+            w5100_timeout_init((timeout != NULL) ? timeout : &s->recv_timeout, &tom);
         }
-
-        while (towrite > 0)
+        do
         {
-            size_t written;
-
-            written = write_buf(s->isocket, bytes, towrite);
-            if (written > 0)
-            {
-                bytes += written;
-                towrite -= written;
-                if (nonblock)
-                {
-                    break;
-                }
-            }
-            else if (manage_disconnect(s) == -1)
+            ret = read_dgrams(s->isocket, msgvec, vlen, flags);
+            if (ret > 0)
             {
-                ret = -1;
                 break;
             }
             else if (nonblock)
             {
                 errno = EAGAIN;
+                ret = -1;
                 break;
             }
-            else if (timeout_ended(&tom))
+            else if (w5100_timeout_ended(&tom))
             {
+                ret = -1;
                 break;
             }
+            else
+            {
+                w5100_events_wait(1U << s->isocket, W5100_INT_RECV|W5100_INT_TIMEOUT, &tom);
+            }
+        } while(1);
+    }
+    if (s != NULL)
+    {
+        ssize_t n;
+        int i;
+
+        n = ret;
+        if (ret > 0)
+        {
+            n = 0;
+            for (i = 0; i < ret; i++)
+            {
+                n += msgvec[i].msg_len;
+            }
         }
-        ret = len - towrite;
+        stats_result(s, n, flags, (flags & MSG_PEEK) ? NULL : &s->stats.bytes_in);
     }
     return ret;
 }
 
-ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
-        const struct sockaddr *dest_address, socklen_t dest_len)
+static
+ssize_t send_stream(struct w5100_socket *s, const struct iovec *iov, int iovcnt, size_t len, int flags)
 {
     ssize_t ret;
-    struct w5100_socket *s;
+    size_t towrite;
+    struct timeout_manager tom;
+    int nonblock;
 
-    s = get_socket_from_fd(sockfd);
-    if (s == NULL)
+    nonblock = flags & MSG_DONTWAIT;
+    towrite = len;
+    if (!nonblock)
     {
-        ret = -1;
+        w5100_timeout_init(&s->send_timeout, &tom);
     }
-    else if (s->type == SOCK_STREAM)
+
+    ret = 0;
+    while (towrite > 0)
     {
-        (void)dest_address; /* ignore */
-        (void)dest_len; /* ignore */
-        ret = send(sockfd, buf, len, flags);
+        size_t written;
+
+        written = write_buf(s->isocket, iov, iovcnt, len - towrite, towrite);
+        if (written > 0)
+        {
+            towrite -= written;
+            if (nonblock)
+            {
+                break;
+            }
+        }
+        else if (stream_status(s) == -1)
+        {
+            errno = ECONNRESET;
+            ret = -1;
+            break;
+        }
+        else if (nonblock)
+        {
+            errno = EAGAIN;
+            ret = -1;
+            break;
+        }
+        else if (w5100_timeout_ended(&tom))
+        {
+            ret = -1;
+            break;
+        }
+        else
+        {
+            /* room is made when sent data is acknowledged */
+            w5100_events_wait(1U << s->isocket, W5100_INT_SEND_OK|W5100_INT_DISCON|W5100_INT_TIMEOUT, &tom);
+        }
     }
-    else if (s->type == SOCK_DGRAM)
+    if ((ret != -1) || (towrite < len))
     {
-        const struct sockaddr_in *peer;
+        /* an error after some data is for the next call */
+        ret = len - towrite;
+    }
 
-        check_bind_udp(s);
-        peer = (struct sockaddr_in *)dest_address;
+    return ret;
+}
+
+/* Wait for room for len bytes in the TX buffer and, if sent is set,
+ * for the datagram in flight to be gone: the destination registers
+ * can not change before.
+ */
+int w5100_dgram_wait(struct w5100_socket *s, size_t len, int sent, int nonblock, const struct timeout_manager *tom)
+{
+    int ret;
+    const uint8_t done = W5100_INT_SEND_OK|W5100_INT_TIMEOUT;
 
-        if (len > get_tx_size(s->isocket))
+    w5100_events_update();
+    if (s->events & done)
+    {
+        s->events &= ~done;
+        s->dgram_in_flight = 0;
+        poll_invalidate(s);
+    }
+    do
+    {
+        if ((w5100_write_buf_len(s->isocket) >= len) && !(sent && s->dgram_in_flight))
         {
-            errno = EMSGSIZE;
-            ret = -1;
+            ret = 0;
+            break;
         }
-        else if (dest_address == NULL)
+        else if (nonblock)
         {
-            errno = EDESTADDRREQ;
+            errno = EAGAIN;
             ret = -1;
+            break;
         }
-        else if ((peer->sin_addr.s_addr == INADDR_BROADCAST) && !s->can_broadcast)
+        else if (w5100_timeout_ended(tom))
         {
-            errno = EINVAL;
             ret = -1;
+            break;
         }
-        else
+        else if (w5100_events_wait(1U << s->isocket, done, tom) != 0)
         {
-            struct timeout_manager tom;
-            int nonblock;
+            s->dgram_in_flight = 0;
+        }
+    } while(1);
+    return ret;
+}
 
-            nonblock = s->fd_data->status_flags & O_NONBLOCK;
-            if (!nonblock)
-            {
-                timeout_init(&s->send_timeout, &tom);
-            }
-            do
-            {
-                if (write_buf_len(s->isocket) >= len)
-                {
-                    w5100_write_sock_regx(W5100_Sn_DIPR, s->isocket, &peer->sin_addr.s_addr);
-                    w5100_write_sock_regx(W5100_Sn_DPORT, s->isocket, &peer->sin_port);
+/* Sn_DIPR, Sn_DPORT, Sn_DHAR and Sn_TTL are written only when
+ * the destination changes.
+ */
+static
+void dgram_dest_set(struct w5100_socket *s, const struct sockaddr_in *peer)
+{
+    int multicast;
+    uint8_t ttl;
 
-                    ret = write_buf(s->isocket, buf, len);
-                    break;
-                }
-                else if (nonblock)
-                {
-                    errno = EAGAIN;
-                    ret = 1;
-                    break;
-                }
-                else if (timeout_ended(&tom))
-                {
-                    ret = -1;
-                    break;
-                }
-            } while(1); /* TODO: non blocking */
+    multicast = IN_MULTICAST(ntohl(peer->sin_addr.s_addr));
+    if (
+            !s->dgram_dest_valid
+            ||
+            (s->dgram_dest.sin_addr.s_addr != peer->sin_addr.s_addr)
+            ||
+            (s->dgram_dest.sin_port != peer->sin_port)
+       )
+    {
+        w5x00_write_sock_regx(W5100_Sn_DIPR, s->isocket, &peer->sin_addr.s_addr);
+        w5x00_write_sock_regx(W5100_Sn_DPORT, s->isocket, &peer->sin_port);
+        /* a member socket has the group MAC address since OPEN */
+        s->dgram_send_mac = multicast && !s->mc_joined;
+        if (s->dgram_send_mac)
+        {
+            uint8_t mac[W5100_Sn_DHAR_SIZE];
+
+            w5100_mc_mac_get(peer->sin_addr.s_addr, mac);
+            w5x00_write_sock_regx(W5100_Sn_DHAR, s->isocket, mac);
         }
+        s->dgram_dest = *peer;
+        s->dgram_dest_valid = 1;
     }
-    else /* TODO: RAW */
+    ttl = multicast ? s->mc_ttl : W5100_IP_TTL;
+    if (ttl != s->ttl)
     {
-        errno = EBADF;
-        ret = -1;
+        w5x00_write_sock_reg(W5100_Sn_TTL, s->isocket, ttl);
+        s->ttl = ttl;
+    }
+}
+
+/* Largest datagram that send_dgram takes for s. */
+static
+size_t dgram_max(const struct w5100_socket *s)
+{
+    size_t ret;
+
+    if (is_soft(s))
+    {
+        /* no fragments */
+        ret = W5100_MTU - W5100_IP_HEADER_SIZE - W5100_UDP_HDR_SIZE;
+    }
+    else
+    {
+        ret = get_tx_size(s->isocket);
     }
     return ret;
 }
 
 static
-short w5100_sock_poll_rw(int isocket)
+ssize_t send_dgram(struct w5100_socket *s, const struct iovec *iov, int iovcnt, size_t len,
+        const struct sockaddr_in *peer, int flags)
 {
-    short ret;
-    uint16_t toread;
-    uint16_t towrite;
+    ssize_t ret;
 
-    toread = read_buf_len(isocket);
-    towrite = write_buf_len(isocket);
+    check_bind_udp(s);
 
-    ret = 0;
-    if (toread > 0)
+    if (len > dgram_max(s))
     {
-        ret |= POLLRDNORM|POLLIN;
+        errno = EMSGSIZE;
+        ret = -1;
     }
-    if (towrite > 0)
+    else if ((peer->sin_addr.s_addr == INADDR_BROADCAST) && !s->can_broadcast)
     {
-        ret |= POLLWRNORM|POLLOUT;
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (s->mc_joined && (peer->sin_addr.s_addr != s->mc_group.s_addr))
+    {
+        /* in multicast mode the chip sends to the group only */
+        errno = EINVAL;
+        ret = -1;
     }
+#ifdef W5100_MACRAW
+    else if (is_soft(s))
+    {
+        ret = w5100_macraw_send_dgram(s, iov, iovcnt, len, peer, flags);
+    }
+#endif
+    else
+    {
+        struct timeout_manager tom;
+        int nonblock;
+
+        nonblock = flags & MSG_DONTWAIT;
+        if (!nonblock)
+        {
+            w5100_timeout_init(&s->send_timeout, &tom);
+        }
+        ret = w5100_dgram_wait(s, len, 0, nonblock, &tom);
+        if (ret == 0)
+        {
+            uint16_t pwrite;
 
+            /* written past Sn_TX_WR while the previous datagram goes */
+            pwrite = w5100_write_buf_pstart(s->isocket);
+            w5100_write_buf_sure_iov(s->isocket, iov, iovcnt, 0, len, &pwrite);
+            ret = w5100_dgram_wait(s, len, 1, nonblock, &tom);
+            if (ret == 0)
+            {
+                dgram_dest_set(s, peer);
+                w5100_write_buf_send(s->isocket, pwrite);
+                s->dgram_in_flight = 1;
+                ret = len;
+            }
+        }
+    }
     return ret;
 }
 
-static
-short w5100_sock_poll(int fd)
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
 {
-    int ret;
+    ssize_t ret;
     struct w5100_socket *s;
+    size_t len;
 
-    s = get_socket_from_fd(fd);
+    len = w5100_iov_len_get(msg->msg_iov, msg->msg_iovlen);
+
+    if ((file_struct_get(sockfd) != NULL)
+            && (file_struct_get(sockfd)->status_flags & O_NONBLOCK))
+    {
+        /* The accepted fd decides, not the socket it was accepted on. */
+        flags |= MSG_DONTWAIT;
+    }
+    s = get_socket_from_fd(sockfd);
     if (s == NULL)
     {
-        ret = POLLNVAL;
+        ret = -1;
     }
-    else if(s->state == W5100_SOCK_STATE_LISTENING)
+    else if (s->type == SOCK_DGRAM)
     {
-        uint8_t sr;
-
-        sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-        if (sr == W5100_SOCK_ESTABLISHED)
+        if (msg->msg_name != NULL)
         {
-            ret = POLLRDNORM|POLLIN;
+            ret = send_dgram(s, msg->msg_iov, msg->msg_iovlen, len, msg->msg_name, flags);
+        }
+        else if (s->dest_address.sin_family == AF_UNSPEC)
+        {
+            errno = EDESTADDRREQ;
+            ret = -1;
         }
         else
         {
-            ret = 0;
+            ret = send_dgram(s, msg->msg_iov, msg->msg_iovlen, len, &s->dest_address, flags);
         }
     }
+    else if (s->type != SOCK_STREAM) /* TODO: RAW */
+    {
+        errno = EDESTADDRREQ;
+        ret = -1;
+    }
     else if (
-                (s->type == SOCK_STREAM) &&
-                (
-                    (s->state == W5100_SOCK_STATE_CONNECTED) ||
-                    (s->state == W5100_SOCK_STATE_ACCEPTED)
-                )
+            (s->state != W5100_SOCK_STATE_ACCEPTED)
+            &&
+            (s->state != W5100_SOCK_STATE_CONNECTED)
             )
     {
-        uint8_t sr;
+        errno = ENOTCONN;
+        ret = -1;
+    }
+    else if (s->shut_wr)
+    {
+        errno = EPIPE;
+        ret = -1;
+    }
+    else
+    {
+        /* destination of msg ignored */
+        ret = send_stream(s, msg->msg_iov, msg->msg_iovlen, len, flags);
+    }
+    if (s != NULL)
+    {
+        stats_result(s, ret, flags, &s->stats.bytes_out);
+    }
+    return ret;
+}
+
+struct file_sink {
+    int isocket;
+    uint16_t pwrite;
+};
 
-        sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+static
+size_t file_sink_write(const void *buf, size_t len, void *arg)
+{
+    struct file_sink *sink;
 
-        if (sr != W5100_SOCK_ESTABLISHED)
-        {
-            ret = POLLHUP;
-        }
-        else
+    sink = arg;
+    w5100_write_buf_sure(sink->isocket, buf, len, &sink->pwrite);
+
+    return len;
+}
+
+/* Move len bytes of in_fd, from its position, into the TX buffer
+ * and send them. len must fit in the free space.
+ * \retval bytes moved, 0 at end of file, -1 on read error.
+ */
+static
+ssize_t write_buf_file(int isocket, int in_fd, size_t len)
+{
+    ssize_t ret;
+    struct fd *f;
+    struct file_sink sink;
+
+    sink.isocket = isocket;
+    sink.pwrite = w5100_write_buf_pstart(isocket);
+    f = file_struct_get(in_fd);
+    if ((f == NULL) || !(f->isopen) || (f->read == NULL))
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else if (f->forward != NULL)
+    {
+        ret = f->forward(in_fd, file_sink_write, &sink, len);
+    }
+    else
+    {
+        uint8_t buf[W5100_SENDFILE_BUF];
+
+        ret = 0;
+        while ((size_t)ret < len)
         {
-            ret = w5100_sock_poll_rw(s->isocket);
+            ssize_t nread;
+            size_t n;
+
+            n = len - ret;
+            if (n > sizeof(buf))
+            {
+                n = sizeof(buf);
+            }
+            nread = f->read(in_fd, (char *)buf, n);
+            if (nread <= 0)
+            {
+                if (ret == 0)
+                {
+                    ret = nread;
+                }
+                break;
+            }
+            (void)file_sink_write(buf, nread, &sink);
+            ret += nread;
         }
     }
-    else if (
-                (s->type == SOCK_DGRAM) &&
-                (
-                    (s->state == W5100_SOCK_STATE_CONNECTED) ||
-                    (s->state == W5100_SOCK_STATE_BOUND)
-                )
-            )
+    if (ret > 0)
     {
-        ret = w5100_sock_poll_rw(s->isocket);
+        w5100_write_buf_send(isocket, sink.pwrite);
     }
-    else
+    return ret;
+}
+
+/* The file is read in chunks of half the TX buffer at most,
+ * so that a chunk is read while the chip sends the previous one.
+ */
+static
+ssize_t send_file(struct w5100_socket *s, int in_fd, size_t count, int flags)
+{
+    ssize_t ret;
+    size_t towrite;
+    uint16_t chunk_max;
+    struct timeout_manager tom;
+    int nonblock;
+
+    nonblock = flags & MSG_DONTWAIT;
+    towrite = count;
+    if (!nonblock)
+    {
+        w5100_timeout_init(&s->send_timeout, &tom);
+    }
+    chunk_max = w5x00_chip.get_tx_size(s->isocket) / 2;
+
+    ret = 0;
+    while (towrite > 0)
+    {
+        uint16_t nfree;
+
+        nfree = w5100_write_buf_len(s->isocket);
+        if (nfree > chunk_max)
+        {
+            nfree = chunk_max;
+        }
+        if (nfree > 0)
+        {
+            ssize_t written;
+
+            written = write_buf_file(s->isocket, in_fd, (towrite < nfree) ? towrite : nfree);
+            if (written > 0)
+            {
+                towrite -= written;
+            }
+            else
+            {
+                if ((written == -1) && (towrite == count))
+                {
+                    ret = -1;
+                }
+                /* end of file */
+                break;
+            }
+        }
+        else
+        {
+            /* make room sending what is held */
+            tx_flush(s);
+            if (stream_status(s) == -1)
+            {
+                if (towrite == count)
+                {
+                    errno = ECONNRESET;
+                    ret = -1;
+                }
+                break;
+            }
+            else if (nonblock)
+            {
+                if (towrite == count)
+                {
+                    errno = EAGAIN;
+                    ret = -1;
+                }
+                break;
+            }
+            else if (w5100_timeout_ended(&tom))
+            {
+                break;
+            }
+            else
+            {
+                w5100_events_wait(1U << s->isocket, W5100_INT_SEND_OK|W5100_INT_DISCON|W5100_INT_TIMEOUT, &tom);
+            }
+        }
+    }
+    if (ret != -1)
+    {
+        ret = count - towrite;
+    }
+
+    return ret;
+}
+
+static
+ssize_t w5100_sock_sendfile(int out_fd, int in_fd, size_t count)
+{
+    ssize_t ret;
+    struct w5100_socket *s;
+    int flags;
+
+    flags = 0;
+    if ((file_struct_get(out_fd) != NULL)
+            && (file_struct_get(out_fd)->status_flags & O_NONBLOCK))
+    {
+        flags |= MSG_DONTWAIT;
+    }
+    s = get_socket_from_fd(out_fd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if (s->type != SOCK_STREAM)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (
+            (s->state != W5100_SOCK_STATE_ACCEPTED)
+            &&
+            (s->state != W5100_SOCK_STATE_CONNECTED)
+            )
+    {
+        errno = ENOTCONN;
+        ret = -1;
+    }
+    else if (s->shut_wr)
+    {
+        errno = EPIPE;
+        ret = -1;
+    }
+    else
+    {
+        ret = send_file(s, in_fd, count, flags);
+    }
+    if (s != NULL)
+    {
+        stats_result(s, ret, flags, &s->stats.bytes_out);
+    }
+    return ret;
+}
+
+/* Datagrams are pipelined by send_dgram: each one is written
+ * in the TX buffer while the previous one is being sent.
+ */
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    int ret;
+    unsigned int i;
+
+    ret = 0;
+    for (i = 0; i < vlen; i++)
+    {
+        ssize_t nsent;
+
+        nsent = sendmsg(sockfd, &msgvec[i].msg_hdr, flags);
+        if (nsent == -1)
+        {
+            if (i == 0)
+            {
+                ret = -1;
+            }
+            break;
+        }
+        msgvec[i].msg_len = nsent;
+        ret++;
+    }
+    return ret;
+}
+
+ssize_t send(int sockfd, const void *buf, size_t len, int flags)
+{
+    return sendto(sockfd, buf, len, flags, NULL, 0);
+}
+
+ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
+        const struct sockaddr *dest_address, socklen_t dest_len)
+{
+    struct iovec iov;
+    struct msghdr msg;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_name = (void *)dest_address;
+    msg.msg_namelen = dest_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    msg.msg_flags = 0;
+
+    return sendmsg(sockfd, &msg, flags);
+}
+
+static
+short w5100_sock_poll_rw(int isocket)
+{
+    short ret;
+    uint16_t toread;
+    uint16_t towrite;
+
+    toread = w5100_read_buf_len(isocket);
+    towrite = w5100_write_buf_len(isocket);
+
+    ret = 0;
+    if (toread > 0)
+    {
+        ret |= POLLRDNORM|POLLIN;
+    }
+    if (towrite > 0)
+    {
+        ret |= POLLWRNORM|POLLOUT;
+    }
+
+    return ret;
+}
+
+static
+void poll_invalidate(struct w5100_socket *s)
+{
+    s->poll_valid[0] = 0;
+    s->poll_valid[1] = 0;
+    poll_notify(s);
+}
+
+/* poll and select ask again about the files of s,
+ * and about the listening socket it accepts connections for.
+ */
+static
+void poll_notify(const struct w5100_socket *s)
+{
+    if (s->fd_data != NULL)
+    {
+        file_notify(s->fd_data->fd);
+    }
+    if (s->connection_data != NULL)
+    {
+        file_notify(s->connection_data->fd);
+    }
+    if ((s->listener != NULL) && (s->listener->fd_data != NULL))
+    {
+        file_notify(s->listener->fd_data->fd);
+    }
+}
+
+/* Forget the poll results of s if something happened to it,
+ * or to the sockets listening for it.
+ */
+static
+void poll_events_take(struct w5100_socket *s)
+{
+    int isocket;
+
+    w5100_events_update();
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        struct w5100_socket *m;
+
+        m = &w5100_sockets[isocket];
+        if (
+                ((m == s) || (s->listening && listen_member(s, m)))
+                &&
+                (m->events != 0)
+           )
+        {
+            m->events = 0;
+            poll_invalidate(s);
+        }
+    }
+}
+
+static
+short w5100_sock_poll_state(struct w5100_socket *s, int fd)
+{
+    int ret;
+
+    if ((s->listening) && (s->fd_data != NULL) && (s->fd_data->fd == fd))
+    {
+        if (listen_ready(s) != NULL)
+        {
+            ret = POLLRDNORM|POLLIN;
+        }
+        else
+        {
+            ret = 0;
+        }
+    }
+    else if ((s->type == SOCK_STREAM) && (s->state == W5100_SOCK_STATE_CONNECTING))
+    {
+        ret = 0;
+    }
+    else if ((s->type == SOCK_STREAM) && (s->so_error != 0))
+    {
+        /* failed connect */
+        ret = POLLERR|POLLHUP|POLLOUT|POLLWRNORM;
+    }
+    else if (
+                (s->type == SOCK_STREAM) &&
+                (
+                    (s->state == W5100_SOCK_STATE_CONNECTED) ||
+                    (s->state == W5100_SOCK_STATE_ACCEPTED)
+                )
+            )
+    {
+        int status;
+
+        status = stream_status(s);
+        if (status == -1)
+        {
+            ret = POLLHUP;
+        }
+        else
+        {
+            ret = w5100_sock_poll_rw(s->isocket);
+            if ((status == 1) || s->shut_rd)
+            {
+                /* recv does not block: returns 0 */
+                ret |= POLLRDNORM|POLLIN;
+                if (s->shut_wr)
+                {
+                    ret |= POLLHUP;
+                }
+            }
+        }
+        if (s->rx_stage_len > 0)
+        {
+            /* already out of the chip */
+            ret |= POLLRDNORM|POLLIN;
+        }
+    }
+    else if (
+                (s->type == SOCK_DGRAM) &&
+                (
+                    (s->state == W5100_SOCK_STATE_CONNECTED) ||
+                    (s->state == W5100_SOCK_STATE_BOUND)
+                )
+            )
+    {
+        ret = w5100_sock_poll_rw(s->isocket);
+    }
+    else
+    {
+        ret = POLLNVAL;
+    }
+
+    return ret;
+}
+
+/* Registers are read only when the socket had some event,
+ * or did something, since its last poll.
+ */
+static
+short w5100_sock_poll(int fd)
+{
+    int ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(fd);
+    if (s == NULL)
+    {
+        ret = POLLNVAL;
+    }
+#ifdef W5100_MACRAW
+    else if (is_soft(s))
+    {
+        s->stats.polls++;
+        ret = w5100_macraw_poll(s);
+    }
+#endif
+    else
+    {
+        int i;
+
+        uint8_t ev;
+
+        s->stats.polls++;
+        i = ((s->fd_data != NULL) && (s->fd_data->fd == fd)) ? 0 : 1;
+        tx_flush_check(s);
+        keepalive_check(s);
+        w5100_events_update();
+        ev = s->events;
+        poll_events_take(s);
+        if (!s->poll_valid[i])
+        {
+            linger_reap();
+            connect_update(s, ev);
+            s->poll_revents[i] = w5100_sock_poll_state(s, fd);
+            s->poll_valid[i] = 1;
+        }
+        ret = s->poll_revents[i];
+    }
+
+    return ret;
+}
+
+/* Before each look of poll and select at the files: socket events
+ * notify the files they are for, and timers are run, so that only
+ * the sockets that changed are polled.
+ */
+void poll_update(void)
+{
+    int isocket;
+
+    w5100_events_update();
+    keepalive_tick();
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        tx_flush_check(&w5100_sockets[isocket]);
+    }
+}
+
+/* poll and select sleep until the chip has something to say,
+ * or their deadline, or the sockets have timers to run;
+ * the registers are looked at again after W5100_EVENT_RECHECK_MS anyway.
+ */
+void poll_idle(const struct timespec *deadline)
+{
+    struct timeout_manager recheck;
+
+    w5100_timeout_init(&event_recheck_timeout, &recheck);
+    if ((deadline != NULL) && (timespec_diff(deadline, &recheck.end, NULL) < 0))
+    {
+        recheck.end = *deadline;
+    }
+    idle_until(&recheck.end);
+}
+
+/* Buffers of sockets in use must not move. */
+static
+int buf_sizes_busy(const uint16_t *old_sizes, const uint16_t *new_sizes, int except)
+{
+    int busy;
+    int isocket;
+    uint16_t old_base;
+    uint16_t new_base;
+
+    busy = 0;
+    old_base = 0;
+    new_base = 0;
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        if (
+                (isocket != except)
+                &&
+                (w5100_sockets[isocket].state != W5100_SOCK_STATE_NONE)
+                &&
+                (
+                    (old_base != new_base)
+                    ||
+                    (old_sizes[isocket] != new_sizes[isocket])
+                )
+           )
+        {
+            busy = 1;
+            break;
+        }
+        old_base += old_sizes[isocket];
+        new_base += new_sizes[isocket];
+    }
+    return busy;
+}
+
+static
+int buf_sizes_set(const uint16_t *tx_sizes, const uint16_t *rx_sizes, int except)
+{
+    int ret;
+    int isocket;
+    uint16_t old_tx_sizes[W5X00_MAX_SOCKETS];
+    uint16_t old_rx_sizes[W5X00_MAX_SOCKETS];
+
+    linger_reap();
+
+    for (isocket = 0; isocket < w5x00_chip.n_sockets; isocket++)
+    {
+        old_tx_sizes[isocket] = w5x00_chip.get_tx_size(isocket);
+        old_rx_sizes[isocket] = w5x00_chip.get_rx_size(isocket);
+    }
+    if (
+            buf_sizes_busy(old_tx_sizes, tx_sizes, except)
+            ||
+            buf_sizes_busy(old_rx_sizes, rx_sizes, except)
+       )
+    {
+        errno = EBUSY;
+        ret = -1;
+    }
+    else if (w5x00_chip.set_buf_sizes(tx_sizes, rx_sizes) != 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        ret = 0;
+    }
+    return ret;
+}
+
+int w5100_socket_set_buf_sizes(const uint16_t *tx_sizes, const uint16_t *rx_sizes)
+{
+    return buf_sizes_set(tx_sizes, rx_sizes, -1);
+}
+
+/* Give the requested buffer size to the socket, taking memory from the
+ * free sockets, starting from the last one.
+ */
+static
+int set_sock_buf_size(struct w5100_socket *s, int value, int is_tx)
+{
+    int ret;
+
+    if (is_soft(s))
+    {
+        /* no buffer in the chip */
+        errno = ENOPROTOOPT;
+        ret = -1;
+    }
+    else if (s->state != W5100_SOCK_STATE_CREATED)
+    {
+        /* the chip is already using the buffer */
+        errno = EBUSY;
+        ret = -1;
+    }
+    else
+    {
+        uint16_t tx_sizes[W5X00_MAX_SOCKETS];
+        uint16_t rx_sizes[W5X00_MAX_SOCKETS];
+        uint16_t *sizes;
+        uint32_t mem_size;
+        uint32_t total;
+        uint16_t size;
+        int i;
+
+        for (i = 0; i < w5x00_chip.n_sockets; i++)
+        {
+            tx_sizes[i] = w5x00_chip.get_tx_size(i);
+            rx_sizes[i] = w5x00_chip.get_rx_size(i);
+        }
+        sizes = is_tx ? tx_sizes : rx_sizes;
+        mem_size = is_tx ? w5x00_chip.tx_mem_size : w5x00_chip.rx_mem_size;
+
+        size = W5100_BUF_SIZE_MIN;
+        while ((size < value) && (size < mem_size))
+        {
+            size <<= 1;
+        }
+        sizes[s->isocket] = size;
+
+        total = 0;
+        for (i = 0; i < w5x00_chip.n_sockets; i++)
+        {
+            total += sizes[i];
+        }
+        for (i = w5x00_chip.n_sockets - 1; (i >= 0) && (total > mem_size); i--)
+        {
+            if ((i != s->isocket) && (w5100_sockets[i].state == W5100_SOCK_STATE_NONE))
+            {
+                while ((total > mem_size) && (sizes[i] > 0))
+                {
+                    uint16_t half;
+
+                    half = (sizes[i] > W5100_BUF_SIZE_MIN) ? (sizes[i] / 2) : 0;
+                    total -= sizes[i] - half;
+                    sizes[i] = half;
+                }
+            }
+        }
+        /* memory left over goes back to free sockets without buffers */
+        for (i = 0; i < w5x00_chip.n_sockets; i++)
+        {
+            if (
+                    (sizes[i] == 0)
+                    &&
+                    (w5100_sockets[i].state == W5100_SOCK_STATE_NONE)
+                    &&
+                    (total + W5100_BUF_SIZE_MIN <= mem_size)
+               )
+            {
+                sizes[i] = W5100_BUF_SIZE_MIN;
+                total += W5100_BUF_SIZE_MIN;
+            }
+        }
+
+        if (total > mem_size)
+        {
+            errno = ENOBUFS;
+            ret = -1;
+        }
+        else
+        {
+            ret = buf_sizes_set(tx_sizes, rx_sizes, s->isocket);
+        }
+    }
+    return ret;
+}
+
+static
+int setsockopt_tcp(struct w5100_socket *s, int option_name, const void *option_value)
+{
+    int ret;
+
+    if (s->type != SOCK_STREAM)
+    {
+        errno = ENOPROTOOPT;
+        ret = -1;
+    }
+    else
+    {
+        switch (option_name)
+        {
+            case TCP_NODELAY:
+                s->tcp_nodelay = ((*(const int *)option_value) != 0);
+                if (s->tcp_nodelay)
+                {
+                    tx_flush(s);
+                }
+                ret = 0;
+                break;
+            case TCP_CORK:
+                s->tcp_cork = ((*(const int *)option_value) != 0);
+                if (!s->tcp_cork)
+                {
+                    tx_flush(s);
+                }
+                ret = 0;
+                break;
+            case TCP_KEEPIDLE:
+            case TCP_KEEPINTVL:
+                if (*(const int *)option_value < 1)
+                {
+                    errno = EINVAL;
+                    ret = -1;
+                }
+                else
+                {
+                    if (option_name == TCP_KEEPIDLE)
+                    {
+                        s->keep_idle = *(const int *)option_value;
+                    }
+                    else
+                    {
+                        s->keep_intvl = *(const int *)option_value;
+                    }
+                    s->keep_armed = 0; /* from now */
+                    ret = 0;
+                }
+                break;
+            case TCP_MAXSEG:
+                if (
+                        (*(const int *)option_value < 1)
+                        ||
+                        (*(const int *)option_value > W5100_TCP_MAXSEG_MAX)
+                   )
+                {
+                    errno = EINVAL;
+                    ret = -1;
+                }
+                else
+                {
+                    /* offered at the next connection */
+                    s->tcp_maxseg = *(const int *)option_value;
+                    tcp_maxseg_set(s);
+                    ret = 0;
+                }
+                break;
+            default:
+                ret = -1;
+                errno = EINVAL;
+                break;
+        }
+    }
+    return ret;
+}
+
+static
+int set_rx_stage_size(struct w5100_socket *s, int value)
+{
+    int ret;
+
+    if (s->type != SOCK_STREAM)
+    {
+        errno = ENOPROTOOPT;
+        ret = -1;
+    }
+    else if ((value < 0) || (value > W5100_RX_STAGE_MAX))
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (s->rx_stage_len > 0)
+    {
+        /* data would be lost */
+        errno = EBUSY;
+        ret = -1;
+    }
+    else
+    {
+        s->rx_stage_size = value;
+        ret = 0;
+    }
+    return ret;
+}
+
+/* The chip joins and leaves groups when the socket is opened and closed. */
+static
+void mc_reopen(struct w5100_socket *s)
+{
+    if (s->state != W5100_SOCK_STATE_CREATED)
+    {
+        w5100_command(s->isocket, W5100_CMD_CLOSE);
+        bind_udp(s, s->sockname.sin_port);
+    }
+}
+
+static
+int setsockopt_ip(struct w5100_socket *s, int option_name, const void *option_value)
+{
+    int ret;
+
+    if (s->type != SOCK_DGRAM)
+    {
+        errno = ENOPROTOOPT;
+        ret = -1;
+    }
+    else
+    {
+        const struct ip_mreq *mreq;
+
+        mreq = option_value;
+        switch (option_name)
+        {
+            case IP_MULTICAST_TTL:
+                if ((*(const int *)option_value < 0) || (*(const int *)option_value > 0xFF))
+                {
+                    errno = EINVAL;
+                    ret = -1;
+                }
+                else
+                {
+                    s->mc_ttl = *(const int *)option_value;
+                    ret = 0;
+                }
+                break;
+            case IP_ADD_MEMBERSHIP:
+                if (is_soft(s))
+                {
+                    /* the MACRAW socket takes no groups */
+                    errno = ENOPROTOOPT;
+                    ret = -1;
+                }
+                else if (!IN_MULTICAST(ntohl(mreq->imr_multiaddr.s_addr)))
+                {
+                    errno = EINVAL;
+                    ret = -1;
+                }
+                else if (s->mc_joined && (s->mc_group.s_addr == mreq->imr_multiaddr.s_addr))
+                {
+                    errno = EADDRINUSE;
+                    ret = -1;
+                }
+                else if (s->mc_joined)
+                {
+                    /* the chip filters a single group per socket */
+                    errno = ENOBUFS;
+                    ret = -1;
+                }
+                else
+                {
+                    s->mc_joined = 1;
+                    s->mc_group = mreq->imr_multiaddr;
+                    mc_reopen(s);
+                    ret = 0;
+                }
+                break;
+            case IP_DROP_MEMBERSHIP:
+                if (!s->mc_joined || (s->mc_group.s_addr != mreq->imr_multiaddr.s_addr))
+                {
+                    errno = EADDRNOTAVAIL;
+                    ret = -1;
+                }
+                else
+                {
+                    s->mc_joined = 0;
+                    mc_reopen(s);
+                    ret = 0;
+                }
+                break;
+            default:
+                ret = -1;
+                errno = EINVAL;
+                break;
+        }
+    }
+    return ret;
+}
+
+static
+int setsockopt_w5100(struct w5100_socket *s, int option_name, const void *option_value)
+{
+    int ret;
+
+    switch (option_name)
     {
-        ret = POLLNVAL;
+        case W5100_SO_RXSTAGE:
+            ret = set_rx_stage_size(s, *(const int *)option_value);
+            break;
+        case W5100_SO_RETRY_TIME:
+            if ((*(const int *)option_value < 1) || (*(const int *)option_value > 0xFFFF))
+            {
+                errno = EINVAL;
+                ret = -1;
+            }
+            else
+            {
+                w5100_retry_time = *(const int *)option_value;
+                w5x00_chip.set_retry(w5100_retry_time, w5100_retry_count);
+                ret = 0;
+            }
+            break;
+        case W5100_SO_RETRY_COUNT:
+            if ((*(const int *)option_value < 0) || (*(const int *)option_value > 0xFF))
+            {
+                errno = EINVAL;
+                ret = -1;
+            }
+            else
+            {
+                w5100_retry_count = *(const int *)option_value;
+                w5x00_chip.set_retry(w5100_retry_time, w5100_retry_count);
+                ret = 0;
+            }
+            break;
+        default:
+            ret = -1;
+            errno = EINVAL;
+            break;
     }
-
     return ret;
 }
 
@@ -1451,6 +3716,18 @@ int setsockopt(int sockfd, int level, int option_name, const void *option_value,
     {
         ret = -1;
     }
+    else if (level == IPPROTO_TCP)
+    {
+        ret = setsockopt_tcp(s, option_name, option_value);
+    }
+    else if (level == IPPROTO_IP)
+    {
+        ret = setsockopt_ip(s, option_name, option_value);
+    }
+    else if (level == SOL_W5100)
+    {
+        ret = setsockopt_w5100(s, option_name, option_value);
+    }
     else if (level != SOL_SOCKET)
     {
         ret = -1;
@@ -1466,6 +3743,17 @@ int setsockopt(int sockfd, int level, int option_name, const void *option_value,
                 s->can_broadcast = ((*(int *)option_value) != 0);
                 ret = 0;
                 break;
+            case SO_KEEPALIVE:
+                s->keepalive = ((*(const int *)option_value) != 0);
+                s->keep_armed = 0;
+                ret = 0;
+                break;
+            case SO_RCVBUF:
+                ret = set_sock_buf_size(s, *(const int *)option_value, 0);
+                break;
+            case SO_SNDBUF:
+                ret = set_sock_buf_size(s, *(const int *)option_value, 1);
+                break;
             case SO_RCVTIMEO:
                 timeval_to_timespec((const struct timeval *)option_value, &s->recv_timeout);
                 ret = 0;
@@ -1484,6 +3772,150 @@ int setsockopt(int sockfd, int level, int option_name, const void *option_value,
     return ret;
 }
 
+static
+int getsockopt_tcp(struct w5100_socket *s, int option_name, void *option_value)
+{
+    int ret;
+
+    if (s->type != SOCK_STREAM)
+    {
+        errno = ENOPROTOOPT;
+        ret = -1;
+    }
+    else
+    {
+        switch (option_name)
+        {
+            case TCP_NODELAY:
+                *(int *)option_value = s->tcp_nodelay;
+                ret = 0;
+                break;
+            case TCP_CORK:
+                *(int *)option_value = s->tcp_cork;
+                ret = 0;
+                break;
+            case TCP_KEEPIDLE:
+                *(int *)option_value = s->keep_idle;
+                ret = 0;
+                break;
+            case TCP_KEEPINTVL:
+                *(int *)option_value = s->keep_intvl;
+                ret = 0;
+                break;
+            case TCP_MAXSEG:
+                if (
+                        (s->state == W5100_SOCK_STATE_CONNECTED)
+                        ||
+                        (s->state == W5100_SOCK_STATE_ACCEPTED)
+                   )
+                {
+                    uint16_t mss;
+
+                    /* the chip keeps the one agreed with the peer */
+                    w5x00_read_sock_regx(W5100_Sn_MSSR, s->isocket, &mss);
+                    *(int *)option_value = ntohs(mss);
+                }
+                else
+                {
+                    *(int *)option_value = s->tcp_maxseg;
+                }
+                ret = 0;
+                break;
+            default:
+                ret = -1;
+                errno = EINVAL;
+                break;
+        }
+    }
+    return ret;
+}
+
+static
+int getsockopt_ip(struct w5100_socket *s, int option_name, void *option_value)
+{
+    int ret;
+
+    if (s->type != SOCK_DGRAM)
+    {
+        errno = ENOPROTOOPT;
+        ret = -1;
+    }
+    else if (option_name == IP_MULTICAST_TTL)
+    {
+        *(int *)option_value = s->mc_ttl;
+        ret = 0;
+    }
+    else
+    {
+        ret = -1;
+        errno = EINVAL;
+    }
+    return ret;
+}
+
+static
+int getsockopt_w5100(struct w5100_socket *s, int option_name, void *option_value, socklen_t *option_len)
+{
+    int ret;
+
+    switch (option_name)
+    {
+        case W5100_SO_RXSTAGE:
+            *(int *)option_value = s->rx_stage_size;
+            ret = 0;
+            break;
+        case W5100_SO_RETRY_TIME:
+            *(int *)option_value = w5100_retry_time;
+            ret = 0;
+            break;
+        case W5100_SO_RETRY_COUNT:
+            *(int *)option_value = w5100_retry_count;
+            ret = 0;
+            break;
+        case W5100_SO_STATS:
+            if ((option_value == NULL) || (option_len == NULL))
+            {
+                ret = -1;
+                errno = EFAULT;
+            }
+            else if (*option_len < (socklen_t)sizeof(struct w5100_sock_stats))
+            {
+                ret = -1;
+                errno = EINVAL;
+            }
+            else
+            {
+                stats_get(s, option_value);
+                *option_len = sizeof(struct w5100_sock_stats);
+                ret = 0;
+            }
+            break;
+        default:
+            ret = -1;
+            errno = EINVAL;
+            break;
+    }
+    return ret;
+}
+
+static
+uint16_t sock_rx_size(const struct w5100_socket *s)
+{
+    uint16_t ret;
+
+#ifdef W5100_MACRAW
+    if (is_soft(s))
+    {
+        ret = W5100_MACRAW_RX_BUF;
+    }
+    else
+#endif
+    {
+        ret = w5x00_chip.get_rx_size(s->isocket);
+    }
+    return ret;
+}
+
 int getsockopt(int sockfd, int level, int option_name, void *__restrict option_value, socklen_t *__restrict option_len)
 {
     int ret;
@@ -1494,6 +3926,18 @@ int getsockopt(int sockfd, int level, int option_name, void *__restrict option_v
     {
         ret = -1;
     }
+    else if (level == IPPROTO_TCP)
+    {
+        ret = getsockopt_tcp(s, option_name, option_value);
+    }
+    else if (level == IPPROTO_IP)
+    {
+        ret = getsockopt_ip(s, option_name, option_value);
+    }
+    else if (level == SOL_W5100)
+    {
+        ret = getsockopt_w5100(s, option_name, option_value, option_len);
+    }
     else if (level != SOL_SOCKET)
     {
         ret = -1;
@@ -1512,6 +3956,29 @@ int getsockopt(int sockfd, int level, int option_name, void *__restrict option_v
             case SO_BROADCAST:
                 ret = 0;
                 break;
+            case SO_KEEPALIVE:
+                *(int *)option_value = s->keepalive;
+                ret = 0;
+                break;
+            case SO_ERROR:
+                /* read and cleared */
+                *(int *)option_value = s->so_error;
+                if (s->so_error != 0)
+                {
+                    s->so_error = 0;
+                    poll_invalidate(s);
+                }
+                ret = 0;
+                break;
+            case SO_RCVBUF:
+                *(int *)option_value = sock_rx_size(s);
+                ret = 0;
+                break;
+            case SO_SNDBUF:
+                /* software sockets share the MACRAW one */
+                *(int *)option_value = w5x00_chip.get_tx_size(is_soft(s) ? W5100_MACRAW_ISOCKET : s->isocket);
+                ret = 0;
+                break;
             case SO_RCVTIMEO:
                 timespec_to_timeval(&s->recv_timeout, (struct timeval *)option_value);
                 ret = 0;
@@ -1621,38 +4088,272 @@ int getpeername(
     return ret;
 }
 
+/* Stats file: the text is made line by line while it is read,
+ * pos is how much of it has been read already.
+ */
+static struct stats_file {
+    int isopen;
+    size_t pos;
+} stats_files[W5100_STATS_FILES];
+
+static const char *const stats_state_names[] = {
+    [W5100_SOCK_STATE_NONE] = "none",
+    [W5100_SOCK_STATE_CREATED] = "created",
+    [W5100_SOCK_STATE_CONNECTED] = "connected",
+    [W5100_SOCK_STATE_BOUND] = "bound",
+    [W5100_SOCK_STATE_LISTENING] = "listening",
+    [W5100_SOCK_STATE_ACCEPTED] = "accepted",
+    [W5100_SOCK_STATE_SPARE] = "spare",
+    [W5100_SOCK_STATE_CONNECTING] = "connecting",
+    [W5100_SOCK_STATE_CLOSING] = "closing",
+};
+
+/* The n-th socket in use, hardware ones first. */
+static
+const struct w5100_socket *stats_socket(int n)
+{
+    const struct w5100_socket *ret;
+    int i;
+
+    ret = NULL;
+    for (i = 0; i < W5X00_MAX_SOCKETS + W5100_MACRAW_SOCKETS; i++)
+    {
+        const struct w5100_socket *s;
+
+        s = get_socket_from_isocket(i);
+        if ((s != NULL) && (s->state != W5100_SOCK_STATE_NONE))
+        {
+            if (n == 0)
+            {
+                ret = s;
+                break;
+            }
+            n--;
+        }
+    }
+    return ret;
+}
+
+/* Line n of the stats file, 0 past the end. */
+static
+int stats_line(int n, char *buf, size_t size)
+{
+    int ret;
+
+    if (n == 0)
+    {
+        ret = snprintf(buf, size, "%s data_frames %lu reg_frames %lu\n",
+                w5x00_chip.name, w5x00_frames.data, w5x00_frames.reg);
+    }
+    else if (n == 1)
+    {
+        ret = snprintf(buf, size, "%s\n",
+                "sock fd type state bytes_in bytes_out send_cmds recv_cmds"
+                " data_frames reg_frames polls eagain timeouts");
+    }
+    else
+    {
+        const struct w5100_socket *s;
+
+        s = stats_socket(n - 2);
+        if (s == NULL)
+        {
+            ret = 0;
+        }
+        else
+        {
+            struct w5100_sock_stats st;
+            const struct fd *f;
+
+            stats_get(s, &st);
+            f = (s->connection_data != NULL) ? s->connection_data : s->fd_data;
+            ret = snprintf(buf, size,
+                    "%d %d %s %s %lu %lu %lu %lu %lu %lu %lu %lu %lu\n",
+                    s->isocket,
+                    (f != NULL) ? f->fd : -1,
+                    (s->type == SOCK_STREAM) ? "tcp" : (s->type == SOCK_DGRAM) ? "udp" : "raw",
+                    stats_state_names[s->state],
+                    st.bytes_in, st.bytes_out, st.send_cmds, st.recv_cmds,
+                    st.data_frames, st.reg_frames, st.polls, st.eagain, st.timeouts);
+        }
+    }
+    if (ret < 0)
+    {
+        ret = 0;
+    }
+    else if ((size_t)ret >= size)
+    {
+        ret = size - 1;
+    }
+    return ret;
+}
+
+static
+int stats_file_read(int fd, char *buf, int len)
+{
+    int ret;
+    struct stats_file *sf;
+    char line[W5100_STATS_LINE];
+    size_t start;
+    int n;
+    int iline;
+
+    sf = file_struct_get(fd)->opaque;
+    ret = 0;
+    start = 0;
+    iline = 0;
+    while ((ret < len) && ((n = stats_line(iline, line, sizeof(line))) > 0))
+    {
+        if (start + n > sf->pos)
+        {
+            size_t skip;
+            size_t tocopy;
+
+            skip = sf->pos - start;
+            tocopy = n - skip;
+            if (tocopy > (size_t)(len - ret))
+            {
+                tocopy = len - ret;
+            }
+            memcpy(&buf[ret], &line[skip], tocopy);
+            ret += tocopy;
+            sf->pos += tocopy;
+        }
+        start += n;
+        iline++;
+    }
+    return ret;
+}
+
+static
+int stats_file_close(int fd)
+{
+    struct fd *f;
+
+    f = file_struct_get(fd);
+    ((struct stats_file *)f->opaque)->isopen = 0;
+    f->isopen = 0;
+    file_free(fd);
+
+    return 0;
+}
+
+static
+short stats_file_poll(int fd)
+{
+    (void)fd;
+    return POLLIN|POLLRDNORM;
+}
+
+int w5100_stats_open(void)
+{
+    int ret;
+    int i;
+
+    for (i = 0; i < W5100_STATS_FILES; i++)
+    {
+        if (!stats_files[i].isopen)
+        {
+            break;
+        }
+    }
+    if (i == W5100_STATS_FILES)
+    {
+        errno = ENFILE;
+        ret = -1;
+    }
+    else
+    {
+        ret = file_alloc();
+        if (ret == -1)
+        {
+            errno = ENFILE;
+        }
+        else
+        {
+            struct fd *f;
+
+            stats_files[i].isopen = 1;
+            stats_files[i].pos = 0;
+            f = file_struct_get(ret);
+            f->isatty = 0;
+            f->isopen = 1;
+            f->read = stats_file_read;
+            f->close = stats_file_close;
+            f->poll = stats_file_poll;
+            f->stat.st_mode = S_IFCHR|S_IRUSR|S_IRGRP|S_IROTH;
+            f->status_flags = O_RDONLY;
+            f->opaque = &stats_files[i];
+        }
+    }
+    return ret;
+}
+
+int dev_open(const char *pathname, int flags)
+{
+    int ret;
+
+    if (strcmp(pathname, W5100_STATS_PATH) != 0)
+    {
+        errno = ENOENT;
+        ret = -1;
+    }
+    else if ((flags & O_ACCMODE) != O_RDONLY)
+    {
+        errno = EACCES;
+        ret = -1;
+    }
+    else
+    {
+        ret = w5100_stats_open();
+    }
+    return ret;
+}
+
 __attribute__((__constructor__))
 void w5100_socket_init(void)
 {
     int i;
+    uint16_t tx_sizes[W5X00_MAX_SOCKETS];
+    uint16_t rx_sizes[W5X00_MAX_SOCKETS];
 
-    w5100_init();
+    w5x00_chip.init();
 
-    w5100_write_reg(W5100_MR, W5100_MODE_RST); /* RST */
-    while(w5100_read_reg(W5100_MR) & W5100_MODE_RST) /* RST bit clears by itself */
+    w5x00_write_reg(W5100_MR, W5100_MODE_RST); /* RST */
+    while(w5x00_read_reg(W5100_MR) & W5100_MODE_RST) /* RST bit clears by itself */
     {
         continue;
     }
     
-    for (i = 0; i < W5100_N_SOCKETS; i++)
+    for (i = 0; i < w5x00_chip.n_sockets; i++)
     {
-        socket_free(i);
+        w5100_sockets[i].ttl = W5100_IP_TTL;
+        w5100_socket_free(i);
+        /* same buffer size for every socket */
+        tx_sizes[i] = w5x00_chip.tx_mem_size / w5x00_chip.n_sockets;
+        rx_sizes[i] = w5x00_chip.rx_mem_size / w5x00_chip.n_sockets;
     }
-    w5100_write_reg(W5100_RMSR, 0x55); /* 2KiB per socket */
-    w5100_write_reg(W5100_TMSR, 0x55); /* 2KiB per socket */
-    w5100_write_regx(W5100_SHAR, w5100_mac_addr);
+    (void)w5x00_chip.set_buf_sizes(tx_sizes, rx_sizes);
+    w5x00_chip.sock_int_enable((1U << w5x00_chip.n_sockets) - 1);
+    w5100_retry_time = W5100_RETRY_TIME;
+    w5100_retry_count = W5100_RETRY_COUNT;
+    w5x00_chip.set_retry(w5100_retry_time, w5100_retry_count);
+    w5x00_write_regx(W5100_SHAR, w5100_mac_addr);
 
 #ifdef W5100_STATIC_IP
     do {
         in_addr_t addr;
 
         addr = inet_addr(W5100_IP_ADDR);
-        w5100_write_regx(W5100_SIPR, &addr);
+        w5x00_write_regx(W5100_SIPR, &addr);
         addr = inet_addr(W5100_GATEWAY_ADDR);
-        w5100_write_regx(W5100_GAR, &addr);
+        w5x00_write_regx(W5100_GAR, &addr);
         addr = inet_addr(W5100_SUBNET);
-        w5100_write_regx(W5100_SUBR, &addr);
+        w5x00_write_regx(W5100_SUBR, &addr);
     } while(0);
 #endif
+#ifdef W5100_MACRAW
+    w5100_macraw_open();
+#endif
 }
 
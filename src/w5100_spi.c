@@ -18,14 +18,67 @@
  */
 #include <stdint.h>
 #include "w5100.h"
+#include "w5x00_int.h"
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/spi.h>
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/gpio.h>
+#ifndef W5100_SPI_NO_DMA
+#  include <libopencm3/stm32/dma.h>
+#  include <libopencm3/cm3/nvic.h>
+#  include <libopencm3/cm3/cortex.h>
+#endif
 
 #define OP_WRITE 0xF0
 #define OP_READ 0x0F
 
+#define FRAME_SIZE 4
+#define FRAME_DATA 3
+
+#ifndef W5100_SPI_NO_DMA
+
+/* Transfers shorter than this are done with polled SPI,
+ * setting up DMA is not worth it for register accesses.
+ */
+#  ifndef W5100_SPI_DMA_THRESHOLD
+#    define W5100_SPI_DMA_THRESHOLD 16
+#  endif
+
+/* Number of frames that are pre-built in the scratch buffers. */
+#  ifndef W5100_SPI_DMA_CHUNK
+#    define W5100_SPI_DMA_CHUNK 64
+#  endif
+
+#  ifdef STM32F1
+/* SPI1_RX on DMA1 channel 2, SPI1_TX on DMA1 channel 3 */
+#    define W5100_DMA        DMA1
+#    define W5100_DMA_RX     DMA_CHANNEL2
+#    define W5100_DMA_TX     DMA_CHANNEL3
+#    define W5100_DMA_RCC    RCC_DMA1
+#    define W5100_DMA_RX_IRQ NVIC_DMA1_CHANNEL2_IRQ
+#    define w5100_dma_rx_isr dma1_channel2_isr
+#  elif defined(STM32F4)
+/* SPI1_RX on DMA2 stream 0 channel 3, SPI1_TX on DMA2 stream 3 channel 3 */
+#    define W5100_DMA        DMA2
+#    define W5100_DMA_RX     DMA_STREAM0
+#    define W5100_DMA_TX     DMA_STREAM3
+#    define W5100_DMA_RCC    RCC_DMA2
+#    define W5100_DMA_RX_IRQ NVIC_DMA2_STREAM0_IRQ
+#    define w5100_dma_rx_isr dma2_stream0_isr
+#  endif
+
+static struct {
+    volatile size_t frames_left;
+    const uint8_t *tx;
+    uint8_t *rx;
+} dma_xfer;
+
+static uint8_t dma_tx_frames[W5100_SPI_DMA_CHUNK * FRAME_SIZE];
+
+static uint8_t dma_rx_frames[W5100_SPI_DMA_CHUNK * FRAME_SIZE];
+
+#endif /* W5100_SPI_NO_DMA */
+
 static
 void w5100_select(void)
 {
@@ -115,14 +168,195 @@ void w5100_write_reg2(uint16_t reg, uint16_t val)
     }
 }
 
+#ifndef W5100_SPI_NO_DMA
+
+static
+void w5100_dma_frame_start(void)
+{
+#ifdef STM32F1
+    dma_disable_channel(W5100_DMA, W5100_DMA_RX);
+    dma_disable_channel(W5100_DMA, W5100_DMA_TX);
+#elif defined(STM32F4)
+    dma_disable_stream(W5100_DMA, W5100_DMA_RX);
+    dma_disable_stream(W5100_DMA, W5100_DMA_TX);
+#endif
+    dma_set_memory_address(W5100_DMA, W5100_DMA_RX, (uint32_t)dma_xfer.rx);
+    dma_set_number_of_data(W5100_DMA, W5100_DMA_RX, FRAME_SIZE);
+    dma_set_memory_address(W5100_DMA, W5100_DMA_TX, (uint32_t)dma_xfer.tx);
+    dma_set_number_of_data(W5100_DMA, W5100_DMA_TX, FRAME_SIZE);
+
+    w5100_select();
+    /* RX first, so that no received byte is lost. */
+#ifdef STM32F1
+    dma_enable_channel(W5100_DMA, W5100_DMA_RX);
+    dma_enable_channel(W5100_DMA, W5100_DMA_TX);
+#elif defined(STM32F4)
+    dma_enable_stream(W5100_DMA, W5100_DMA_RX);
+    dma_enable_stream(W5100_DMA, W5100_DMA_TX);
+#endif
+}
+
+/* RX transfer complete means that the last byte of the frame
+ * has been clocked in, so chip select can be raised and the
+ * next frame started.
+ */
+void w5100_dma_rx_isr(void)
+{
+    if (dma_get_interrupt_flag(W5100_DMA, W5100_DMA_RX, DMA_TCIF))
+    {
+        dma_clear_interrupt_flags(W5100_DMA, W5100_DMA_RX, DMA_TCIF);
+        w5100_deselect();
+        dma_xfer.tx += FRAME_SIZE;
+        dma_xfer.rx += FRAME_SIZE;
+        dma_xfer.frames_left--;
+        if (dma_xfer.frames_left > 0)
+        {
+            w5100_dma_frame_start();
+        }
+    }
+}
+
+static
+void w5100_dma_xfer_frames(size_t nframes)
+{
+    dma_xfer.tx = dma_tx_frames;
+    dma_xfer.rx = dma_rx_frames;
+    dma_xfer.frames_left = nframes;
+
+    spi_enable_rx_dma(SPI1);
+    spi_enable_tx_dma(SPI1);
+    /* With interrupts masked, the last DMA interrupt coming after
+     * the check still wakes up the core from WFI.
+     */
+    cm_disable_interrupts();
+    w5100_dma_frame_start();
+    while (dma_xfer.frames_left > 0)
+    {
+        __asm__ volatile ("wfi"); /* woken up by DMA interrupt */
+        cm_enable_interrupts();
+        cm_disable_interrupts();
+    }
+    cm_enable_interrupts();
+    /* SPI1 is shared with the SD card, that uses polled transfers. */
+    spi_disable_tx_dma(SPI1);
+    spi_disable_rx_dma(SPI1);
+}
+
+static
+void w5100_dma_frames_fill(uint8_t op, uint16_t addr, const uint8_t *data, size_t n)
+{
+    size_t i_frame;
+    uint8_t *frame;
+
+    frame = dma_tx_frames;
+    for (i_frame = 0; i_frame < n; i_frame++)
+    {
+        frame[0] = op;
+        frame[1] = (addr + i_frame) >> 8;
+        frame[2] = (addr + i_frame) & 0xFF;
+        frame[FRAME_DATA] = (data != NULL) ? data[i_frame] : 0x00;
+        frame += FRAME_SIZE;
+    }
+}
+
+static
+void w5100_dma_read_mem(uint16_t addr, uint8_t *pbytes, size_t n)
+{
+    while (n > 0)
+    {
+        size_t chunk;
+        size_t i_byte;
+
+        chunk = (n > W5100_SPI_DMA_CHUNK) ? W5100_SPI_DMA_CHUNK : n;
+        w5100_dma_frames_fill(OP_READ, addr, NULL, chunk);
+        w5100_dma_xfer_frames(chunk);
+        for (i_byte = 0; i_byte < chunk; i_byte++)
+        {
+            pbytes[i_byte] = dma_rx_frames[i_byte * FRAME_SIZE + FRAME_DATA];
+        }
+        addr += chunk;
+        pbytes += chunk;
+        n -= chunk;
+    }
+}
+
+static
+void w5100_dma_write_mem(uint16_t addr, const uint8_t *pbytes, size_t n)
+{
+    while (n > 0)
+    {
+        size_t chunk;
+
+        chunk = (n > W5100_SPI_DMA_CHUNK) ? W5100_SPI_DMA_CHUNK : n;
+        w5100_dma_frames_fill(OP_WRITE, addr, pbytes, chunk);
+        w5100_dma_xfer_frames(chunk);
+        addr += chunk;
+        pbytes += chunk;
+        n -= chunk;
+    }
+}
+
+static
+void w5100_dma_channel_init(uint32_t channel, uint32_t dir)
+{
+#ifdef STM32F1
+    dma_channel_reset(W5100_DMA, channel);
+    if (dir)
+    {
+        dma_set_read_from_memory(W5100_DMA, channel);
+    }
+    else
+    {
+        dma_set_read_from_peripheral(W5100_DMA, channel);
+    }
+    dma_set_peripheral_size(W5100_DMA, channel, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(W5100_DMA, channel, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(W5100_DMA, channel, DMA_CCR_PL_VERY_HIGH);
+#elif defined(STM32F4)
+    dma_stream_reset(W5100_DMA, channel);
+    dma_channel_select(W5100_DMA, channel, DMA_SxCR_CHSEL_3);
+    dma_set_transfer_mode(
+            W5100_DMA,
+            channel,
+            dir ? DMA_SxCR_DIR_MEM_TO_PERIPHERAL : DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+    dma_set_peripheral_size(W5100_DMA, channel, DMA_SxCR_PSIZE_8BIT);
+    dma_set_memory_size(W5100_DMA, channel, DMA_SxCR_MSIZE_8BIT);
+    dma_set_priority(W5100_DMA, channel, DMA_SxCR_PL_VERY_HIGH);
+#endif
+    dma_set_peripheral_address(W5100_DMA, channel, (uint32_t)&SPI1_DR);
+    dma_enable_memory_increment_mode(W5100_DMA, channel);
+}
+
+static
+void w5100_dma_init(void)
+{
+    rcc_periph_clock_enable(W5100_DMA_RCC);
+
+    w5100_dma_channel_init(W5100_DMA_RX, 0);
+    w5100_dma_channel_init(W5100_DMA_TX, 1);
+    dma_enable_transfer_complete_interrupt(W5100_DMA, W5100_DMA_RX);
+    nvic_enable_irq(W5100_DMA_RX_IRQ);
+}
+
+#endif /* W5100_SPI_NO_DMA */
+
 void w5100_read_mem(uint16_t addr, void *buf, size_t n)
 {
     uint8_t *pbytes = buf;
     size_t i_byte;
 
-    for (i_byte = 0; i_byte < n; i_byte++)
+#ifndef W5100_SPI_NO_DMA
+    if (n >= W5100_SPI_DMA_THRESHOLD)
+    {
+        w5100_dma_read_mem(addr, pbytes, n);
+    }
+    else
+#endif
     {
-        pbytes[i_byte] = w5100_read_byte(addr + i_byte);
+        for (i_byte = 0; i_byte < n; i_byte++)
+        {
+            pbytes[i_byte] = w5100_read_byte(addr + i_byte);
+        }
     }
 }
 
@@ -131,12 +365,32 @@ void w5100_write_mem(uint16_t addr, const void *buf, size_t n)
     const uint8_t *pbytes = buf;
     size_t i_byte;
 
-    for (i_byte = 0; i_byte < n; i_byte++)
+#ifndef W5100_SPI_NO_DMA
+    if (n >= W5100_SPI_DMA_THRESHOLD)
+    {
+        w5100_dma_write_mem(addr, pbytes, n);
+    }
+    else
+#endif
     {
-        w5100_write_byte(addr + i_byte, pbytes[i_byte]);
+        for (i_byte = 0; i_byte < n; i_byte++)
+        {
+            w5100_write_byte(addr + i_byte, pbytes[i_byte]);
+        }
     }
 }
 
+/* The INT line is the same for both shields. */
+int w5100_int_asserted(void)
+{
+    return w5x00_int_asserted();
+}
+
+void w5100_int_wait(const struct timespec *deadline)
+{
+    w5x00_int_wait(deadline);
+}
+
 static
 void w5100_spi_init(void)
 {
@@ -192,6 +446,10 @@ void w5100_spi_init(void)
 void w5100_init(void)
 {
     w5100_spi_init();
+#ifndef W5100_SPI_NO_DMA
+    w5100_dma_init();
+#endif
+    w5x00_int_init();
 
 }
 
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "w5500.h"
+#include "w5x00.h"
+
+/* W5500 backend of the chip driver.
+ * Every access is a single frame, whatever its length,
+ * and the chip wraps pointers around the socket buffers by itself.
+ * Blocks are accessed through w5500_read_block and w5500_write_block,
+ * that are provided by w5500_spi.c on the board
+ * and by w5500_emu.c on the host.
+ */
+
+#define W5500_BUF_SIZE_MAX 0x4000 /* 16KiB */
+
+static uint16_t tx_sizes[W5500_N_SOCKETS];
+static uint16_t rx_sizes[W5500_N_SOCKETS];
+
+struct w5x00_frames w5x00_frames;
+struct w5x00_frames w5x00_sock_frames[W5X00_MAX_SOCKETS];
+
+/* A frame for each access; isocket is -1 for common registers. */
+static
+void reg_frame_add(int isocket)
+{
+    w5x00_frames.reg++;
+    if (isocket >= 0)
+    {
+        w5x00_sock_frames[isocket].reg++;
+    }
+}
+
+static
+void data_frame_add(int isocket)
+{
+    w5x00_frames.data++;
+    w5x00_sock_frames[isocket].data++;
+}
+
+static
+uint16_t w5500_chip_get_tx_size(int isocket)
+{
+    return tx_sizes[isocket];
+}
+
+static
+uint16_t w5500_chip_get_rx_size(int isocket)
+{
+    return rx_sizes[isocket];
+}
+
+static
+void w5500_chip_read_mem(uint16_t reg, void *buf, size_t n)
+{
+    reg_frame_add(-1);
+    w5500_read_block(W5500_BSB_COMMON, reg, buf, n);
+}
+
+static
+void w5500_chip_write_mem(uint16_t reg, const void *buf, size_t n)
+{
+    reg_frame_add(-1);
+    w5500_write_block(W5500_BSB_COMMON, reg, buf, n);
+}
+
+static
+void w5500_chip_read_sock_mem(int isocket, uint16_t sn_reg, void *buf, size_t n)
+{
+    reg_frame_add(isocket);
+    w5500_read_block(W5500_BSB_SOCK(isocket), sn_reg, buf, n);
+}
+
+static
+void w5500_chip_write_sock_mem(int isocket, uint16_t sn_reg, const void *buf, size_t n)
+{
+    reg_frame_add(isocket);
+    w5500_write_block(W5500_BSB_SOCK(isocket), sn_reg, buf, n);
+}
+
+static
+void w5500_chip_read_rx(int isocket, uint16_t ptr, void *buf, size_t n)
+{
+    data_frame_add(isocket);
+    w5500_read_block(W5500_BSB_RX(isocket), ptr, buf, n);
+}
+
+static
+void w5500_chip_write_tx(int isocket, uint16_t ptr, const void *buf, size_t n)
+{
+    data_frame_add(isocket);
+    w5500_write_block(W5500_BSB_TX(isocket), ptr, buf, n);
+}
+
+/* Sizes are set in KiB: 0, 1, 2, 4, 8 or 16 */
+static
+int size_is_valid(uint16_t size)
+{
+    return
+        (size <= W5500_BUF_SIZE_MAX)
+        &&
+        ((size & 0x3FF) == 0)
+        &&
+        ((size & (size - 1)) == 0);
+}
+
+static
+int sizes_are_valid(const uint16_t *sizes, uint16_t mem_size)
+{
+    int ret;
+    int isocket;
+    uint32_t total;
+
+    ret = 1;
+    total = 0;
+    for (isocket = 0; isocket < W5500_N_SOCKETS; isocket++)
+    {
+        if (!size_is_valid(sizes[isocket]))
+        {
+            ret = 0;
+            break;
+        }
+        total += sizes[isocket];
+    }
+    if (total > mem_size)
+    {
+        ret = 0;
+    }
+    return ret;
+}
+
+static
+int w5500_chip_set_buf_sizes(const uint16_t *tx, const uint16_t *rx)
+{
+    int ret;
+
+    if (!sizes_are_valid(tx, W5500_TX_MEM_SIZE))
+    {
+        ret = -1;
+    }
+    else if (!sizes_are_valid(rx, W5500_RX_MEM_SIZE))
+    {
+        ret = -1;
+    }
+    else
+    {
+        int isocket;
+
+        for (isocket = 0; isocket < W5500_N_SOCKETS; isocket++)
+        {
+            uint8_t kib;
+
+            kib = tx[isocket] >> 10;
+            w5500_chip_write_sock_mem(isocket, W5500_Sn_TXBUF_SIZE, &kib, 1);
+            kib = rx[isocket] >> 10;
+            w5500_chip_write_sock_mem(isocket, W5500_Sn_RXBUF_SIZE, &kib, 1);
+            tx_sizes[isocket] = tx[isocket];
+            rx_sizes[isocket] = rx[isocket];
+        }
+        ret = 0;
+    }
+    return ret;
+}
+
+static
+void w5500_chip_sock_int_enable(uint8_t mask)
+{
+    reg_frame_add(-1);
+    w5500_write_block(W5500_BSB_COMMON, W5500_SIMR, &mask, 1);
+}
+
+static
+uint8_t w5500_chip_sock_int_get(void)
+{
+    uint8_t sir;
+
+    reg_frame_add(-1);
+    w5500_read_block(W5500_BSB_COMMON, W5500_SIR, &sir, 1);
+
+    return sir;
+}
+
+static
+void w5500_chip_set_retry(uint16_t rtr, uint8_t rcr)
+{
+    uint8_t buf[2];
+
+    buf[0] = rtr >> 8;
+    buf[1] = rtr & 0xFF;
+    reg_frame_add(-1);
+    w5500_write_block(W5500_BSB_COMMON, W5500_RTR, buf, sizeof(buf));
+    reg_frame_add(-1);
+    w5500_write_block(W5500_BSB_COMMON, W5500_RCR, &rcr, 1);
+}
+
+const struct w5x00_chip w5x00_chip = {
+    .name = "W5500",
+    .n_sockets = W5500_N_SOCKETS,
+    .tx_mem_size = W5500_TX_MEM_SIZE,
+    .rx_mem_size = W5500_RX_MEM_SIZE,
+    .macraw_filter = W5500_Sn_MR_MFEN,
+    .init = w5500_init,
+    .read_mem = w5500_chip_read_mem,
+    .write_mem = w5500_chip_write_mem,
+    .read_sock_mem = w5500_chip_read_sock_mem,
+    .write_sock_mem = w5500_chip_write_sock_mem,
+    .read_rx = w5500_chip_read_rx,
+    .write_tx = w5500_chip_write_tx,
+    .get_tx_size = w5500_chip_get_tx_size,
+    .get_rx_size = w5500_chip_get_rx_size,
+    .set_buf_sizes = w5500_chip_set_buf_sizes,
+    .sock_int_enable = w5500_chip_sock_int_enable,
+    .sock_int_get = w5500_chip_sock_int_get,
+    .set_retry = w5500_chip_set_retry,
+    .int_asserted = w5500_int_asserted,
+    .int_wait = w5500_int_wait,
+};
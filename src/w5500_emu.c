@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include "w5100.h"
+#include "w5500.h"
+#include "w5x00_emu.h"
+
+/* Host replacement of w5500_spi.c: blocks are decoded and
+ * forwarded to the emulator core.
+ * Every block access costs a single SPI frame, as on the real bus.
+ */
+
+#define BSB_TYPE(bsb)   ((bsb) & 0x3)
+#define BSB_SOCKET(bsb) ((bsb) >> 2)
+#define BSB_TYPE_SOCK 1
+#define BSB_TYPE_TX   2
+#define BSB_TYPE_RX   3
+
+#define W5500_DEFAULT_BUF_KIB 2
+
+/* Buffers are placed one after the other, as they are in the chip. */
+static
+void layout_set(void)
+{
+    int isocket;
+    uint16_t tx_base;
+    uint16_t rx_base;
+
+    tx_base = 0;
+    rx_base = 0;
+    for (isocket = 0; isocket < W5500_N_SOCKETS; isocket++)
+    {
+        uint16_t size;
+
+        size = w5x00_emu_sock_read(isocket, W5500_Sn_TXBUF_SIZE) << 10;
+        if (tx_base + size > W5500_TX_MEM_SIZE)
+        {
+            size = 0;
+        }
+        w5x00_emu_set_tx_buf(isocket, tx_base, size);
+        tx_base += size;
+
+        size = w5x00_emu_sock_read(isocket, W5500_Sn_RXBUF_SIZE) << 10;
+        if (rx_base + size > W5500_RX_MEM_SIZE)
+        {
+            size = 0;
+        }
+        w5x00_emu_set_rx_buf(isocket, rx_base, size);
+        rx_base += size;
+    }
+}
+
+static
+void reset(void)
+{
+    int isocket;
+
+    w5x00_emu_reset(W5500_N_SOCKETS);
+    w5x00_emu_common_write(W5500_RTR0, 0x07);
+    w5x00_emu_common_write(W5500_RTR1, 0xD0);
+    w5x00_emu_common_write(W5500_RCR, 0x08);
+    w5x00_emu_common_write(W5500_VERSIONR, W5500_VERSION);
+    for (isocket = 0; isocket < W5500_N_SOCKETS; isocket++)
+    {
+        w5x00_emu_sock_write(isocket, W5500_Sn_TXBUF_SIZE, W5500_DEFAULT_BUF_KIB);
+        w5x00_emu_sock_write(isocket, W5500_Sn_RXBUF_SIZE, W5500_DEFAULT_BUF_KIB);
+    }
+    layout_set();
+}
+
+static
+uint8_t *buf_byte(uint8_t *mem, uint16_t base, uint16_t size, uint16_t addr)
+{
+    /* the chip wraps addresses around the socket buffer */
+    return &mem[base + (addr & (size - 1))];
+}
+
+static
+uint8_t emu_read(uint8_t bsb, uint16_t addr, const uint16_t *bases)
+{
+    uint8_t val;
+
+    switch (BSB_TYPE(bsb))
+    {
+        case BSB_TYPE_SOCK:
+            val = w5x00_emu_sock_read(BSB_SOCKET(bsb), addr);
+            break;
+        case BSB_TYPE_TX:
+            val = *buf_byte(w5x00_emu_tx_mem, bases[0], bases[1], addr);
+            break;
+        case BSB_TYPE_RX:
+            val = *buf_byte(w5x00_emu_rx_mem, bases[0], bases[1], addr);
+            break;
+        default:
+            if (addr == W5500_SIR)
+            {
+                val = w5x00_emu_sock_ir();
+            }
+            else
+            {
+                val = w5x00_emu_common_read(addr);
+            }
+            break;
+    }
+    return val;
+}
+
+static
+void emu_write(uint8_t bsb, uint16_t addr, uint8_t val, const uint16_t *bases)
+{
+    switch (BSB_TYPE(bsb))
+    {
+        case BSB_TYPE_SOCK:
+            w5x00_emu_sock_write(BSB_SOCKET(bsb), addr, val);
+            if ((addr == W5500_Sn_TXBUF_SIZE) || (addr == W5500_Sn_RXBUF_SIZE))
+            {
+                layout_set();
+            }
+            break;
+        case BSB_TYPE_TX:
+            *buf_byte(w5x00_emu_tx_mem, bases[0], bases[1], addr) = val;
+            break;
+        case BSB_TYPE_RX:
+            *buf_byte(w5x00_emu_rx_mem, bases[0], bases[1], addr) = val;
+            break;
+        default:
+            if ((addr == W5100_MR) && (val & W5100_MODE_RST))
+            {
+                reset(); /* RST bit clears by itself */
+            }
+            else if (addr != W5500_VERSIONR)
+            {
+                w5x00_emu_common_write(addr, val);
+            }
+            break;
+    }
+}
+
+/* Base and size of the buffer selected by bsb. */
+static
+void buf_get(uint8_t bsb, uint16_t *bases)
+{
+    int isocket;
+    int i;
+    uint16_t base;
+
+    isocket = BSB_SOCKET(bsb);
+    base = 0;
+    for (i = 0; i <= isocket; i++)
+    {
+        uint16_t size;
+
+        if (BSB_TYPE(bsb) == BSB_TYPE_TX)
+        {
+            size = w5x00_emu_sock_read(i, W5500_Sn_TXBUF_SIZE) << 10;
+        }
+        else
+        {
+            size = w5x00_emu_sock_read(i, W5500_Sn_RXBUF_SIZE) << 10;
+        }
+        bases[0] = base;
+        bases[1] = size;
+        base += size;
+    }
+}
+
+void w5500_read_block(uint8_t bsb, uint16_t addr, void *buf, size_t n)
+{
+    uint8_t *pbytes = buf;
+    size_t i_byte;
+    uint16_t bases[2];
+
+    w5x00_emu_stats.frames++;
+    w5x00_emu_stats.bytes += n;
+
+    buf_get(bsb, bases);
+    for (i_byte = 0; i_byte < n; i_byte++)
+    {
+        pbytes[i_byte] = emu_read(bsb, addr + i_byte, bases);
+    }
+}
+
+void w5500_write_block(uint8_t bsb, uint16_t addr, const void *buf, size_t n)
+{
+    const uint8_t *pbytes = buf;
+    size_t i_byte;
+    uint16_t bases[2];
+
+    w5x00_emu_stats.frames++;
+    w5x00_emu_stats.bytes += n;
+
+    buf_get(bsb, bases);
+    for (i_byte = 0; i_byte < n; i_byte++)
+    {
+        emu_write(bsb, addr + i_byte, pbytes[i_byte], bases);
+    }
+}
+
+void w5500_init(void)
+{
+    reset(); /* power on */
+}
+
+/* The INT line follows the socket interrupts enabled in SIMR.
+ * Waiting lasts at most a tick of 1 ms, as on the board.
+ */
+int w5500_int_asserted(void)
+{
+    return (w5x00_emu_sock_ir() & w5x00_emu_common_read(W5500_SIMR)) != 0;
+}
+
+void w5500_int_wait(const struct timespec *deadline)
+{
+    (void)deadline;
+    w5x00_emu_wait(1);
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include "w5500.h"
+#include "w5x00_int.h"
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/gpio.h>
+
+/* W5500 shields use the same pins as the W5100 ones. */
+
+static
+void w5500_select(void)
+{
+    gpio_clear(GPIOB, GPIO6); /* lower chip select */
+}
+
+static
+void w5500_deselect(void)
+{
+    gpio_set(GPIOB, GPIO6); /* raise chip select */
+}
+
+static
+void w5500_xfer_header(uint8_t bsb, uint16_t addr, uint8_t rwb)
+{
+    (void)spi_xfer(SPI1, addr >> 8);
+    (void)spi_xfer(SPI1, addr & 0xFF);
+    (void)spi_xfer(SPI1, (bsb << W5500_CTRL_BSB_SHIFT) | rwb | W5500_CTRL_VDM);
+}
+
+void w5500_read_block(uint8_t bsb, uint16_t addr, void *buf, size_t n)
+{
+    uint8_t *pbytes = buf;
+    size_t i_byte;
+
+    w5500_select();
+    w5500_xfer_header(bsb, addr, W5500_CTRL_READ);
+    for (i_byte = 0; i_byte < n; i_byte++)
+    {
+        pbytes[i_byte] = spi_xfer(SPI1, 0x00);
+    }
+    w5500_deselect();
+}
+
+void w5500_write_block(uint8_t bsb, uint16_t addr, const void *buf, size_t n)
+{
+    const uint8_t *pbytes = buf;
+    size_t i_byte;
+
+    w5500_select();
+    w5500_xfer_header(bsb, addr, W5500_CTRL_WRITE);
+    for (i_byte = 0; i_byte < n; i_byte++)
+    {
+        (void)spi_xfer(SPI1, pbytes[i_byte]);
+    }
+    w5500_deselect();
+}
+
+/* The INT line is the same for both shields. */
+int w5500_int_asserted(void)
+{
+    return w5x00_int_asserted();
+}
+
+void w5500_int_wait(const struct timespec *deadline)
+{
+    w5x00_int_wait(deadline);
+}
+
+static
+void w5500_spi_init(void)
+{
+    rcc_periph_clock_enable(RCC_SPI1);
+    rcc_periph_clock_enable(RCC_GPIOA);
+    rcc_periph_clock_enable(RCC_GPIOB);
+
+    gpio_set(GPIOB, GPIO5);
+#ifdef STM32F1
+    /* CN5_6 D13 PA5 SPI1_SCK */
+    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_SCK);
+    /* CN5_4 D11 PA7 SPI1_MOSI */
+    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_MOSI);
+    /* CN5_5 D12 PA6 SPI1_MISO */
+    gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, GPIO_SPI1_MISO);
+    /* CN5_3 D10 PB6 SPI1_CS */
+    gpio_set_mode(GPIOB, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO6);
+    gpio_set_mode(GPIOB, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO5);
+#elif defined(STM32F4)
+    /* CN5_6 D13 PA5 SPI1_SCK */
+    /* CN5_4 D11 PA7 SPI1_MOSI */
+    /* CN5_5 D12 PA6 SPI1_MISO */
+    gpio_set_af(GPIOA, GPIO_AF5, GPIO5|GPIO6|GPIO7);
+    gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO5|GPIO6|GPIO7);
+    /* CN5_3 D10 PB6 SPI1_CS */
+    /* CN9_5 D4 PB5 SD_CS */
+    gpio_mode_setup(GPIOB, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO5|GPIO6);
+#endif
+    w5500_deselect();
+
+    /* Same clock setup as W5100: SCLK @ 4MHz with HSI 8MHz. */
+    spi_init_master(
+            SPI1,
+            SPI_CR1_BAUDRATE_FPCLK_DIV_2,
+            SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE,
+            SPI_CR1_CPHA_CLK_TRANSITION_1,
+            SPI_CR1_DFF_8BIT,
+            SPI_CR1_MSBFIRST);
+
+    spi_enable_software_slave_management(SPI1);
+    spi_set_nss_high(SPI1); /* Avoid Master mode fault MODF */
+    spi_enable(SPI1);
+}
+
+void w5500_init(void)
+{
+    w5500_spi_init();
+    w5x00_int_init();
+}
@@ -0,0 +1,1327 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "w5100.h"
+#include "w5x00_emu.h"
+#include "w5x00_emu_host.h"
+
+#define UDP_HEADER_SIZE 8
+
+#define NO_PEER (-1)
+#define NO_HOST_FD (-1)
+#define NO_LISTENER (-1)
+
+#define TUNNEL_CHUNK 1024
+
+/* MACRAW frames */
+#define MACRAW_INFO_SIZE 2
+#define ETH_HEADER_SIZE 14
+#define ETH_TYPE_IP 0x0800
+#define ETH_TYPE_ARP 0x0806
+#define ARP_SIZE 28
+#define IP_HEADER_SIZE 20
+#define IP_PROTO_UDP 17
+#define UDP_HDR_SIZE 8
+#define FRAME_HEADERS (ETH_HEADER_SIZE + IP_HEADER_SIZE + UDP_HDR_SIZE)
+#define MACRAW_PORTS 8 /* source ports with a host socket */
+
+/* W5500 only, RX write pointer */
+#define EMU_Sn_RX_WR0 0x002A
+#define EMU_Sn_RX_WR1 0x002B
+
+struct emu_socket {
+    uint8_t regs[W5X00_EMU_SOCK_REGS_SIZE];
+    uint16_t tx_base;
+    uint16_t tx_size;
+    uint16_t rx_base;
+    uint16_t rx_size;
+    uint16_t tx_rd;  /* next byte to be sent */
+    uint16_t tx_end; /* Sn_TX_WR at the last SEND */
+    uint16_t rx_wr;  /* next byte to be received */
+    uint16_t rx_rd;  /* Sn_RX_RD at the last RECV */
+    int peer;        /* connected socket, for local TCP connections */
+    int host_fd;     /* host socket, for tunneled traffic */
+    int listener;    /* host listening socket, index in listeners */
+};
+
+/* Host listening sockets, shared by the sockets listening on a port. */
+struct emu_listener {
+    int fd;
+    uint16_t port;
+    int users;
+};
+
+struct w5x00_emu_stats w5x00_emu_stats;
+
+uint8_t w5x00_emu_tx_mem[W5X00_EMU_MEM_SIZE];
+
+uint8_t w5x00_emu_rx_mem[W5X00_EMU_MEM_SIZE];
+
+static uint8_t common[W5X00_EMU_COMMON_SIZE];
+
+static struct emu_socket sockets[W5X00_EMU_MAX_SOCKETS];
+
+static struct emu_listener listeners[W5X00_EMU_MAX_SOCKETS];
+
+static int n_sockets;
+
+/* Host UDP sockets of the MACRAW socket, one per source port. */
+static struct macraw_port {
+    int fd;
+    uint16_t port;
+} macraw_ports[MACRAW_PORTS];
+
+/* Ethernet address of every other node. */
+static const uint8_t peer_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+
+static
+uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static
+void set16(uint8_t *p, uint16_t val)
+{
+    p[0] = val >> 8;
+    p[1] = val & 0xFF;
+}
+
+static
+uint16_t tx_used(const struct emu_socket *s)
+{
+    return s->tx_end - s->tx_rd;
+}
+
+static
+uint16_t rx_used(const struct emu_socket *s)
+{
+    return s->rx_wr - s->rx_rd;
+}
+
+static
+uint16_t rx_free(const struct emu_socket *s)
+{
+    return s->rx_size - rx_used(s);
+}
+
+static
+void tx_get(struct emu_socket *s, void *buf, uint16_t n)
+{
+    uint8_t *bytes = buf;
+    uint16_t i;
+
+    if (s->tx_size == 0)
+    {
+        n = 0; /* no memory assigned to the socket */
+    }
+    for (i = 0; i < n; i++)
+    {
+        bytes[i] = w5x00_emu_tx_mem[s->tx_base + (s->tx_rd & (s->tx_size - 1))];
+        s->tx_rd++;
+    }
+}
+
+static
+void tx_peek(const struct emu_socket *s, void *buf, uint16_t n)
+{
+    uint8_t *bytes = buf;
+    uint16_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        bytes[i] = w5x00_emu_tx_mem[s->tx_base + ((s->tx_rd + i) & (s->tx_size - 1))];
+    }
+}
+
+static
+void rx_put(struct emu_socket *s, const void *buf, uint16_t n)
+{
+    const uint8_t *bytes = buf;
+    uint16_t i;
+
+    if (s->rx_size == 0)
+    {
+        n = 0; /* no memory assigned to the socket */
+    }
+    for (i = 0; i < n; i++)
+    {
+        w5x00_emu_rx_mem[s->rx_base + (s->rx_wr & (s->rx_size - 1))] = bytes[i];
+        s->rx_wr++;
+    }
+    s->regs[W5100_Sn_IR] |= W5100_INT_RECV;
+}
+
+static
+int is_local_address(const uint8_t *ip)
+{
+    return (memcmp(ip, &common[W5100_SIPR], W5100_SIPR_SIZE) == 0);
+}
+
+static
+struct emu_socket *find_socket(uint8_t sr, const uint8_t *port)
+{
+    struct emu_socket *found;
+    int i;
+
+    found = NULL;
+    for (i = 0; i < n_sockets; i++)
+    {
+        struct emu_socket *s;
+
+        s = &sockets[i];
+        if ((s->regs[W5100_Sn_SR] == sr)
+                && (memcmp(&s->regs[W5100_Sn_PORT], port, W5100_Sn_PORT_SIZE) == 0))
+        {
+            found = s;
+            break;
+        }
+    }
+    return found;
+}
+
+static
+void set_state(struct emu_socket *s, uint8_t sr, uint8_t ir)
+{
+    s->regs[W5100_Sn_SR] = sr;
+    s->regs[W5100_Sn_IR] |= ir;
+}
+
+static
+int can_send(uint8_t sr)
+{
+    return (sr == W5100_SOCK_ESTABLISHED) || (sr == W5100_SOCK_CLOSE_WAIT);
+}
+
+/* Tunnel: traffic for other addresses goes through host sockets,
+ * that are looked at whenever the MCU could notice a change:
+ * reading Sn_SR, Sn_IR, Sn_RX_RSR, Sn_TX_FSR or the interrupt register.
+ */
+
+static
+void macraw_close(void)
+{
+    int i;
+
+    for (i = 0; i < MACRAW_PORTS; i++)
+    {
+        if (macraw_ports[i].fd != NO_HOST_FD)
+        {
+            w5x00_emu_host_close(macraw_ports[i].fd);
+            macraw_ports[i].fd = NO_HOST_FD;
+        }
+    }
+}
+
+static
+void tunnel_host_close(struct emu_socket *s)
+{
+    if (s->host_fd != NO_HOST_FD)
+    {
+        w5x00_emu_host_close(s->host_fd);
+        s->host_fd = NO_HOST_FD;
+    }
+}
+
+/* A server socket keeps its host listening socket after a connection,
+ * until it is opened again, usually to listen again on the same port.
+ */
+static
+void tunnel_close(struct emu_socket *s)
+{
+    tunnel_host_close(s);
+    if (s->regs[W5100_Sn_SR] == W5100_SOCK_MACRAW)
+    {
+        macraw_close();
+    }
+    if (s->listener != NO_LISTENER)
+    {
+        /* the host socket is closed at the next pump, if nobody
+         * listens again on the port in the meantime.
+         */
+        listeners[s->listener].users--;
+        s->listener = NO_LISTENER;
+    }
+}
+
+static
+void tunnel_listen(struct emu_socket *s)
+{
+    uint16_t port;
+    int i;
+    int free_slot;
+
+    port = get16(&s->regs[W5100_Sn_PORT]);
+    free_slot = NO_LISTENER;
+    for (i = 0; i < W5X00_EMU_MAX_SOCKETS; i++)
+    {
+        if (listeners[i].fd == NO_HOST_FD)
+        {
+            free_slot = i;
+        }
+        else if (listeners[i].port == port)
+        {
+            break;
+        }
+    }
+    if (i < W5X00_EMU_MAX_SOCKETS)
+    {
+        listeners[i].users++;
+        s->listener = i;
+    }
+    else if (free_slot != NO_LISTENER)
+    {
+        int fd;
+
+        fd = w5x00_emu_host_tcp_listen(port);
+        if (fd != -1)
+        {
+            listeners[free_slot].fd = fd;
+            listeners[free_slot].port = port;
+            listeners[free_slot].users = 1;
+            s->listener = free_slot;
+        }
+    }
+}
+
+static
+void tunnel_connect(struct emu_socket *s)
+{
+    static const uint8_t any_address[4] = {0, 0, 0, 0};
+
+    /* the host would take 0.0.0.0 for itself, the chip gets no ARP reply */
+    if (memcmp(&s->regs[W5100_Sn_DIPR], any_address, sizeof(any_address)) != 0)
+    {
+        s->host_fd = w5x00_emu_host_tcp_connect(
+                &s->regs[W5100_Sn_DIPR],
+                get16(&s->regs[W5100_Sn_DPORT]));
+    }
+    if (s->host_fd == NO_HOST_FD)
+    {
+        set_state(s, W5100_SOCK_CLOSED, W5100_INT_TIMEOUT);
+    }
+    else
+    {
+        s->regs[W5100_Sn_SR] = W5100_SOCK_SYNSENT;
+    }
+}
+
+/* The host connection is gone. */
+static
+void tunnel_lost(struct emu_socket *s)
+{
+    tunnel_host_close(s);
+    set_state(s, W5100_SOCK_CLOSED, W5100_INT_DISCON);
+}
+
+static
+void tunnel_tx(struct emu_socket *s)
+{
+    if (tx_used(s) > 0)
+    {
+        do
+        {
+            uint8_t chunk[TUNNEL_CHUNK];
+            uint16_t n;
+            long nsent;
+
+            n = tx_used(s);
+            if (n > sizeof(chunk))
+            {
+                n = sizeof(chunk);
+            }
+            tx_peek(s, chunk, n);
+            nsent = w5x00_emu_host_send(s->host_fd, chunk, n);
+            if (nsent == W5X00_EMU_HOST_ERROR)
+            {
+                tunnel_lost(s);
+                break;
+            }
+            else if (nsent == W5X00_EMU_HOST_AGAIN)
+            {
+                break;
+            }
+            s->tx_rd += nsent;
+        } while (tx_used(s) > 0);
+        if (tx_used(s) == 0)
+        {
+            s->regs[W5100_Sn_IR] |= W5100_INT_SEND_OK;
+        }
+    }
+}
+
+static
+void tunnel_rx(struct emu_socket *s)
+{
+    while (rx_free(s) > 0)
+    {
+        uint8_t chunk[TUNNEL_CHUNK];
+        uint16_t n;
+        long nrecv;
+
+        n = rx_free(s);
+        if (n > sizeof(chunk))
+        {
+            n = sizeof(chunk);
+        }
+        nrecv = w5x00_emu_host_recv(s->host_fd, chunk, n);
+        if (nrecv == W5X00_EMU_HOST_ERROR)
+        {
+            tunnel_lost(s);
+            break;
+        }
+        else if (nrecv == W5X00_EMU_HOST_AGAIN)
+        {
+            break;
+        }
+        else if (nrecv == 0)
+        {
+            /* FIN from the host */
+            set_state(s, W5100_SOCK_CLOSE_WAIT, W5100_INT_DISCON);
+            break;
+        }
+        rx_put(s, chunk, nrecv);
+    }
+}
+
+static
+void tunnel_udp_rx(struct emu_socket *s)
+{
+    uint8_t dgram[W5X00_EMU_MEM_SIZE];
+    long len;
+
+    do
+    {
+        uint8_t header[UDP_HEADER_SIZE];
+        uint16_t port;
+
+        len = -1;
+        if (rx_free(s) > UDP_HEADER_SIZE)
+        {
+            len = w5x00_emu_host_recvfrom(
+                    s->host_fd, dgram, rx_free(s) - UDP_HEADER_SIZE,
+                    &header[0], &port);
+        }
+        if (len >= 0)
+        {
+            set16(&header[4], port);
+            set16(&header[6], len);
+            rx_put(s, header, sizeof(header));
+            rx_put(s, dgram, len);
+        }
+    } while (len >= 0);
+}
+
+static
+uint16_t cksum(uint32_t sum, const uint8_t *buf, uint16_t n)
+{
+    uint16_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        sum += (i & 1) ? buf[i] : (buf[i] << 8);
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return sum;
+}
+
+/* Datagrams from the host become frames for the MACRAW socket. */
+static
+void tunnel_macraw_rx(struct emu_socket *s)
+{
+    uint8_t frame[MACRAW_INFO_SIZE + FRAME_HEADERS + W5X00_EMU_MEM_SIZE];
+    int i;
+
+    for (i = 0; i < MACRAW_PORTS; i++)
+    {
+        long len;
+
+        do
+        {
+            uint8_t *eth;
+            uint8_t *ip;
+            uint8_t *udp;
+            uint8_t pseudo[4];
+            uint16_t port;
+            uint16_t sum;
+
+            eth = &frame[MACRAW_INFO_SIZE];
+            ip = &eth[ETH_HEADER_SIZE];
+            udp = &ip[IP_HEADER_SIZE];
+            len = -1;
+            if (
+                    (macraw_ports[i].fd != NO_HOST_FD)
+                    &&
+                    (rx_free(s) > MACRAW_INFO_SIZE + FRAME_HEADERS)
+               )
+            {
+                len = w5x00_emu_host_recvfrom(
+                        macraw_ports[i].fd, &udp[UDP_HDR_SIZE],
+                        rx_free(s) - MACRAW_INFO_SIZE - FRAME_HEADERS,
+                        &ip[12], &port);
+            }
+            if (len >= 0)
+            {
+                set16(&frame[0], MACRAW_INFO_SIZE + FRAME_HEADERS + len);
+                memcpy(&eth[0], &common[W5100_SHAR], W5100_SHAR_SIZE);
+                memcpy(&eth[6], peer_mac, sizeof(peer_mac));
+                set16(&eth[12], ETH_TYPE_IP);
+                ip[0] = 0x45;
+                ip[1] = 0;
+                set16(&ip[2], IP_HEADER_SIZE + UDP_HDR_SIZE + len);
+                set16(&ip[4], 0);
+                set16(&ip[6], 0);
+                ip[8] = 64;
+                ip[9] = IP_PROTO_UDP;
+                set16(&ip[10], 0);
+                memcpy(&ip[16], &common[W5100_SIPR], W5100_SIPR_SIZE);
+                set16(&ip[10], ~cksum(0, ip, IP_HEADER_SIZE));
+                set16(&udp[0], port);
+                set16(&udp[2], macraw_ports[i].port);
+                set16(&udp[4], UDP_HDR_SIZE + len);
+                set16(&udp[6], 0);
+                pseudo[0] = 0;
+                pseudo[1] = IP_PROTO_UDP;
+                set16(&pseudo[2], UDP_HDR_SIZE + len);
+                sum = cksum(cksum(cksum(0, &ip[12], 8), pseudo, sizeof(pseudo)),
+                        udp, UDP_HDR_SIZE + len);
+                set16(&udp[6], (sum != 0xFFFF) ? (uint16_t)~sum : 0xFFFF);
+                rx_put(s, frame, MACRAW_INFO_SIZE + FRAME_HEADERS + len);
+            }
+        } while (len >= 0);
+    }
+}
+
+static
+void tunnel_accept(struct emu_socket *s)
+{
+    uint16_t port;
+    int fd;
+
+    fd = w5x00_emu_host_tcp_accept(
+            listeners[s->listener].fd,
+            &s->regs[W5100_Sn_DIPR],
+            &port);
+    if (fd != -1)
+    {
+        s->host_fd = fd;
+        set16(&s->regs[W5100_Sn_DPORT], port);
+        set_state(s, W5100_SOCK_ESTABLISHED, W5100_INT_CON);
+    }
+}
+
+static
+void tunnel_pump(void)
+{
+    int i;
+
+    for (i = 0; i < n_sockets; i++)
+    {
+        struct emu_socket *s;
+
+        s = &sockets[i];
+        switch (s->regs[W5100_Sn_SR])
+        {
+            case W5100_SOCK_SYNSENT:
+                switch (w5x00_emu_host_tcp_connected(s->host_fd))
+                {
+                    case 0:
+                        set_state(s, W5100_SOCK_ESTABLISHED, W5100_INT_CON);
+                        break;
+                    case 1:
+                        break;
+                    case -1:
+                        tunnel_lost(s); /* RST */
+                        break;
+                    default:
+                        tunnel_host_close(s);
+                        set_state(s, W5100_SOCK_CLOSED, W5100_INT_TIMEOUT);
+                        break;
+                }
+                break;
+            case W5100_SOCK_LISTEN:
+                if (s->listener != NO_LISTENER)
+                {
+                    tunnel_accept(s);
+                }
+                break;
+            case W5100_SOCK_ESTABLISHED:
+                if (s->host_fd != NO_HOST_FD)
+                {
+                    tunnel_tx(s);
+                }
+                if (s->host_fd != NO_HOST_FD)
+                {
+                    tunnel_rx(s);
+                }
+                break;
+            case W5100_SOCK_CLOSE_WAIT:
+                if (s->host_fd != NO_HOST_FD)
+                {
+                    tunnel_tx(s);
+                }
+                break;
+            case W5100_SOCK_UDP:
+                if (s->host_fd != NO_HOST_FD)
+                {
+                    tunnel_udp_rx(s);
+                }
+                break;
+            case W5100_SOCK_MACRAW:
+                tunnel_macraw_rx(s);
+                break;
+            default:
+                break;
+        }
+    }
+    for (i = 0; i < W5X00_EMU_MAX_SOCKETS; i++)
+    {
+        if ((listeners[i].fd != NO_HOST_FD) && (listeners[i].users == 0))
+        {
+            w5x00_emu_host_close(listeners[i].fd);
+            listeners[i].fd = NO_HOST_FD;
+        }
+    }
+}
+
+/* Move pending TX data of a TCP socket into the RX buffer of its peer,
+ * as much as the peer window allows.
+ */
+static
+void tcp_flush(struct emu_socket *s)
+{
+    if (tx_used(s) > 0)
+    {
+        if (s->peer == NO_PEER)
+        {
+            /* nobody is listening anymore, data is lost */
+            s->tx_rd = s->tx_end;
+        }
+        else if (can_send(s->regs[W5100_Sn_SR]))
+        {
+            struct emu_socket *peer;
+            uint8_t chunk[64];
+            uint16_t n;
+
+            peer = &sockets[s->peer];
+            n = tx_used(s);
+            if (n > rx_free(peer))
+            {
+                n = rx_free(peer);
+            }
+            while (n > 0)
+            {
+                uint16_t nchunk;
+
+                nchunk = (n > sizeof(chunk)) ? sizeof(chunk) : n;
+                tx_get(s, chunk, nchunk);
+                rx_put(peer, chunk, nchunk);
+                n -= nchunk;
+            }
+        }
+        if (tx_used(s) == 0)
+        {
+            s->regs[W5100_Sn_IR] |= W5100_INT_SEND_OK;
+        }
+    }
+}
+
+/* Both ends keep the smaller of the offered MSS, 0 is the default. */
+static
+void tcp_mss_agree(struct emu_socket *a, struct emu_socket *b)
+{
+    uint16_t mss_a;
+    uint16_t mss_b;
+    uint16_t mss;
+
+    mss_a = get16(&a->regs[W5100_Sn_MSSR]);
+    mss_b = get16(&b->regs[W5100_Sn_MSSR]);
+    if ((mss_a == 0) || ((mss_b != 0) && (mss_b < mss_a)))
+    {
+        mss = mss_b;
+    }
+    else
+    {
+        mss = mss_a;
+    }
+    set16(&a->regs[W5100_Sn_MSSR], mss);
+    set16(&b->regs[W5100_Sn_MSSR], mss);
+}
+
+static
+void tcp_connect(struct emu_socket *s)
+{
+    struct emu_socket *listener;
+
+    if (is_local_address(&s->regs[W5100_Sn_DIPR]))
+    {
+        listener = find_socket(W5100_SOCK_LISTEN, &s->regs[W5100_Sn_DPORT]);
+        if (listener == NULL)
+        {
+            /* RST */
+            set_state(s, W5100_SOCK_CLOSED, W5100_INT_DISCON);
+        }
+        else
+        {
+            memcpy(&listener->regs[W5100_Sn_DIPR], &common[W5100_SIPR], W5100_Sn_DIPR_SIZE);
+            memcpy(&listener->regs[W5100_Sn_DPORT], &s->regs[W5100_Sn_PORT], W5100_Sn_DPORT_SIZE);
+            tcp_mss_agree(s, listener);
+            listener->peer = s - sockets;
+            s->peer = listener - sockets;
+            set_state(listener, W5100_SOCK_ESTABLISHED, W5100_INT_CON);
+            set_state(s, W5100_SOCK_ESTABLISHED, W5100_INT_CON);
+        }
+    }
+    else
+    {
+        tunnel_connect(s);
+    }
+}
+
+/* FIN handshake, without the time spent in the intermediate states:
+ * the first socket that disconnects stays in FIN_WAIT, and can still
+ * receive, while its peer goes to CLOSE_WAIT; when the peer
+ * disconnects too both are CLOSED.
+ * Data already received stays in the RX buffer.
+ */
+static
+void tcp_disconnect(struct emu_socket *s)
+{
+    if (s->host_fd != NO_HOST_FD)
+    {
+        /* the host sends the FIN after the data */
+        tunnel_tx(s);
+        tunnel_host_close(s);
+    }
+    tcp_flush(s);
+    if (s->peer == NO_PEER)
+    {
+        set_state(s, W5100_SOCK_CLOSED, W5100_INT_DISCON);
+    }
+    else if (s->regs[W5100_Sn_SR] == W5100_SOCK_ESTABLISHED)
+    {
+        set_state(&sockets[s->peer], W5100_SOCK_CLOSE_WAIT, W5100_INT_DISCON);
+        set_state(s, W5100_SOCK_FIN_WAIT, 0);
+    }
+    else if (s->regs[W5100_Sn_SR] == W5100_SOCK_CLOSE_WAIT)
+    {
+        struct emu_socket *peer;
+
+        peer = &sockets[s->peer];
+        set_state(peer, W5100_SOCK_CLOSED, W5100_INT_DISCON);
+        peer->peer = NO_PEER;
+        s->peer = NO_PEER;
+        set_state(s, W5100_SOCK_CLOSED, W5100_INT_DISCON);
+    }
+}
+
+static
+void tcp_close(struct emu_socket *s)
+{
+    if (s->peer != NO_PEER)
+    {
+        struct emu_socket *peer;
+
+        /* RST */
+        peer = &sockets[s->peer];
+        set_state(peer, W5100_SOCK_CLOSED, W5100_INT_DISCON);
+        peer->peer = NO_PEER;
+        s->peer = NO_PEER;
+    }
+}
+
+/* A local connection without peer has lost it silently,
+ * see w5x00_emu_drop_peers: the probe is not answered.
+ * Tunneled connections are kept alive by the host.
+ */
+static
+void tcp_keepalive(struct emu_socket *s)
+{
+    uint8_t sr;
+
+    sr = s->regs[W5100_Sn_SR];
+    if (
+            ((sr == W5100_SOCK_ESTABLISHED) || (sr == W5100_SOCK_CLOSE_WAIT))
+            &&
+            (s->peer == NO_PEER)
+            &&
+            (s->host_fd == NO_HOST_FD)
+       )
+    {
+        set_state(s, W5100_SOCK_CLOSED, W5100_INT_TIMEOUT);
+    }
+}
+
+static
+int is_multicast_address(const uint8_t *ip)
+{
+    return ((ip[0] & 0xF0) == 0xE0);
+}
+
+/* The datagram from ip and port (in network order) goes
+ * in the RX buffer of dest, if there is room.
+ */
+static
+void udp_deliver(const uint8_t *ip, const uint8_t *port, struct emu_socket *dest,
+        const uint8_t *dgram, uint16_t len)
+{
+    if (rx_free(dest) >= len + UDP_HEADER_SIZE)
+    {
+        uint8_t header[UDP_HEADER_SIZE];
+
+        memcpy(&header[0], ip, 4);
+        memcpy(&header[4], port, 2);
+        set16(&header[6], len);
+        rx_put(dest, header, sizeof(header));
+        rx_put(dest, dgram, len);
+    }
+}
+
+/* Group datagrams reach the other sockets open in multicast mode
+ * on the group, as if they were on other nodes of the segment.
+ */
+static
+void udp_multicast(const struct emu_socket *s, const uint8_t *dgram, uint16_t len)
+{
+    int i;
+
+    for (i = 0; i < n_sockets; i++)
+    {
+        struct emu_socket *dest;
+
+        dest = &sockets[i];
+        if (
+                (dest != s)
+                &&
+                (dest->regs[W5100_Sn_SR] == W5100_SOCK_UDP)
+                &&
+                (dest->regs[W5100_Sn_MR] & W5100_SOCK_MODE_MULTI)
+                &&
+                (memcmp(&dest->regs[W5100_Sn_DIPR], &s->regs[W5100_Sn_DIPR], W5100_Sn_DIPR_SIZE) == 0)
+                &&
+                (memcmp(&dest->regs[W5100_Sn_PORT], &s->regs[W5100_Sn_DPORT], W5100_Sn_PORT_SIZE) == 0)
+           )
+        {
+            udp_deliver(&common[W5100_SIPR], &s->regs[W5100_Sn_PORT], dest, dgram, len);
+        }
+    }
+}
+
+static
+void udp_send(struct emu_socket *s)
+{
+    uint16_t len;
+    uint8_t dgram[W5X00_EMU_MEM_SIZE];
+
+    len = tx_used(s);
+    tx_get(s, dgram, len);
+    if (is_multicast_address(&s->regs[W5100_Sn_DIPR]))
+    {
+        udp_multicast(s, dgram, len);
+    }
+    else if (is_local_address(&s->regs[W5100_Sn_DIPR]))
+    {
+        struct emu_socket *dest;
+
+        dest = find_socket(W5100_SOCK_UDP, &s->regs[W5100_Sn_DPORT]);
+        if (dest != NULL)
+        {
+            udp_deliver(&common[W5100_SIPR], &s->regs[W5100_Sn_PORT], dest, dgram, len);
+        }
+    }
+    else if (s->host_fd != NO_HOST_FD)
+    {
+        (void)w5x00_emu_host_sendto(
+                s->host_fd, dgram, len,
+                &s->regs[W5100_Sn_DIPR],
+                get16(&s->regs[W5100_Sn_DPORT]));
+    }
+    /* datagrams that can not be delivered are lost */
+    s->tx_rd = s->tx_end;
+    s->regs[W5100_Sn_IR] |= W5100_INT_SEND_OK;
+}
+
+/* Host socket for the datagrams from port, opened on first use. */
+static
+int macraw_port_fd(uint16_t port)
+{
+    int fd;
+    int i;
+
+    fd = NO_HOST_FD;
+    for (i = 0; (i < MACRAW_PORTS) && (fd == NO_HOST_FD); i++)
+    {
+        if ((macraw_ports[i].fd != NO_HOST_FD) && (macraw_ports[i].port == port))
+        {
+            fd = macraw_ports[i].fd;
+        }
+    }
+    for (i = 0; (i < MACRAW_PORTS) && (fd == NO_HOST_FD); i++)
+    {
+        if (macraw_ports[i].fd == NO_HOST_FD)
+        {
+            fd = w5x00_emu_host_udp_open(port);
+            macraw_ports[i].fd = fd;
+            macraw_ports[i].port = port;
+            break;
+        }
+    }
+    return fd;
+}
+
+/* ARP requests are answered at once, IPv4 UDP frames are delivered;
+ * everything else is lost.
+ */
+static
+void macraw_send(struct emu_socket *s)
+{
+    uint8_t frame[MACRAW_INFO_SIZE + W5X00_EMU_MEM_SIZE];
+    uint8_t *eth;
+    uint8_t *ip;
+    uint16_t len;
+
+    eth = &frame[MACRAW_INFO_SIZE];
+    ip = &eth[ETH_HEADER_SIZE];
+    len = tx_used(s);
+    tx_get(s, eth, len);
+    if (
+            (len >= ETH_HEADER_SIZE + ARP_SIZE)
+            &&
+            (get16(&eth[12]) == ETH_TYPE_ARP)
+            &&
+            (get16(&ip[6]) == 1)
+       )
+    {
+        uint8_t *arp;
+        uint8_t sha[6];
+        uint8_t spa[4];
+        uint8_t tpa[4];
+
+        /* the reply, in place */
+        arp = ip;
+        memcpy(sha, &arp[8], sizeof(sha));
+        memcpy(spa, &arp[14], sizeof(spa));
+        memcpy(tpa, &arp[24], sizeof(tpa));
+        memcpy(&eth[0], sha, sizeof(sha));
+        memcpy(&eth[6], peer_mac, sizeof(peer_mac));
+        set16(&arp[6], 2);
+        memcpy(&arp[8], peer_mac, sizeof(peer_mac));
+        memcpy(&arp[14], tpa, sizeof(tpa));
+        memcpy(&arp[18], sha, sizeof(sha));
+        memcpy(&arp[24], spa, sizeof(spa));
+        set16(&frame[0], MACRAW_INFO_SIZE + ETH_HEADER_SIZE + ARP_SIZE);
+        if (rx_free(s) >= MACRAW_INFO_SIZE + ETH_HEADER_SIZE + ARP_SIZE)
+        {
+            rx_put(s, frame, MACRAW_INFO_SIZE + ETH_HEADER_SIZE + ARP_SIZE);
+        }
+    }
+    else if (
+            (len >= FRAME_HEADERS)
+            &&
+            (get16(&eth[12]) == ETH_TYPE_IP)
+            &&
+            (ip[9] == IP_PROTO_UDP)
+            &&
+            (get16(&ip[IP_HEADER_SIZE + 4]) >= UDP_HDR_SIZE)
+            &&
+            (get16(&ip[IP_HEADER_SIZE + 4]) <= len - ETH_HEADER_SIZE - IP_HEADER_SIZE)
+       )
+    {
+        const uint8_t *udp;
+        uint16_t dlen;
+
+        udp = &ip[IP_HEADER_SIZE];
+        dlen = get16(&udp[4]) - UDP_HDR_SIZE;
+        if (is_local_address(&ip[16]))
+        {
+            struct emu_socket *dest;
+
+            dest = find_socket(W5100_SOCK_UDP, &udp[2]);
+            if (dest != NULL)
+            {
+                udp_deliver(&ip[12], &udp[0], dest, &udp[UDP_HDR_SIZE], dlen);
+            }
+        }
+        else if (!is_multicast_address(&ip[16]))
+        {
+            int fd;
+
+            fd = macraw_port_fd(get16(&udp[0]));
+            if (fd != NO_HOST_FD)
+            {
+                (void)w5x00_emu_host_sendto(fd, &udp[UDP_HDR_SIZE], dlen, &ip[16], get16(&udp[2]));
+            }
+        }
+    }
+    s->tx_rd = s->tx_end;
+    s->regs[W5100_Sn_IR] |= W5100_INT_SEND_OK;
+}
+
+static
+void sock_open(struct emu_socket *s)
+{
+    uint8_t sr;
+
+    if (s->peer != NO_PEER)
+    {
+        tcp_close(s);
+    }
+    tunnel_close(s);
+    switch (s->regs[W5100_Sn_MR] & 0x0F)
+    {
+        case W5100_SOCK_MODE_TCP:
+            sr = W5100_SOCK_INIT;
+            break;
+        case W5100_SOCK_MODE_UDP:
+            sr = W5100_SOCK_UDP;
+            break;
+        case W5100_SOCK_MODE_IPRAW:
+            sr = W5100_SOCK_IPRAW;
+            break;
+        case W5100_SOCK_MODE_MACRAW:
+            sr = W5100_SOCK_MACRAW;
+            break;
+        default:
+            sr = W5100_SOCK_CLOSED;
+            break;
+    }
+    s->tx_rd = 0;
+    s->tx_end = 0;
+    s->rx_wr = 0;
+    s->rx_rd = 0;
+    set16(&s->regs[W5100_Sn_TX_WR], 0);
+    set16(&s->regs[W5100_Sn_RX_RD], 0);
+    s->regs[W5100_Sn_SR] = sr;
+    if (sr == W5100_SOCK_UDP)
+    {
+        s->host_fd = w5x00_emu_host_udp_open(get16(&s->regs[W5100_Sn_PORT]));
+    }
+}
+
+static
+void sock_command(struct emu_socket *s, uint8_t cmd)
+{
+    uint8_t sr;
+
+    w5x00_emu_stats.commands++;
+    sr = s->regs[W5100_Sn_SR];
+    switch (cmd)
+    {
+        case W5100_CMD_OPEN:
+            sock_open(s);
+            break;
+        case W5100_CMD_LISTEN:
+            if (sr == W5100_SOCK_INIT)
+            {
+                s->regs[W5100_Sn_SR] = W5100_SOCK_LISTEN;
+                tunnel_listen(s);
+            }
+            break;
+        case W5100_CMD_CONNECT:
+            if (sr == W5100_SOCK_INIT)
+            {
+                tcp_connect(s);
+            }
+            break;
+        case W5100_CMD_DISCON:
+            tcp_disconnect(s);
+            break;
+        case W5100_CMD_CLOSE:
+            tcp_close(s);
+            tunnel_close(s);
+            s->regs[W5100_Sn_SR] = W5100_SOCK_CLOSED;
+            break;
+        case W5100_CMD_SEND:
+        case W5100_CMD_SEND_MAC:
+            s->tx_end = get16(&s->regs[W5100_Sn_TX_WR]);
+            if (sr == W5100_SOCK_UDP)
+            {
+                udp_send(s);
+            }
+            else if (sr == W5100_SOCK_MACRAW)
+            {
+                macraw_send(s);
+            }
+            else if (s->host_fd != NO_HOST_FD)
+            {
+                tunnel_tx(s);
+            }
+            else
+            {
+                tcp_flush(s);
+            }
+            break;
+        case W5100_CMD_SEND_KEEP:
+            tcp_keepalive(s);
+            break;
+        case W5100_CMD_RECV:
+            s->rx_rd = get16(&s->regs[W5100_Sn_RX_RD]);
+            if (s->peer != NO_PEER)
+            {
+                /* window opened */
+                tcp_flush(&sockets[s->peer]);
+            }
+            else if ((s->host_fd != NO_HOST_FD) && (sr == W5100_SOCK_ESTABLISHED))
+            {
+                tunnel_rx(s);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void w5x00_emu_reset(int n)
+{
+    int i;
+
+    for (i = 0; i < W5X00_EMU_MAX_SOCKETS; i++)
+    {
+        /* power on, when everything is 0, does not close anything */
+        if (sockets[i].host_fd > 0)
+        {
+            w5x00_emu_host_close(sockets[i].host_fd);
+        }
+        if (listeners[i].fd > 0)
+        {
+            w5x00_emu_host_close(listeners[i].fd);
+        }
+    }
+    for (i = 0; i < MACRAW_PORTS; i++)
+    {
+        if (macraw_ports[i].fd > 0)
+        {
+            w5x00_emu_host_close(macraw_ports[i].fd);
+        }
+        macraw_ports[i].fd = NO_HOST_FD;
+    }
+    memset(common, 0, sizeof(common));
+    memset(sockets, 0, sizeof(sockets));
+    n_sockets = n;
+    for (i = 0; i < W5X00_EMU_MAX_SOCKETS; i++)
+    {
+        sockets[i].peer = NO_PEER;
+        sockets[i].host_fd = NO_HOST_FD;
+        sockets[i].listener = NO_LISTENER;
+        listeners[i].fd = NO_HOST_FD;
+    }
+}
+
+uint8_t w5x00_emu_common_read(uint16_t reg)
+{
+    uint8_t val;
+
+    if (reg < W5X00_EMU_COMMON_SIZE)
+    {
+        val = common[reg];
+    }
+    else
+    {
+        val = 0;
+    }
+    return val;
+}
+
+void w5x00_emu_common_write(uint16_t reg, uint8_t val)
+{
+    if (reg < W5X00_EMU_COMMON_SIZE)
+    {
+        common[reg] = val;
+    }
+}
+
+uint8_t w5x00_emu_sock_read(int isocket, uint16_t sn_reg)
+{
+    struct emu_socket *s;
+    uint8_t val16[2];
+    uint8_t val;
+
+    s = &sockets[isocket];
+    if (
+            (sn_reg == W5100_Sn_SR) || (sn_reg == W5100_Sn_IR)
+            ||
+            (sn_reg == W5100_Sn_TX_FSR0) || (sn_reg == W5100_Sn_RX_RSR0)
+       )
+    {
+        /* only before the first byte of 16 bit registers,
+         * so that the value is consistent.
+         */
+        tunnel_pump();
+    }
+    switch (sn_reg)
+    {
+        case W5100_Sn_TX_FSR0:
+        case W5100_Sn_TX_FSR1:
+            set16(val16, s->tx_size - tx_used(s));
+            val = val16[sn_reg - W5100_Sn_TX_FSR0];
+            break;
+        case W5100_Sn_TX_RD0:
+        case W5100_Sn_TX_RD1:
+            set16(val16, s->tx_rd);
+            val = val16[sn_reg - W5100_Sn_TX_RD0];
+            break;
+        case W5100_Sn_RX_RSR0:
+        case W5100_Sn_RX_RSR1:
+            set16(val16, rx_used(s));
+            val = val16[sn_reg - W5100_Sn_RX_RSR0];
+            break;
+        case EMU_Sn_RX_WR0:
+        case EMU_Sn_RX_WR1:
+            set16(val16, s->rx_wr);
+            val = val16[sn_reg - EMU_Sn_RX_WR0];
+            break;
+        default:
+            if (sn_reg < W5X00_EMU_SOCK_REGS_SIZE)
+            {
+                val = s->regs[sn_reg];
+            }
+            else
+            {
+                val = 0;
+            }
+            break;
+    }
+    return val;
+}
+
+void w5x00_emu_sock_write(int isocket, uint16_t sn_reg, uint8_t val)
+{
+    struct emu_socket *s;
+
+    s = &sockets[isocket];
+    switch (sn_reg)
+    {
+        case W5100_Sn_CR:
+            sock_command(s, val);
+            s->regs[W5100_Sn_CR] = 0; /* command accepted */
+            break;
+        case W5100_Sn_IR:
+            s->regs[W5100_Sn_IR] &= ~val; /* write 1 to clear */
+            break;
+        case W5100_Sn_SR:
+        case W5100_Sn_TX_FSR0:
+        case W5100_Sn_TX_FSR1:
+        case W5100_Sn_TX_RD0:
+        case W5100_Sn_TX_RD1:
+        case W5100_Sn_RX_RSR0:
+        case W5100_Sn_RX_RSR1:
+        case EMU_Sn_RX_WR0:
+        case EMU_Sn_RX_WR1:
+            break; /* read only */
+        default:
+            if (sn_reg < W5X00_EMU_SOCK_REGS_SIZE)
+            {
+                s->regs[sn_reg] = val;
+            }
+            break;
+    }
+}
+
+void w5x00_emu_set_tx_buf(int isocket, uint16_t base, uint16_t size)
+{
+    sockets[isocket].tx_base = base;
+    sockets[isocket].tx_size = size;
+}
+
+void w5x00_emu_set_rx_buf(int isocket, uint16_t base, uint16_t size)
+{
+    sockets[isocket].rx_base = base;
+    sockets[isocket].rx_size = size;
+}
+
+uint8_t w5x00_emu_sock_ir(void)
+{
+    uint8_t ir;
+    int i;
+
+    tunnel_pump();
+    ir = 0;
+    for (i = 0; i < n_sockets; i++)
+    {
+        if (sockets[i].regs[W5100_Sn_IR] != 0)
+        {
+            ir |= (1 << i);
+        }
+    }
+    return ir;
+}
+
+void w5x00_emu_drop_peers(void)
+{
+    int i;
+
+    for (i = 0; i < n_sockets; i++)
+    {
+        sockets[i].peer = NO_PEER;
+    }
+}
+
+void w5x00_emu_wait(int timeout_ms)
+{
+    int rfds[2 * W5X00_EMU_MAX_SOCKETS + MACRAW_PORTS];
+    int wfds[W5X00_EMU_MAX_SOCKETS];
+    int nr;
+    int nw;
+    int i;
+
+    nr = 0;
+    nw = 0;
+    for (i = 0; i < n_sockets; i++)
+    {
+        struct emu_socket *s;
+
+        s = &sockets[i];
+        if (s->host_fd != NO_HOST_FD)
+        {
+            if ((s->regs[W5100_Sn_SR] == W5100_SOCK_SYNSENT) || (tx_used(s) > 0))
+            {
+                wfds[nw++] = s->host_fd;
+            }
+            if (rx_free(s) > 0)
+            {
+                rfds[nr++] = s->host_fd;
+            }
+        }
+        if ((s->regs[W5100_Sn_SR] == W5100_SOCK_MACRAW) && (rx_free(s) > 0))
+        {
+            int j;
+
+            for (j = 0; j < MACRAW_PORTS; j++)
+            {
+                if (macraw_ports[j].fd != NO_HOST_FD)
+                {
+                    rfds[nr++] = macraw_ports[j].fd;
+                }
+            }
+        }
+    }
+    for (i = 0; i < W5X00_EMU_MAX_SOCKETS; i++)
+    {
+        if (listeners[i].fd != NO_HOST_FD)
+        {
+            rfds[nr++] = listeners[i].fd;
+        }
+    }
+    w5x00_emu_host_wait(rfds, nr, wfds, nw, timeout_ms);
+    tunnel_pump();
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file is built with the host headers, not with the ones in
+ * include/, so that socket constants and structures are the kernel ones.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "w5x00_emu_host.h"
+
+#define WAIT_MAX_FDS 32
+
+static
+void sockaddr_fill(struct sockaddr_in *sa, const uint8_t *ip, uint16_t port)
+{
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    memcpy(&sa->sin_addr.s_addr, ip, 4);
+    sa->sin_port = htons(port);
+}
+
+static
+void sockaddr_get(const struct sockaddr_in *sa, uint8_t *ip, uint16_t *port)
+{
+    memcpy(ip, &sa->sin_addr.s_addr, 4);
+    *port = ntohs(sa->sin_port);
+}
+
+static
+int socket_open(int type)
+{
+    return syscall(SYS_socket, AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+
+static
+int socket_bind_loopback(int fd, uint16_t port)
+{
+    struct sockaddr_in sa;
+    int one;
+
+    one = 1;
+    (void)syscall(SYS_setsockopt, fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(port);
+
+    return syscall(SYS_bind, fd, &sa, sizeof(sa));
+}
+
+int w5x00_emu_host_tcp_connect(const uint8_t *ip, uint16_t port)
+{
+    int fd;
+    struct sockaddr_in sa;
+
+    fd = socket_open(SOCK_STREAM);
+    if (fd != -1)
+    {
+        sockaddr_fill(&sa, ip, port);
+        if ((syscall(SYS_connect, fd, &sa, sizeof(sa)) == -1) && (errno != EINPROGRESS))
+        {
+            (void)syscall(SYS_close, fd);
+            fd = -1;
+        }
+    }
+    return fd;
+}
+
+int w5x00_emu_host_tcp_connected(int fd)
+{
+    int ret;
+    struct pollfd p;
+    struct timespec zero;
+
+    p.fd = fd;
+    p.events = POLLOUT;
+    p.revents = 0;
+    zero.tv_sec = 0;
+    zero.tv_nsec = 0;
+    if (syscall(SYS_ppoll, &p, 1, &zero, NULL, 0) <= 0)
+    {
+        ret = 1;
+    }
+    else
+    {
+        int err;
+        socklen_t len;
+
+        len = sizeof(err);
+        if (syscall(SYS_getsockopt, fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        {
+            err = errno;
+        }
+        if (err == 0)
+        {
+            ret = 0;
+        }
+        else if (err == ECONNREFUSED)
+        {
+            ret = -1;
+        }
+        else
+        {
+            ret = -2;
+        }
+    }
+    return ret;
+}
+
+int w5x00_emu_host_tcp_listen(uint16_t port)
+{
+    int fd;
+
+    fd = socket_open(SOCK_STREAM);
+    if (fd != -1)
+    {
+        if (
+                (socket_bind_loopback(fd, port) == -1)
+                ||
+                (syscall(SYS_listen, fd, SOMAXCONN) == -1)
+           )
+        {
+            (void)syscall(SYS_close, fd);
+            fd = -1;
+        }
+    }
+    return fd;
+}
+
+int w5x00_emu_host_tcp_accept(int fd, uint8_t *ip, uint16_t *port)
+{
+    int ret;
+    struct sockaddr_in sa;
+    socklen_t len;
+
+    len = sizeof(sa);
+    ret = syscall(SYS_accept4, fd, &sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (ret != -1)
+    {
+        sockaddr_get(&sa, ip, port);
+    }
+    return ret;
+}
+
+int w5x00_emu_host_udp_open(uint16_t port)
+{
+    int fd;
+
+    fd = socket_open(SOCK_DGRAM);
+    if ((fd != -1) && (socket_bind_loopback(fd, port) == -1))
+    {
+        (void)syscall(SYS_close, fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static
+long io_result(long n)
+{
+    long ret;
+
+    if (n >= 0)
+    {
+        ret = n;
+    }
+    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+    {
+        ret = W5X00_EMU_HOST_AGAIN;
+    }
+    else
+    {
+        ret = W5X00_EMU_HOST_ERROR;
+    }
+    return ret;
+}
+
+long w5x00_emu_host_send(int fd, const void *buf, size_t n)
+{
+    return io_result(syscall(SYS_sendto, fd, buf, n, MSG_NOSIGNAL, NULL, 0));
+}
+
+long w5x00_emu_host_recv(int fd, void *buf, size_t n)
+{
+    return io_result(syscall(SYS_recvfrom, fd, buf, n, 0, NULL, NULL));
+}
+
+long w5x00_emu_host_sendto(int fd, const void *buf, size_t n, const uint8_t *ip, uint16_t port)
+{
+    struct sockaddr_in sa;
+
+    sockaddr_fill(&sa, ip, port);
+
+    return io_result(syscall(SYS_sendto, fd, buf, n, MSG_NOSIGNAL, &sa, sizeof(sa)));
+}
+
+long w5x00_emu_host_recvfrom(int fd, void *buf, size_t n, uint8_t *ip, uint16_t *port)
+{
+    long ret;
+    uint8_t dummy;
+
+    /* with MSG_TRUNC the real length of the datagram is returned */
+    ret = syscall(SYS_recvfrom, fd, &dummy, 1, MSG_PEEK | MSG_TRUNC, NULL, NULL);
+    if ((ret >= 0) && ((size_t)ret <= n))
+    {
+        struct sockaddr_in sa;
+        socklen_t len;
+
+        len = sizeof(sa);
+        ret = syscall(SYS_recvfrom, fd, buf, n, 0, &sa, &len);
+        if (ret >= 0)
+        {
+            sockaddr_get(&sa, ip, port);
+        }
+        else
+        {
+            ret = W5X00_EMU_HOST_AGAIN;
+        }
+    }
+    else
+    {
+        ret = W5X00_EMU_HOST_AGAIN;
+    }
+    return ret;
+}
+
+void w5x00_emu_host_close(int fd)
+{
+    (void)syscall(SYS_close, fd);
+}
+
+void w5x00_emu_host_wait(const int *rfds, int nr, const int *wfds, int nw, int timeout_ms)
+{
+    struct pollfd p[WAIT_MAX_FDS];
+    struct timespec timeout;
+    int n;
+    int i;
+
+    n = 0;
+    for (i = 0; (i < nr) && (n < WAIT_MAX_FDS); i++)
+    {
+        p[n].fd = rfds[i];
+        p[n].events = POLLIN;
+        n++;
+    }
+    for (i = 0; (i < nw) && (n < WAIT_MAX_FDS); i++)
+    {
+        p[n].fd = wfds[i];
+        p[n].events = POLLOUT;
+        n++;
+    }
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    (void)syscall(SYS_ppoll, p, n, &timeout, NULL, 0);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "w5x00_int.h"
+#include "timespec.h"
+#ifndef W5X00_SPI_NO_INT
+#  include <libopencm3/stm32/rcc.h>
+#  include <libopencm3/stm32/gpio.h>
+#  include <libopencm3/stm32/exti.h>
+#  include <libopencm3/cm3/nvic.h>
+#  include <libopencm3/cm3/cortex.h>
+#endif
+
+#ifndef W5X00_SPI_NO_INT
+
+/* The interrupt is only used to wake up the MCU: registers are
+ * read by the socket layer, outside of the handler, so that they
+ * do not interfere with transfers in progress on SPI1.
+ */
+void exti15_10_isr(void)
+{
+    exti_reset_request(EXTI10);
+}
+
+void w5x00_int_init(void)
+{
+    rcc_periph_clock_enable(RCC_GPIOA);
+#ifdef STM32F1
+    rcc_periph_clock_enable(RCC_AFIO);
+    gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, GPIO10);
+    gpio_set(GPIOA, GPIO10); /* pull-up */
+#elif defined(STM32F4)
+    rcc_periph_clock_enable(RCC_SYSCFG);
+    gpio_mode_setup(GPIOA, GPIO_MODE_INPUT, GPIO_PUPD_PULLUP, GPIO10);
+#endif
+    exti_select_source(EXTI10, GPIOA);
+    exti_set_trigger(EXTI10, EXTI_TRIGGER_FALLING);
+    exti_enable_request(EXTI10);
+    nvic_enable_irq(NVIC_EXTI15_10_IRQ);
+}
+
+int w5x00_int_asserted(void)
+{
+    return gpio_get(GPIOA, GPIO10) == 0;
+}
+
+void w5x00_int_wait(const struct timespec *deadline)
+{
+    /* With interrupts masked, an edge coming after the check
+     * still wakes up the core from WFI.
+     */
+    cm_disable_interrupts();
+    if (!w5x00_int_asserted())
+    {
+        clock_idle(deadline);
+    }
+    cm_enable_interrupts();
+}
+
+#else
+
+void w5x00_int_init(void)
+{
+}
+
+int w5x00_int_asserted(void)
+{
+    return 1; /* unknown: always look at the registers */
+}
+
+void w5x00_int_wait(const struct timespec *deadline)
+{
+    (void)deadline;
+}
+
+#endif /* W5X00_SPI_NO_INT */
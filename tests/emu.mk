@@ -0,0 +1,72 @@
+#
+# Copyright (c) 2015 Francesco Balducci
+#
+# This file is part of nucleo_tests.
+#
+#    nucleo_tests is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU Lesser General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    nucleo_tests is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU Lesser General Public License for more details.
+#
+#    You should have received a copy of the GNU Lesser General Public License
+#    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Host build of a test program, on top of the chip emulator.
+# The traffic that is not for the emulated chip goes through the host
+# sockets on the loopback interface, see include/w5x00_emu.h.
+# The including Makefile sets BINARY and SRCS;
+# "make CHIP=w5500" emulates a W5500 instead of a W5100.
+
+ROOT_DIR = ../../..
+SRC_DIR = $(ROOT_DIR)/src
+CHIP ?= w5100
+
+CFLAGS += -std=c99 -Wall -Wextra
+CPPFLAGS += -I$(ROOT_DIR)/include
+
+LIB_SRCS += $(SRC_DIR)/w5100_socket.c
+LIB_SRCS += $(SRC_DIR)/w5x00_emu.c
+LIB_SRCS += $(SRC_DIR)/w5x00_emu_host.c
+LIB_SRCS += $(SRC_DIR)/$(CHIP)_chip.c
+LIB_SRCS += $(SRC_DIR)/$(CHIP)_emu.c
+LIB_SRCS += $(SRC_DIR)/inet.c
+LIB_SRCS += $(SRC_DIR)/file.c
+LIB_SRCS += $(SRC_DIR)/fcntl.c
+LIB_SRCS += $(SRC_DIR)/timespec.c
+LIB_SRCS += $(SRC_DIR)/uio.c
+LIB_SRCS += $(SRC_DIR)/sendfile.c
+LIB_SRCS += $(SRC_DIR)/poll.c
+LIB_SRCS += $(SRC_DIR)/select.c
+LIB_SRCS += $(SRC_DIR)/epoll.c
+LIB_SRCS += $(SRC_DIR)/syscalls_host.c
+
+LIB_OBJS = $(patsubst $(SRC_DIR)/%.c,lib_%.o,$(LIB_SRCS))
+OBJS = $(patsubst ../%.c,%.o,$(SRCS))
+
+.PHONY: all run clean
+all: $(BINARY)
+
+run: $(BINARY)
+	./$(BINARY)
+
+lib_%.o: $(SRC_DIR)/%.c
+	$(CC) $(CFLAGS) $(CPPFLAGS) -D_DEFAULT_SOURCE -c -o $@ $<
+
+# host sockets need the host headers, not the ones in include/
+lib_w5x00_emu_host.o: $(SRC_DIR)/w5x00_emu_host.c
+	$(CC) $(CFLAGS) -iquote $(ROOT_DIR)/include -D_DEFAULT_SOURCE -c -o $@ $<
+
+%.o: ../%.c
+	$(CC) $(CFLAGS) $(CPPFLAGS) -D_POSIX_C_SOURCE=199309L -c -o $@ $<
+
+$(BINARY): $(OBJS) $(LIB_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $^
+
+clean:
+	rm -f *.o $(BINARY)
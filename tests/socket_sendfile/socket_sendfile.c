@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Serves a file of the SD card to every client connecting to SERVER_PORT,
+ * for example with "nc 192.168.1.99 8888 > log.txt" on the host.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <arpa/inet.h>
+
+#ifndef SERVER_PORT
+#  define SERVER_PORT 8888
+#endif
+
+#ifndef FILE_PATH
+#  define FILE_PATH "log.txt"
+#endif
+
+static
+void serve(int client_sock)
+{
+    int fd;
+    struct stat st;
+    ssize_t sent;
+    struct timespec start;
+    struct timespec end;
+    long ms;
+
+    fd = open(FILE_PATH, O_RDONLY);
+    if (fd == -1)
+    {
+        perror(FILE_PATH);
+    }
+    else if (fstat(fd, &st) != 0)
+    {
+        perror("fstat failed");
+        close(fd);
+    }
+    else
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sent = sendfile(client_sock, fd, NULL, st.st_size);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (sent == -1)
+        {
+            perror("sendfile failed");
+        }
+        else
+        {
+            ms = (end.tv_sec - start.tv_sec) * 1000
+                + (end.tv_nsec - start.tv_nsec) / 1000000;
+            printf("sent %ld of %ld bytes in %ld ms\n",
+                    (long)sent, (long)st.st_size, ms);
+        }
+        close(fd);
+    }
+}
+
+int main(void)
+{
+    int socket_desc;
+    struct sockaddr_in server;
+
+    socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_desc == -1)
+    {
+        perror("Could not create socket");
+        return 1;
+    }
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(SERVER_PORT);
+    if (bind(socket_desc, (struct sockaddr *)&server, sizeof(server)) != 0)
+    {
+        perror("bind failed");
+        close(socket_desc);
+        return 1;
+    }
+    if (listen(socket_desc, SOMAXCONN) != 0)
+    {
+        perror("listen failed");
+        close(socket_desc);
+        return 1;
+    }
+
+    while (1)
+    {
+        int client_sock;
+
+        puts("Waiting for incoming connections...");
+        client_sock = accept(socket_desc, NULL, NULL);
+        if (client_sock == -1)
+        {
+            perror("accept failed");
+        }
+        else
+        {
+            serve(client_sock);
+            close(client_sock);
+        }
+    }
+}
@@ -18,6 +18,7 @@
  */
 #include <stdio.h>
 #include <time.h>
+#include <poll.h>
 #include "timesync.h"
 #include "timespec.h"
 
@@ -43,6 +44,22 @@ int main(void)
             "Press any key to continue...\n");
     getchar();
 
+    /* in the background first, the first call being time to synchronize */
+    do {
+        struct pollfd p;
+
+        res = timesync_poll();
+        p.fd = timesync_fd();
+        p.events = POLLIN;
+        if ((res == 0) && (p.fd >= 0))
+        {
+            (void)poll(&p, 1, 100);
+        }
+    } while ((res == 0) && (timesync_fd() >= 0));
+    printf("timesync_poll returned %d\n", res);
+    clock_gettime(CLOCK_REALTIME, &t);
+    print_timespec(&t);
+
     t = TIMESPEC_ZERO;
     res = timesync_timespec(&t);
     printf("timesync_timespec(TIMESPEC_ZERO) returned %d\n", res);
@@ -0,0 +1,1767 @@
+/*
+ * Socket layer against the chip emulator, on the host.
+ * Sockets of the same program talk to each other through
+ * the address of the chip itself.
+ */
+#include <stdio.h> //printf
+#include <string.h>    //strlen
+#include <unistd.h>    //close
+#include <sys/socket.h>    //socket
+#include <sys/uio.h>    //writev
+#include <sys/sendfile.h>
+#include <sys/time.h>    //timeval
+#include <arpa/inet.h> //inet_addr
+#include <netinet/tcp.h> //TCP_CORK
+#include <time.h> //nanosleep
+#include <errno.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include "file.h"
+#include "w5x00.h"
+#include "w5100_socket.h"
+#include "w5x00_emu.h"
+#include "w5x00_emu_host.h"
+
+#ifndef CHIP_IP_ADDR
+#  define CHIP_IP_ADDR "192.168.1.99"
+#endif
+
+#define TCP_PORT 8888
+#define UDP_PORT 8889
+#define MCAST_GROUP "239.1.2.3"
+#define MCAST_GROUP2 "239.1.2.4"
+
+/* host side of the tunnel */
+#define HOST_TCP_PORT 18888
+#define HOST_UDP_PORT 18889
+#define TUNNEL_TCP_PORT 18890
+#define TUNNEL_UDP_PORT 18891
+
+#define BENCH_KIB 64
+
+int assertions_failed = 0;
+
+#define assert_equal(x, y) do { \
+        if (x != y) { \
+            fprintf(stderr, "%s:%d: %s: " #x " != " #y ": %d != %d\n", __FILE__, __LINE__, __func__, (int)(x), (int)(y)); \
+            assertions_failed++; \
+        }\
+    } while(0);
+
+static
+void test_udp(void)
+{
+    int sock_a;
+    int sock_b;
+    int ret;
+    struct sockaddr_in addr;
+    char buf[32];
+
+    sock_a = socket(AF_INET, SOCK_DGRAM, 0);
+    sock_b = socket(AF_INET, SOCK_DGRAM, 0);
+
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(UDP_PORT);
+    ret = bind(sock_b, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 0);
+
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    ret = sendto(sock_a, "ping", 4, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 4);
+
+    ret = recvfrom(sock_b, buf, sizeof(buf), 0, NULL, NULL);
+    assert_equal(ret, 4);
+    assert_equal(memcmp(buf, "ping", 4), 0);
+
+    assert_equal(close(sock_a), 0);
+    assert_equal(close(sock_b), 0);
+}
+
+static
+void test_tcp(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int ret;
+    int i;
+    struct sockaddr_in addr;
+    static char tx_buf[1500];
+    static char rx_buf[1500];
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TCP_PORT);
+    ret = bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 0);
+    ret = listen(listen_sock, 1);
+    assert_equal(ret, 0);
+
+    client_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    ret = connect(client_sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 0);
+
+    server_sock = accept(listen_sock, NULL, NULL);
+    assert_equal((server_sock != -1), 1);
+
+    for (i = 0; i < (int)sizeof(tx_buf); i++)
+    {
+        tx_buf[i] = i;
+    }
+    ret = send(client_sock, tx_buf, sizeof(tx_buf), 0);
+    assert_equal(ret, (int)sizeof(tx_buf));
+    ret = recv(server_sock, rx_buf, sizeof(rx_buf), 0);
+    assert_equal(ret, (int)sizeof(rx_buf));
+    assert_equal(memcmp(tx_buf, rx_buf, sizeof(rx_buf)), 0);
+
+    /* small request/response traffic */
+    for (i = 0; i < 8; i++)
+    {
+        ret = write(client_sock, "ping", 4);
+        assert_equal(ret, 4);
+        ret = read(server_sock, rx_buf, sizeof(rx_buf));
+        assert_equal(ret, 4);
+        ret = write(server_sock, "pong", 4);
+        assert_equal(ret, 4);
+        ret = read(client_sock, rx_buf, sizeof(rx_buf));
+        assert_equal(ret, 4);
+        assert_equal(memcmp(rx_buf, "pong", 4), 0);
+    }
+
+    assert_equal(close(client_sock), 0);
+    assert_equal(close(server_sock), 0);
+    assert_equal(close(listen_sock), 0);
+}
+
+static
+void test_iov(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int udp_a;
+    int udp_b;
+    int ret;
+    struct sockaddr_in addr;
+    struct sockaddr_in peer;
+    struct iovec iov[2];
+    struct msghdr msg;
+    char head[4];
+    char body[8];
+    unsigned long commands;
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TCP_PORT);
+    bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr));
+    listen(listen_sock, 1);
+    client_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    connect(client_sock, (struct sockaddr *)&addr, sizeof(addr));
+    server_sock = accept(listen_sock, NULL, NULL);
+
+    /* header and payload in a single SEND and a single RECV */
+    iov[0].iov_base = "HEAD";
+    iov[0].iov_len = 4;
+    iov[1].iov_base = "payload!";
+    iov[1].iov_len = 8;
+    commands = w5x00_emu_stats.commands;
+    ret = writev(client_sock, iov, 2);
+    assert_equal(ret, 12);
+    assert_equal(w5x00_emu_stats.commands - commands, 1);
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+    iov[1].iov_base = body;
+    iov[1].iov_len = sizeof(body);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    commands = w5x00_emu_stats.commands;
+    ret = recvmsg(server_sock, &msg, 0);
+    assert_equal(ret, 12);
+    assert_equal(w5x00_emu_stats.commands - commands, 1);
+    assert_equal(memcmp(head, "HEAD", 4), 0);
+    assert_equal(memcmp(body, "payload!", 8), 0);
+
+    close(client_sock);
+    close(server_sock);
+    close(listen_sock);
+
+    /* datagram longer than the vector is truncated */
+    udp_a = socket(AF_INET, SOCK_DGRAM, 0);
+    udp_b = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(UDP_PORT);
+    bind(udp_b, (struct sockaddr *)&addr, sizeof(addr));
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    iov[0].iov_base = "0123";
+    iov[0].iov_len = 4;
+    iov[1].iov_base = "456789";
+    iov[1].iov_len = 6;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ret = sendmsg(udp_a, &msg, 0);
+    assert_equal(ret, 10);
+    ret = sendto(udp_a, "next", 4, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 4);
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+    iov[1].iov_base = body;
+    iov[1].iov_len = 2;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &peer;
+    msg.msg_namelen = sizeof(peer);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ret = recvmsg(udp_b, &msg, 0);
+    assert_equal(ret, 6);
+    assert_equal(msg.msg_flags, MSG_TRUNC);
+    assert_equal(memcmp(head, "0123", 4), 0);
+    assert_equal(memcmp(body, "45", 2), 0);
+    assert_equal(peer.sin_addr.s_addr, inet_addr(CHIP_IP_ADDR));
+    ret = recv(udp_b, body, sizeof(body), 0);
+    assert_equal(ret, 4);
+    assert_equal(memcmp(body, "next", 4), 0);
+
+    close(udp_a);
+    close(udp_b);
+}
+
+static
+void tcp_pair(int *listen_sock, int *client_sock, int *server_sock)
+{
+    struct sockaddr_in addr;
+
+    *listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TCP_PORT);
+    bind(*listen_sock, (struct sockaddr *)&addr, sizeof(addr));
+    listen(*listen_sock, 1);
+    *client_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    connect(*client_sock, (struct sockaddr *)&addr, sizeof(addr));
+    *server_sock = accept(*listen_sock, NULL, NULL);
+}
+
+static
+void test_recv_flags(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int ret;
+    char buf[8];
+    struct timeval tv;
+
+    tcp_pair(&listen_sock, &client_sock, &server_sock);
+
+    errno = 0;
+    ret = recv(server_sock, buf, sizeof(buf), MSG_DONTWAIT);
+    assert_equal(ret, -1);
+    assert_equal(errno, EAGAIN);
+
+    send(client_sock, "abcd", 4, 0);
+    ret = recv(server_sock, buf, 2, MSG_PEEK);
+    assert_equal(ret, 2);
+    assert_equal(memcmp(buf, "ab", 2), 0);
+    ret = recv(server_sock, buf, sizeof(buf), MSG_PEEK);
+    assert_equal(ret, 4);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 4);
+    assert_equal(memcmp(buf, "abcd", 4), 0);
+
+    send(client_sock, "0123", 4, 0);
+    send(client_sock, "4567", 4, 0);
+    ret = recv(server_sock, buf, 6, MSG_WAITALL);
+    assert_equal(ret, 6);
+    assert_equal(memcmp(buf, "012345", 6), 0);
+
+    /* on timeout, whatever arrived */
+    tv.tv_sec = 0;
+    tv.tv_usec = 10000;
+    setsockopt(server_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ret = recv(server_sock, buf, sizeof(buf), MSG_WAITALL);
+    assert_equal(ret, 2);
+    assert_equal(memcmp(buf, "67", 2), 0);
+
+    close(client_sock);
+    close(server_sock);
+    close(listen_sock);
+}
+
+static
+void test_shutdown(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int ret;
+    char buf[8];
+    struct sockaddr_in addr;
+    struct pollfd p;
+
+    tcp_pair(&listen_sock, &client_sock, &server_sock);
+
+    /* request, then no more from the client */
+    send(client_sock, "req", 3, 0);
+    ret = shutdown(client_sock, SHUT_WR);
+    assert_equal(ret, 0);
+    errno = 0;
+    ret = send(client_sock, "x", 1, 0);
+    assert_equal(ret, -1);
+    assert_equal(errno, EPIPE);
+    ret = recv(server_sock, buf, sizeof(buf), MSG_WAITALL);
+    assert_equal(ret, 3);
+    assert_equal(memcmp(buf, "req", 3), 0);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 0);
+    p.fd = server_sock;
+    p.events = POLLIN;
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 1);
+
+    /* the response still reaches the client */
+    ret = send(server_sock, "resp", 4, 0);
+    assert_equal(ret, 4);
+    assert_equal(close(server_sock), 0);
+    ret = recv(client_sock, buf, sizeof(buf), MSG_WAITALL);
+    assert_equal(ret, 4);
+    assert_equal(memcmp(buf, "resp", 4), 0);
+    ret = recv(client_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 0);
+    assert_equal(close(client_sock), 0);
+
+    /* close does not wait for the peer, that sees the end of stream */
+    client_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    addr.sin_port = htons(TCP_PORT);
+    ret = connect(client_sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 0);
+    server_sock = accept(listen_sock, NULL, NULL);
+    assert_equal((server_sock != -1), 1);
+    send(client_sock, "bye", 3, 0);
+    assert_equal(close(client_sock), 0);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 3);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 0);
+    ret = shutdown(server_sock, SHUT_RDWR);
+    assert_equal(ret, 0);
+    assert_equal(close(server_sock), 0);
+
+    assert_equal(close(listen_sock), 0);
+}
+
+static
+void test_keepalive(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int ret;
+    int val;
+    socklen_t len;
+    char buf[8];
+    struct pollfd p;
+    unsigned long commands;
+
+    tcp_pair(&listen_sock, &client_sock, &server_sock);
+
+    val = 1;
+    ret = setsockopt(client_sock, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));
+    assert_equal(ret, 0);
+    ret = setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPIDLE, &val, sizeof(val));
+    assert_equal(ret, 0);
+    ret = setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val));
+    assert_equal(ret, 0);
+    len = sizeof(val);
+    ret = getsockopt(client_sock, IPPROTO_TCP, TCP_KEEPIDLE, &val, &len);
+    assert_equal(ret, 0);
+    assert_equal(val, 1);
+    val = 0;
+    errno = 0;
+    ret = setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val));
+    assert_equal(ret, -1);
+    assert_equal(errno, EINVAL);
+
+    /* the peer answers the probes */
+    p.fd = client_sock;
+    p.events = POLLIN;
+    commands = w5x00_emu_stats.commands;
+    ret = poll(&p, 1, 1500);
+    assert_equal(ret, 0);
+    assert_equal((w5x00_emu_stats.commands > commands), 1);
+
+    /* the peer is gone without a word */
+    w5x00_emu_drop_peers();
+    ret = poll(&p, 1, 3000);
+    assert_equal(ret, 1);
+    assert_equal(p.revents, POLLHUP);
+    errno = 0;
+    ret = recv(client_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, -1);
+    assert_equal(errno, ECONNRESET);
+
+    close(client_sock);
+    close(server_sock);
+    close(listen_sock);
+}
+
+static
+void test_tcp_tuning(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int ret;
+    int val;
+    socklen_t len;
+    struct sockaddr_in addr;
+
+    val = 0;
+    errno = 0;
+    client_sock = socket(AF_INET, SOCK_STREAM, 0);
+    ret = setsockopt(client_sock, IPPROTO_TCP, TCP_MAXSEG, &val, sizeof(val));
+    assert_equal(ret, -1);
+    assert_equal(errno, EINVAL);
+    val = 536;
+    ret = setsockopt(client_sock, IPPROTO_TCP, TCP_MAXSEG, &val, sizeof(val));
+    assert_equal(ret, 0);
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TCP_PORT);
+    bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr));
+    listen(listen_sock, 1);
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    connect(client_sock, (struct sockaddr *)&addr, sizeof(addr));
+    server_sock = accept(listen_sock, NULL, NULL);
+
+    /* agreed by both ends */
+    len = sizeof(val);
+    ret = getsockopt(server_sock, IPPROTO_TCP, TCP_MAXSEG, &val, &len);
+    assert_equal(ret, 0);
+    assert_equal(val, 536);
+
+    /* chip wide */
+    val = 50; /* 5ms */
+    ret = setsockopt(client_sock, SOL_W5100, W5100_SO_RETRY_TIME, &val, sizeof(val));
+    assert_equal(ret, 0);
+    val = 3;
+    ret = setsockopt(client_sock, SOL_W5100, W5100_SO_RETRY_COUNT, &val, sizeof(val));
+    assert_equal(ret, 0);
+    ret = getsockopt(server_sock, SOL_W5100, W5100_SO_RETRY_TIME, &val, &len);
+    assert_equal(val, 50);
+    ret = getsockopt(server_sock, SOL_W5100, W5100_SO_RETRY_COUNT, &val, &len);
+    assert_equal(val, 3);
+    val = 0;
+    errno = 0;
+    ret = setsockopt(client_sock, SOL_W5100, W5100_SO_RETRY_TIME, &val, sizeof(val));
+    assert_equal(ret, -1);
+    assert_equal(errno, EINVAL);
+
+    close(client_sock);
+    close(server_sock);
+    close(listen_sock);
+}
+
+static
+void test_multicast(void)
+{
+    int member;
+    int other;
+    int sender;
+    int ret;
+    int val;
+    socklen_t len;
+    struct ip_mreq mreq;
+    struct sockaddr_in addr;
+    struct pollfd p;
+    char buf[32];
+
+    member = socket(AF_INET, SOCK_DGRAM, 0);
+    other = socket(AF_INET, SOCK_DGRAM, 0);
+    sender = socket(AF_INET, SOCK_DGRAM, 0);
+
+    /* joined before bind: the group is taken at OPEN */
+    mreq.imr_multiaddr.s_addr = inet_addr(MCAST_GROUP);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    ret = setsockopt(member, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    assert_equal(ret, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(UDP_PORT);
+    ret = bind(member, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 0);
+    addr.sin_port = htons(UDP_PORT + 1);
+    bind(other, (struct sockaddr *)&addr, sizeof(addr));
+
+    len = sizeof(val);
+    ret = getsockopt(sender, IPPROTO_IP, IP_MULTICAST_TTL, &val, &len);
+    assert_equal(ret, 0);
+    assert_equal(val, 1);
+    val = 4;
+    ret = setsockopt(sender, IPPROTO_IP, IP_MULTICAST_TTL, &val, sizeof(val));
+    assert_equal(ret, 0);
+
+    addr.sin_addr.s_addr = inet_addr(MCAST_GROUP);
+    addr.sin_port = htons(UDP_PORT);
+    ret = sendto(sender, "group", 5, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 5);
+    ret = recvfrom(member, buf, sizeof(buf), 0, NULL, NULL);
+    assert_equal(ret, 5);
+    assert_equal(memcmp(buf, "group", 5), 0);
+
+    /* the member socket sends to its group only */
+    errno = 0;
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    ret = sendto(member, "x", 1, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, -1);
+    assert_equal(errno, EINVAL);
+
+    /* one group per socket */
+    errno = 0;
+    mreq.imr_multiaddr.s_addr = inet_addr(MCAST_GROUP2);
+    ret = setsockopt(member, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    assert_equal(ret, -1);
+    assert_equal(errno, ENOBUFS);
+    errno = 0;
+    ret = setsockopt(member, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+    assert_equal(ret, -1);
+    assert_equal(errno, EADDRNOTAVAIL);
+
+    /* a bound socket joins at once */
+    ret = setsockopt(other, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    assert_equal(ret, 0);
+    addr.sin_addr.s_addr = inet_addr(MCAST_GROUP2);
+    addr.sin_port = htons(UDP_PORT + 1);
+    ret = sendto(sender, "group2", 6, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 6);
+    ret = recvfrom(other, buf, sizeof(buf), 0, NULL, NULL);
+    assert_equal(ret, 6);
+    p.fd = member;
+    p.events = POLLIN;
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 0);
+
+    /* left the group: no more datagrams */
+    mreq.imr_multiaddr.s_addr = inet_addr(MCAST_GROUP);
+    ret = setsockopt(member, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+    assert_equal(ret, 0);
+    addr.sin_addr.s_addr = inet_addr(MCAST_GROUP);
+    addr.sin_port = htons(UDP_PORT);
+    ret = sendto(sender, "group", 5, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 5);
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 0);
+
+    /* unicast again after a multicast datagram */
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    ret = sendto(sender, "ping", 4, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 4);
+    ret = recvfrom(member, buf, sizeof(buf), 0, NULL, NULL);
+    assert_equal(ret, 4);
+
+    errno = 0;
+    val = 256;
+    ret = setsockopt(sender, IPPROTO_IP, IP_MULTICAST_TTL, &val, sizeof(val));
+    assert_equal(ret, -1);
+    assert_equal(errno, EINVAL);
+
+    close(member);
+    close(other);
+    close(sender);
+}
+
+static
+void test_poll_events(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int ret;
+    char buf[8];
+    struct pollfd p;
+    unsigned long frames;
+    unsigned long polls;
+    int i;
+    socklen_t len;
+    struct w5100_sock_stats st;
+    fd_set rfds;
+    struct timeval tv;
+
+    tcp_pair(&listen_sock, &client_sock, &server_sock);
+
+    p.fd = server_sock;
+    p.events = POLLIN;
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 0);
+
+    /* nothing happened: no need to look at the chip */
+    frames = w5x00_emu_stats.frames;
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 0);
+    assert_equal(w5x00_emu_stats.frames - frames, 0);
+
+    /* nor to ask the socket layer */
+    len = sizeof(st);
+    getsockopt(server_sock, SOL_W5100, W5100_SO_STATS, &st, &len);
+    polls = st.polls;
+    for (i = 0; i < 10; i++)
+    {
+        ret = poll(&p, 1, 0);
+        assert_equal(ret, 0);
+    }
+    getsockopt(server_sock, SOL_W5100, W5100_SO_STATS, &st, &len);
+    assert_equal(st.polls, polls);
+
+    send(client_sock, "data", 4, 0);
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 1);
+    assert_equal(p.revents, POLLIN);
+
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 4);
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 0);
+
+    /* select gives the ready fds only */
+    send(client_sock, "more", 4, 0);
+    FD_ZERO(&rfds);
+    FD_SET(server_sock, &rfds);
+    FD_SET(client_sock, &rfds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    ret = select(((server_sock > client_sock) ? server_sock : client_sock) + 1, &rfds, NULL, NULL, &tv);
+    assert_equal(ret, 1);
+    assert_equal(FD_ISSET(server_sock, &rfds), 1);
+    assert_equal(FD_ISSET(client_sock, &rfds), 0);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 4);
+
+    /* a closed socket is not writable any more */
+    p.fd = client_sock;
+    p.events = POLLOUT;
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 1);
+    assert_equal(p.revents, POLLOUT);
+    close(client_sock);
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 1);
+    assert_equal(p.revents, POLLNVAL);
+    FD_ZERO(&rfds);
+    FD_SET(client_sock, &rfds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    errno = 0;
+    ret = select(client_sock + 1, NULL, &rfds, NULL, &tv);
+    assert_equal(ret, -1);
+    assert_equal(errno, EBADF);
+
+    close(server_sock);
+    close(listen_sock);
+}
+
+static
+void test_rx_stage(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int ret;
+    int val;
+    int i;
+    char buf[8];
+    struct pollfd p;
+    unsigned long frames;
+    unsigned long frames_direct;
+
+    tcp_pair(&listen_sock, &client_sock, &server_sock);
+
+    val = 4096;
+    ret = setsockopt(server_sock, SOL_W5100, W5100_SO_RXSTAGE, &val, sizeof(val));
+    assert_equal(ret, -1);
+    assert_equal(errno, EINVAL);
+
+    /* a line read one byte at a time, as by a parser */
+    send(client_sock, "0123456789abcdef", 16, 0);
+    frames = w5x00_emu_stats.frames;
+    for (i = 0; i < 8; i++)
+    {
+        ret = recv(server_sock, buf, 1, 0);
+        assert_equal(ret, 1);
+    }
+    frames_direct = w5x00_emu_stats.frames - frames;
+
+    val = 64;
+    ret = setsockopt(server_sock, SOL_W5100, W5100_SO_RXSTAGE, &val, sizeof(val));
+    assert_equal(ret, 0);
+    frames = w5x00_emu_stats.frames;
+    for (i = 0; i < 8; i++)
+    {
+        ret = recv(server_sock, buf, 1, 0);
+        assert_equal(ret, 1);
+        assert_equal(buf[0], "89abcdef"[i]);
+    }
+    printf("1 byte recv: %lu SPI frames, %lu with read-ahead\n",
+            frames_direct / 8, (w5x00_emu_stats.frames - frames) / 8);
+
+    /* buffered data, nothing left in the chip */
+    send(client_sock, "ABCD", 4, 0);
+    ret = recv(server_sock, buf, 1, 0);
+    assert_equal(ret, 1);
+    p.fd = server_sock;
+    p.events = POLLIN;
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 1);
+    assert_equal(p.revents, POLLIN);
+    ret = recv(server_sock, buf, sizeof(buf), MSG_PEEK);
+    assert_equal(ret, 3);
+    assert_equal(memcmp(buf, "BCD", 3), 0);
+    ret = setsockopt(server_sock, SOL_W5100, W5100_SO_RXSTAGE, &val, sizeof(val));
+    assert_equal(ret, -1);
+    assert_equal(errno, EBUSY);
+
+    /* what is buffered comes first, then what is in the chip */
+    send(client_sock, "EFGH", 4, 0);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 7);
+    assert_equal(memcmp(buf, "BCDEFGH", 7), 0);
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 0);
+
+    close(client_sock);
+    close(server_sock);
+    close(listen_sock);
+}
+
+/* A file in memory, standing for one on the SD card.
+ * It fits in the RX buffer of the peer, that is not read meanwhile.
+ */
+static char mem_file_data[1500];
+static size_t mem_file_pos;
+
+static
+int mem_file_read(int fd, char *buf, int len)
+{
+    size_t n;
+
+    (void)fd;
+    n = sizeof(mem_file_data) - mem_file_pos;
+    if (n > (size_t)len)
+    {
+        n = len;
+    }
+    memcpy(buf, &mem_file_data[mem_file_pos], n);
+    mem_file_pos += n;
+    return n;
+}
+
+/* in sectors, as FatFs does */
+static
+ssize_t mem_file_forward(int fd, size_t (*sink)(const void *, size_t, void *), void *arg, size_t count)
+{
+    size_t ret;
+
+    (void)fd;
+    ret = 0;
+    while ((ret < count) && (mem_file_pos < sizeof(mem_file_data)))
+    {
+        size_t n;
+
+        n = 512 - (mem_file_pos % 512);
+        if (n > count - ret)
+        {
+            n = count - ret;
+        }
+        if (n > sizeof(mem_file_data) - mem_file_pos)
+        {
+            n = sizeof(mem_file_data) - mem_file_pos;
+        }
+        n = sink(&mem_file_data[mem_file_pos], n, arg);
+        mem_file_pos += n;
+        ret += n;
+    }
+    return ret;
+}
+
+static
+int mem_file_open(int can_forward)
+{
+    int fd;
+    struct fd *f;
+
+    fd = file_alloc();
+    f = file_struct_get(fd);
+    f->isopen = 1;
+    f->read = mem_file_read;
+    if (can_forward)
+    {
+        f->forward = mem_file_forward;
+    }
+    mem_file_pos = 0;
+    return fd;
+}
+
+static
+void test_sendfile(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int file;
+    int can_forward;
+    size_t i;
+    ssize_t ret;
+    static char buf[sizeof(mem_file_data)];
+
+    for (i = 0; i < sizeof(mem_file_data); i++)
+    {
+        mem_file_data[i] = (char)(i * 7);
+    }
+    tcp_pair(&listen_sock, &client_sock, &server_sock);
+
+    for (can_forward = 0; can_forward < 2; can_forward++)
+    {
+        file = mem_file_open(can_forward);
+        /* asking for more stops at the end of file */
+        ret = sendfile(server_sock, file, NULL, sizeof(mem_file_data) + 100);
+        assert_equal(ret, sizeof(mem_file_data));
+        ret = recv(client_sock, buf, sizeof(buf), MSG_WAITALL);
+        assert_equal(ret, sizeof(buf));
+        assert_equal(memcmp(buf, mem_file_data, sizeof(buf)), 0);
+        ret = sendfile(server_sock, file, NULL, 10);
+        assert_equal(ret, 0);
+        close(file);
+        file_free(file);
+    }
+
+    close(client_sock);
+    close(server_sock);
+    close(listen_sock);
+
+    client_sock = socket(AF_INET, SOCK_STREAM, 0);
+    file = mem_file_open(1);
+    errno = 0;
+    ret = sendfile(client_sock, file, NULL, 10);
+    assert_equal(ret, -1);
+    assert_equal(errno, ENOTCONN);
+    close(file);
+    file_free(file);
+    close(client_sock);
+}
+
+static
+void test_mmsg(void)
+{
+    int sock_a;
+    int sock_b;
+    int sock_c;
+    int ret;
+    int i;
+    struct sockaddr_in addr;
+    struct sockaddr_in addr_c;
+    struct sockaddr_in from[4];
+    struct mmsghdr msgs[4];
+    struct iovec iovs[4];
+    char bufs[4][8];
+    unsigned long frames;
+    unsigned long frames_single;
+
+    sock_a = socket(AF_INET, SOCK_DGRAM, 0);
+    sock_b = socket(AF_INET, SOCK_DGRAM, 0);
+    sock_c = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(UDP_PORT);
+    bind(sock_b, (struct sockaddr *)&addr, sizeof(addr));
+    addr_c = addr;
+    addr_c.sin_port = htons(UDP_PORT + 1);
+    bind(sock_c, (struct sockaddr *)&addr_c, sizeof(addr_c));
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    addr_c.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+
+    /* a batch to two destinations */
+    for (i = 0; i < 4; i++)
+    {
+        snprintf(bufs[i], sizeof(bufs[i]), "dgram%d", i);
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = 6;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = (i == 3) ? &addr_c : &addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+    }
+    ret = sendmmsg(sock_a, msgs, 4, 0);
+    assert_equal(ret, 4);
+    assert_equal(msgs[3].msg_len, 6);
+
+    /* three datagrams wait in sock_b, the batch takes them all */
+    memset(bufs, 0, sizeof(bufs));
+    for (i = 0; i < 4; i++)
+    {
+        iovs[i].iov_len = sizeof(bufs[i]);
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+    }
+    ret = recvmmsg(sock_b, msgs, 4, 0, NULL);
+    assert_equal(ret, 3);
+    for (i = 0; i < 3; i++)
+    {
+        assert_equal(msgs[i].msg_len, 6);
+        assert_equal(bufs[i][5], '0' + i);
+    }
+    ret = recvmmsg(sock_c, msgs, 4, MSG_DONTWAIT, NULL);
+    assert_equal(ret, 1);
+    assert_equal(memcmp(bufs[0], "dgram3", 6), 0);
+    errno = 0;
+    ret = recvmmsg(sock_c, msgs, 4, MSG_DONTWAIT, NULL);
+    assert_equal(ret, -1);
+    assert_equal(errno, EAGAIN);
+
+    /* cost of taking the datagrams one by one, and in a batch */
+    for (i = 0; i < 4; i++)
+    {
+        sendto(sock_a, "x", 1, 0, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    frames = w5x00_emu_stats.frames;
+    for (i = 0; i < 4; i++)
+    {
+        recvfrom(sock_b, bufs[0], sizeof(bufs[0]), 0, NULL, NULL);
+    }
+    frames_single = w5x00_emu_stats.frames - frames;
+    for (i = 0; i < 4; i++)
+    {
+        sendto(sock_a, "x", 1, 0, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    frames = w5x00_emu_stats.frames;
+    ret = recvmmsg(sock_b, msgs, 4, 0, NULL);
+    assert_equal(ret, 4);
+    frames = w5x00_emu_stats.frames - frames;
+    assert_equal((frames < frames_single), 1);
+    printf("4 datagrams recv: %lu SPI frames, %lu with recvmmsg\n",
+            frames_single, frames);
+
+    assert_equal(close(sock_a), 0);
+    assert_equal(close(sock_b), 0);
+    assert_equal(close(sock_c), 0);
+}
+
+static
+void test_tcp_cork(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int ret;
+    int val;
+    char buf[32];
+    unsigned long commands;
+    struct timespec delay;
+
+    tcp_pair(&listen_sock, &client_sock, &server_sock);
+
+    val = 1;
+    ret = setsockopt(client_sock, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+    assert_equal(ret, 0);
+    commands = w5x00_emu_stats.commands;
+    send(client_sock, "GET ", 4, 0);
+    send(client_sock, "/ HTTP/1.0", 10, 0);
+    send(client_sock, "\r\n\r\n", 4, 0);
+    assert_equal(w5x00_emu_stats.commands - commands, 0);
+    ret = recv(server_sock, buf, sizeof(buf), MSG_DONTWAIT);
+    assert_equal(ret, -1);
+
+    val = 0;
+    commands = w5x00_emu_stats.commands;
+    ret = setsockopt(client_sock, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+    assert_equal(ret, 0);
+    assert_equal(w5x00_emu_stats.commands - commands, 1);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 18);
+
+    /* without TCP_NODELAY small writes wait for the timer */
+    ret = setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    assert_equal(ret, 0);
+    send(client_sock, "ab", 2, 0);
+    ret = recv(server_sock, buf, sizeof(buf), MSG_DONTWAIT);
+    assert_equal(ret, -1);
+    delay.tv_sec = 0;
+    delay.tv_nsec = 250000000;
+    nanosleep(&delay, NULL);
+    send(client_sock, "c", 1, 0);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 3);
+
+    close(client_sock);
+    close(server_sock);
+    close(listen_sock);
+}
+
+static
+void test_backlog(void)
+{
+    int listen_sock;
+    int client_sock[2];
+    int server_sock[2];
+    int sock[W5X00_MAX_SOCKETS];
+    int ret;
+    int i;
+    struct sockaddr_in addr;
+    char buf[8];
+    struct pollfd p;
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TCP_PORT);
+    bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr));
+    ret = listen(listen_sock, 2);
+    assert_equal(ret, 0);
+
+    /* both clients connect before any accept */
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    for (i = 0; i < 2; i++)
+    {
+        client_sock[i] = socket(AF_INET, SOCK_STREAM, 0);
+        ret = connect(client_sock[i], (struct sockaddr *)&addr, sizeof(addr));
+        assert_equal(ret, 0);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        server_sock[i] = accept(listen_sock, NULL, NULL);
+        assert_equal((server_sock[i] != -1), 1);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        buf[0] = '0' + i;
+        send(client_sock[i], buf, 1, 0);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        ret = recv(server_sock[i], buf, sizeof(buf), 0);
+        assert_equal(ret, 1);
+        assert_equal(buf[0], '0' + i);
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        assert_equal(close(client_sock[i]), 0);
+        assert_equal(close(server_sock[i]), 0);
+    }
+    assert_equal(close(listen_sock), 0);
+
+    /* spare sockets have been released */
+    for (i = 0; i < w5x00_chip.n_sockets; i++)
+    {
+        sock[i] = socket(AF_INET, SOCK_STREAM, 0);
+        assert_equal((sock[i] != -1), 1);
+    }
+    for (i = 0; i < w5x00_chip.n_sockets; i++)
+    {
+        close(sock[i]);
+    }
+
+    /* an error left on a socket does not go to the spare taking it */
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr));
+    sock[0] = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(sock[0], F_SETFL, O_NONBLOCK);
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    errno = 0;
+    ret = connect(sock[0], (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(errno, EINPROGRESS);
+    p.fd = sock[0];
+    p.events = POLLOUT;
+    ret = poll(&p, 1, 1000);
+    assert_equal(((p.revents & POLLERR) != 0), 1);
+    close(sock[0]); /* SO_ERROR not read */
+    ret = listen(listen_sock, 2);
+    assert_equal(ret, 0);
+    for (i = 0; i < 2; i++)
+    {
+        client_sock[i] = socket(AF_INET, SOCK_STREAM, 0);
+        ret = connect(client_sock[i], (struct sockaddr *)&addr, sizeof(addr));
+        assert_equal(ret, 0);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        server_sock[i] = accept(listen_sock, NULL, NULL);
+        assert_equal((server_sock[i] != -1), 1);
+        p.fd = server_sock[i];
+        p.events = POLLIN | POLLOUT;
+        ret = poll(&p, 1, 0);
+        assert_equal(ret, 1);
+        assert_equal(p.revents, POLLOUT);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        close(client_sock[i]);
+        close(server_sock[i]);
+    }
+    close(listen_sock);
+
+    /* the listening socket taken back after its connection:
+     * still one socket listening for a backlog of 1
+     */
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr));
+    ret = listen(listen_sock, 1);
+    assert_equal(ret, 0);
+    client_sock[0] = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    ret = connect(client_sock[0], (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 0);
+    server_sock[0] = accept(listen_sock, NULL, NULL);
+    assert_equal((server_sock[0] != -1), 1);
+    assert_equal(close(client_sock[0]), 0);
+    assert_equal(close(server_sock[0]), 0);
+    for (i = 0; i < w5x00_chip.n_sockets; i++)
+    {
+        sock[i] = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    assert_equal((sock[w5x00_chip.n_sockets - 2] != -1), 1);
+    assert_equal(sock[w5x00_chip.n_sockets - 1], -1);
+    for (i = 0; i < w5x00_chip.n_sockets; i++)
+    {
+        close(sock[i]);
+    }
+    close(listen_sock);
+}
+
+static
+int host_accept(int fd)
+{
+    int ret;
+    uint8_t ip[4];
+    uint16_t port;
+
+    do
+    {
+        w5x00_emu_wait(1);
+        ret = w5x00_emu_host_tcp_accept(fd, ip, &port);
+    } while (ret == -1);
+
+    return ret;
+}
+
+static
+size_t host_recv_all(int fd, void *buf, size_t len)
+{
+    size_t ntotal;
+
+    ntotal = 0;
+    while (ntotal < len)
+    {
+        long n;
+
+        n = w5x00_emu_host_recv(fd, (char *)buf + ntotal, len - ntotal);
+        if ((n == 0) || (n == W5X00_EMU_HOST_ERROR))
+        {
+            break;
+        }
+        else if (n > 0)
+        {
+            ntotal += n;
+        }
+        else
+        {
+            w5x00_emu_wait(1);
+        }
+    }
+    return ntotal;
+}
+
+static
+void test_connect_nonblock(void)
+{
+    int listen_sock;
+    int sock;
+    int host_listen;
+    int host_sock;
+    int ret;
+    int err;
+    socklen_t len;
+    struct sockaddr_in addr;
+    struct pollfd p;
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TCP_PORT);
+    bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr));
+    listen(listen_sock, 1);
+
+    /* local peer */
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    errno = 0;
+    ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, -1);
+    assert_equal(errno, EINPROGRESS);
+    p.fd = sock;
+    p.events = POLLOUT;
+    ret = poll(&p, 1, 1000);
+    assert_equal(ret, 1);
+    assert_equal(p.revents, POLLOUT);
+    len = sizeof(err);
+    ret = getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+    assert_equal(ret, 0);
+    assert_equal(err, 0);
+    errno = 0;
+    ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(errno, EISCONN);
+    close(sock);
+    close(listen_sock);
+
+    /* nobody listening */
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    errno = 0;
+    ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(errno, EINPROGRESS);
+    p.fd = sock;
+    ret = poll(&p, 1, 1000);
+    assert_equal(ret, 1);
+    assert_equal(((p.revents & POLLERR) != 0), 1);
+    ret = getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+    assert_equal(err, ECONNREFUSED);
+    ret = getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+    assert_equal(err, 0);
+    close(sock);
+
+    /* through the tunnel, completed later */
+    host_listen = w5x00_emu_host_tcp_listen(HOST_TCP_PORT);
+    assert_equal((host_listen != -1), 1);
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(HOST_TCP_PORT);
+    errno = 0;
+    ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(errno, EINPROGRESS);
+    errno = 0;
+    ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(errno, EALREADY);
+    p.fd = sock;
+    ret = poll(&p, 1, 1000);
+    assert_equal(ret, 1);
+    assert_equal(p.revents, POLLOUT);
+    ret = send(sock, "hi", 2, 0);
+    assert_equal(ret, 2);
+    host_sock = host_accept(host_listen);
+    close(sock);
+    w5x00_emu_host_close(host_sock);
+    w5x00_emu_host_close(host_listen);
+}
+
+static
+void test_tunnel(void)
+{
+    static const uint8_t loopback[4] = {127, 0, 0, 1};
+    static char buf[1024];
+    static char rx_buf[1024];
+    int host_listen;
+    int host_sock;
+    int host_udp;
+    int sock;
+    int listen_sock;
+    int server_sock;
+    int ret;
+    int i;
+    long n;
+    uint8_t ip[4];
+    uint16_t port;
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    unsigned long frames;
+
+    /* client on the chip, server on the host */
+    host_listen = w5x00_emu_host_tcp_listen(HOST_TCP_PORT);
+    assert_equal((host_listen != -1), 1);
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(HOST_TCP_PORT);
+    ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 0);
+    host_sock = host_accept(host_listen);
+
+    ret = send(sock, "ping", 4, 0);
+    assert_equal(ret, 4);
+    assert_equal(host_recv_all(host_sock, rx_buf, 4), 4);
+    assert_equal(memcmp(rx_buf, "ping", 4), 0);
+    n = w5x00_emu_host_send(host_sock, "pong", 4);
+    assert_equal(n, 4);
+    ret = recv(sock, rx_buf, 4, MSG_WAITALL);
+    assert_equal(ret, 4);
+    assert_equal(memcmp(rx_buf, "pong", 4), 0);
+
+    memset(buf, 'x', sizeof(buf));
+    frames = w5x00_emu_stats.frames;
+    for (i = 0; i < BENCH_KIB; i++)
+    {
+        ret = send(sock, buf, sizeof(buf), 0);
+        assert_equal(ret, (int)sizeof(buf));
+        assert_equal(host_recv_all(host_sock, rx_buf, sizeof(rx_buf)), sizeof(rx_buf));
+    }
+    printf("tunnel TCP send: %lu SPI frames per KiB\n",
+            (w5x00_emu_stats.frames - frames) / BENCH_KIB);
+
+    frames = w5x00_emu_stats.frames;
+    for (i = 0; i < BENCH_KIB; i++)
+    {
+        n = w5x00_emu_host_send(host_sock, buf, sizeof(buf));
+        assert_equal(n, (long)sizeof(buf));
+        ret = recv(sock, rx_buf, sizeof(rx_buf), MSG_WAITALL);
+        assert_equal(ret, (int)sizeof(rx_buf));
+    }
+    printf("tunnel TCP recv: %lu SPI frames per KiB\n",
+            (w5x00_emu_stats.frames - frames) / BENCH_KIB);
+
+    /* FIN reaches the host */
+    assert_equal(close(sock), 0);
+    assert_equal(host_recv_all(host_sock, rx_buf, sizeof(rx_buf)), 0);
+    w5x00_emu_host_close(host_sock);
+    w5x00_emu_host_close(host_listen);
+
+    /* server on the chip, client on the host */
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(TUNNEL_TCP_PORT);
+    bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr));
+    ret = listen(listen_sock, 1);
+    assert_equal(ret, 0);
+    host_sock = w5x00_emu_host_tcp_connect(loopback, TUNNEL_TCP_PORT);
+    assert_equal((host_sock != -1), 1);
+    addrlen = sizeof(addr);
+    server_sock = accept(listen_sock, (struct sockaddr *)&addr, &addrlen);
+    assert_equal((server_sock != -1), 1);
+    assert_equal(addr.sin_addr.s_addr, inet_addr("127.0.0.1"));
+    assert_equal(w5x00_emu_host_tcp_connected(host_sock), 0);
+    n = w5x00_emu_host_send(host_sock, "hello", 5);
+    assert_equal(n, 5);
+    ret = recv(server_sock, rx_buf, 5, MSG_WAITALL);
+    assert_equal(ret, 5);
+    assert_equal(memcmp(rx_buf, "hello", 5), 0);
+    w5x00_emu_host_close(host_sock);
+    close(server_sock);
+    close(listen_sock);
+
+    /* UDP both ways */
+    host_udp = w5x00_emu_host_udp_open(HOST_UDP_PORT);
+    assert_equal((host_udp != -1), 1);
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(TUNNEL_UDP_PORT);
+    bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(HOST_UDP_PORT);
+    ret = sendto(sock, "query", 5, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 5);
+    do
+    {
+        w5x00_emu_wait(1);
+        n = w5x00_emu_host_recvfrom(host_udp, rx_buf, sizeof(rx_buf), ip, &port);
+    } while (n == W5X00_EMU_HOST_AGAIN);
+    assert_equal(n, 5);
+    assert_equal(port, TUNNEL_UDP_PORT);
+    n = w5x00_emu_host_sendto(host_udp, "answer", 6, loopback, TUNNEL_UDP_PORT);
+    assert_equal(n, 6);
+    addrlen = sizeof(addr);
+    ret = recvfrom(sock, rx_buf, sizeof(rx_buf), 0, (struct sockaddr *)&addr, &addrlen);
+    assert_equal(ret, 6);
+    assert_equal(memcmp(rx_buf, "answer", 6), 0);
+    assert_equal(ntohs(addr.sin_port), HOST_UDP_PORT);
+    close(sock);
+    w5x00_emu_host_close(host_udp);
+}
+
+static
+void test_buf_sizes(void)
+{
+    int sock;
+    int ret;
+    int i;
+    int val;
+    socklen_t len;
+    uint16_t tx_sizes[W5X00_MAX_SOCKETS];
+    uint16_t rx_sizes[W5X00_MAX_SOCKETS];
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    val = 3000; /* rounded up */
+    ret = setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+    assert_equal(ret, 0);
+    len = sizeof(val);
+    ret = getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &val, &len);
+    assert_equal(ret, 0);
+    assert_equal(val, 4096);
+    assert_equal((w5x00_chip.get_tx_size(w5x00_chip.n_sockets - 1) < 2048), 1);
+
+    /* the buffer of sock can not move while in use */
+    for (i = 0; i < w5x00_chip.n_sockets; i++)
+    {
+        tx_sizes[i] = w5x00_chip.tx_mem_size / w5x00_chip.n_sockets;
+        rx_sizes[i] = w5x00_chip.rx_mem_size / w5x00_chip.n_sockets;
+    }
+    errno = 0;
+    ret = w5100_socket_set_buf_sizes(tx_sizes, rx_sizes);
+    assert_equal(ret, -1);
+    assert_equal(errno, EBUSY);
+
+    assert_equal(close(sock), 0);
+    ret = w5100_socket_set_buf_sizes(tx_sizes, rx_sizes);
+    assert_equal(ret, 0);
+}
+
+static
+void test_stats(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int ret;
+    int fd;
+    int fd2;
+    int n;
+    int total;
+    socklen_t len;
+    char buf[8];
+    struct timeval tv;
+    struct pollfd p;
+    struct w5100_sock_stats st;
+    unsigned long frames;
+    unsigned long emu_frames;
+    static char text[1024];
+    static char text2[1024];
+
+    tcp_pair(&listen_sock, &client_sock, &server_sock);
+
+    len = sizeof(st);
+    ret = getsockopt(server_sock, SOL_W5100, W5100_SO_STATS, &st, &len);
+    assert_equal(ret, 0);
+    assert_equal(len, sizeof(st));
+    assert_equal(st.bytes_in, 0);
+    assert_equal(st.bytes_out, 0);
+    len = sizeof(st) - 1;
+    errno = 0;
+    ret = getsockopt(server_sock, SOL_W5100, W5100_SO_STATS, &st, &len);
+    assert_equal(ret, -1);
+    assert_equal(errno, EINVAL);
+    errno = 0;
+    ret = getsockopt(server_sock, SOL_W5100, W5100_SO_STATS, &st, NULL);
+    assert_equal(ret, -1);
+    assert_equal(errno, EFAULT);
+
+    /* every frame on the bus goes through the chip driver */
+    frames = w5x00_frames.data + w5x00_frames.reg;
+    emu_frames = w5x00_emu_stats.frames;
+
+    ret = send(client_sock, "hello", 5, 0);
+    assert_equal(ret, 5);
+    ret = recv(server_sock, buf, 2, MSG_PEEK|MSG_WAITALL);
+    assert_equal(ret, 2);
+    ret = recv(server_sock, buf, 5, MSG_WAITALL);
+    assert_equal(ret, 5);
+    errno = 0;
+    ret = recv(server_sock, buf, sizeof(buf), MSG_DONTWAIT);
+    assert_equal(ret, -1);
+    assert_equal(errno, EAGAIN);
+    tv.tv_sec = 0;
+    tv.tv_usec = 10000;
+    setsockopt(server_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    errno = 0;
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, -1);
+    assert_equal(errno, EAGAIN);
+    p.fd = server_sock;
+    p.events = POLLIN;
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 0);
+
+    assert_equal(w5x00_frames.data + w5x00_frames.reg - frames, w5x00_emu_stats.frames - emu_frames);
+
+    len = sizeof(st);
+    ret = getsockopt(server_sock, SOL_W5100, W5100_SO_STATS, &st, &len);
+    assert_equal(ret, 0);
+    assert_equal(st.bytes_in, 5);
+    assert_equal(st.bytes_out, 0);
+    assert_equal((st.recv_cmds > 0), 1);
+    assert_equal(st.send_cmds, 0);
+    assert_equal((st.data_frames > 0), 1);
+    assert_equal((st.reg_frames > 0), 1);
+    assert_equal((st.polls > 0), 1);
+    assert_equal(st.eagain, 1);
+    assert_equal(st.timeouts, 1);
+    ret = getsockopt(client_sock, SOL_W5100, W5100_SO_STATS, &st, &len);
+    assert_equal(ret, 0);
+    assert_equal(st.bytes_out, 5);
+    assert_equal(st.send_cmds, 1);
+    assert_equal(st.eagain, 0);
+
+    /* the same text, read in one go or in small pieces */
+    fd = w5100_stats_open();
+    assert_equal((fd != -1), 1);
+    fd2 = w5100_stats_open();
+    assert_equal((fd2 != -1), 1);
+    errno = 0;
+    ret = w5100_stats_open();
+    assert_equal(ret, -1);
+    assert_equal(errno, ENFILE);
+    n = read(fd, text, sizeof(text) - 1);
+    assert_equal((n > 0), 1);
+    text[n] = '\0';
+    assert_equal(read(fd, text, sizeof(text) - 1), 0);
+    total = 0;
+    do
+    {
+        ret = read(fd2, &text2[total], 7);
+        total += ret;
+    } while (ret > 0);
+    assert_equal(total, n);
+    assert_equal(memcmp(text, text2, n), 0);
+    assert_equal(strncmp(text, w5x00_chip.name, strlen(w5x00_chip.name)), 0);
+    assert_equal((strstr(text, " tcp accepted 5 0 ") != NULL), 1);
+    assert_equal(close(fd), 0);
+    assert_equal(close(fd2), 0);
+
+    assert_equal(close(server_sock), 0);
+    assert_equal(close(client_sock), 0);
+    assert_equal(close(listen_sock), 0);
+}
+
+static
+void test_epoll(void)
+{
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int udp_sock;
+    int epfd;
+    int ret;
+    int i;
+    char buf[8];
+    socklen_t len;
+    unsigned long polls;
+    struct w5100_sock_stats st;
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    struct epoll_event events[4];
+
+    errno = 0;
+    ret = epoll_create(0);
+    assert_equal(ret, -1);
+    assert_equal(errno, EINVAL);
+    epfd = epoll_create(1);
+    assert_equal((epfd != -1), 1);
+
+    tcp_pair(&listen_sock, &client_sock, &server_sock);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = server_sock;
+    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, server_sock, &ev);
+    assert_equal(ret, 0);
+    ev.data.fd = listen_sock;
+    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev);
+    assert_equal(ret, 0);
+    ev.events = EPOLLOUT|EPOLLET;
+    ev.data.fd = client_sock;
+    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &ev);
+    assert_equal(ret, 0);
+    errno = 0;
+    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &ev);
+    assert_equal(ret, -1);
+    assert_equal(errno, EEXIST);
+    errno = 0;
+    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, epfd, &ev);
+    assert_equal(ret, -1);
+    assert_equal(errno, EINVAL);
+
+    /* edge triggered: writable once */
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 1);
+    assert_equal(events[0].data.fd, client_sock);
+    assert_equal(events[0].events, EPOLLOUT);
+
+    /* nothing happened: the sockets are not asked again */
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 0);
+    len = sizeof(st);
+    getsockopt(server_sock, SOL_W5100, W5100_SO_STATS, &st, &len);
+    polls = st.polls;
+    for (i = 0; i < 10; i++)
+    {
+        ret = epoll_wait(epfd, events, 4, 0);
+        assert_equal(ret, 0);
+    }
+    getsockopt(server_sock, SOL_W5100, W5100_SO_STATS, &st, &len);
+    assert_equal(st.polls, polls);
+    /* each SEND_OK would be a new edge */
+    ret = epoll_ctl(epfd, EPOLL_CTL_DEL, client_sock, NULL);
+    assert_equal(ret, 0);
+
+    /* level triggered: readable until read */
+    send(client_sock, "data", 4, 0);
+    ret = epoll_wait(epfd, events, 4, 100);
+    assert_equal(ret, 1);
+    assert_equal(events[0].data.fd, server_sock);
+    assert_equal(events[0].events, EPOLLIN);
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 1);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 4);
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 0);
+
+    /* one shot: then not until EPOLL_CTL_MOD */
+    ev.events = EPOLLIN|EPOLLONESHOT;
+    ev.data.fd = server_sock;
+    ret = epoll_ctl(epfd, EPOLL_CTL_MOD, server_sock, &ev);
+    assert_equal(ret, 0);
+    send(client_sock, "more", 4, 0);
+    ret = epoll_wait(epfd, events, 4, 100);
+    assert_equal(ret, 1);
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 0);
+    ret = epoll_ctl(epfd, EPOLL_CTL_MOD, server_sock, &ev);
+    assert_equal(ret, 0);
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 1);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 4);
+
+    /* edge triggered: data coming after all has been read is an edge,
+     * though the socket was readable at the last look
+     */
+    ev.events = EPOLLIN|EPOLLET;
+    ret = epoll_ctl(epfd, EPOLL_CTL_MOD, server_sock, &ev);
+    assert_equal(ret, 0);
+    send(client_sock, "one", 3, 0);
+    ret = epoll_wait(epfd, events, 4, 100);
+    assert_equal(ret, 1);
+    assert_equal(events[0].events, EPOLLIN);
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 0);
+    do
+    {
+        ret = recv(server_sock, buf, sizeof(buf), MSG_DONTWAIT);
+    } while (ret > 0);
+    assert_equal(errno, EAGAIN);
+    send(client_sock, "two", 3, 0);
+    ret = epoll_wait(epfd, events, 4, 300);
+    assert_equal(ret, 1);
+    assert_equal(events[0].data.fd, server_sock);
+    assert_equal(events[0].events, EPOLLIN);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 3);
+
+    /* closed files leave the list, even when they were ready */
+    ev.events = EPOLLOUT;
+    ev.data.fd = client_sock;
+    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &ev);
+    assert_equal(ret, 0);
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 1);
+    assert_equal(events[0].data.fd, client_sock);
+    assert_equal(close(client_sock), 0);
+    /* only the end of file of the other side */
+    ret = epoll_wait(epfd, events, 4, 100);
+    assert_equal(ret, 1);
+    assert_equal(events[0].data.fd, server_sock);
+    assert_equal(close(server_sock), 0);
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 0);
+    errno = 0;
+    ret = epoll_ctl(epfd, EPOLL_CTL_DEL, server_sock, NULL);
+    assert_equal(ret, -1);
+    errno = 0;
+    ret = epoll_ctl(epfd, EPOLL_CTL_DEL, client_sock, NULL);
+    assert_equal(ret, -1);
+    ret = epoll_ctl(epfd, EPOLL_CTL_DEL, listen_sock, NULL);
+    assert_equal(ret, 0);
+
+    /* nor when closing does not change anything else */
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(UDP_PORT);
+    ret = bind(udp_sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 0);
+    ev.events = EPOLLOUT;
+    ev.data.fd = udp_sock;
+    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, udp_sock, &ev);
+    assert_equal(ret, 0);
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 1);
+    assert_equal(close(udp_sock), 0);
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, 0);
+
+    assert_equal(close(epfd), 0);
+    errno = 0;
+    ret = epoll_wait(epfd, events, 4, 0);
+    assert_equal(ret, -1);
+    assert_equal(errno, EBADF);
+
+    assert_equal(close(listen_sock), 0);
+}
+
+int main(void)
+{
+    printf("chip: %s\n", w5x00_chip.name);
+
+    w5x00_emu_stats.frames = 0;
+    test_udp();
+    printf("UDP: %lu SPI frames\n", w5x00_emu_stats.frames);
+
+    w5x00_emu_stats.frames = 0;
+    test_tcp();
+    printf("TCP: %lu SPI frames\n", w5x00_emu_stats.frames);
+
+    test_iov();
+    test_recv_flags();
+    test_poll_events();
+    test_shutdown();
+    test_keepalive();
+    test_tcp_tuning();
+    test_multicast();
+    test_rx_stage();
+    test_connect_nonblock();
+    test_sendfile();
+    test_mmsg();
+    test_tcp_cork();
+    test_backlog();
+    test_tunnel();
+    test_buf_sizes();
+    test_stats();
+    test_epoll();
+
+    if (assertions_failed)
+    {
+        printf("%d assertions failed.\n", assertions_failed);
+        return 1;
+    }
+    else
+    {
+        puts("All tests OK");
+        return 0;
+    }
+}
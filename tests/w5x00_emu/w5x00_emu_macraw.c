@@ -0,0 +1,328 @@
+/*
+ * Software UDP sockets, on top of socket 0 in MACRAW mode,
+ * against the chip emulator: the socket layer is built with
+ * W5100_MACRAW.
+ */
+#include <stdio.h> //printf
+#include <string.h>    //strlen
+#include <unistd.h>    //close
+#include <sys/socket.h>    //socket
+#include <arpa/inet.h> //inet_addr
+#include <errno.h>
+#include <poll.h>
+#include "w5x00.h"
+#include "w5x00_emu.h"
+#include "w5x00_emu_host.h"
+
+#ifndef CHIP_IP_ADDR
+#  define CHIP_IP_ADDR "192.168.1.99"
+#endif
+
+#define TCP_PORT 8888
+#define UDP_PORT 8889
+#define N_UDP_SOCKETS 8 /* W5100_MACRAW_SOCKETS */
+
+/* host side of the tunnel */
+#define HOST_UDP_PORT 18989
+#define TUNNEL_UDP_PORT 18991
+
+int assertions_failed = 0;
+
+#define assert_equal(x, y) do { \
+        if (x != y) { \
+            fprintf(stderr, "%s:%d: %s: " #x " != " #y ": %d != %d\n", __FILE__, __LINE__, __func__, (int)(x), (int)(y)); \
+            assertions_failed++; \
+        }\
+    } while(0);
+
+static
+void test_many_sockets(void)
+{
+    int socks[N_UDP_SOCKETS];
+    int ret;
+    int i;
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    char buf[32];
+
+    /* more than the hardware sockets */
+    for (i = 0; i < N_UDP_SOCKETS; i++)
+    {
+        socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        assert_equal((socks[i] != -1), 1);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(UDP_PORT + i);
+        ret = bind(socks[i], (struct sockaddr *)&addr, sizeof(addr));
+        assert_equal(ret, 0);
+    }
+    errno = 0;
+    ret = socket(AF_INET, SOCK_DGRAM, 0);
+    assert_equal(ret, -1);
+    assert_equal(errno, ENOMEM); /* as for the hardware sockets */
+
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    for (i = 1; i < N_UDP_SOCKETS; i++)
+    {
+        snprintf(buf, sizeof(buf), "dgram%d", i);
+        addr.sin_port = htons(UDP_PORT + i);
+        ret = sendto(socks[0], buf, 6, 0, (struct sockaddr *)&addr, sizeof(addr));
+        assert_equal(ret, 6);
+    }
+    for (i = 1; i < N_UDP_SOCKETS; i++)
+    {
+        addrlen = sizeof(addr);
+        ret = recvfrom(socks[i], buf, sizeof(buf), 0, (struct sockaddr *)&addr, &addrlen);
+        assert_equal(ret, 6);
+        assert_equal(buf[5], '0' + i);
+        assert_equal(ntohs(addr.sin_port), UDP_PORT);
+        assert_equal(addr.sin_addr.s_addr, inet_addr(CHIP_IP_ADDR));
+    }
+
+    for (i = 0; i < N_UDP_SOCKETS; i++)
+    {
+        assert_equal(close(socks[i]), 0);
+    }
+}
+
+static
+void test_tcp_alongside(void)
+{
+    int udp_sock;
+    int listen_sock;
+    int client_sock;
+    int server_sock;
+    int ret;
+    struct sockaddr_in addr;
+    char buf[32];
+
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(UDP_PORT);
+    bind(udp_sock, (struct sockaddr *)&addr, sizeof(addr));
+
+    /* the hardware sockets left to TCP */
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_port = htons(TCP_PORT);
+    ret = bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 0);
+    ret = listen(listen_sock, 1);
+    assert_equal(ret, 0);
+    client_sock = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    ret = connect(client_sock, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 0);
+    server_sock = accept(listen_sock, NULL, NULL);
+    assert_equal((server_sock != -1), 1);
+
+    ret = send(client_sock, "ping", 4, 0);
+    assert_equal(ret, 4);
+    addr.sin_port = htons(UDP_PORT);
+    ret = sendto(udp_sock, "self", 4, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 4);
+    ret = recv(server_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 4);
+    assert_equal(memcmp(buf, "ping", 4), 0);
+    ret = recv(udp_sock, buf, sizeof(buf), 0);
+    assert_equal(ret, 4);
+    assert_equal(memcmp(buf, "self", 4), 0);
+
+    close(client_sock);
+    close(server_sock);
+    close(listen_sock);
+    close(udp_sock);
+}
+
+static
+void test_tunnel(void)
+{
+    static const uint8_t loopback[4] = {127, 0, 0, 1};
+    int host_udp;
+    int sock;
+    int ret;
+    long n;
+    uint8_t ip[4];
+    uint16_t port;
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    struct mmsghdr msgs[2];
+    struct iovec iovs[2];
+    char bufs[2][16];
+    char buf[32];
+
+    host_udp = w5x00_emu_host_udp_open(HOST_UDP_PORT);
+    assert_equal((host_udp != -1), 1);
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(TUNNEL_UDP_PORT);
+    bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+
+    /* off the local network: the gateway is not known yet */
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(HOST_UDP_PORT);
+    errno = 0;
+    ret = sendto(sock, "query", 5, MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, -1);
+    assert_equal(errno, EAGAIN);
+    ret = sendto(sock, "query", 5, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 5);
+    do
+    {
+        w5x00_emu_wait(1);
+        n = w5x00_emu_host_recvfrom(host_udp, buf, sizeof(buf), ip, &port);
+    } while (n == W5X00_EMU_HOST_AGAIN);
+    assert_equal(n, 5);
+    assert_equal(memcmp(buf, "query", 5), 0);
+    assert_equal(port, TUNNEL_UDP_PORT);
+
+    /* known now */
+    ret = sendto(sock, "again", 5, MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 5);
+    do
+    {
+        w5x00_emu_wait(1);
+        n = w5x00_emu_host_recvfrom(host_udp, buf, sizeof(buf), ip, &port);
+    } while (n == W5X00_EMU_HOST_AGAIN);
+    assert_equal(n, 5);
+
+    n = w5x00_emu_host_sendto(host_udp, "answer", 6, loopback, TUNNEL_UDP_PORT);
+    assert_equal(n, 6);
+    addrlen = sizeof(addr);
+    ret = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr, &addrlen);
+    assert_equal(ret, 6);
+    assert_equal(memcmp(buf, "answer", 6), 0);
+    assert_equal(ntohs(addr.sin_port), HOST_UDP_PORT);
+    assert_equal(addr.sin_addr.s_addr, inet_addr("127.0.0.1"));
+
+    /* a batch */
+    n = w5x00_emu_host_sendto(host_udp, "first", 5, loopback, TUNNEL_UDP_PORT);
+    assert_equal(n, 5);
+    n = w5x00_emu_host_sendto(host_udp, "second", 6, loopback, TUNNEL_UDP_PORT);
+    assert_equal(n, 6);
+    memset(msgs, 0, sizeof(msgs));
+    iovs[0].iov_base = bufs[0];
+    iovs[0].iov_len = sizeof(bufs[0]);
+    iovs[1].iov_base = bufs[1];
+    iovs[1].iov_len = sizeof(bufs[1]);
+    msgs[0].msg_hdr.msg_iov = &iovs[0];
+    msgs[0].msg_hdr.msg_iovlen = 1;
+    msgs[1].msg_hdr.msg_iov = &iovs[1];
+    msgs[1].msg_hdr.msg_iovlen = 1;
+    ret = 0;
+    do
+    {
+        w5x00_emu_wait(1);
+        n = recvmmsg(sock, &msgs[ret], 2 - ret, MSG_DONTWAIT, NULL);
+        if (n > 0)
+        {
+            ret += n;
+        }
+    } while ((ret < 2) && ((n > 0) || (errno == EAGAIN)));
+    assert_equal(ret, 2);
+    assert_equal(msgs[0].msg_len, 5);
+    assert_equal(msgs[1].msg_len, 6);
+    assert_equal(memcmp(bufs[1], "second", 6), 0);
+
+    close(sock);
+    w5x00_emu_host_close(host_udp);
+}
+
+static
+void test_flags(void)
+{
+    int sock;
+    int ret;
+    int val;
+    socklen_t len;
+    struct sockaddr_in addr;
+    struct ip_mreq mreq;
+    struct pollfd p;
+    struct iovec iov;
+    struct msghdr msg;
+    static char big[1500];
+    char buf[32];
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(UDP_PORT);
+    bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+
+    p.fd = sock;
+    p.events = POLLIN|POLLOUT;
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 1);
+    assert_equal(p.revents, POLLOUT);
+    errno = 0;
+    ret = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+    assert_equal(ret, -1);
+    assert_equal(errno, EAGAIN);
+
+    addr.sin_addr.s_addr = inet_addr(CHIP_IP_ADDR);
+    ret = sendto(sock, "truncated", 9, 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, 9);
+    ret = poll(&p, 1, 0);
+    assert_equal(ret, 1);
+    assert_equal(p.revents, (POLLIN|POLLOUT));
+
+    ret = recv(sock, buf, sizeof(buf), MSG_PEEK);
+    assert_equal(ret, 9);
+    iov.iov_base = buf;
+    iov.iov_len = 4;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    ret = recvmsg(sock, &msg, 0);
+    assert_equal(ret, 4);
+    assert_equal((msg.msg_flags & MSG_TRUNC), MSG_TRUNC);
+    ret = poll(&p, 1, 0);
+    assert_equal(p.revents, POLLOUT);
+
+    errno = 0;
+    ret = sendto(sock, big, sizeof(big), 0, (struct sockaddr *)&addr, sizeof(addr));
+    assert_equal(ret, -1);
+    assert_equal(errno, EMSGSIZE);
+
+    /* the buffers are not in the chip */
+    len = sizeof(val);
+    ret = getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, &len);
+    assert_equal(ret, 0);
+    assert_equal(val, 1024);
+    errno = 0;
+    val = 4096;
+    ret = setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+    assert_equal(ret, -1);
+    assert_equal(errno, ENOPROTOOPT);
+
+    errno = 0;
+    mreq.imr_multiaddr.s_addr = inet_addr("239.1.2.3");
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    ret = setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    assert_equal(ret, -1);
+    assert_equal(errno, ENOPROTOOPT);
+
+    close(sock);
+}
+
+int main(void)
+{
+    printf("chip: %s, MACRAW\n", w5x00_chip.name);
+
+    test_many_sockets();
+    test_tcp_alongside();
+    test_tunnel();
+    test_flags();
+
+    if (assertions_failed)
+    {
+        printf("%d assertions failed.\n", assertions_failed);
+        return 1;
+    }
+    else
+    {
+        puts("All tests OK");
+        return 0;
+    }
+}